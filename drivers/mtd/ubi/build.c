@@ -567,17 +567,18 @@ static void free_internal_volumes(struct ubi_device *ubi)
  * This function returns zero in case of success and a negative error code in
  * case of failure.
  *
- * Note, currently this is the only method to attach UBI devices. Hopefully in
- * the future we'll have more scalable attaching methods and avoid full media
- * scanning. But even in this case scanning will be needed as a fall-back
- * attaching method if there are some on-flash table corruptions.
+ * Note, if there is a valid fastmap, the scanning information is built from
+ * it instead of scanning the media (see fastmap.c). Scanning is the fall-back
+ * attaching method if there is no fastmap or if it is out of date or corrupted.
  */
 static int attach_by_scanning(struct ubi_device *ubi)
 {
 	int err;
 	struct ubi_scan_info *si;
 
-	si = ubi_scan(ubi);
+	si = ubi_scan_fastmap(ubi);
+	if (!si)
+		si = ubi_scan(ubi);
 	if (IS_ERR(si))
 		return PTR_ERR(si);
 
@@ -853,6 +854,7 @@ static int ubi_reboot_notifier(struct notifier_block *n, unsigned long state,
 	if (ubi->bgt_thread)
 		kthread_stop(ubi->bgt_thread);
 	ubi_sync(ubi->ubi_num);
+	ubi_update_fastmap(ubi);
 	return NOTIFY_DONE;
 }
 
@@ -939,6 +941,10 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	mutex_init(&ubi->ckvol_mutex);
 	mutex_init(&ubi->device_mutex);
 	spin_lock_init(&ubi->volumes_lock);
+#ifdef CONFIG_MTD_UBI_FASTMAP
+	init_rwsem(&ubi->fm_sem);
+	mutex_init(&ubi->fm_mutex);
+#endif
 
 	ubi_msg("attaching mtd%d to ubi%d", mtd->index, ubi_num);
 
@@ -1099,6 +1105,8 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	 */
 	get_device(&ubi->dev);
 
+	/* Nothing is written any more, so this fastmap will stay valid */
+	ubi_update_fastmap(ubi);
 	uif_close(ubi);
 	ubi_wl_close(ubi);
 	free_internal_volumes(ubi);
@@ -50,14 +50,14 @@
 #define EBA_RESERVED_PEBS 1
 
 /**
- * next_sqnum - get next sequence number.
+ * ubi_next_sqnum - get next sequence number.
  * @ubi: UBI device description object
  *
  * This function returns next sequence number to use, which is just the current
  * global sequence counter value. It also increases the global sequence
  * counter.
  */
-static unsigned long long next_sqnum(struct ubi_device *ubi)
+unsigned long long ubi_next_sqnum(struct ubi_device *ubi)
 {
 	unsigned long long sqnum;
 
@@ -243,14 +243,25 @@ static void leb_read_unlock(struct ubi_device *ubi, int vol_id, int lnum)
  *
  * This function locks a logical eraseblock for writing. Returns zero in case
  * of success and a negative error code in case of failure.
+ *
+ * Any change of a logical eraseblock makes the fastmap out of date, so this
+ * function also invalidates the fastmap, if there is one, and prevents a new
+ * one from being written until the logical eraseblock is unlocked.
  */
 static int leb_write_lock(struct ubi_device *ubi, int vol_id, int lnum)
 {
 	struct ubi_ltree_entry *le;
+	int err;
+
+	err = ubi_fastmap_lock(ubi);
+	if (err)
+		return err;
 
 	le = ltree_add_entry(ubi, vol_id, lnum);
-	if (IS_ERR(le))
+	if (IS_ERR(le)) {
+		ubi_fastmap_unlock(ubi);
 		return PTR_ERR(le);
+	}
 	down_write(&le->mutex);
 	return 0;
 }
@@ -269,10 +280,17 @@ static int leb_write_lock(struct ubi_device *ubi, int vol_id, int lnum)
 static int leb_write_trylock(struct ubi_device *ubi, int vol_id, int lnum)
 {
 	struct ubi_ltree_entry *le;
+	int err;
+
+	err = ubi_fastmap_trylock(ubi);
+	if (err)
+		return err;
 
 	le = ltree_add_entry(ubi, vol_id, lnum);
-	if (IS_ERR(le))
+	if (IS_ERR(le)) {
+		ubi_fastmap_unlock(ubi);
 		return PTR_ERR(le);
+	}
 	if (down_write_trylock(&le->mutex))
 		return 0;
 
@@ -285,6 +303,7 @@ static int leb_write_trylock(struct ubi_device *ubi, int vol_id, int lnum)
 		kfree(le);
 	}
 	spin_unlock(&ubi->ltree_lock);
+	ubi_fastmap_unlock(ubi);
 
 	return 1;
 }
@@ -309,6 +328,7 @@ static void leb_write_unlock(struct ubi_device *ubi, int vol_id, int lnum)
 		kfree(le);
 	}
 	spin_unlock(&ubi->ltree_lock);
+	ubi_fastmap_unlock(ubi);
 }
 
 /**
@@ -521,7 +541,7 @@ retry:
 		goto out_put;
 	}
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	err = ubi_io_write_vid_hdr(ubi, new_pnum, vid_hdr);
 	if (err)
 		goto write_error;
@@ -633,7 +653,7 @@ int ubi_eba_write_leb(struct ubi_device *ubi, struct ubi_volume *vol, int lnum,
 	}
 
 	vid_hdr->vol_type = UBI_VID_DYNAMIC;
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	vid_hdr->vol_id = cpu_to_be32(vol_id);
 	vid_hdr->lnum = cpu_to_be32(lnum);
 	vid_hdr->compat = ubi_get_compat(ubi, vol_id);
@@ -694,7 +714,7 @@ write_error:
 		return err;
 	}
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	ubi_msg("try another PEB");
 	goto retry;
 }
@@ -749,7 +769,7 @@ int ubi_eba_write_leb_st(struct ubi_device *ubi, struct ubi_volume *vol,
 		return err;
 	}
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	vid_hdr->vol_id = cpu_to_be32(vol_id);
 	vid_hdr->lnum = cpu_to_be32(lnum);
 	vid_hdr->compat = ubi_get_compat(ubi, vol_id);
@@ -814,7 +834,7 @@ write_error:
 		return err;
 	}
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	ubi_msg("try another PEB");
 	goto retry;
 }
@@ -867,7 +887,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 	if (err)
 		goto out_mutex;
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	vid_hdr->vol_id = cpu_to_be32(vol_id);
 	vid_hdr->lnum = cpu_to_be32(lnum);
 	vid_hdr->compat = ubi_get_compat(ubi, vol_id);
@@ -935,7 +955,7 @@ write_error:
 		goto out_leb_unlock;
 	}
 
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 	ubi_msg("try another PEB");
 	goto retry;
 }
@@ -1093,7 +1113,7 @@ int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		vid_hdr->data_size = cpu_to_be32(data_size);
 		vid_hdr->data_crc = cpu_to_be32(crc);
 	}
-	vid_hdr->sqnum = cpu_to_be64(next_sqnum(ubi));
+	vid_hdr->sqnum = cpu_to_be64(ubi_next_sqnum(ubi));
 
 	err = ubi_io_write_vid_hdr(ubi, to, vid_hdr);
 	if (err) {
@@ -0,0 +1,975 @@
+/*
+ * Copyright (c) International Business Machines Corp., 2006
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * UBI fastmap sub-system.
+ *
+ * Scanning reads the headers of every physical eraseblock, so attaching takes
+ * time proportional to the size of the flash. The fastmap is a snapshot of
+ * the state of all physical eraseblocks - their erase counters and which
+ * logical eraseblocks they are mapped to - from which the scanning information
+ * is built without reading the headers of every physical eraseblock.
+ *
+ * The fastmap is stored in the %UBI_FM_VOLUME_ID internal volume (see
+ * &struct ubi_fm_hdr for the format), and it is written when the device is
+ * quiescent: when it is detached and before rebooting. A fastmap written while
+ * the device is in use would be out of date with the next write anyway.
+ *
+ * A fastmap is only valid as long as nothing is written to the flash after it.
+ * So the first change of a logical eraseblock (see 'ubi_fastmap_lock()')
+ * synchronously erases the anchor - logical eraseblock 0 of the fastmap, which
+ * is always one of the first %UBI_FM_MAX_START physical eraseblocks - and only
+ * then lets the change go ahead. As long as the device is only read, the
+ * fastmap stays valid, and consecutive attaches use it.
+ *
+ * When attaching, the first %UBI_FM_MAX_START physical eraseblocks are read to
+ * find the anchor. If there is one and the fastmap is consistent with the
+ * headers of those physical eraseblocks, the scanning information is built
+ * from it. Otherwise the anchor is erased and the device is scanned. The
+ * physical eraseblocks holding the fastmap are not part of the scanning
+ * information, they are kept aside in @ubi->fm_pnum until the fastmap is
+ * invalidated.
+ */
+
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include <linux/math64.h>
+#include "ubi.h"
+
+/**
+ * struct fm_probe - headers of one of the first physical eraseblocks.
+ * @bad: what 'ubi_io_is_bad()' returned
+ * @ec_err: what 'ubi_io_read_ec_hdr()' returned
+ * @vid_err: what 'ubi_io_read_vid_hdr()' returned
+ * @ec: erase counter
+ * @image_seq: image sequence number
+ * @vol_id: volume ID
+ * @lnum: logical eraseblock number
+ * @sqnum: sequence number
+ *
+ * The first %UBI_FM_MAX_START physical eraseblocks are read when looking for
+ * the fastmap anchor, and what was found is then checked against the fastmap.
+ */
+struct fm_probe {
+	int bad;
+	int ec_err;
+	int vid_err;
+	int ec;
+	int image_seq;
+	int vol_id;
+	int lnum;
+	unsigned long long sqnum;
+};
+
+/**
+ * fm_size - calculate fastmap size.
+ * @ubi: UBI device description object
+ * @vol_count: count of volume records
+ */
+static int fm_size(const struct ubi_device *ubi, int vol_count)
+{
+	return sizeof(struct ubi_fm_hdr) + vol_count * sizeof(struct ubi_fm_vol) +
+	       ubi->peb_count * sizeof(struct ubi_fm_peb);
+}
+
+/**
+ * fm_vol_idx - get index of a volume in the volume records lookup table.
+ * @vol_id: volume ID
+ *
+ * The volume table size is not known when the fastmap is read, so volumes are
+ * looked up by their ID, and the layout volume goes last. Returns %-1 if
+ * @vol_id cannot be in the fastmap.
+ */
+static int fm_vol_idx(int vol_id)
+{
+	if (vol_id >= 0 && vol_id < UBI_MAX_VOLUMES)
+		return vol_id;
+	if (vol_id == UBI_LAYOUT_VOLUME_ID)
+		return UBI_MAX_VOLUMES;
+	return -1;
+}
+
+/**
+ * fm_fill - fill the fastmap.
+ * @ubi: UBI device description object
+ * @buf: zeroed buffer to fill
+ * @vol_count: count of volumes
+ *
+ * This function fills everything but the sequence number and the header CRC.
+ * The caller has to hold @ubi->fm_sem for writing, and the fastmap physical
+ * eraseblocks have to be already taken out of the WL sub-system. Returns zero
+ * in case of success and a negative error code in case of failure.
+ */
+static int fm_fill(struct ubi_device *ubi, void *buf, int vol_count)
+{
+	int i, n = 0, pnum, lnum, err, size = fm_size(ubi, vol_count);
+	struct ubi_fm_hdr *fmh = buf;
+	struct ubi_fm_vol *fmv = buf + sizeof(struct ubi_fm_hdr);
+	struct ubi_fm_peb *fmp = (void *)(fmv + vol_count);
+	struct ubi_wl_entry *e;
+	struct rb_node *rb;
+
+	for (i = 0; i < ubi->fm_count; i++) {
+		fmp[ubi->fm_pnum[i]].state = UBI_FM_PEB_FASTMAP;
+		fmp[ubi->fm_pnum[i]].ec = cpu_to_be32(ubi->fm_ec[i]);
+		fmh->pebs[i] = cpu_to_be32(ubi->fm_pnum[i]);
+	}
+
+	spin_lock(&ubi->volumes_lock);
+	for (i = 0; i < ubi->vtbl_slots + UBI_INT_VOL_COUNT; i++) {
+		struct ubi_volume *vol = ubi->volumes[i];
+
+		if (!vol)
+			continue;
+
+		ubi_assert(n < vol_count);
+		fmv[n].vol_id = cpu_to_be32(vol->vol_id);
+		fmv[n].data_pad = cpu_to_be32(vol->data_pad);
+		if (vol->vol_type == UBI_DYNAMIC_VOLUME)
+			fmv[n].vol_type = UBI_VID_DYNAMIC;
+		else {
+			fmv[n].vol_type = UBI_VID_STATIC;
+			fmv[n].used_ebs = cpu_to_be32(vol->used_ebs);
+			fmv[n].last_data_size = cpu_to_be32(vol->last_eb_bytes);
+		}
+		if (vol->vol_id == UBI_LAYOUT_VOLUME_ID)
+			fmv[n].compat = UBI_LAYOUT_VOLUME_COMPAT;
+		n += 1;
+
+		for (lnum = 0; lnum < vol->reserved_pebs; lnum++) {
+			pnum = vol->eba_tbl[lnum];
+			if (pnum < 0)
+				continue;
+
+			fmp[pnum].state = UBI_FM_PEB_USED;
+			fmp[pnum].vol_id = cpu_to_be32(vol->vol_id);
+			fmp[pnum].lnum = cpu_to_be32(lnum);
+		}
+	}
+	spin_unlock(&ubi->volumes_lock);
+	ubi_assert(n == vol_count);
+
+	/*
+	 * Physical eraseblocks the WL sub-system knows about which are neither
+	 * mapped nor free are waiting for erasure.
+	 */
+	spin_lock(&ubi->wl_lock);
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		e = ubi->lookuptbl[pnum];
+		if (!e)
+			continue;
+
+		fmp[pnum].ec = cpu_to_be32(e->ec);
+		if (!fmp[pnum].state)
+			fmp[pnum].state = UBI_FM_PEB_ERASE;
+	}
+	ubi_rb_for_each_entry(rb, e, &ubi->free, u.rb)
+		fmp[e->pnum].state = UBI_FM_PEB_FREE;
+	ubi_rb_for_each_entry(rb, e, &ubi->scrub, u.rb)
+		fmp[e->pnum].scrub = 1;
+	spin_unlock(&ubi->wl_lock);
+
+	/* The rest is either bad or not used by UBI */
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		if (fmp[pnum].state)
+			continue;
+
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			return err;
+		fmp[pnum].state = err ? UBI_FM_PEB_BAD : UBI_FM_PEB_ALIEN;
+	}
+
+	fmh->magic = cpu_to_be32(UBI_FM_HDR_MAGIC);
+	fmh->version = UBI_FM_VERSION;
+	fmh->peb_count = cpu_to_be32(ubi->peb_count);
+	fmh->vol_count = cpu_to_be32(vol_count);
+	fmh->fm_count = cpu_to_be32(ubi->fm_count);
+	size -= sizeof(struct ubi_fm_hdr);
+	fmh->data_size = cpu_to_be32(size);
+	fmh->data_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, fmv, size));
+	return 0;
+}
+
+/**
+ * fm_write_leb - write a logical eraseblock of the fastmap.
+ * @ubi: UBI device description object
+ * @vid_hdr: volume identifier header buffer to use
+ * @buf: the fastmap
+ * @size: fastmap size
+ * @lnum: the logical eraseblock to write
+ * @sqnum: sequence number to use
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+static int fm_write_leb(struct ubi_device *ubi, struct ubi_vid_hdr *vid_hdr,
+			const void *buf, int size, int lnum,
+			unsigned long long sqnum)
+{
+	int err, pnum = ubi->fm_pnum[lnum];
+	int len = min(size - lnum * ubi->leb_size, ubi->leb_size);
+
+	dbg_bld("write fastmap LEB %d to PEB %d", lnum, pnum);
+
+	memset(vid_hdr, 0, UBI_VID_HDR_SIZE);
+	vid_hdr->vol_type = UBI_FM_VOLUME_TYPE;
+	vid_hdr->compat = UBI_FM_VOLUME_COMPAT;
+	vid_hdr->vol_id = cpu_to_be32(UBI_FM_VOLUME_ID);
+	vid_hdr->lnum = cpu_to_be32(lnum);
+	vid_hdr->sqnum = cpu_to_be64(sqnum);
+
+	err = ubi_io_write_vid_hdr(ubi, pnum, vid_hdr);
+	if (err)
+		return err;
+
+	return ubi_io_write_data(ubi, buf + lnum * ubi->leb_size, pnum, 0,
+				 ALIGN(len, ubi->min_io_size));
+}
+
+/**
+ * ubi_update_fastmap - write the fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function writes a snapshot of the state of all physical eraseblocks to
+ * the flash, unless the fastmap on the flash is still valid. It is supposed to
+ * be called when the device is quiescent, but is safe at any time. Returns
+ * zero in case of success (including when no fastmap could be written) and a
+ * negative error code in case of failure.
+ */
+int ubi_update_fastmap(struct ubi_device *ubi)
+{
+	int err = 0, i, vol_count = 0, size, fm_count = 0, pnum;
+	unsigned long long sqnum;
+	struct ubi_fm_hdr *fmh;
+	struct ubi_vid_hdr *vid_hdr;
+	void *buf;
+
+	if (ubi->ro_mode)
+		return 0;
+
+	mutex_lock(&ubi->device_mutex);
+	down_write(&ubi->fm_sem);
+	if (ubi->fm_count) {
+		dbg_bld("fastmap in PEB %d is still valid", ubi->fm_pnum[0]);
+		goto out_unlock;
+	}
+
+	for (i = 0; i < ubi->vtbl_slots + UBI_INT_VOL_COUNT; i++)
+		if (ubi->volumes[i])
+			vol_count += 1;
+
+	size = fm_size(ubi, vol_count);
+	fm_count = DIV_ROUND_UP(size, ubi->leb_size);
+	if (fm_count > UBI_FM_MAX_PEBS) {
+		ubi_warn("fastmap needs %d PEBs, maximum is %d", fm_count,
+			 UBI_FM_MAX_PEBS);
+		goto out_unlock;
+	}
+
+	err = -ENOMEM;
+	buf = vmalloc(fm_count * ubi->leb_size);
+	if (!buf)
+		goto out_unlock;
+	memset(buf, 0, fm_count * ubi->leb_size);
+
+	vid_hdr = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!vid_hdr)
+		goto out_free;
+
+	/* The anchor has to be found quickly, the rest can be anywhere */
+	for (i = 0; i < fm_count; i++) {
+		pnum = ubi_wl_get_fm_peb(ubi, i ? ubi->peb_count :
+					 UBI_FM_MAX_START, &ubi->fm_ec[i]);
+		if (pnum < 0) {
+			ubi_warn("no free PEB for the fastmap");
+			err = 0;
+			goto out_put;
+		}
+		ubi->fm_pnum[i] = pnum;
+		ubi->fm_count = i + 1;
+	}
+
+	err = fm_fill(ubi, buf, vol_count);
+	if (err)
+		goto out_put;
+
+	/* Write the anchor last, so that the fastmap is only found complete */
+	for (i = 1; i < fm_count; i++) {
+		err = fm_write_leb(ubi, vid_hdr, buf, size, i,
+				   ubi_next_sqnum(ubi));
+		if (err)
+			goto out_put;
+	}
+
+	sqnum = ubi_next_sqnum(ubi);
+	fmh = buf;
+	fmh->sqnum = cpu_to_be64(sqnum);
+	fmh->hdr_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, fmh,
+					 UBI_FM_HDR_SIZE_CRC));
+	err = fm_write_leb(ubi, vid_hdr, buf, size, 0, sqnum);
+	if (err)
+		goto out_put;
+
+	ubi_msg("fastmap written to PEB %d (%d PEBs)", ubi->fm_pnum[0],
+		fm_count);
+	goto out_vid_hdr;
+
+out_put:
+	if (err)
+		ubi_err("cannot write fastmap, error %d", err);
+	for (i = 0; i < ubi->fm_count; i++)
+		ubi_wl_put_fm_peb(ubi, ubi->fm_pnum[i], ubi->fm_ec[i], 0);
+	ubi->fm_count = 0;
+out_vid_hdr:
+	ubi_free_vid_hdr(ubi, vid_hdr);
+out_free:
+	vfree(buf);
+out_unlock:
+	up_write(&ubi->fm_sem);
+	mutex_unlock(&ubi->device_mutex);
+	return err;
+}
+
+/**
+ * invalidate_fastmap - make sure the fastmap is not found any more.
+ * @ubi: UBI device description object
+ *
+ * This function synchronously erases the fastmap anchor and gives all the
+ * fastmap physical eraseblocks back to the WL sub-system. The caller has to
+ * hold @ubi->fm_mutex. Returns zero in case of success and a negative error
+ * code in case of failure.
+ */
+static int invalidate_fastmap(struct ubi_device *ubi)
+{
+	int err, i;
+
+	dbg_bld("invalidate fastmap in PEB %d", ubi->fm_pnum[0]);
+
+	err = ubi_wl_put_fm_peb(ubi, ubi->fm_pnum[0], ubi->fm_ec[0], 1);
+	if (err) {
+		/*
+		 * The fastmap may still be found, so nothing may be written
+		 * to the flash any more.
+		 */
+		ubi_err("cannot erase fastmap anchor PEB %d, error %d",
+			ubi->fm_pnum[0], err);
+		ubi_ro_mode(ubi);
+	}
+
+	for (i = 1; i < ubi->fm_count; i++)
+		ubi_wl_put_fm_peb(ubi, ubi->fm_pnum[i], ubi->fm_ec[i], 0);
+
+	ubi->fm_count = 0;
+	return err;
+}
+
+/**
+ * fastmap_locked - invalidate the fastmap if needed.
+ * @ubi: UBI device description object
+ *
+ * This is a helper for 'ubi_fastmap_lock()' and 'ubi_fastmap_trylock()'
+ * which is called with @ubi->fm_sem held for reading. It releases
+ * @ubi->fm_sem in case of failure.
+ */
+static int fastmap_locked(struct ubi_device *ubi)
+{
+	int err = 0;
+
+	if (likely(!ubi->fm_count))
+		return 0;
+
+	mutex_lock(&ubi->fm_mutex);
+	if (ubi->fm_count)
+		err = invalidate_fastmap(ubi);
+	mutex_unlock(&ubi->fm_mutex);
+
+	if (err)
+		up_read(&ubi->fm_sem);
+	return err;
+}
+
+/**
+ * ubi_fastmap_lock - prepare for changing a logical eraseblock.
+ * @ubi: UBI device description object
+ *
+ * This function prevents the fastmap from being written until
+ * 'ubi_fastmap_unlock()' is called, and invalidates the fastmap on the flash,
+ * if there is one. Returns zero in case of success and a negative error code
+ * in case of failure.
+ */
+int ubi_fastmap_lock(struct ubi_device *ubi)
+{
+	down_read(&ubi->fm_sem);
+	return fastmap_locked(ubi);
+}
+
+/**
+ * ubi_fastmap_trylock - prepare for changing a logical eraseblock.
+ * @ubi: UBI device description object
+ *
+ * Same as 'ubi_fastmap_lock()', but returns %1 instead of waiting if the
+ * fastmap is being written.
+ */
+int ubi_fastmap_trylock(struct ubi_device *ubi)
+{
+	if (!down_read_trylock(&ubi->fm_sem))
+		return 1;
+	return fastmap_locked(ubi);
+}
+
+/**
+ * ubi_fastmap_unlock - allow the fastmap to be written.
+ * @ubi: UBI device description object
+ */
+void ubi_fastmap_unlock(struct ubi_device *ubi)
+{
+	up_read(&ubi->fm_sem);
+}
+
+/**
+ * add_peb - add physical eraseblock to a scanning information list.
+ * @si: scanning information
+ * @pnum: physical eraseblock number
+ * @ec: erase counter
+ * @list: the list to add to
+ *
+ * Returns zero in case of success and %-ENOMEM in case of failure.
+ */
+static int add_peb(struct ubi_scan_info *si, int pnum, int ec,
+		   struct list_head *list)
+{
+	struct ubi_scan_leb *seb;
+
+	seb = kmalloc(sizeof(struct ubi_scan_leb), GFP_KERNEL);
+	if (!seb)
+		return -ENOMEM;
+
+	seb->pnum = pnum;
+	seb->ec = ec;
+	list_add_tail(&seb->u.list, list);
+	return 0;
+}
+
+/**
+ * ubi_fastmap_invalidate_si - invalidate the fastmap before the WL is ready.
+ * @ubi: UBI device description object
+ * @si: scanning information built from the fastmap
+ *
+ * The volume table may be re-written while attaching, before the WL
+ * sub-system is initialized. This function erases the fastmap anchor and adds
+ * the fastmap physical eraseblocks to @si. Returns zero in case of success and
+ * a negative error code in case of failure.
+ */
+int ubi_fastmap_invalidate_si(struct ubi_device *ubi, struct ubi_scan_info *si)
+{
+	int err, i;
+
+	if (!ubi->fm_count)
+		return 0;
+
+	dbg_bld("invalidate fastmap in PEB %d", ubi->fm_pnum[0]);
+	err = ubi_scan_erase_peb(ubi, si, ubi->fm_pnum[0], ubi->fm_ec[0] + 1);
+	if (err)
+		return err;
+
+	err = add_peb(si, ubi->fm_pnum[0], ubi->fm_ec[0] + 1, &si->free);
+	if (err)
+		return err;
+
+	for (i = 1; i < ubi->fm_count; i++) {
+		err = add_peb(si, ubi->fm_pnum[i], ubi->fm_ec[i], &si->erase);
+		if (err)
+			return err;
+	}
+
+	ubi->fm_count = 0;
+	return 0;
+}
+
+/**
+ * probe_pebs - read the headers of the first physical eraseblocks.
+ * @ubi: UBI device description object
+ * @probe: where to store the headers
+ * @count: count of physical eraseblocks to read
+ *
+ * Returns the fastmap anchor physical eraseblock number, %-ENOENT if there is
+ * no anchor, %-EINVAL if there are several, and %-ENOMEM if there is not
+ * enough memory.
+ */
+static int probe_pebs(struct ubi_device *ubi, struct fm_probe *probe,
+		      int count)
+{
+	int pnum, anchor = -ENOENT;
+	struct ubi_ec_hdr *ech;
+	struct ubi_vid_hdr *vidh;
+
+	ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
+	if (!ech)
+		return -ENOMEM;
+
+	vidh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!vidh) {
+		kfree(ech);
+		return -ENOMEM;
+	}
+
+	for (pnum = 0; pnum < count; pnum++) {
+		struct fm_probe *p = &probe[pnum];
+
+		p->bad = ubi_io_is_bad(ubi, pnum);
+		if (p->bad)
+			continue;
+
+		p->ec_err = ubi_io_read_ec_hdr(ubi, pnum, ech, 0);
+		if (p->ec_err < 0 || p->ec_err == UBI_IO_PEB_EMPTY ||
+		    p->ec_err == UBI_IO_BAD_EC_HDR)
+			continue;
+		p->ec = be64_to_cpu(ech->ec);
+		p->image_seq = be32_to_cpu(ech->image_seq);
+
+		p->vid_err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+		if (p->vid_err < 0 || p->vid_err == UBI_IO_PEB_FREE ||
+		    p->vid_err == UBI_IO_BAD_VID_HDR)
+			continue;
+		p->vol_id = be32_to_cpu(vidh->vol_id);
+		p->lnum = be32_to_cpu(vidh->lnum);
+		p->sqnum = be64_to_cpu(vidh->sqnum);
+
+		if (p->vol_id == UBI_FM_VOLUME_ID && p->lnum == 0) {
+			if (anchor >= 0) {
+				ubi_warn("fastmap anchors in PEBs %d and %d",
+					 anchor, pnum);
+				anchor = -EINVAL;
+				break;
+			}
+			anchor = pnum;
+		}
+	}
+
+	ubi_free_vid_hdr(ubi, vidh);
+	kfree(ech);
+	return anchor;
+}
+
+/**
+ * read_fastmap - read and check the fastmap.
+ * @ubi: UBI device description object
+ * @anchor: the fastmap anchor physical eraseblock
+ * @probe: headers of the first physical eraseblocks
+ *
+ * This function reads the fastmap into a vmalloc'ed buffer and fills
+ * @ubi->fm_pnum and @ubi->fm_ec, but leaves @ubi->fm_count alone. Returns the
+ * buffer in case of success, %NULL if the fastmap is bad, and %-ENOMEM if
+ * there is not enough memory.
+ */
+static void *read_fastmap(struct ubi_device *ubi, int anchor,
+			  const struct fm_probe *probe)
+{
+	int err, i, pnum, len, size, fm_count;
+	unsigned long long sqnum;
+	struct ubi_fm_hdr *fmh;
+	struct ubi_ec_hdr *ech = NULL;
+	struct ubi_vid_hdr *vidh = NULL;
+	void *buf = NULL;
+
+	fmh = kmalloc(sizeof(struct ubi_fm_hdr), GFP_KERNEL);
+	if (!fmh)
+		return ERR_PTR(-ENOMEM);
+
+	err = ubi_io_read_data(ubi, fmh, anchor, 0, sizeof(struct ubi_fm_hdr));
+	if (err && err != UBI_IO_BITFLIPS)
+		goto bad;
+
+	if (be32_to_cpu(fmh->magic) != UBI_FM_HDR_MAGIC ||
+	    be32_to_cpu(fmh->hdr_crc) !=
+	    crc32(UBI_CRC32_INIT, fmh, UBI_FM_HDR_SIZE_CRC)) {
+		ubi_warn("bad fastmap header in PEB %d", anchor);
+		goto bad;
+	}
+
+	sqnum = be64_to_cpu(fmh->sqnum);
+	fm_count = be32_to_cpu(fmh->fm_count);
+	size = fm_size(ubi, be32_to_cpu(fmh->vol_count));
+	if (fmh->version != UBI_FM_VERSION ||
+	    be32_to_cpu(fmh->peb_count) != ubi->peb_count ||
+	    be32_to_cpu(fmh->vol_count) > UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT ||
+	    be32_to_cpu(fmh->data_size) != size - sizeof(struct ubi_fm_hdr) ||
+	    fm_count != DIV_ROUND_UP(size, ubi->leb_size) ||
+	    fm_count > UBI_FM_MAX_PEBS ||
+	    be32_to_cpu(fmh->pebs[0]) != anchor ||
+	    sqnum != probe[anchor].sqnum) {
+		ubi_warn("fastmap in PEB %d does not match this device",
+			 anchor);
+		goto bad;
+	}
+
+	err = -ENOMEM;
+	buf = vmalloc(fm_count * ubi->leb_size);
+	ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
+	vidh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!buf || !ech || !vidh)
+		goto out_free;
+
+	ubi->fm_pnum[0] = anchor;
+	ubi->fm_ec[0] = probe[anchor].ec;
+	for (i = 0; i < fm_count; i++) {
+		pnum = be32_to_cpu(fmh->pebs[i]);
+		if (pnum < 0 || pnum >= ubi->peb_count)
+			goto bad;
+
+		if (i > 0) {
+			err = ubi_io_read_ec_hdr(ubi, pnum, ech, 0);
+			if (err && err != UBI_IO_BITFLIPS)
+				goto bad;
+			err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+			if (err && err != UBI_IO_BITFLIPS)
+				goto bad;
+
+			if (be32_to_cpu(vidh->vol_id) != UBI_FM_VOLUME_ID ||
+			    be32_to_cpu(vidh->lnum) != i ||
+			    be64_to_cpu(vidh->sqnum) >= sqnum) {
+				ubi_warn("bad fastmap LEB %d in PEB %d",
+					 i, pnum);
+				goto bad;
+			}
+			ubi->fm_pnum[i] = pnum;
+			ubi->fm_ec[i] = be64_to_cpu(ech->ec);
+		}
+
+		len = min(size - i * ubi->leb_size, ubi->leb_size);
+		err = ubi_io_read_data(ubi, buf + i * ubi->leb_size, pnum, 0,
+				       len);
+		if (err && err != UBI_IO_BITFLIPS)
+			goto bad;
+	}
+
+	size -= sizeof(struct ubi_fm_hdr);
+	if (be32_to_cpu(fmh->data_crc) !=
+	    crc32(UBI_CRC32_INIT, buf + sizeof(struct ubi_fm_hdr), size)) {
+		ubi_warn("bad fastmap data CRC");
+		goto bad;
+	}
+
+	ubi_free_vid_hdr(ubi, vidh);
+	kfree(ech);
+	kfree(fmh);
+	return buf;
+
+bad:
+	err = 0;
+out_free:
+	ubi_free_vid_hdr(ubi, vidh);
+	kfree(ech);
+	vfree(buf);
+	kfree(fmh);
+	return err ? ERR_PTR(err) : NULL;
+}
+
+/**
+ * check_probe - check the fastmap against headers read from the flash.
+ * @fmp: fastmap record of the physical eraseblock
+ * @p: headers of the physical eraseblock
+ * @sqnum: sequence number of the fastmap
+ *
+ * Returns zero if the fastmap record is consistent with the headers and %1 if
+ * not.
+ */
+static int check_probe(const struct ubi_fm_peb *fmp, const struct fm_probe *p,
+		       unsigned long long sqnum)
+{
+	if (p->bad < 0)
+		return 1;
+	if (p->bad || fmp->state == UBI_FM_PEB_BAD)
+		return !(p->bad && fmp->state == UBI_FM_PEB_BAD);
+
+	/* Nothing may have been written after the fastmap */
+	if (p->ec_err < 0 || p->vid_err < 0)
+		return 1;
+	if ((p->vid_err == 0 || p->vid_err == UBI_IO_BITFLIPS) &&
+	    p->sqnum >= sqnum)
+		return 1;
+
+	/* Physical eraseblocks to erase may be in any state */
+	if (fmp->state == UBI_FM_PEB_ERASE)
+		return 0;
+
+	if (p->ec_err == UBI_IO_PEB_EMPTY || p->ec_err == UBI_IO_BAD_EC_HDR ||
+	    p->ec != be32_to_cpu(fmp->ec))
+		return 1;
+
+	switch (fmp->state) {
+	case UBI_FM_PEB_FREE:
+		return p->vid_err != UBI_IO_PEB_FREE;
+	case UBI_FM_PEB_USED:
+		return p->vid_err == UBI_IO_PEB_FREE ||
+		       p->vid_err == UBI_IO_BAD_VID_HDR ||
+		       p->vol_id != be32_to_cpu(fmp->vol_id) ||
+		       p->lnum != be32_to_cpu(fmp->lnum);
+	case UBI_FM_PEB_ALIEN:
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * build_si - build scanning information from the fastmap.
+ * @ubi: UBI device description object
+ * @buf: the fastmap
+ * @probe: headers of the first physical eraseblocks
+ * @probe_count: count of elements in @probe
+ *
+ * Returns the scanning information in case of success, %NULL if the fastmap
+ * is inconsistent, and an error pointer in case of failure.
+ */
+static struct ubi_scan_info *build_si(struct ubi_device *ubi, const void *buf,
+				      const struct fm_probe *probe,
+				      int probe_count)
+{
+	int i, err, pnum, ec, idx, fm_pebs = 0;
+	const struct ubi_fm_hdr *fmh = buf;
+	const struct ubi_fm_vol *fmv = buf + sizeof(struct ubi_fm_hdr);
+	const struct ubi_fm_vol *vols[UBI_MAX_VOLUMES + 1];
+	const struct ubi_fm_peb *fmp;
+	int vol_count = be32_to_cpu(fmh->vol_count);
+	int fm_count = be32_to_cpu(fmh->fm_count);
+	unsigned long long sqnum = be64_to_cpu(fmh->sqnum);
+	struct ubi_vid_hdr *vid_hdr;
+	struct ubi_scan_info *si;
+
+	fmp = (const void *)(fmv + vol_count);
+
+	memset(vols, 0, sizeof(vols));
+	for (i = 0; i < vol_count; i++) {
+		idx = fm_vol_idx(be32_to_cpu(fmv[i].vol_id));
+		if (idx < 0 || vols[idx] ||
+		    (fmv[i].vol_type != UBI_VID_DYNAMIC &&
+		     fmv[i].vol_type != UBI_VID_STATIC)) {
+			ubi_warn("bad fastmap volume record %d", i);
+			return NULL;
+		}
+		vols[idx] = &fmv[i];
+	}
+
+	for (i = 0; i < fm_count; i++)
+		if (fmp[ubi->fm_pnum[i]].state != UBI_FM_PEB_FASTMAP) {
+			ubi_warn("fastmap PEB %d is not in the fastmap",
+				 ubi->fm_pnum[i]);
+			return NULL;
+		}
+
+	for (pnum = 0; pnum < probe_count; pnum++) {
+		if (fmp[pnum].state == UBI_FM_PEB_FASTMAP)
+			continue;
+		if (check_probe(&fmp[pnum], &probe[pnum], sqnum)) {
+			ubi_warn("fastmap is out of date at PEB %d", pnum);
+			return NULL;
+		}
+	}
+
+	si = kzalloc(sizeof(struct ubi_scan_info), GFP_KERNEL);
+	if (!si)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&si->corr);
+	INIT_LIST_HEAD(&si->free);
+	INIT_LIST_HEAD(&si->erase);
+	INIT_LIST_HEAD(&si->alien);
+	si->volumes = RB_ROOT;
+	si->min_ec = UBI_MAX_ERASECOUNTER;
+
+	err = -ENOMEM;
+	vid_hdr = kzalloc(UBI_VID_HDR_SIZE, GFP_KERNEL);
+	if (!vid_hdr)
+		goto out_si;
+
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		const struct ubi_fm_vol *vol;
+
+		cond_resched();
+
+		ec = be32_to_cpu(fmp[pnum].ec);
+		if (ec < 0 || ec > UBI_MAX_ERASECOUNTER)
+			goto bad_peb;
+
+		switch (fmp[pnum].state) {
+		case UBI_FM_PEB_FREE:
+			err = add_peb(si, pnum, ec, &si->free);
+			break;
+
+		case UBI_FM_PEB_ERASE:
+			err = add_peb(si, pnum, ec, &si->erase);
+			break;
+
+		case UBI_FM_PEB_USED:
+			idx = fm_vol_idx(be32_to_cpu(fmp[pnum].vol_id));
+			vol = idx < 0 ? NULL : vols[idx];
+			if (!vol)
+				goto bad_peb;
+
+			vid_hdr->vol_type = vol->vol_type;
+			vid_hdr->compat = vol->compat;
+			vid_hdr->vol_id = vol->vol_id;
+			vid_hdr->lnum = fmp[pnum].lnum;
+			vid_hdr->data_size = vol->last_data_size;
+			vid_hdr->used_ebs = vol->used_ebs;
+			vid_hdr->data_pad = vol->data_pad;
+			err = ubi_scan_add_used(ubi, si, pnum, ec, vid_hdr,
+						fmp[pnum].scrub);
+			if (err > 0)
+				goto bad_peb;
+			break;
+
+		case UBI_FM_PEB_BAD:
+			si->bad_peb_count += 1;
+			continue;
+
+		case UBI_FM_PEB_ALIEN:
+			si->alien_peb_count += 1;
+			err = add_peb(si, pnum, UBI_SCAN_UNKNOWN_EC,
+				      &si->alien);
+			if (err)
+				goto out_vid_hdr;
+			continue;
+
+		case UBI_FM_PEB_FASTMAP:
+			fm_pebs += 1;
+			continue;
+
+		default:
+			goto bad_peb;
+		}
+		if (err)
+			goto out_vid_hdr;
+
+		si->ec_sum += ec;
+		si->ec_count += 1;
+		if (ec > si->max_ec)
+			si->max_ec = ec;
+		if (ec < si->min_ec)
+			si->min_ec = ec;
+	}
+
+	if (fm_pebs != fm_count) {
+		ubi_warn("fastmap has %d fastmap PEBs, expected %d", fm_pebs,
+			 fm_count);
+		err = 0;
+		goto out_vid_hdr;
+	}
+
+	if (si->ec_count)
+		si->mean_ec = div_u64(si->ec_sum, si->ec_count);
+	si->max_sqnum = sqnum;
+	si->is_empty = 0;
+
+	kfree(vid_hdr);
+	return si;
+
+bad_peb:
+	ubi_warn("bad fastmap record of PEB %d", pnum);
+	err = 0;
+out_vid_hdr:
+	kfree(vid_hdr);
+out_si:
+	ubi_scan_destroy_si(si);
+	return err ? ERR_PTR(err) : NULL;
+}
+
+/**
+ * ubi_scan_fastmap - attach using the fastmap.
+ * @ubi: UBI device description object
+ *
+ * This function looks for the fastmap and builds scanning information from
+ * it. Returns the scanning information in case of success, %NULL if there is
+ * no usable fastmap and the device has to be scanned, and an error pointer in
+ * case of failure.
+ */
+struct ubi_scan_info *ubi_scan_fastmap(struct ubi_device *ubi)
+{
+	int err, anchor, fm_count = 0;
+	int probe_count = min(ubi->peb_count, UBI_FM_MAX_START);
+	struct ubi_scan_info *si = NULL;
+	const struct ubi_fm_hdr *fmh;
+	struct fm_probe *probe;
+	void *buf;
+
+	probe = kcalloc(probe_count, sizeof(struct fm_probe), GFP_KERNEL);
+	if (!probe)
+		return ERR_PTR(-ENOMEM);
+
+	anchor = probe_pebs(ubi, probe, probe_count);
+	if (anchor == -ENOENT) {
+		dbg_bld("no fastmap found");
+		goto out_probe;
+	} else if (anchor < 0 && anchor != -EINVAL) {
+		si = ERR_PTR(anchor);
+		goto out_probe;
+	}
+
+	if (anchor >= 0) {
+		buf = read_fastmap(ubi, anchor, probe);
+		if (IS_ERR(buf)) {
+			si = buf;
+			goto out_probe;
+		}
+		if (buf) {
+			fmh = buf;
+			fm_count = be32_to_cpu(fmh->fm_count);
+			si = build_si(ubi, buf, probe, probe_count);
+			vfree(buf);
+			if (IS_ERR(si))
+				goto out_probe;
+		}
+	}
+
+	if (si) {
+		ubi->image_seq = probe[anchor].image_seq;
+		si->image_seq_set = 1;
+		ubi->fm_count = fm_count;
+		ubi_msg("attached by fastmap in PEB %d", anchor);
+		goto out_probe;
+	}
+
+	/*
+	 * The fastmap cannot be used, scan the device. Any anchor has to be
+	 * erased first, because the physical eraseblocks scanning finds will
+	 * soon be written to, and the fastmap must never be found after that.
+	 */
+	ubi_warn("cannot use fastmap, scan the device");
+	for (anchor = 0; anchor < probe_count && !ubi->ro_mode; anchor++) {
+		if (probe[anchor].vid_err != 0 &&
+		    probe[anchor].vid_err != UBI_IO_BITFLIPS)
+			continue;
+		if (probe[anchor].vol_id != UBI_FM_VOLUME_ID ||
+		    probe[anchor].lnum != 0 || probe[anchor].bad)
+			continue;
+
+		ubi->image_seq = probe[anchor].image_seq;
+		err = ubi_scan_erase_peb(ubi, NULL, anchor,
+					 probe[anchor].ec + 1);
+		if (err) {
+			si = ERR_PTR(err);
+			break;
+		}
+	}
+
+out_probe:
+	kfree(probe);
+	return si;
+}
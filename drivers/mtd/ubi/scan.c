@@ -38,13 +38,27 @@
  * Corrupted physical eraseblocks are put to the @corr list, free physical
  * eraseblocks are put to the @free list and the physical eraseblock to be
  * erased are put to the @erase list.
+ *
+ * The headers are read by up to %UBI_SCAN_MAX_WORKERS workers in parallel, in
+ * windows of %UBI_SCAN_WINDOW physical eraseblocks. Once all the headers of a
+ * window have been read, they are added to the scanning information in
+ * physical eraseblock order, so the result does not depend on the order in
+ * which the reads complete.
  */
 
 #include <linux/err.h>
 #include <linux/crc32.h>
 #include <linux/math64.h>
+#include <linux/async.h>
+#include <linux/cpumask.h>
 #include "ubi.h"
 
+/* Maximum count of workers reading headers in parallel */
+#define UBI_SCAN_MAX_WORKERS 8
+
+/* Count of physical eraseblocks the workers read before they are processed */
+#define UBI_SCAN_WINDOW 256
+
 #ifdef CONFIG_MTD_UBI_DEBUG_PARANOID
 static int paranoid_check_si(struct ubi_device *ubi, struct ubi_scan_info *si);
 #else
@@ -55,6 +69,50 @@ static int paranoid_check_si(struct ubi_device *ubi, struct ubi_scan_info *si);
 static struct ubi_ec_hdr *ech;
 static struct ubi_vid_hdr *vidh;
 
+/**
+ * struct scan_peb - headers of a physical eraseblock.
+ * @bad: what 'ubi_io_is_bad()' returned
+ * @ec_err: what 'ubi_io_read_ec_hdr()' returned
+ * @vid_err: what 'ubi_io_read_vid_hdr()' returned
+ * @ech: the EC header
+ * @vidh: the VID header
+ */
+struct scan_peb {
+	int bad;
+	int ec_err;
+	int vid_err;
+	struct ubi_ec_hdr ech;
+	struct ubi_vid_hdr vidh;
+};
+
+/**
+ * struct scan_window - physical eraseblocks read in parallel.
+ * @ubi: UBI device description object
+ * @first: the first physical eraseblock of the window
+ * @count: count of physical eraseblocks in the window
+ * @next: index of the next physical eraseblock to read
+ * @pebs: headers of the physical eraseblocks of the window
+ */
+struct scan_window {
+	struct ubi_device *ubi;
+	int first;
+	int count;
+	atomic_t next;
+	struct scan_peb *pebs;
+};
+
+/**
+ * struct scan_worker - a worker reading headers.
+ * @win: the window the worker reads
+ * @ech: EC header buffer of the worker
+ * @vidh: VID header buffer of the worker
+ */
+struct scan_worker {
+	struct scan_window *win;
+	struct ubi_ec_hdr *ech;
+	struct ubi_vid_hdr *vidh;
+};
+
 /**
  * add_to_list - add physical eraseblock to a list.
  * @si: scanning information
@@ -664,6 +722,11 @@ struct ubi_scan_leb *ubi_scan_get_free_peb(struct ubi_device *ubi,
 	int err = 0, i;
 	struct ubi_scan_leb *seb;
 
+	/* Anything written now makes the fastmap out of date */
+	err = ubi_fastmap_invalidate_si(ubi, si);
+	if (err)
+		return ERR_PTR(err);
+
 	if (!list_empty(&si->free)) {
 		seb = list_entry(si->free.next, struct ubi_scan_leb, u.list);
 		list_del(&seb->u.list);
@@ -706,24 +769,77 @@ struct ubi_scan_leb *ubi_scan_get_free_peb(struct ubi_device *ubi,
 }
 
 /**
- * process_eb - read, check UBI headers, and add them to scanning information.
+ * read_peb - read UBI headers of a physical eraseblock.
+ * @ubi: UBI device description object
+ * @pnum: the physical eraseblock number
+ * @sp: where to store the headers
+ * @ech: EC header buffer to use
+ * @vidh: VID header buffer to use
+ *
+ * This function only reads the headers, all the checks are done by
+ * 'process_eb()'. It may run concurrently for different physical eraseblocks.
+ */
+static void read_peb(struct ubi_device *ubi, int pnum, struct scan_peb *sp,
+		     struct ubi_ec_hdr *ech, struct ubi_vid_hdr *vidh)
+{
+	sp->ec_err = sp->vid_err = 0;
+	sp->bad = ubi_io_is_bad(ubi, pnum);
+	if (sp->bad)
+		return;
+
+	sp->ec_err = ubi_io_read_ec_hdr(ubi, pnum, ech, 0);
+	if (sp->ec_err < 0 || sp->ec_err == UBI_IO_PEB_EMPTY)
+		return;
+	memcpy(&sp->ech, ech, UBI_EC_HDR_SIZE);
+
+	sp->vid_err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+	if (sp->vid_err >= 0)
+		memcpy(&sp->vidh, vidh, UBI_VID_HDR_SIZE);
+}
+
+/**
+ * scan_worker - read headers of the physical eraseblocks of a window.
+ * @data: the &struct scan_worker object of this worker
+ * @cookie: not used
+ *
+ * The workers of a window pick physical eraseblocks to read until all of them
+ * have been read.
+ */
+static void scan_worker(void *data, async_cookie_t cookie)
+{
+	struct scan_worker *wrk = data;
+	struct scan_window *win = wrk->win;
+	int i;
+
+	while ((i = atomic_inc_return(&win->next) - 1) < win->count) {
+		cond_resched();
+		read_peb(win->ubi, win->first + i, &win->pebs[i], wrk->ech,
+			 wrk->vidh);
+	}
+}
+
+/**
+ * process_eb - check UBI headers, and add them to scanning information.
  * @ubi: UBI device description object
  * @si: scanning information
  * @pnum: the physical eraseblock number
+ * @sp: the headers read by 'read_peb()'
  *
  * This function returns a zero if the physical eraseblock was successfully
  * handled and a negative error code in case of failure.
  */
 static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
-		      int pnum)
+		      int pnum, const struct scan_peb *sp)
 {
+	const struct ubi_ec_hdr *ech = &sp->ech;
+	const struct ubi_vid_hdr *vidh = &sp->vidh;
 	long long uninitialized_var(ec);
 	int err, bitflips = 0, vol_id, ec_corr = 0;
 
 	dbg_bld("scan PEB %d", pnum);
 
 	/* Skip bad physical eraseblocks */
-	err = ubi_io_is_bad(ubi, pnum);
+	err = sp->bad;
 	if (err < 0)
 		return err;
 	else if (err) {
@@ -736,7 +852,7 @@ static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
 		return 0;
 	}
 
-	err = ubi_io_read_ec_hdr(ubi, pnum, ech, 0);
+	err = sp->ec_err;
 	if (err < 0)
 		return err;
 	else if (err == UBI_IO_BITFLIPS)
@@ -807,7 +923,7 @@ static int process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
 
 	/* OK, we've done with the EC header, let's look at the VID header */
 
-	err = ubi_io_read_vid_hdr(ubi, pnum, vidh, 0);
+	err = sp->vid_err;
 	if (err < 0)
 		return err;
 	else if (err == UBI_IO_BITFLIPS)
@@ -891,11 +1007,14 @@ adjust_mean_ec:
  */
 struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 {
-	int err, pnum;
+	int err, pnum, i, workers;
 	struct rb_node *rb1, *rb2;
 	struct ubi_scan_volume *sv;
 	struct ubi_scan_leb *seb;
 	struct ubi_scan_info *si;
+	struct scan_window win;
+	struct scan_worker *wrk;
+	LIST_HEAD(domain);
 
 	si = kzalloc(sizeof(struct ubi_scan_info), GFP_KERNEL);
 	if (!si)
@@ -917,13 +1036,41 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	if (!vidh)
 		goto out_ech;
 
-	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
-		cond_resched();
+	win.ubi = ubi;
+	win.pebs = vmalloc(UBI_SCAN_WINDOW * sizeof(struct scan_peb));
+	if (!win.pebs)
+		goto out_vidh;
+
+	workers = min_t(int, num_online_cpus(), UBI_SCAN_MAX_WORKERS);
+	wrk = kcalloc(workers, sizeof(struct scan_worker), GFP_KERNEL);
+	if (!wrk)
+		goto out_pebs;
+
+	for (i = 0; i < workers; i++) {
+		wrk[i].win = &win;
+		wrk[i].ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
+		wrk[i].vidh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+		if (!wrk[i].ech || !wrk[i].vidh)
+			goto out_wrk;
+	}
 
-		dbg_gen("process PEB %d", pnum);
-		err = process_eb(ubi, si, pnum);
-		if (err < 0)
-			goto out_vidh;
+	dbg_msg("scan with %d workers", workers);
+	for (pnum = 0; pnum < ubi->peb_count; pnum += win.count) {
+		win.first = pnum;
+		win.count = min(ubi->peb_count - pnum, UBI_SCAN_WINDOW);
+		atomic_set(&win.next, 0);
+
+		for (i = 1; i < workers; i++)
+			async_schedule_domain(scan_worker, &wrk[i], &domain);
+		scan_worker(&wrk[0], 0);
+		async_synchronize_full_domain(&domain);
+
+		for (i = 0; i < win.count; i++) {
+			dbg_gen("process PEB %d", pnum + i);
+			err = process_eb(ubi, si, pnum + i, &win.pebs[i]);
+			if (err < 0)
+				goto out_wrk;
+		}
 	}
 
 	dbg_msg("scanning is finished");
@@ -962,14 +1109,28 @@ struct ubi_scan_info *ubi_scan(struct ubi_device *ubi)
 	if (err) {
 		if (err > 0)
 			err = -EINVAL;
-		goto out_vidh;
+		goto out_wrk;
 	}
 
+	for (i = 0; i < workers; i++) {
+		ubi_free_vid_hdr(ubi, wrk[i].vidh);
+		kfree(wrk[i].ech);
+	}
+	kfree(wrk);
+	vfree(win.pebs);
 	ubi_free_vid_hdr(ubi, vidh);
 	kfree(ech);
 
 	return si;
 
+out_wrk:
+	for (i = 0; i < workers; i++) {
+		ubi_free_vid_hdr(ubi, wrk[i].vidh);
+		kfree(wrk[i].ech);
+	}
+	kfree(wrk);
+out_pebs:
+	vfree(win.pebs);
 out_vidh:
 	ubi_free_vid_hdr(ubi, vidh);
 out_ech:
@@ -375,4 +375,136 @@ struct ubi_vtbl_record {
 	__be32  crc;
 } __attribute__ ((packed));
 
+/*
+ * The fastmap volume holds a snapshot of the state of all physical
+ * eraseblocks, which allows attaching the device without scanning it. It is
+ * not a real volume: its eraseblocks are not in the volume table and are
+ * erased as soon as the snapshot becomes out of date. Implementations which do
+ * not know about it simply delete it.
+ */
+#define UBI_FM_VOLUME_ID     (UBI_INTERNAL_VOL_START + 1)
+#define UBI_FM_VOLUME_TYPE   UBI_VID_DYNAMIC
+#define UBI_FM_VOLUME_COMPAT UBI_COMPAT_DELETE
+
+/* Fastmap header magic number (ASCII "UBIF") */
+#define UBI_FM_HDR_MAGIC 0x55424946
+
+/* The version of the fastmap supported by this implementation */
+#define UBI_FM_VERSION 1
+
+/* The fastmap anchor (its logical eraseblock 0) is one of these first PEBs */
+#define UBI_FM_MAX_START 64
+
+/* The maximum number of physical eraseblocks a fastmap may occupy */
+#define UBI_FM_MAX_PEBS 32
+
+/* Size of the fastmap header without the ending CRC */
+#define UBI_FM_HDR_SIZE_CRC (sizeof(struct ubi_fm_hdr) - sizeof(__be32))
+
+/*
+ * Physical eraseblock states recorded in the fastmap.
+ *
+ * @UBI_FM_PEB_FREE: the physical eraseblock is free
+ * @UBI_FM_PEB_USED: the physical eraseblock is mapped to a logical eraseblock
+ * @UBI_FM_PEB_ERASE: the physical eraseblock has to be erased
+ * @UBI_FM_PEB_BAD: the physical eraseblock is bad
+ * @UBI_FM_PEB_ALIEN: the physical eraseblock is not used by UBI
+ * @UBI_FM_PEB_FASTMAP: the physical eraseblock holds the fastmap itself
+ */
+enum {
+	UBI_FM_PEB_FREE = 1,
+	UBI_FM_PEB_USED,
+	UBI_FM_PEB_ERASE,
+	UBI_FM_PEB_BAD,
+	UBI_FM_PEB_ALIEN,
+	UBI_FM_PEB_FASTMAP
+};
+
+/**
+ * struct ubi_fm_hdr - fastmap header.
+ * @magic: fastmap header magic number (%UBI_FM_HDR_MAGIC)
+ * @version: version of the fastmap format
+ * @padding1: reserved for future, zeroes
+ * @sqnum: sequence number of the fastmap
+ * @peb_count: number of physical eraseblocks the fastmap describes
+ * @vol_count: number of &struct ubi_fm_vol records
+ * @fm_count: number of physical eraseblocks holding the fastmap
+ * @data_size: number of bytes following the header
+ * @data_crc: CRC32 checksum of the bytes following the header
+ * @pebs: the physical eraseblocks holding the fastmap, in order
+ * @padding2: reserved for future, zeroes
+ * @hdr_crc: fastmap header CRC checksum
+ *
+ * The fastmap is stored in the data area of the logical eraseblocks of the
+ * %UBI_FM_VOLUME_ID volume, starting with this header at offset 0 of logical
+ * eraseblock 0 (the anchor). The header is followed by @vol_count
+ * &struct ubi_fm_vol records and by @peb_count &struct ubi_fm_peb records,
+ * which continue in logical eraseblocks 1, 2, etc.
+ *
+ * The anchor is written last, so a fastmap is either complete or not found.
+ * @sqnum is higher than the sequence number of any volume identifier header
+ * which existed when the fastmap was written. UBI erases the anchor before it
+ * writes anything, so a fastmap which is found describes the flash contents.
+ */
+struct ubi_fm_hdr {
+	__be32  magic;
+	__u8    version;
+	__u8    padding1[3];
+	__be64  sqnum;
+	__be32  peb_count;
+	__be32  vol_count;
+	__be32  fm_count;
+	__be32  data_size;
+	__be32  data_crc;
+	__be32  pebs[UBI_FM_MAX_PEBS];
+	__u8    padding2[24];
+	__be32  hdr_crc;
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_fm_vol - fastmap volume record.
+ * @vol_id: volume ID
+ * @used_ebs: number of used logical eraseblocks (static volumes only)
+ * @data_pad: how many bytes at the end of logical eraseblocks are not used
+ * @last_data_size: amount of data in the last logical eraseblock (static
+ *                  volumes only)
+ * @vol_type: volume type (%UBI_VID_DYNAMIC or %UBI_VID_STATIC)
+ * @compat: compatibility of this volume (as in the volume identifier header)
+ * @padding: reserved for future, zeroes
+ *
+ * The volume records carry the fields of the volume identifier headers which
+ * are the same for all the logical eraseblocks of a volume.
+ */
+struct ubi_fm_vol {
+	__be32  vol_id;
+	__be32  used_ebs;
+	__be32  data_pad;
+	__be32  last_data_size;
+	__u8    vol_type;
+	__u8    compat;
+	__u8    padding[2];
+} __attribute__ ((packed));
+
+/**
+ * struct ubi_fm_peb - fastmap physical eraseblock record.
+ * @ec: erase counter
+ * @vol_id: ID of the volume this physical eraseblock belongs to
+ * @lnum: logical eraseblock number this physical eraseblock is mapped to
+ * @state: one of the %UBI_FM_PEB_FREE, etc. constants
+ * @scrub: if this physical eraseblock has to be scrubbed
+ * @padding: reserved for future, zeroes
+ *
+ * Records are indexed by the physical eraseblock number. @vol_id and @lnum
+ * are only meaningful for %UBI_FM_PEB_USED physical eraseblocks, and @ec is
+ * not meaningful for bad and alien ones.
+ */
+struct ubi_fm_peb {
+	__be32  ec;
+	__be32  vol_id;
+	__be32  lnum;
+	__u8    state;
+	__u8    scrub;
+	__u8    padding[2];
+} __attribute__ ((packed));
+
 #endif /* !__UBI_MEDIA_H__ */
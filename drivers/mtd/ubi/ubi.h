@@ -351,6 +351,14 @@ struct ubi_wl_entry;
  * @bgt_name: background thread name
  * @reboot_notifier: notifier to terminate background thread before rebooting
  *
+ * @fm_sem: held for reading while logical eraseblocks are changed and for
+ *          writing while the fastmap is written
+ * @fm_mutex: serializes fastmap invalidation
+ * @fm_count: count of physical eraseblocks holding the fastmap, %0 if there is
+ *            no valid fastmap on the flash
+ * @fm_pnum: physical eraseblocks holding the fastmap, the anchor first
+ * @fm_ec: erase counters of the @fm_pnum physical eraseblocks
+ *
  * @flash_size: underlying MTD device size (in bytes)
  * @peb_count: count of physical eraseblocks on the MTD device
  * @peb_size: physical eraseblock size
@@ -437,6 +445,15 @@ struct ubi_device {
 	char bgt_name[sizeof(UBI_BGT_NAME_PATTERN)+2];
 	struct notifier_block reboot_notifier;
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+	/* Fastmap stuff */
+	struct rw_semaphore fm_sem;
+	struct mutex fm_mutex;
+	int fm_count;
+	int fm_pnum[UBI_FM_MAX_PEBS];
+	int fm_ec[UBI_FM_MAX_PEBS];
+#endif
+
 	/* I/O sub-system's stuff */
 	long long flash_size;
 	int peb_count;
@@ -523,6 +540,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr);
 int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
+unsigned long long ubi_next_sqnum(struct ubi_device *ubi);
 
 /* wl.c */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype);
@@ -532,6 +550,10 @@ int ubi_wl_scrub_peb(struct ubi_device *ubi, int pnum);
 int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
 void ubi_wl_close(struct ubi_device *ubi);
 int ubi_thread(void *u);
+#ifdef CONFIG_MTD_UBI_FASTMAP
+int ubi_wl_get_fm_peb(struct ubi_device *ubi, int max_pnum, int *ec);
+int ubi_wl_put_fm_peb(struct ubi_device *ubi, int pnum, int ec, int sync);
+#endif
 
 /* io.c */
 int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
@@ -550,6 +572,30 @@ int ubi_io_read_vid_hdr(struct ubi_device *ubi, int pnum,
 int ubi_io_write_vid_hdr(struct ubi_device *ubi, int pnum,
 			 struct ubi_vid_hdr *vid_hdr);
 
+/* fastmap.c */
+#ifdef CONFIG_MTD_UBI_FASTMAP
+struct ubi_scan_info *ubi_scan_fastmap(struct ubi_device *ubi);
+int ubi_fastmap_invalidate_si(struct ubi_device *ubi, struct ubi_scan_info *si);
+int ubi_update_fastmap(struct ubi_device *ubi);
+int ubi_fastmap_lock(struct ubi_device *ubi);
+int ubi_fastmap_trylock(struct ubi_device *ubi);
+void ubi_fastmap_unlock(struct ubi_device *ubi);
+#else
+static inline struct ubi_scan_info *ubi_scan_fastmap(struct ubi_device *ubi)
+{
+	return NULL;
+}
+static inline int ubi_fastmap_invalidate_si(struct ubi_device *ubi,
+					    struct ubi_scan_info *si)
+{
+	return 0;
+}
+static inline int ubi_update_fastmap(struct ubi_device *ubi) { return 0; }
+static inline int ubi_fastmap_lock(struct ubi_device *ubi) { return 0; }
+static inline int ubi_fastmap_trylock(struct ubi_device *ubi) { return 0; }
+static inline void ubi_fastmap_unlock(struct ubi_device *ubi) {}
+#endif
+
 /* build.c */
 int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset);
 int ubi_detach_mtd_dev(int ubi_num, int anyway);
@@ -1193,6 +1193,104 @@ retry:
 	return err;
 }
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+
+/**
+ * ubi_wl_get_fm_peb - get a physical eraseblock for the fastmap.
+ * @ubi: UBI device description object
+ * @max_pnum: the physical eraseblock number has to be less than this
+ * @ec: the erase counter of the physical eraseblock is returned here
+ *
+ * This function takes the free physical eraseblock with the lowest erase
+ * counter among those below @max_pnum and removes it from the WL sub-system
+ * altogether. It is given back by 'ubi_wl_put_fm_peb()' when the fastmap is
+ * invalidated. Returns the physical eraseblock number in case of success and
+ * %-ENOSPC if there is no suitable free physical eraseblock.
+ */
+int ubi_wl_get_fm_peb(struct ubi_device *ubi, int max_pnum, int *ec)
+{
+	struct rb_node *rb;
+	struct ubi_wl_entry *e;
+	int pnum = -ENOSPC;
+
+	spin_lock(&ubi->wl_lock);
+	ubi_rb_for_each_entry(rb, e, &ubi->free, u.rb) {
+		if (e->pnum >= max_pnum)
+			continue;
+
+		rb_erase(&e->u.rb, &ubi->free);
+		ubi->lookuptbl[e->pnum] = NULL;
+		pnum = e->pnum;
+		*ec = e->ec;
+		kmem_cache_free(ubi_wl_entry_slab, e);
+		break;
+	}
+	spin_unlock(&ubi->wl_lock);
+
+	dbg_wl("PEB %d", pnum);
+	return pnum;
+}
+
+/**
+ * ubi_wl_put_fm_peb - give a fastmap physical eraseblock back to the WL.
+ * @ubi: UBI device description object
+ * @pnum: physical eraseblock to give back
+ * @ec: erase counter of the physical eraseblock
+ * @sync: if the physical eraseblock has to be erased before returning
+ *
+ * This function is the counterpart of 'ubi_wl_get_fm_peb()'. If @sync is zero,
+ * the physical eraseblock is scheduled for erasure. Otherwise it is erased
+ * synchronously and put to the free tree. Returns zero in case of success and
+ * a negative error code in case of failure.
+ */
+int ubi_wl_put_fm_peb(struct ubi_device *ubi, int pnum, int ec, int sync)
+{
+	int err = 0;
+	struct ubi_wl_entry *e;
+
+	dbg_wl("PEB %d EC %d, sync %d", pnum, ec, sync);
+	ubi_assert(pnum >= 0 && pnum < ubi->peb_count);
+
+	e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_NOFS);
+	if (!e)
+		return -ENOMEM;
+
+	e->pnum = pnum;
+	e->ec = ec;
+	spin_lock(&ubi->wl_lock);
+	ubi->lookuptbl[pnum] = e;
+	spin_unlock(&ubi->wl_lock);
+
+	if (!sync)
+		goto out_schedule;
+
+	err = sync_erase(ubi, e, 0);
+	if (err)
+		goto out_schedule;
+
+	spin_lock(&ubi->wl_lock);
+	wl_tree_add(e, &ubi->free);
+	spin_unlock(&ubi->wl_lock);
+	return 0;
+
+out_schedule:
+	/*
+	 * Let the erase worker deal with the physical eraseblock, including
+	 * torturing it if the synchronous erasure failed. Note, should this
+	 * fail, the physical eraseblock is lost until the next attach.
+	 */
+	if (schedule_erase(ubi, e, sync)) {
+		spin_lock(&ubi->wl_lock);
+		ubi->lookuptbl[pnum] = NULL;
+		spin_unlock(&ubi->wl_lock);
+		kmem_cache_free(ubi_wl_entry_slab, e);
+		return -ENOMEM;
+	}
+	return sync ? err : 0;
+}
+
+#endif /* CONFIG_MTD_UBI_FASTMAP */
+
 /**
  * ubi_wl_scrub_peb - schedule a physical eraseblock for scrubbing.
  * @ubi: UBI device description object
@@ -46,6 +46,7 @@
 #include <linux/swab.h>
 #include <linux/fec.h>
 #include <linux/phy.h>
+#include <linux/rtnetlink.h>
 
 #include <asm/cacheflush.h>
 
@@ -105,6 +106,21 @@
 #error "FEC: descriptor ring size constants too large"
 #endif
 
+/* Each receive descriptor owns one page and points the controller at one
+ * half of it.  When a large frame is passed up as a page fragment, the
+ * other half is used for the next frame if the stack has already released
+ * it, so under steady load pages are recycled rather than reallocated.
+ * Frames up to FEC_ENET_RX_COPYBREAK bytes are copied into a small skb and
+ * the buffer is handed straight back to the controller.
+ */
+#if (FEC_ENET_RX_FRPPG < 2)
+#error "FEC: receive page recycling needs two frames per page"
+#endif
+
+#define FEC_ENET_RX_COPYBREAK	256
+#define FEC_ENET_RX_HDR_LEN	128	/* bytes pulled into the skb head */
+#define FEC_NAPI_WEIGHT		64
+
 /* Interrupt events/masks. */
 #define FEC_ENET_HBERR	((uint)0x80000000)	/* Heartbeat error */
 #define FEC_ENET_BABR	((uint)0x40000000)	/* Babbling receiver */
@@ -119,6 +135,9 @@
 #define FEC_ENET_TS_AVAIL	((uint)0x00010000)
 #define FEC_ENET_TS_TIMER	((uint)0x00008000)
 
+/* Events handled by the NAPI poll routine, masked while it is scheduled. */
+#define FEC_NAPI_IMASK	(FEC_ENET_TXF | FEC_ENET_RXF)
+
 /*
  * RMII mode to be configured via a gasket
  */
@@ -152,6 +171,13 @@
 #define	OPT_FRAME_SIZE	0
 #endif
 
+/* Page backing a receive descriptor and the half of it given to the FEC. */
+struct fec_rx_buffer {
+	struct page	*page;
+	unsigned int	page_offset;
+	dma_addr_t	dma;
+};
+
 /* The FEC buffer descriptors track the ring buffers.  The rx_bd_base and
  * tx_bd_base always point to the base of the buffer descriptors.  The
  * cur_rx and cur_tx point to the currently available buffer.
@@ -165,13 +191,14 @@ struct fec_enet_private {
 	void __iomem *hwp;
 
 	struct net_device *netdev;
+	struct napi_struct napi;
 
 	struct clk *clk;
 
 	/* The saved address of a sent-in-place packet/buffer, for skfree(). */
 	unsigned char *tx_bounce[TX_RING_SIZE];
 	struct	sk_buff* tx_skbuff[TX_RING_SIZE];
-	struct	sk_buff* rx_skbuff[RX_RING_SIZE];
+	struct	fec_rx_buffer rx_buffer[RX_RING_SIZE];
 	ushort	skb_cur;
 	ushort	skb_dirty;
 
@@ -188,6 +215,8 @@ struct fec_enet_private {
 	uint	tx_full;
 	/* hold while accessing the HW like ringbuffer for tx/rx but not MAC */
 	spinlock_t hw_lock;
+	/* restarts the controller with NAPI and transmit quiesced */
+	struct work_struct restart_work;
 	phy_interface_t phy_interface;
 
 	struct  platform_device *pdev;
@@ -215,7 +244,7 @@ static struct mii_bus *fec_mii_bus;
 
 static irqreturn_t fec_enet_interrupt(int irq, void * dev_id);
 static void fec_enet_tx(struct net_device *dev);
-static void fec_enet_rx(struct net_device *dev);
+static int fec_enet_rx(struct net_device *dev, int budget);
 static int fec_enet_close(struct net_device *dev);
 static void fec_restart(struct net_device *dev, int duplex);
 static void fec_stop(struct net_device *dev);
@@ -247,6 +276,17 @@ static void *swap_buffer(void *bufaddr, int len)
 }
 #endif
 
+/* Interrupt events enabled while the interface is running. */
+static inline uint fec_enet_imask(struct fec_enet_private *fep)
+{
+	uint imask = FEC_ENET_TXF | FEC_ENET_RXF;
+
+	if (fep->ptimer_present)
+		imask |= FEC_ENET_TS_AVAIL | FEC_ENET_TS_TIMER;
+
+	return imask;
+}
+
 static int
 fec_enet_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
@@ -358,8 +398,37 @@ fec_timeout(struct net_device *dev)
 
 	dev->stats.tx_errors++;
 
-	fec_restart(dev, fep->full_duplex);
+	schedule_work(&fep->restart_work);
+}
+
+/*
+ * fec_restart() reinitialises the descriptor rings and the interrupt mask,
+ * which the NAPI poll routine and the transmit path use without hw_lock.
+ * Transmit timeouts and link changes therefore restart the controller from
+ * here, with NAPI disabled and the transmit queue locked.  rtnl_lock keeps
+ * this from racing with open and close.
+ */
+static void fec_enet_restart_work(struct work_struct *work)
+{
+	struct fec_enet_private *fep =
+		container_of(work, struct fec_enet_private, restart_work);
+	struct net_device *dev = fep->netdev;
+	unsigned long flags;
+
+	rtnl_lock();
+	if (!netif_running(dev) || !fep->opened || !fep->link)
+		goto out;
+
+	napi_disable(&fep->napi);
+	netif_tx_lock_bh(dev);
+	spin_lock_irqsave(&fep->hw_lock, flags);
+	fec_restart(dev, fep->phy_dev->duplex);
+	spin_unlock_irqrestore(&fep->hw_lock, flags);
 	netif_wake_queue(dev);
+	netif_tx_unlock_bh(dev);
+	napi_enable(&fep->napi);
+out:
+	rtnl_unlock();
 }
 
 static irqreturn_t
@@ -375,18 +444,17 @@ fec_enet_interrupt(int irq, void * dev_id)
 		int_events = readl(fep->hwp + FEC_IEVENT);
 		writel(int_events, fep->hwp + FEC_IEVENT);
 
-		if (int_events & FEC_ENET_RXF) {
-			ret = IRQ_HANDLED;
-			fec_enet_rx(dev);
-		}
-
-		/* Transmit OK, or non-fatal error. Update the buffer
-		 * descriptors. FEC handles all errors, we just discover
-		 * them as part of the transmit process.
+		/* Receive and transmit completion are handled by the NAPI
+		 * poll routine.  Mask both events until it has drained the
+		 * rings so a busy link does not raise an interrupt per frame.
 		 */
-		if (int_events & FEC_ENET_TXF) {
+		if (int_events & FEC_NAPI_IMASK) {
 			ret = IRQ_HANDLED;
-			fec_enet_tx(dev);
+			if (napi_schedule_prep(&fep->napi)) {
+				writel(fec_enet_imask(fep) & ~FEC_NAPI_IMASK,
+						fep->hwp + FEC_IMASK);
+				__napi_schedule(&fep->napi);
+			}
 		}
 		if (int_events & FEC_ENET_TS_AVAIL) {
 			ret = IRQ_HANDLED;
@@ -403,7 +471,7 @@ fec_enet_interrupt(int irq, void * dev_id)
 	return ret;
 }
 
-
+/* Reap completed transmit descriptors; called from the NAPI poll routine. */
 static void
 fec_enet_tx(struct net_device *dev)
 {
@@ -476,28 +544,110 @@ fec_enet_tx(struct net_device *dev)
 }
 
 
+/* Build an skb for a received frame of len bytes (FCS excluded) held in
+ * rxb.  Small frames are copied and the buffer is left mapped for reuse;
+ * larger frames get their headers copied and the rest of the buffer
+ * attached as a page fragment, in which case rxb is moved to the other half
+ * of its page or to a fresh page.  Returns NULL if memory is short, leaving
+ * the buffer with the controller.
+ */
+static struct sk_buff *
+fec_enet_rx_skb(struct net_device *dev, struct fec_rx_buffer *rxb,
+		int pkt_len, int len)
+{
+	struct	sk_buff	*skb;
+	struct	page *page = rxb->page;
+	struct	page *new_page = NULL;
+	__u8 *data = page_address(page) + rxb->page_offset;
+	int	hlen = len;
+
+	if (len > FEC_ENET_RX_COPYBREAK) {
+		hlen = FEC_ENET_RX_HDR_LEN;
+
+		/* Unless we hold the only reference, the other half of the
+		 * page is still owned by the stack and cannot be reused.
+		 */
+		if (page_count(page) != 1) {
+			new_page = alloc_page(GFP_ATOMIC | __GFP_COLD);
+			if (unlikely(!new_page))
+				return NULL;
+		}
+	}
+
+	skb = netdev_alloc_skb(dev, hlen + NET_IP_ALIGN);
+	if (unlikely(!skb)) {
+		if (new_page)
+			__free_page(new_page);
+		return NULL;
+	}
+	skb_reserve(skb, NET_IP_ALIGN);
+
+	if (hlen == len) {
+		dma_sync_single_for_cpu(&dev->dev, rxb->dma, pkt_len,
+				DMA_FROM_DEVICE);
+#ifdef CONFIG_ARCH_MXS
+		swap_buffer(data, pkt_len);
+#endif
+		skb_copy_to_linear_data(skb, data, len);
+		skb_put(skb, len);
+		dma_sync_single_for_device(&dev->dev, rxb->dma,
+				FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
+		return skb;
+	}
+
+	dma_unmap_page(&dev->dev, rxb->dma, FEC_ENET_RX_FRSIZE,
+			DMA_FROM_DEVICE);
+#ifdef CONFIG_ARCH_MXS
+	swap_buffer(data, pkt_len);
+#endif
+	skb_copy_to_linear_data(skb, data, hlen);
+	skb_put(skb, hlen);
+
+	/* The fragment takes over our reference to the page. */
+	skb_fill_page_desc(skb, 0, page, rxb->page_offset + hlen, len - hlen);
+	skb->len += len - hlen;
+	skb->data_len += len - hlen;
+	skb->truesize += FEC_ENET_RX_FRSIZE;
+
+	if (new_page) {
+		rxb->page = new_page;
+		rxb->page_offset = 0;
+	} else {
+		get_page(page);
+		rxb->page_offset ^= FEC_ENET_RX_FRSIZE;
+	}
+	rxb->dma = dma_map_page(&dev->dev, rxb->page, rxb->page_offset,
+			FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
+
+	return skb;
+}
+
 /* During a receive, the cur_rx points to the current incoming buffer.
  * When we update through the ring, if the next incoming buffer has
  * not been given to the system, we just set the empty indicator,
  * effectively tossing the packet.
+ *
+ * Called from the NAPI poll routine.  At most budget frames are taken
+ * off the ring; the number processed is returned.  The receive ring is
+ * only walked from here, so hw_lock is not needed: the stack may transmit
+ * on this device while a frame is being delivered.
  */
-static void
-fec_enet_rx(struct net_device *dev)
+static int
+fec_enet_rx(struct net_device *dev, int budget)
 {
 	struct	fec_enet_private *fep = netdev_priv(dev);
 	struct	fec_ptp_private *fpp = fep->ptp_priv;
+	struct	fec_rx_buffer *rxb;
 	struct bufdesc *bdp;
 	unsigned short status;
 	struct	sk_buff	*skb;
 	ushort	pkt_len;
-	__u8 *data;
+	int	pkt_received = 0;
 
 #ifdef CONFIG_M532x
 	flush_cache_all();
 #endif
 
-	spin_lock(&fep->hw_lock);
-
 	/* First, grab all of the stats for the incoming packet.
 	 * These get messed up if we get called due to a busy condition.
 	 */
@@ -505,6 +655,10 @@ fec_enet_rx(struct net_device *dev)
 
 	while (!((status = bdp->cbd_sc) & BD_ENET_RX_EMPTY)) {
 
+		if (pkt_received >= budget)
+			break;
+		pkt_received++;
+
 		/* Since we have allocated space to hold a complete frame,
 		 * the last indicator should be set.
 		 */
@@ -544,37 +698,28 @@ fec_enet_rx(struct net_device *dev)
 		dev->stats.rx_packets++;
 		pkt_len = bdp->cbd_datlen;
 		dev->stats.rx_bytes += pkt_len;
-		data = (__u8*)__va(bdp->cbd_bufaddr);
+		rxb = &fep->rx_buffer[bdp - fep->rx_bd_base];
 
-	        dma_unmap_single(NULL, bdp->cbd_bufaddr, bdp->cbd_datlen,
-        			DMA_FROM_DEVICE);
-#ifdef CONFIG_ARCH_MXS
-		swap_buffer(data, pkt_len);
-#endif
-		/* This does 16 byte alignment, exactly what we need.
-		 * The packet length includes FCS, but we don't want to
+		/* The packet length includes FCS, but we don't want to
 		 * include that when passing upstream as it messes up
 		 * bridging applications.
 		 */
-		skb = dev_alloc_skb(pkt_len - 4 + NET_IP_ALIGN);
+		skb = fec_enet_rx_skb(dev, rxb, pkt_len, pkt_len - 4);
 
 		if (unlikely(!skb)) {
-			printk("%s: Memory squeeze, dropping packet.\n",
-					dev->name);
+			if (printk_ratelimit())
+				printk("%s: Memory squeeze, dropping packet.\n",
+						dev->name);
 			dev->stats.rx_dropped++;
 		} else {
-			skb_reserve(skb, NET_IP_ALIGN);
-			skb_put(skb, pkt_len - 4);	/* Make room */
-			skb_copy_to_linear_data(skb, data, pkt_len - 4);
 			skb->protocol = eth_type_trans(skb, dev);
 			/* 1588 messeage TS handle */
 			if (fep->ptimer_present)
 				fec_ptp_store_rxstamp(fpp, skb, bdp);
-			netif_rx(skb);
+			napi_gro_receive(&fep->napi, skb);
 		}
 
-        	bdp->cbd_bufaddr = dma_map_single(NULL, data, bdp->cbd_datlen,
-			DMA_FROM_DEVICE);
+		bdp->cbd_bufaddr = rxb->dma;
 rx_processing_done:
 		/* Clear the status flags for this buffer */
 		status &= ~BD_ENET_RX_STATS;
@@ -601,7 +746,29 @@ rx_processing_done:
 	}
 	fep->cur_rx = bdp;
 
-	spin_unlock(&fep->hw_lock);
+	return pkt_received;
+}
+
+/* NAPI poll: reap transmit completions, then receive up to budget frames.
+ * The RX/TX interrupts stay masked until both rings have been drained.
+ */
+static int
+fec_enet_rx_napi(struct napi_struct *napi, int budget)
+{
+	struct fec_enet_private *fep =
+		container_of(napi, struct fec_enet_private, napi);
+	struct net_device *dev = fep->netdev;
+	int pkts;
+
+	fec_enet_tx(dev);
+	pkts = fec_enet_rx(dev, budget);
+
+	if (pkts < budget) {
+		napi_complete(napi);
+		writel(fec_enet_imask(fep), fep->hwp + FEC_IMASK);
+	}
+
+	return pkts;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -669,7 +836,7 @@ static void fec_enet_adjust_link(struct net_device *dev)
 	/* Duplex link change */
 	if (phy_dev->link) {
 		if (fep->full_duplex != phy_dev->duplex) {
-			fec_restart(dev, phy_dev->duplex);
+			schedule_work(&fep->restart_work);
 			status_change = 1;
 		}
 	}
@@ -678,7 +845,7 @@ static void fec_enet_adjust_link(struct net_device *dev)
 	if (phy_dev->link != fep->link) {
 		fep->link = phy_dev->link;
 		if (phy_dev->link)
-			fec_restart(dev, phy_dev->duplex);
+			schedule_work(&fep->restart_work);
 		else
 			fec_stop(dev);
 		status_change = 1;
@@ -929,18 +1096,20 @@ static void fec_enet_free_buffers(struct net_device *dev)
 {
 	struct fec_enet_private *fep = netdev_priv(dev);
 	int i;
-	struct sk_buff *skb;
+	struct fec_rx_buffer *rxb;
 	struct bufdesc	*bdp;
 
 	bdp = fep->rx_bd_base;
 	for (i = 0; i < RX_RING_SIZE; i++) {
-		skb = fep->rx_skbuff[i];
+		rxb = &fep->rx_buffer[i];
 
-		if (bdp->cbd_bufaddr)
-			dma_unmap_single(&dev->dev, bdp->cbd_bufaddr,
+		if (rxb->page) {
+			dma_unmap_page(&dev->dev, rxb->dma,
 					FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
-		if (skb)
-			dev_kfree_skb(skb);
+			put_page(rxb->page);
+			rxb->page = NULL;
+		}
+		bdp->cbd_bufaddr = 0;
 		bdp++;
 	}
 
@@ -953,20 +1122,22 @@ static int fec_enet_alloc_buffers(struct net_device *dev)
 {
 	struct fec_enet_private *fep = netdev_priv(dev);
 	int i;
-	struct sk_buff *skb;
+	struct fec_rx_buffer *rxb;
 	struct bufdesc	*bdp;
 
 	bdp = fep->rx_bd_base;
 	for (i = 0; i < RX_RING_SIZE; i++) {
-		skb = dev_alloc_skb(FEC_ENET_RX_FRSIZE);
-		if (!skb) {
+		rxb = &fep->rx_buffer[i];
+		rxb->page = alloc_page(GFP_KERNEL);
+		if (!rxb->page) {
 			fec_enet_free_buffers(dev);
 			return -ENOMEM;
 		}
-		fep->rx_skbuff[i] = skb;
-
-		bdp->cbd_bufaddr = dma_map_single(&dev->dev, skb->data,
+		rxb->page_offset = 0;
+		rxb->dma = dma_map_page(&dev->dev, rxb->page, 0,
 				FEC_ENET_RX_FRSIZE, DMA_FROM_DEVICE);
+
+		bdp->cbd_bufaddr = rxb->dma;
 		bdp->cbd_sc = BD_ENET_RX_EMPTY;
 #ifdef CONFIG_FEC_1588
 		bdp->cbd_esc = BD_ENET_RX_INT;
@@ -1018,6 +1189,7 @@ fec_enet_open(struct net_device *dev)
 	       return ret;
 	}
 	phy_start(fep->phy_dev);
+	napi_enable(&fep->napi);
 	fec_restart(dev, fep->phy_dev->duplex);
 	netif_start_queue(dev);
 	fep->opened = 1;
@@ -1032,6 +1204,7 @@ fec_enet_close(struct net_device *dev)
 	/* Don't know what to do yet. */
 	fep->opened = 0;
 	netif_stop_queue(dev);
+	napi_disable(&fep->napi);
 	fec_stop(dev);
 
 	if (fep->phy_dev) {
@@ -1204,6 +1377,7 @@ int __init fec_enet_init(struct net_device *dev, int index)
 	}
 
 	spin_lock_init(&fep->hw_lock);
+	INIT_WORK(&fep->restart_work, fec_enet_restart_work);
 
 	fep->index = index;
 	fep->hwp = (void __iomem *)dev->base_addr;
@@ -1220,6 +1394,9 @@ int __init fec_enet_init(struct net_device *dev, int index)
 	dev->watchdog_timeo = TX_TIMEOUT;
 	dev->netdev_ops = &fec_netdev_ops;
 	dev->ethtool_ops = &fec_enet_ethtool_ops;
+	dev->features |= NETIF_F_GRO;
+
+	netif_napi_add(dev, &fep->napi, fec_enet_rx_napi, FEC_NAPI_WEIGHT);
 
 	/* Initialize the receive buffer descriptors. */
 	bdp = fep->rx_bd_base;
@@ -1323,6 +1500,7 @@ fec_restart(struct net_device *dev, int duplex)
 
 	/* Reset SKB transmit buffers. */
 	fep->skb_cur = fep->skb_dirty = 0;
+	fep->tx_full = 0;
 	for (i = 0; i <= TX_RING_MOD_MASK; i++) {
 		if (fep->tx_skbuff[i]) {
 			dev_kfree_skb_any(fep->tx_skbuff[i]);
@@ -1384,11 +1562,7 @@ fec_restart(struct net_device *dev, int duplex)
 	writel(0, fep->hwp + FEC_R_DES_ACTIVE);
 
 	/* Enable interrupts we wish to service */
-	if (fep->ptimer_present)
-		writel(FEC_ENET_TXF | FEC_ENET_RXF | FEC_ENET_TS_AVAIL |
-				FEC_ENET_TS_TIMER, fep->hwp + FEC_IMASK);
-	else
-		writel(FEC_ENET_TXF | FEC_ENET_RXF, fep->hwp + FEC_IMASK);
+	writel(fec_enet_imask(fep), fep->hwp + FEC_IMASK);
 }
 
 static void
@@ -1554,6 +1728,9 @@ fec_drv_remove(struct platform_device *pdev)
 	platform_set_drvdata(pdev, NULL);
 
 	fec_stop(ndev);
+	unregister_netdev(ndev);
+	/* A restart queued by a transmit timeout still touches registers */
+	cancel_work_sync(&fep->restart_work);
 	fec_enet_mii_remove(fep);
 	if (pdata && pdata->uninit)
 		pdata->uninit();
@@ -1563,7 +1740,6 @@ fec_drv_remove(struct platform_device *pdev)
 	if (fep->ptimer_present)
 		fec_ptp_cleanup(fep->ptp_priv);
 	kfree(fep->ptp_priv);
-	unregister_netdev(ndev);
 	free_netdev(ndev);
 	return 0;
 }
@@ -16,6 +16,7 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
@@ -28,18 +29,53 @@
 #include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
 #include <linux/vmalloc.h>
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking
+ *
+ * binder_main_lock is held for reading by every ioctl and poll call, and
+ * for writing by open, BINDER_THREAD_EXIT, the deferred flush/release work
+ * and the /proc readers.  Holding it for reading guarantees that no
+ * binder_proc or binder_thread goes away, so the locks below only need to
+ * cover the data itself.  A thread drops it while it sleeps for work.
+ *
+ * binder_refs_lock protects the node and ref trees of all processes, the
+ * node and ref counts, node->refs, death notification objects,
+ * binder_context_mgr_node and binder_dead_nodes.
+ *
+ * binder_transaction_lock protects the thread transaction stacks and the
+ * links between transactions, threads and buffers (t->from, t->to_thread,
+ * t->buffer, buffer->transaction).
+ *
+ * proc->inner_lock protects the todo lists of a process and its threads,
+ * delivered_death, the thread tree, the thread counters, return_error and
+ * the async queue of the nodes the process owns.
+ *
+ * proc->alloc_lock protects the transaction buffer area of a process,
+ * including its pages and the lru of pages kept mapped after their
+ * buffers were freed.
+ *
+ * Lock order: binder_main_lock, binder_refs_lock, binder_transaction_lock,
+ * proc->inner_lock.  proc->alloc_lock is only nested outside mmap_sem.
+ */
+static DECLARE_RWSEM(binder_main_lock);
+static DEFINE_MUTEX(binder_refs_lock);
+static DEFINE_SPINLOCK(binder_transaction_lock);
 static HLIST_HEAD(binder_procs);
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
 static struct hlist_head binder_dead_nodes;
 static HLIST_HEAD(binder_deferred_list);
 static DEFINE_MUTEX(binder_deferred_lock);
@@ -60,6 +96,9 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/* How long pages stay mapped after the buffers using them were freed */
+#define BINDER_LRU_DELAY                    (HZ)
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -85,6 +124,15 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Number of pages at the start of the buffer area that are mapped by mmap
+ * and kept mapped for the lifetime of the process, so that most
+ * transactions never allocate or map pages.
+ */
+static uint32_t binder_reserved_pages = 4;
+module_param_named(reserved_pages, binder_reserved_pages, uint,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -108,7 +156,7 @@ module_param_call(stop_on_user_error, binder_set_stop_on_user_error,
 			binder_stop_on_user_error = 2; \
 	} while (0)
 
-enum {
+enum binder_stat_types {
 	BINDER_STAT_PROC,
 	BINDER_STAT_THREAD,
 	BINDER_STAT_NODE,
@@ -120,14 +168,24 @@ enum {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+static inline void binder_stats_deleted(enum binder_stat_types type)
+{
+	atomic_inc(&binder_stats.obj_deleted[type]);
+}
+
+static inline void binder_stats_created(enum binder_stat_types type)
+{
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -147,11 +205,14 @@ struct binder_transaction_log {
 };
 struct binder_transaction_log binder_transaction_log;
 struct binder_transaction_log binder_transaction_log_failed;
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -159,6 +220,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
 	return e;
 }
 
@@ -192,9 +254,10 @@ struct binder_node {
 	unsigned pending_strong_ref:1;
 	unsigned has_weak_ref:1;
 	unsigned pending_weak_ref:1;
-	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
+	/* under proc->inner_lock, so kept out of the bitfield above */
+	int has_async_transaction;
 	struct list_head async_todo;
 };
 
@@ -237,6 +300,43 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * A page of the buffer area.  Pages no longer used by any buffer are not
+ * unmapped straight away but put on the lru of the process, from which
+ * binder_lru_func() unmaps them BINDER_LRU_DELAY later unless a new buffer
+ * has taken them again in the meantime.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	unsigned long freed;
+};
+
+/*
+ * Transaction latency histograms, kept per process and shown in
+ * debugfs binder/latency.  Bucket 0 counts latencies under 1us and
+ * bucket n those from 2^(n-1) up to 2^n us; the last one also counts
+ * everything longer.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+enum {
+	BINDER_LATENCY_SEND_TO_WAKE,	/* queued to target thread awake */
+	BINDER_LATENCY_WAKE_TO_READ,	/* awake to copied to userspace */
+	BINDER_LATENCY_ROUND_TRIP,	/* transaction sent to reply sent */
+	BINDER_LATENCY_COUNT
+};
+
+static const char *binder_latency_names[] = {
+	"send_to_wake",
+	"wake_to_read",
+	"round_trip",
+};
+
+struct binder_latency_hist {
+	atomic_t count[BINDER_LATENCY_BUCKETS];
+};
+
 enum {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -255,6 +355,8 @@ struct binder_proc {
 	struct files_struct *files;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
@@ -263,9 +365,12 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	uint32_t reserved_pages;
+	struct list_head lru_pages;
+	struct delayed_work lru_work;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
@@ -275,6 +380,7 @@ struct binder_proc {
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	struct binder_latency_hist latency[BINDER_LATENCY_COUNT];
 };
 
 enum {
@@ -318,10 +424,25 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	send_ts;	/* when it was queued to the target */
 };
 
 static void binder_defer_work(struct binder_proc *proc, int defer);
 
+#define CREATE_TRACE_POINTS
+#include "trace_binder.h"
+
+static void binder_latency_add(struct binder_proc *proc, int type,
+			       s64 latency_ns)
+{
+	int bucket = 0;
+
+	if (latency_ns >= NSEC_PER_USEC)
+		bucket = min(fls64(div_u64(latency_ns, NSEC_PER_USEC)),
+			     BINDER_LATENCY_BUCKETS - 1);
+	atomic_inc(&proc->latency[type].count[bucket]);
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -569,19 +690,54 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
-static int binder_update_page_range(struct binder_proc *proc, int allocate,
-				    void *start, void *end,
-				    struct vm_area_struct *vma)
+/*
+ * Called when the pages in start-end are no longer used by any buffer.
+ * They stay mapped until binder_lru_func() or the shrinker frees them.
+ */
+static void binder_lru_add_range(struct binder_proc *proc,
+				 void *start, void *end)
+{
+	void *page_addr;
+	size_t index;
+	struct binder_lru_page *page;
+
+	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+		printk(KERN_INFO "binder: %d: lru pages %p-%p\n",
+		       proc->pid, start, end);
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		index = (page_addr - proc->buffer) / PAGE_SIZE;
+		page = &proc->pages[index];
+		BUG_ON(page->page_ptr == NULL);
+		BUG_ON(!list_empty(&page->lru));
+		if (index < proc->reserved_pages)
+			continue;
+		page->freed = jiffies;
+		list_add_tail(&page->lru, &proc->lru_pages);
+	}
+	if (!list_empty(&proc->lru_pages))
+		schedule_delayed_work(&proc->lru_work, BINDER_LRU_DELAY);
+}
+
+/*
+ * Make sure the pages in start-end are mapped, reusing those still held
+ * in the reserve or on the lru.  Unused pages are never unmapped here;
+ * they go through binder_lru_add_range() instead.
+ */
+static int binder_alloc_page_range(struct binder_proc *proc,
+				   void *start, void *end,
+				   struct vm_area_struct *vma)
 {
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page, *tmp;
 	struct mm_struct *mm;
+	LIST_HEAD(allocated);
 
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
-		printk(KERN_INFO "binder: %d: %s pages %p-%p\n",
-		       proc->pid, allocate ? "allocate" : "free", start, end);
+		printk(KERN_INFO "binder: %d: allocate pages %p-%p\n",
+		       proc->pid, start, end);
 
 	if (end <= start)
 		return 0;
@@ -596,9 +752,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -610,16 +763,20 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			/* Still mapped, from the reserve or the lru */
+			list_del_init(&page->lru);
+			continue;
+		}
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -629,7 +786,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -637,39 +794,101 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		list_add(&page->lru, &allocated);
 	}
+	list_for_each_entry_safe(page, tmp, &allocated, lru)
+		list_del_init(&page->lru);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
+err_vm_insert_page_failed:
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+err_map_kernel_failed:
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+err_alloc_page_failed:
+	/*
+	 * Only free what this call allocated, which is on 'allocated'.  The
+	 * other pages were still mapped and go back where they came from.
+	 */
+	for (page_addr -= PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (list_empty(&page->lru)) {
+			binder_lru_add_range(proc, page_addr,
+					     page_addr + PAGE_SIZE);
+			continue;
+		}
+		list_del_init(&page->lru);
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+	}
+err_no_vma:
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return -ENOMEM;
+}
+
+static void binder_lru_func(struct work_struct *work)
+{
+	struct binder_proc *proc = container_of(work, struct binder_proc,
+						lru_work.work);
+	struct binder_lru_page *page, *tmp;
+	struct vm_area_struct *vma = NULL;
+	struct mm_struct *mm;
+	unsigned long delay = 0;
+	void *page_addr;
+	int count = 0;
+
+	mutex_lock(&proc->alloc_lock);
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		vma = proc->vma;
+	}
+
+	/* The lru is in the order the pages were freed */
+	list_for_each_entry_safe(page, tmp, &proc->lru_pages, lru) {
+		if (time_before(jiffies, page->freed + BINDER_LRU_DELAY)) {
+			delay = page->freed + BINDER_LRU_DELAY - jiffies;
+			break;
+		}
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
 		if (vma)
 			zap_page_range(vma, (uintptr_t)page_addr +
 				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
 		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
-err_alloc_page_failed:
-		;
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		list_del_init(&page->lru);
+		count++;
 	}
-err_no_vma:
+
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	if (delay)
+		schedule_delayed_work(&proc->lru_work, delay);
+	mutex_unlock(&proc->alloc_lock);
+
+	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+		printk(KERN_INFO "binder: %d: lru freed %d pages\n",
+		       proc->pid, count);
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -743,7 +962,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
 		end_page_addr = has_page_addr;
-	if (binder_update_page_range(proc, 1,
+	if (binder_alloc_page_range(proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
@@ -762,6 +981,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
@@ -773,6 +994,21 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+	ktime_t start = ktime_get();
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	trace_binder_alloc_buf(proc, data_size, offsets_size, is_async, buffer,
+			       ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -823,15 +1059,15 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 			       "not share page%s%s with with %p or %p\n",
 			       proc->pid, buffer, free_page_start ? "" : " end",
 			       free_page_end ? "" : " start", prev, next);
-		binder_update_page_range(proc, 0, free_page_start ?
+		binder_lru_add_range(proc, free_page_start ?
 			buffer_start_page(buffer) : buffer_end_page(buffer),
 			(free_page_end ? buffer_end_page(buffer) :
-			buffer_start_page(buffer)) + PAGE_SIZE, NULL);
+			buffer_start_page(buffer)) + PAGE_SIZE);
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -857,10 +1093,9 @@ static void binder_free_buf(struct binder_proc *proc,
 			       proc->free_async_space);
 	}
 
-	binder_update_page_range(proc, 0,
+	binder_lru_add_range(proc,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
-		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
-		NULL);
+		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK));
 	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
@@ -883,6 +1118,18 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+/*
+ * The node and ref helpers below are called with binder_refs_lock held,
+ * or with binder_main_lock held for writing.
+ */
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -925,10 +1172,10 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	node = kzalloc(sizeof(*node), GFP_KERNEL);
 	if (node == NULL)
 		return NULL;
-	binder_stats.obj_created[BINDER_STAT_NODE]++;
+	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -959,8 +1206,10 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 		} else
 			node->local_strong_refs++;
 		if (!node->has_strong_ref && target_list) {
+			spin_lock(&node->proc->inner_lock);
 			list_del_init(&node->work.entry);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->inner_lock);
 		}
 	} else {
 		if (!internal)
@@ -971,7 +1220,9 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 					"for %d\n", node->debug_id);
 				return -EINVAL;
 			}
+			spin_lock(&node->proc->inner_lock);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->inner_lock);
 		}
 	}
 	return 0;
@@ -993,25 +1244,30 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 			return 0;
 	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+		spin_lock(&node->proc->inner_lock);
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
 			wake_up_interruptible(&node->proc->wait);
 		}
+		spin_unlock(&node->proc->inner_lock);
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
 		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
 			if (node->proc) {
+				spin_lock(&node->proc->inner_lock);
+				list_del_init(&node->work.entry);
+				spin_unlock(&node->proc->inner_lock);
 				rb_erase(&node->rb_node, &node->proc->nodes);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: refless node %d deleted\n", node->debug_id);
 			} else {
+				list_del_init(&node->work.entry);
 				hlist_del(&node->dead_node);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: dead node %d deleted\n", node->debug_id);
 			}
 			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+			binder_stats_deleted(BINDER_STAT_NODE);
 		}
 	}
 
@@ -1060,8 +1316,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	new_ref = kzalloc(sizeof(*ref), GFP_KERNEL);
 	if (new_ref == NULL)
 		return NULL;
-	binder_stats.obj_created[BINDER_STAT_REF]++;
-	new_ref->debug_id = ++binder_last_id;
+	binder_stats_created(BINDER_STAT_REF);
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1121,12 +1377,14 @@ static void binder_delete_ref(struct binder_ref *ref)
 			printk(KERN_INFO "binder: %d delete ref %d desc %d "
 				"has death notification\n", ref->proc->pid,
 				ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
-		binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
+		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
 	kfree(ref);
-	binder_stats.obj_deleted[BINDER_STAT_REF]++;
+	binder_stats_deleted(BINDER_STAT_REF);
 }
 
 static int binder_inc_ref(struct binder_ref *ref, int strong,
@@ -1184,6 +1442,7 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+/* Called with binder_transaction_lock held. */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
@@ -1198,7 +1457,7 @@ static void binder_pop_transaction(struct binder_thread *target_thread,
 	if (t->buffer)
 		t->buffer->transaction = NULL;
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
 static void binder_send_failed_reply(struct binder_transaction *t,
@@ -1206,9 +1465,13 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 {
 	struct binder_thread *target_thread;
 	BUG_ON(t->flags & TF_ONE_WAY);
+	spin_lock(&binder_transaction_lock);
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1218,7 +1481,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 			if (target_thread->return_error == BR_OK) {
 				if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
 					printk(KERN_INFO "binder: send failed reply for transaction %d to %d:%d\n",
-					       t->debug_id, target_thread->proc->pid, target_thread->pid);
+					       t->debug_id, target_proc->pid, target_thread->pid);
 
 				binder_pop_transaction(target_thread, t);
 				target_thread->return_error = error_code;
@@ -1226,11 +1489,12 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
-			return;
+			spin_unlock(&target_proc->inner_lock);
+			break;
 		} else {
 			struct binder_transaction *next = t->from_parent;
 
@@ -1244,7 +1508,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
 					printk(KERN_INFO "binder: reply failed,"
 						" no target thread at root\n");
-				return;
+				break;
 			}
 			t = next;
 			if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
@@ -1252,6 +1516,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					"et thread -- retry %d\n", t->debug_id);
 		}
 	}
+	spin_unlock(&binder_transaction_lock);
 }
 
 static void binder_transaction_buffer_release(struct binder_proc *proc,
@@ -1283,15 +1548,19 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		long saved_priority;
+
+		spin_lock(&binder_transaction_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&binder_transaction_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		saved_priority = in_reply_to->saved_priority;
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1301,6 +1570,8 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&binder_transaction_lock);
+			binder_set_nice(saved_priority);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
@@ -1308,6 +1579,8 @@ static void binder_transaction(struct binder_proc *proc,
 		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
+			spin_unlock(&binder_transaction_lock);
+			binder_set_nice(saved_priority);
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
@@ -1319,17 +1592,23 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&binder_transaction_lock);
+			binder_set_nice(saved_priority);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		spin_unlock(&binder_transaction_lock);
+		binder_set_nice(saved_priority);
 	} else {
+		mutex_lock(&binder_refs_lock);
 		if (tr->target.handle) {
 			struct binder_ref *ref;
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1340,6 +1619,7 @@ static void binder_transaction(struct binder_proc *proc,
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
@@ -1347,9 +1627,19 @@ static void binder_transaction(struct binder_proc *proc,
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
 		if (target_proc == NULL) {
+			mutex_unlock(&binder_refs_lock);
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		/*
+		 * Pin the node now, the ref we found it through can go
+		 * away as soon as binder_refs_lock is dropped.  The buffer
+		 * takes over this reference below.
+		 */
+		binder_inc_node(target_node, 1, 0, NULL);
+		mutex_unlock(&binder_refs_lock);
+
+		spin_lock(&binder_transaction_lock);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1361,6 +1651,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&binder_transaction_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1370,6 +1661,7 @@ static void binder_transaction(struct binder_proc *proc,
 				tmp = tmp->from_parent;
 			}
 		}
+		spin_unlock(&binder_transaction_lock);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1387,16 +1679,16 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_t_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_tcomplete_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (binder_debug_mask & BINDER_DEBUG_TRANSACTION) {
@@ -1432,12 +1724,9 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1477,10 +1766,14 @@ static void binder_transaction(struct binder_proc *proc,
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			mutex_lock(&binder_refs_lock);
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
 				node = binder_new_node(proc, fp->binder, fp->cookie);
 				if (node == NULL) {
+					mutex_unlock(&binder_refs_lock);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
@@ -1493,10 +1786,12 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				mutex_unlock(&binder_refs_lock);
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1509,11 +1804,16 @@ static void binder_transaction(struct binder_proc *proc,
 			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 				printk(KERN_INFO "        node %d u%p -> ref %d desc %d\n",
 				       node->debug_id, node->ptr, ref->debug_id, ref->desc);
+			mutex_unlock(&binder_refs_lock);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&binder_refs_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1536,6 +1836,7 @@ static void binder_transaction(struct binder_proc *proc,
 				struct binder_ref *new_ref;
 				new_ref = binder_get_ref_for_node(target_proc, ref->node);
 				if (new_ref == NULL) {
+					mutex_unlock(&binder_refs_lock);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
@@ -1545,6 +1846,7 @@ static void binder_transaction(struct binder_proc *proc,
 					printk(KERN_INFO "        ref %d desc %d -> ref %d desc %d (node %d)\n",
 					       ref->debug_id, ref->desc, new_ref->debug_id, new_ref->desc, ref->node->debug_id);
 			}
+			mutex_unlock(&binder_refs_lock);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1593,15 +1895,39 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+
+	/*
+	 * Queue the completion before the transaction itself, so a reply
+	 * can never overtake it on this thread's todo list.
+	 */
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	spin_unlock(&proc->inner_lock);
+
 	if (reply) {
+		s64 round_trip_ns;
+
 		BUG_ON(t->buffer->async_transaction != 0);
+		round_trip_ns = ktime_to_ns(ktime_sub(ktime_get(),
+						      in_reply_to->send_ts));
+		binder_latency_add(proc, BINDER_LATENCY_ROUND_TRIP,
+				   round_trip_ns);
+		trace_binder_reply(t, in_reply_to, round_trip_ns);
+		spin_lock(&binder_transaction_lock);
 		binder_pop_transaction(target_thread, in_reply_to);
+		spin_unlock(&binder_transaction_lock);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
+		spin_lock(&binder_transaction_lock);
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
-	} else {
+		spin_unlock(&binder_transaction_lock);
+	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	spin_lock(&target_proc->inner_lock);
+	if (!reply && (t->flags & TF_ONE_WAY)) {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
 		if (target_node->has_async_transaction) {
@@ -1610,10 +1936,10 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
+	t->send_ts = ktime_get();
+	trace_binder_transaction(reply, t, target_node);
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
+	spin_unlock(&target_proc->inner_lock);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
 	return;
@@ -1630,14 +1956,20 @@ err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	target_node = NULL;
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
 err_bad_call_stack:
+	if (target_node) {
+		mutex_lock(&binder_refs_lock);
+		binder_dec_node(target_node, 1, 0);
+		mutex_unlock(&binder_refs_lock);
+	}
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
@@ -1654,12 +1986,23 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	/*
+	 * A failed reply may have been posted to this thread by another
+	 * process since the write loop checked return_error; keep it.
+	 */
+	spin_lock(&proc->inner_lock);
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	spin_unlock(&proc->inner_lock);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
 }
 
 static void binder_transaction_buffer_release(struct binder_proc *proc,
@@ -1674,8 +2017,11 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			   proc->pid, buffer->debug_id,
 			   buffer->data_size, buffer->offsets_size, failed_at);
 
-	if (buffer->target_node)
+	if (buffer->target_node) {
+		mutex_lock(&binder_refs_lock);
 		binder_dec_node(buffer->target_node, 1, 0);
+		mutex_unlock(&binder_refs_lock);
+	}
 
 	offp = (size_t *)(buffer->data + ALIGN(buffer->data_size, sizeof(void *)));
 	if (failed_at)
@@ -1695,8 +2041,12 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			mutex_lock(&binder_refs_lock);
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				printk(KERN_ERR "binder: transaction release %d bad node %p\n", debug_id, fp->binder);
 				break;
 			}
@@ -1704,11 +2054,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				printk(KERN_INFO "        node %d u%p\n",
 				       node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			mutex_unlock(&binder_refs_lock);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&binder_refs_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				printk(KERN_ERR "binder: transaction release %d bad handle %ld\n", debug_id, fp->handle);
 				break;
 			}
@@ -1716,6 +2071,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				printk(KERN_INFO "        ref %d desc %d (node %d)\n",
 				       ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&binder_refs_lock);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1744,9 +2100,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1760,11 +2116,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&binder_refs_lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
 					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1775,6 +2132,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1802,6 +2160,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				       proc->pid, thread->pid, debug_string, ref->debug_id, ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&binder_refs_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1816,8 +2175,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&binder_refs_lock);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1835,6 +2196,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1844,6 +2206,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1854,6 +2217,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				node->pending_weak_ref = 0;
@@ -1862,6 +2226,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s node %d ls %d lw %d\n",
 				       proc->pid, thread->pid, cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE", node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			mutex_unlock(&binder_refs_lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1879,20 +2244,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it, another thread may free the same pointer */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+
+			spin_lock(&binder_transaction_lock);
 			if (binder_debug_mask & BINDER_DEBUG_FREE_BUFFER)
 				printk(KERN_INFO "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				       proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1902,12 +2275,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			spin_unlock(&binder_transaction_lock);
 			if (buffer->async_transaction && buffer->target_node) {
+				spin_lock(&proc->inner_lock);
 				BUG_ON(!buffer->target_node->has_async_transaction);
 				if (list_empty(&buffer->target_node->async_todo))
 					buffer->target_node->has_async_transaction = 0;
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+				spin_unlock(&proc->inner_lock);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -1935,15 +2311,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					" BC_REGISTER_LOOPER called "
 					"after BC_ENTER_LOOPER\n",
 					proc->pid, thread->pid);
-			} else if (proc->requested_threads == 0) {
-				thread->looper |= BINDER_LOOPER_STATE_INVALID;
-				binder_user_error("binder: %d:%d ERROR:"
-					" BC_REGISTER_LOOPER called "
-					"without request\n",
-					proc->pid, thread->pid);
 			} else {
-				proc->requested_threads--;
-				proc->requested_threads_started++;
+				spin_lock(&proc->inner_lock);
+				if (proc->requested_threads == 0) {
+					spin_unlock(&proc->inner_lock);
+					thread->looper |= BINDER_LOOPER_STATE_INVALID;
+					binder_user_error("binder: %d:%d ERROR:"
+						" BC_REGISTER_LOOPER called "
+						"without request\n",
+						proc->pid, thread->pid);
+				} else {
+					proc->requested_threads--;
+					proc->requested_threads_started++;
+					spin_unlock(&proc->inner_lock);
+				}
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
 			break;
@@ -1980,8 +2361,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&binder_refs_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&binder_refs_lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2008,29 +2391,35 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					mutex_unlock(&binder_refs_lock);
+					spin_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
 					if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
 						printk(KERN_INFO "binder: %d:%d "
 							"BC_REQUEST_DEATH_NOTIFICATION failed\n",
 							proc->pid, thread->pid);
 					break;
 				}
-				binder_stats.obj_created[BINDER_STAT_DEATH]++;
+				binder_stats_created(BINDER_STAT_DEATH);
 				INIT_LIST_HEAD(&death->work.entry);
 				death->cookie = cookie;
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2039,6 +2428,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				death = ref->death;
@@ -2050,9 +2440,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2065,7 +2457,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			mutex_unlock(&binder_refs_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2075,6 +2469,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2086,6 +2481,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				printk(KERN_INFO "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				       proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2102,6 +2498,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2118,9 +2515,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2147,6 +2544,7 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	ktime_t wake;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2155,22 +2553,31 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		thread->return_error2 = BR_OK;
+		if (return_error2 != BR_OK &&
+		    end - ptr < 2 * sizeof(uint32_t))
+			return_error = BR_OK; /* no room, keep it for later */
+		else
+			thread->return_error = BR_OK;
+		spin_unlock(&proc->inner_lock);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+		}
+		if (return_error != BR_OK) {
+			if (put_user(return_error, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2178,7 +2585,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2202,10 +2610,13 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	wake = ktime_get();
+	down_read(&binder_main_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2213,27 +2624,63 @@ retry:
 	while (1) {
 		uint32_t cmd;
 		struct binder_transaction_data tr;
+		struct list_head *list;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		int refs_locked = 0;
+		ktime_t woke;
+		s64 send_to_wake_ns, wake_to_read_ns;
 
+next_work:
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			spin_unlock(&proc->inner_lock);
+			if (refs_locked)
+				mutex_unlock(&binder_refs_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
+			if (refs_locked)
+				mutex_unlock(&binder_refs_lock);
 			break;
+		}
+
+		/*
+		 * Node work is handled under binder_refs_lock, which nests
+		 * outside the inner lock, so take it and look again.
+		 */
+		w = list_first_entry(list, struct binder_work, entry);
+		if (w->type == BINDER_WORK_NODE && !refs_locked) {
+			spin_unlock(&proc->inner_lock);
+			mutex_lock(&binder_refs_lock);
+			refs_locked = 1;
+			goto next_work;
+		}
+		if (w->type != BINDER_WORK_NODE && refs_locked) {
+			mutex_unlock(&binder_refs_lock);
+			refs_locked = 0;
+		}
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			t = container_of(w, struct binder_transaction, work);
+			list_del_init(&w->entry);
+			spin_unlock(&proc->inner_lock);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			list_del(&w->entry);
+			spin_unlock(&proc->inner_lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2243,15 +2690,14 @@ retry:
 			if (binder_debug_mask & BINDER_DEBUG_TRANSACTION_COMPLETE)
 				printk(KERN_INFO "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				       proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
 			uint32_t cmd = BR_NOOP;
 			const char *cmd_name;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
 			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
 			if (weak && !node->has_weak_ref) {
@@ -2275,34 +2721,43 @@ retry:
 				cmd_name = "BR_DECREFS";
 				node->has_weak_ref = 0;
 			}
+			if (cmd == BR_NOOP) {
+				list_del_init(&w->entry);
+				if (!weak && !strong)
+					rb_erase(&node->rb_node, &proc->nodes);
+			}
+			/*
+			 * The node stays queued while it has commands left, but
+			 * it may be freed once both locks are dropped.
+			 */
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&binder_refs_lock);
 			if (cmd != BR_NOOP) {
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 					printk(KERN_INFO "binder: %d:%d %s %d u%p c%p\n",
-					       proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					       proc->pid, thread->pid, cmd_name, node_debug_id, node_ptr, node_cookie);
 			} else {
-				list_del_init(&w->entry);
 				if (!weak && !strong) {
 					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 						printk(KERN_INFO "binder: %d:%d node %d u%p c%p deleted\n",
-						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
+						       proc->pid, thread->pid, node_debug_id, node_ptr, node_cookie);
 					kfree(node);
-					binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
 					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 						printk(KERN_INFO "binder: %d:%d node %d u%p c%p state unchanged\n",
-						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
+						       proc->pid, thread->pid, node_debug_id, node_ptr, node_cookie);
 				}
 			}
 		} break;
@@ -2310,17 +2765,28 @@ retry:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				list_del(&w->entry);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				list_move(&w->entry, &proc->delivered_death);
+			}
+			spin_unlock(&proc->inner_lock);
+			if (cmd == BR_CLEAR_DEATH_NOTIFICATION_DONE) {
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			}
+
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			if (binder_debug_mask & BINDER_DEBUG_DEATH_NOTIFICATION)
@@ -2329,14 +2795,8 @@ retry:
 				       cmd == BR_DEAD_BINDER ?
 				       "BR_DEAD_BINDER" :
 				       "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				       death->cookie);
+				       cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
@@ -2383,13 +2843,29 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			/* put it back for the next reader */
+			spin_lock(&proc->inner_lock);
+			list_add(&t->work.entry, list);
+			spin_unlock(&proc->inner_lock);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
+		/* Work queued after we woke up was taken without sleeping */
+		woke = ktime_to_ns(wake) > ktime_to_ns(t->send_ts) ?
+			wake : t->send_ts;
+		send_to_wake_ns = ktime_to_ns(ktime_sub(woke, t->send_ts));
+		wake_to_read_ns = ktime_to_ns(ktime_sub(ktime_get(), woke));
+		binder_latency_add(proc, BINDER_LATENCY_SEND_TO_WAKE,
+				   send_to_wake_ns);
+		binder_latency_add(proc, BINDER_LATENCY_WAKE_TO_READ,
+				   wake_to_read_ns);
+		trace_binder_transaction_received(t, thread, send_to_wake_ns,
+						  wake_to_read_ns);
+
 		binder_stat_br(proc, thread, cmd);
 		if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 			printk(KERN_INFO "binder: %d:%d %s %d %d:%d, cmd %d"
@@ -2402,16 +2878,18 @@ retry:
 			       t->buffer->data_size, t->buffer->offsets_size,
 			       tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
+		spin_lock(&binder_transaction_lock);
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			spin_unlock(&binder_transaction_lock);
 		} else {
 			t->buffer->transaction = NULL;
+			spin_unlock(&binder_transaction_lock);
 			kfree(t);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
 		break;
 	}
@@ -2419,18 +2897,21 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d BR_SPAWN_LOOPER\n",
 			       proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
@@ -2450,7 +2931,7 @@ static void binder_release_work(struct list_head *list)
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		default:
 			break;
@@ -2459,7 +2940,12 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+/*
+ * Look up the binder_thread of current, inserting new_thread if there is
+ * none yet.  Called with proc->inner_lock held.
+ */
+static struct binder_thread *__binder_get_thread(struct binder_proc *proc,
+					struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2474,26 +2960,49 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
+			return thread;
 	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats.obj_created[BINDER_STAT_THREAD]++;
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+	if (new_thread == NULL)
+		return NULL;
+	rb_link_node(&new_thread->rb_node, parent, p);
+	rb_insert_color(&new_thread->rb_node, &proc->threads);
+	return new_thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	spin_lock(&proc->inner_lock);
+	thread = __binder_get_thread(proc, NULL);
+	spin_unlock(&proc->inner_lock);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	binder_stats_created(BINDER_STAT_THREAD);
+	new_thread->proc = proc;
+	new_thread->pid = current->pid;
+	init_waitqueue_head(&new_thread->wait);
+	INIT_LIST_HEAD(&new_thread->todo);
+	new_thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	new_thread->return_error = BR_OK;
+	new_thread->return_error2 = BR_OK;
+
+	spin_lock(&proc->inner_lock);
+	thread = __binder_get_thread(proc, new_thread);
+	spin_unlock(&proc->inner_lock);
+	if (thread != new_thread) {
+		kfree(new_thread);
+		binder_stats_deleted(BINDER_STAT_THREAD);
 	}
 	return thread;
 }
 
+/* Called with binder_main_lock held for writing. */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2530,7 +3039,7 @@ static int binder_free_thread(struct binder_proc *proc,
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
 	kfree(thread);
-	binder_stats.obj_deleted[BINDER_STAT_THREAD]++;
+	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
 }
 
@@ -2541,12 +3050,12 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2578,7 +3087,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2634,13 +3143,16 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	case BINDER_SET_CONTEXT_MGR:
+		mutex_lock(&binder_refs_lock);
 		if (binder_context_mgr_node != NULL) {
+			mutex_unlock(&binder_refs_lock);
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
 			ret = -EBUSY;
 			goto err;
 		}
 		if (binder_context_mgr_uid != -1) {
 			if (binder_context_mgr_uid != current->cred->euid) {
+				mutex_unlock(&binder_refs_lock);
 				printk(KERN_ERR "binder: BINDER_SET_"
 				       "CONTEXT_MGR bad uid %d != %d\n",
 				       current->cred->euid,
@@ -2652,6 +3164,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			binder_context_mgr_uid = current->cred->euid;
 		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
 		if (binder_context_mgr_node == NULL) {
+			mutex_unlock(&binder_refs_lock);
 			ret = -ENOMEM;
 			goto err;
 		}
@@ -2659,12 +3172,21 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		mutex_unlock(&binder_refs_lock);
 		break;
 	case BINDER_THREAD_EXIT:
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d exit\n",
 			       proc->pid, thread->pid);
+		/*
+		 * Other processes may be using this thread under the read
+		 * lock, so it can only be freed with the lock held for
+		 * writing.  The file reference keeps proc alive meanwhile.
+		 */
+		up_read(&binder_main_lock);
+		down_write(&binder_main_lock);
 		binder_free_thread(proc, thread);
+		downgrade_write(&binder_main_lock);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2685,7 +3207,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2725,6 +3247,7 @@ static struct vm_operations_struct binder_vm_ops = {
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int ret;
+	size_t i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2777,11 +3300,16 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+	proc->reserved_pages = clamp_t(uint32_t, binder_reserved_pages, 1,
+				       proc->buffer_size / PAGE_SIZE);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+	if (binder_alloc_page_range(proc, proc->buffer,
+	    proc->buffer + proc->reserved_pages * PAGE_SIZE, vma)) {
 		ret = -ENOMEM;
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
@@ -2829,14 +3357,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
+	INIT_LIST_HEAD(&proc->lru_pages);
+	INIT_DELAYED_WORK(&proc->lru_work, binder_lru_func);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats.obj_created[BINDER_STAT_PROC]++;
+	down_write(&binder_main_lock);
+	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_main_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2925,7 +3457,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		list_del_init(&node->work.entry);
 		if (hlist_empty(&node->refs)) {
 			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
@@ -2979,21 +3511,25 @@ static void binder_deferred_release(struct binder_proc *proc)
 		buffers++;
 	}
 
-	binder_stats.obj_deleted[BINDER_STAT_PROC]++;
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	cancel_delayed_work_sync(&proc->lru_work);
 
 	page_count = 0;
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				if (binder_debug_mask &
-				    BINDER_DEBUG_BUFFER_ALLOC)
+			if (proc->pages[i].page_ptr) {
+				if ((binder_debug_mask &
+				     BINDER_DEBUG_BUFFER_ALLOC) &&
+				    list_empty(&proc->pages[i].lru) &&
+				    i >= proc->reserved_pages)
 					printk(KERN_INFO
 					       "binder_release: %d: "
 					       "page %d at %p not freed\n",
 					       proc->pid, i,
 					       proc->buffer + i * PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
@@ -3021,7 +3557,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3048,7 +3584,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3355,10 +3891,11 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 			ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int count = atomic_read(&stats->bc[i]);
+
+		if (count)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i],
-					stats->bc[i]);
+					binder_command_strings[i], count);
 		if (buf >= end)
 			return buf;
 	}
@@ -3366,9 +3903,11 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 			ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int count = atomic_read(&stats->br[i]);
+
+		if (count)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
+					binder_return_strings[i], count);
 		if (buf >= end)
 			return buf;
 	}
@@ -3378,13 +3917,14 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 			ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			buf += snprintf(buf, end - buf,
 					"%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] -
-						stats->obj_deleted[i],
-					stats->obj_created[i]);
+					created - deleted, created);
 		if (buf >= end)
 			return buf;
 	}
@@ -3477,7 +4017,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
@@ -3495,7 +4035,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3523,7 +4063,7 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
@@ -3535,7 +4075,7 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3564,7 +4104,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -3573,7 +4113,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3600,11 +4140,11 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3686,6 +4226,45 @@ static struct miscdevice binder_miscdev = {
 	.fops = &binder_fops
 };
 
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int type, i;
+
+	seq_printf(m, "%-8s %-14s %8s", "pid", "latency(us)", "<1");
+	for (i = 1; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, " %8lu", 1UL << i);
+	seq_printf(m, " %8s\n", "more");
+
+	down_read(&binder_main_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		for (type = 0; type < BINDER_LATENCY_COUNT; type++) {
+			seq_printf(m, "%-8d %-14s", proc->pid,
+				   binder_latency_names[type]);
+			for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+				seq_printf(m, " %8d", atomic_read(
+					&proc->latency[type].count[i]));
+			seq_putc(m, '\n');
+		}
+	}
+	up_read(&binder_main_lock);
+	return 0;
+}
+
+static int binder_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, binder_latency_show, NULL);
+}
+
+static const struct file_operations binder_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int __init binder_init(void)
 {
 	int ret;
@@ -3722,6 +4301,12 @@ static int __init binder_init(void)
 				       binder_read_proc_transaction_log,
 				       &binder_transaction_log_failed);
 	}
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (binder_debugfs_dir_entry_root &&
+	    !IS_ERR(binder_debugfs_dir_entry_root))
+		debugfs_create_file("latency", S_IRUSR,
+				    binder_debugfs_dir_entry_root, NULL,
+				    &binder_latency_fops);
 	return ret;
 }
 
@@ -23,6 +23,10 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -31,17 +35,27 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not serialize against each other beyond reserving space for
+ * their entry under the spinlock 'lock', which only moves the positions.
+ * They then copy their entry into the buffer concurrently and commit it
+ * by setting its state.  Readers never block writers: they check that
+ * what they read was not overwritten meanwhile, see logger_lapped().
+ * The readers themselves are protected by the mutex 'mutex'.
+ *
+ * The positions live in the header page of the buffer, so that they can
+ * be mapped read-only by readers along with the buffer.
  */
 struct logger_log {
+	struct logger_mmap_header *hdr; /* positions, followed by the buffer */
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	spinlock_t		lock;	/* lock for reserving space */
+	__u32			start;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -54,7 +68,8 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	__u32			r_off;	/* current read position */
+	int			batch;	/* read as many entries as fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -83,14 +98,25 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * entry_state - the state byte of the entry at position 'pos'
+ */
+static inline unsigned char *entry_state(struct logger_log *log, __u32 pos)
+{
+	return log->buffer +
+		logger_offset(pos + offsetof(struct logger_entry, __pad));
+}
+
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from 'pos'.
  *
- * Caller needs to hold log->mutex.
+ * The entry must be committed or discarded, and the result is only valid
+ * if the entry is not found lapped afterwards.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, __u32 pos)
 {
+	size_t off = logger_offset(pos);
 	__u16 val;
 
 	switch (log->size - off) {
@@ -106,16 +132,80 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_lapped - has the entry at 'pos' been (partly) overwritten?
+ *
+ * Writers move 'head' past the entries they drop before they write to
+ * the space, so the entry is intact as long as 'head' has not passed it.
+ * Call after reading the entry.
+ */
+static inline int logger_lapped(struct logger_log *log, __u32 pos)
+{
+	smp_rmb();
+	return (__s32) (ACCESS_ONCE(log->hdr->head) - pos) > 0;
+}
+
+/*
+ * logger_clamp - returns 'pos', or the oldest entry if 'pos' was dropped
+ *
+ * A position more than a buffer behind the writers is always replaced,
+ * however far behind it is, so that a stale position cannot be mistaken
+ * for one ahead of 'head' once the counters have wrapped.
+ */
+static __u32 logger_clamp(struct logger_log *log, __u32 pos)
+{
+	__u32 w_off, head;
+
+	w_off = ACCESS_ONCE(log->hdr->w_off);
+	smp_rmb();
+	head = ACCESS_ONCE(log->hdr->head);
+	if (w_off - pos > log->size || (__s32) (head - pos) > 0)
+		return head;
+	return pos;
+}
+
+/*
+ * logger_readable - is there a committed entry at the reader's position?
+ *
+ * Readers lapped by the writers are pulled forward to the oldest entry,
+ * and discarded entries are stepped over.
  *
  * Caller must hold log->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static int logger_readable(struct logger_log *log,
+			   struct logger_reader *reader)
 {
+	unsigned char state;
+	__u32 len;
+
+	while (1) {
+		reader->r_off = logger_clamp(log, reader->r_off);
+		if (reader->r_off == ACCESS_ONCE(log->hdr->w_off))
+			return 0;
+
+		smp_rmb();
+		state = *entry_state(log, reader->r_off);
+		if (logger_lapped(log, reader->r_off))
+			continue;
+		if (state == LOGGER_ENTRY_RESERVED)
+			return 0;
+		if (state == LOGGER_ENTRY_COMMITTED)
+			return 1;
+
+		/* discarded */
+		len = get_entry_len(log, reader->r_off);
+		if (!logger_lapped(log, reader->r_off))
+			reader->r_off += len;
+	}
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from position 'pos' of
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
+ */
+static ssize_t do_read_log_to_user(struct logger_log *log, __u32 pos,
+				   char __user *buf, size_t count)
+{
+	size_t off = logger_offset(pos);
 	size_t len;
 
 	/*
@@ -123,8 +213,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -135,8 +225,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -147,7 +235,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit if LOGGER_SET_READ_BATCH is set
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -158,6 +247,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	__u32 r_off, len;
 	DEFINE_WAIT(wait);
 
 start:
@@ -165,7 +255,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -189,128 +279,138 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+	while (logger_readable(log, reader)) {
+		r_off = reader->r_off;
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+		/* get the size of the next entry */
+		len = get_entry_len(log, r_off);
+		if (logger_lapped(log, r_off))
+			continue;
+		if (count - ret < len) {
+			if (!ret)
+				ret = -EINVAL;
+			break;
+		}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+		/* get exactly one entry from the log */
+		if (do_read_log_to_user(log, r_off, buf + ret, len) < 0) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
 
-out:
-	mutex_unlock(&log->mutex);
+		/* drop it if a writer overwrote it meanwhile */
+		if (logger_lapped(log, r_off))
+			continue;
 
-	return ret;
-}
+		/* the entry state is not part of the read() ABI */
+		if (put_user(0, &((struct logger_entry __user *)
+				  (buf + ret))->__pad)) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
 
-/*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
+		reader->r_off = r_off + len;
+		ret += len;
+		if (!reader->batch)
+			break;
+	}
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	mutex_unlock(&log->mutex);
+
+	/* did we race with the writers? */
+	if (unlikely(!ret))
+		goto start;
 
-	return off;
+	return ret;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_reserve - reserve 'len' bytes for a new entry and return its
+ * position.
+ *
+ * The oldest entries are dropped to make room.  If the oldest entry is
+ * still being written (its writer is a whole buffer behind), wait for it.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static __u32 logger_reserve(struct logger_log *log, size_t len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	struct logger_mmap_header *hdr = log->hdr;
+	__u32 pos;
+
+	spin_lock(&log->lock);
+	while (hdr->w_off + len - hdr->head > log->size) {
+		if (*entry_state(log, hdr->head) == LOGGER_ENTRY_RESERVED) {
+			spin_unlock(&log->lock);
+			schedule_timeout_uninterruptible(1);
+			spin_lock(&log->lock);
+			continue;
+		}
+		hdr->head += get_entry_len(log, hdr->head);
 	}
 
-	return 0;
+	/* readers must see the dropped entries gone before we overwrite them */
+	smp_wmb();
+	pos = hdr->w_off;
+	*entry_state(log, pos) = LOGGER_ENTRY_RESERVED;
+	smp_wmb();
+	hdr->w_off = pos + len;
+	spin_unlock(&log->lock);
+
+	return pos;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * logger_commit - make the entry at 'pos' visible to readers, or have them
+ * skip it, and wake them up
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, __u32 pos,
+			  unsigned char state)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
-
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	smp_wmb();
+	*entry_state(log, pos) = state;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to position 'pos' of 'log'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, __u32 pos, const void *buf,
+			 size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to position 'pos' of the log 'log'
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, __u32 pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
@@ -323,10 +423,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
+	__u32 pos, off;
 
 	now = current_kernel_time();
 
@@ -335,22 +435,14 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.__pad = 0;
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	pos = logger_reserve(log, sizeof(struct logger_entry) + header.len);
+	off = pos + sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -360,21 +452,25 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			ret = nr;
+			break;
 		}
 
 		iov++;
+		off += nr;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/*
+	 * The header goes in last, its state byte is only set once all of
+	 * the entry is there.  The space cannot be given back if the copy
+	 * failed, as other writers may have reserved after it.
+	 */
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	logger_commit(log, pos, ret < 0 ? LOGGER_ENTRY_DISCARDED :
+					  LOGGER_ENTRY_COMMITTED);
 
 	return ret;
 }
@@ -409,8 +505,10 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
 
+		reader->batch = 0;
+
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = logger_clamp(log, log->start);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -430,7 +528,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -461,7 +563,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -486,10 +588,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		logger_readable(log, reader);
+		ret = ACCESS_ONCE(log->hdr->w_off) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -497,19 +597,31 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		ret = 0;
+		while (logger_readable(log, reader)) {
 			ret = get_entry_len(log, reader->r_off);
-		else
+			if (!logger_lapped(log, reader->r_off))
+				break;
 			ret = 0;
+		}
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+		log->start = ACCESS_ONCE(log->hdr->w_off);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = logger_clamp(log, log->start);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
 		ret = 0;
 		break;
 	}
@@ -519,9 +631,26 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * logger_mmap - map the log read-only, see struct logger_mmap_header
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EACCES;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->hdr, vma->vm_pgoff);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
+	.mmap = logger_mmap,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
@@ -533,12 +662,10 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * 2^31.  The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,8 +675,8 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.start = 0, \
 	.size = SIZE, \
 };
 
@@ -572,10 +699,21 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* vmalloc_user() zeroes the header: both positions start at 0 */
+	log->hdr = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!log->hdr)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+	log->hdr->size = log->size;
+	log->buffer = (unsigned char *) log->hdr + PAGE_SIZE;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->hdr);
 		return ret;
 	}
 
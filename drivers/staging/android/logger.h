@@ -22,7 +22,7 @@
 
 struct logger_entry {
 	__u16		len;	/* length of the payload */
-	__u16		__pad;	/* no matter what, we get 2 bytes of padding */
+	__u16		__pad;	/* first byte is the entry state, see below */
 	__s32		pid;	/* generating process's pid */
 	__s32		tid;	/* generating process's tid */
 	__s32		sec;	/* seconds since Epoch */
@@ -38,11 +38,42 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * Entry states, kept in the first byte of logger_entry.__pad.  Writers
+ * fill their entries concurrently; an entry may only be read once it is
+ * committed.  Discarded entries (the writer faulted on its buffer) are
+ * skipped.  The state is only visible through mmap(): read() returns
+ * entries with __pad cleared.
+ */
+#define LOGGER_ENTRY_RESERVED		0
+#define LOGGER_ENTRY_COMMITTED		1
+#define LOGGER_ENTRY_DISCARDED		2
+
+/*
+ * A log opened for reading can be mapped read-only.  The first page of
+ * the mapping holds this header, the log buffer of 'size' bytes follows.
+ * Positions are free running byte counts that wrap at 2^32; the buffer
+ * offset of position 'pos' is (pos & (size - 1)).
+ *
+ * Entries from 'head' up to 'w_off' are laid out back to back, possibly
+ * wrapping around the end of the buffer.  To read the entry at 'pos':
+ * wait for its state to be committed, read it, then re-read 'head'.
+ * Writers move 'head' past the entries they drop before they overwrite
+ * them, so if 'head' has passed 'pos' the entry was overwritten while it
+ * was read and reading resumes from 'head'.
+ */
+struct logger_mmap_header {
+	__u32		head;	/* oldest entry in the buffer */
+	__u32		w_off;	/* end of the last reserved entry */
+	__u32		size;	/* size of the log buffer */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_BATCH		_IO(__LOGGERIO, 5) /* many per read */
 
 #endif /* _LINUX_LOGGER_H */
@@ -20,6 +20,20 @@
 #include <linux/sched.h>
 #include <linux/nodemask.h>
 #include <linux/vmstat.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/hash.h>
+#include <linux/notifier.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/uaccess.h>
+
+#define CREATE_TRACE_POINTS
+#include "trace_lowmemorykiller.h"
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask);
 
@@ -43,6 +57,35 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+/*
+ * Index of the processes that can be killed, kept up to date through the
+ * oom_adj notifier so that selecting a victim does not walk every task
+ * under tasklist_lock.  Processes are listed in a bucket per oom_adj
+ * value, and found by task in a hash for updates.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+struct lowmem_task {
+	struct list_head	list;	/* in lowmem_bucket[adj] */
+	struct hlist_node	hash;	/* in lowmem_hash */
+	struct task_struct	*task;
+	int			adj;
+};
+
+static DEFINE_SPINLOCK(lowmem_lock);
+static struct list_head lowmem_bucket[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_hash[1 << LOWMEM_HASH_BITS];
+static struct kmem_cache *lowmem_task_cache;
+
+/*
+ * The last task killed, until it exits or the timeout passes.  While it
+ * is exiting its memory is about to be freed, so nothing else is killed.
+ * Only compared against, never dereferenced outside lowmem_lock.
+ */
+static struct task_struct *lowmem_deathpending;
+static unsigned long lowmem_deathpending_timeout;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -56,40 +99,434 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+static inline struct list_head *lowmem_adj_bucket(int adj)
+{
+	return &lowmem_bucket[clamp(adj, OOM_DISABLE, OOM_ADJUST_MAX) -
+			      OOM_DISABLE];
+}
+
+static struct lowmem_task *lowmem_find(struct task_struct *p)
+{
+	struct hlist_head *head = &lowmem_hash[hash_ptr(p, LOWMEM_HASH_BITS)];
+	struct lowmem_task *t;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(t, node, head, hash)
+		if (t->task == p)
+			return t;
+	return NULL;
+}
+
+/* Add p to the index, unless it is exiting or already there. */
+static void lowmem_add(struct task_struct *p, struct lowmem_task *t)
+{
+	spin_lock(&lowmem_lock);
+	if ((p->flags & PF_EXITING) || lowmem_find(p)) {
+		spin_unlock(&lowmem_lock);
+		kmem_cache_free(lowmem_task_cache, t);
+		return;
+	}
+	t->task = p;
+	t->adj = p->oomkilladj;
+	list_add_tail(&t->list, lowmem_adj_bucket(t->adj));
+	hlist_add_head(&t->hash,
+		       &lowmem_hash[hash_ptr(p, LOWMEM_HASH_BITS)]);
+	spin_unlock(&lowmem_lock);
+}
+
+static int lowmem_oom_adj_notify(struct notifier_block *nb,
+				 unsigned long event, void *data)
+{
+	struct task_struct *p = data;
+	struct lowmem_task *t;
+
+	switch (event) {
+	case OOM_ADJ_TASK_NEW:
+		/*
+		 * If this fails the process is not indexed, and is left to
+		 * the regular oom killer.
+		 */
+		t = kmem_cache_alloc(lowmem_task_cache, GFP_KERNEL);
+		if (t)
+			lowmem_add(p, t);
+		break;
+	case OOM_ADJ_TASK_EXIT:
+		spin_lock(&lowmem_lock);
+		if (p == lowmem_deathpending)
+			lowmem_deathpending = NULL;
+		t = lowmem_find(p);
+		if (t) {
+			list_del(&t->list);
+			hlist_del(&t->hash);
+		}
+		spin_unlock(&lowmem_lock);
+		if (t)
+			kmem_cache_free(lowmem_task_cache, t);
+		break;
+	case OOM_ADJ_TASK_CHANGE:
+		spin_lock(&lowmem_lock);
+		t = lowmem_find(p);
+		if (t && t->adj != p->oomkilladj) {
+			t->adj = p->oomkilladj;
+			list_move_tail(&t->list, lowmem_adj_bucket(t->adj));
+		}
+		spin_unlock(&lowmem_lock);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_oom_adj_nb = {
+	.notifier_call = lowmem_oom_adj_notify,
+};
+
+/* Free and file pages outside ZONE_DMA */
+static void lowmem_free_pages(int *other_free, int *other_file)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES);
 	int node;
 
+	*other_free = global_page_state(NR_FREE_PAGES);
+	*other_file = global_page_state(NR_FILE_PAGES);
+
 	for_each_node_state(node, N_HIGH_MEMORY) {
 		struct zone *z =
 			&NODE_DATA(node)->node_zones[ZONE_DMA];
 
-		other_free -= zone_page_state(z, NR_FREE_PAGES);
-		other_file -= zone_page_state(z, NR_FILE_PAGES);
+		*other_free -= zone_page_state(z, NR_FREE_PAGES);
+		*other_file -= zone_page_state(z, NR_FILE_PAGES);
 	}
+}
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
+	return array_size;
+}
+
+/* Index of the first minfree threshold crossed, or array_size if none */
+static int lowmem_threshold(int other_free, int other_file, int array_size)
+{
+	int i;
+
+	for (i = 0; i < array_size; i++)
 		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
+		    other_file < lowmem_minfree[i])
 			break;
+	return i;
+}
+
+/*
+ * Memory pressure notification.
+ *
+ * /dev/memory_pressure reports one of the levels below, derived from the
+ * same minfree thresholds as the killer so that userspace can trim its
+ * caches before anything is killed:
+ *
+ *  low		free and file pages are within pressure_margin percent
+ *		above the largest minfree threshold
+ *  medium	the largest minfree threshold is crossed, processes of the
+ *		highest adj are being killed
+ *  critical	a lower minfree threshold is crossed
+ *
+ * The level is raised by one while reclaim is inefficient, i.e. less
+ * than pressure_efficiency percent of the pages scanned by vmscan over
+ * the last sample were reclaimed.
+ *
+ * Notification is level-triggered: poll reports the device readable
+ * while the level is at or above the level the reader watches (written
+ * to the device, "low" by default) and the reader has not read it yet,
+ * or read it more than pressure_repeat_ms ago.  A read from offset 0
+ * returns the current level name followed by end of file; seek back to
+ * 0 (or use pread) to read the level again.
+ */
+enum {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char *lowmem_pressure_names[] = {
+	"none",
+	"low",
+	"medium",
+	"critical",
+};
+
+static uint32_t lowmem_pressure_margin = 25;
+static uint32_t lowmem_pressure_efficiency = 25;
+static uint32_t lowmem_pressure_repeat_ms = 1000;
+
+module_param_named(pressure_margin, lowmem_pressure_margin, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_efficiency, lowmem_pressure_efficiency, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_repeat_ms, lowmem_pressure_repeat_ms, uint,
+		   S_IRUGO | S_IWUSR);
+
+#define LOWMEM_RECLAIM_SAMPLE	(HZ / 10)
+
+static DEFINE_SPINLOCK(lowmem_reclaim_lock);
+static unsigned long lowmem_reclaim_scanned;
+static unsigned long lowmem_reclaim_stolen;
+static unsigned long lowmem_reclaim_time;
+static int lowmem_reclaim_efficiency = 100;
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static int lowmem_pressure_level;
+static void lowmem_pressure_timer_fn(unsigned long data);
+static DEFINE_TIMER(lowmem_pressure_timer, lowmem_pressure_timer_fn, 0, 0);
+
+struct lowmem_pressure_reader {
+	int		watch;		/* lowest level reported */
+	int		seen_level;	/* level of the last read */
+	unsigned long	seen_time;	/* jiffies of the last read */
+	char		record[16];	/* level name returned by read */
+	int		record_len;
+};
+
+/* Pages scanned and reclaimed by vmscan in all zones, since boot */
+static void lowmem_vm_reclaim(unsigned long *scanned, unsigned long *stolen)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	int cpu, z;
+
+	*scanned = *stolen = 0;
+	for_each_online_cpu(cpu) {
+		struct vm_event_state *ev = &per_cpu(vm_event_states, cpu);
+
+		for (z = 0; z < MAX_NR_ZONES; z++) {
+			*scanned += ev->event[PGSCAN_KSWAPD_NORMAL -
+					     ZONE_NORMAL + z];
+			*scanned += ev->event[PGSCAN_DIRECT_NORMAL -
+					     ZONE_NORMAL + z];
+			*stolen += ev->event[PGSTEAL_NORMAL - ZONE_NORMAL + z];
+		}
+	}
+#else
+	*scanned = *stolen = 0;
+#endif
+}
+
+/*
+ * Called from the shrinker while reclaim is running: update the reclaim
+ * efficiency over the last sample period.
+ */
+static void lowmem_reclaim_sample(void)
+{
+	unsigned long scanned, stolen, d_scanned, d_stolen;
+
+	if (time_before(jiffies, lowmem_reclaim_time + LOWMEM_RECLAIM_SAMPLE))
+		return;
+	if (!spin_trylock(&lowmem_reclaim_lock))
+		return;
+
+	lowmem_vm_reclaim(&scanned, &stolen);
+	d_scanned = scanned - lowmem_reclaim_scanned;
+	d_stolen = stolen - lowmem_reclaim_stolen;
+	if (d_scanned >= SWAP_CLUSTER_MAX)
+		lowmem_reclaim_efficiency = min(d_stolen, d_scanned) * 100 /
+					    d_scanned;
+	else
+		lowmem_reclaim_efficiency = 100;
+	lowmem_reclaim_scanned = scanned;
+	lowmem_reclaim_stolen = stolen;
+	lowmem_reclaim_time = jiffies;
+
+	spin_unlock(&lowmem_reclaim_lock);
+}
+
+static int lowmem_pressure(void)
+{
+	int other_free, other_file, array_size, i, margin, level;
+
+	array_size = lowmem_array_size();
+	if (!array_size)
+		return LOWMEM_PRESSURE_NONE;
+
+	lowmem_free_pages(&other_free, &other_file);
+	i = lowmem_threshold(other_free, other_file, array_size);
+	if (i < array_size - 1)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (i == array_size - 1)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else {
+		margin = lowmem_minfree[array_size - 1];
+		margin += margin * lowmem_pressure_margin / 100;
+		if (other_free < margin && other_file < margin)
+			level = LOWMEM_PRESSURE_LOW;
+		else
+			level = LOWMEM_PRESSURE_NONE;
+	}
+
+	/* A stale sample means reclaim has stopped running */
+	if (level < LOWMEM_PRESSURE_CRITICAL &&
+	    lowmem_reclaim_efficiency < lowmem_pressure_efficiency &&
+	    time_before(jiffies, lowmem_reclaim_time + HZ))
+		level++;
+
+	return level;
+}
+
+/*
+ * Update the pressure level and wake up readers.  While there is any
+ * pressure the timer keeps readers notified every pressure_repeat_ms.
+ */
+static void lowmem_pressure_update(void)
+{
+	int level = lowmem_pressure();
+
+	if (level != lowmem_pressure_level) {
+		lowmem_pressure_level = level;
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	if (level != LOWMEM_PRESSURE_NONE &&
+	    !timer_pending(&lowmem_pressure_timer))
+		mod_timer(&lowmem_pressure_timer, jiffies +
+			  msecs_to_jiffies(lowmem_pressure_repeat_ms));
+}
+
+static void lowmem_pressure_timer_fn(unsigned long data)
+{
+	lowmem_pressure_level = lowmem_pressure();
+	if (lowmem_pressure_level == LOWMEM_PRESSURE_NONE)
+		return;
+	wake_up_interruptible(&lowmem_pressure_wait);
+	if (waitqueue_active(&lowmem_pressure_wait))
+		mod_timer(&lowmem_pressure_timer, jiffies +
+			  msecs_to_jiffies(lowmem_pressure_repeat_ms));
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->watch = LOWMEM_PRESSURE_LOW;
+	reader->seen_level = LOWMEM_PRESSURE_NONE;
+	file->private_data = reader;
+	return 0;
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	int level;
+
+	if (*pos == 0) {
+		level = lowmem_pressure();
+		reader->record_len = snprintf(reader->record,
+					      sizeof(reader->record), "%s\n",
+					      lowmem_pressure_names[level]);
+		reader->seen_level = level;
+		reader->seen_time = jiffies;
+	}
+
+	return simple_read_from_buffer(buf, count, pos, reader->record,
+				       reader->record_len);
+}
+
+/* Set the lowest level the reader is notified of */
+static ssize_t lowmem_pressure_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	char name[16], *p;
+	int level;
+
+	if (count >= sizeof(name))
+		return -EINVAL;
+	if (copy_from_user(name, buf, count))
+		return -EFAULT;
+	name[count] = '\0';
+	p = strstrip(name);
+
+	for (level = LOWMEM_PRESSURE_LOW;
+	     level < ARRAY_SIZE(lowmem_pressure_names); level++) {
+		if (!strcmp(p, lowmem_pressure_names[level])) {
+			reader->watch = level;
+			return count;
 		}
 	}
+	return -EINVAL;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	int level;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	level = lowmem_pressure();
+	if (level < reader->watch)
+		return 0;
+	if (level != reader->seen_level ||
+	    time_after_eq(jiffies, reader->seen_time +
+			  msecs_to_jiffies(lowmem_pressure_repeat_ms)))
+		return POLLIN | POLLRDNORM;
+
+	/* Already read: make sure the timer repeats the notification */
+	if (!timer_pending(&lowmem_pressure_timer))
+		mod_timer(&lowmem_pressure_timer, reader->seen_time +
+			  msecs_to_jiffies(lowmem_pressure_repeat_ms));
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.write = lowmem_pressure_write,
+	.poll = lowmem_pressure_poll,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "memory_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected = NULL;
+	struct lowmem_task *t;
+	int rem = 0;
+	int tasksize;
+	int i, adj;
+	int min_adj = OOM_ADJUST_MAX + 1;
+	int selected_tasksize = 0;
+	int selected_oom_adj = 0;
+	int scanned = 0;
+	int array_size = lowmem_array_size();
+	int other_free, other_file;
+	ktime_t start;
+
+	lowmem_free_pages(&other_free, &other_file);
+	i = lowmem_threshold(other_free, other_file, array_size);
+	if (i < array_size)
+		min_adj = lowmem_adj[i];
+
+	if (nr_to_scan > 0) {
+		lowmem_reclaim_sample();
+		lowmem_pressure_update();
+	}
+
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -103,63 +540,121 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		int oom_adj;
+	start = ktime_get();
+	spin_lock(&lowmem_lock);
 
-		task_lock(p);
-		mm = p->mm;
-		if (!mm) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = p->oomkilladj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		trace_lowmem_deathpending(lowmem_deathpending);
+		spin_unlock(&lowmem_lock);
+		return 0;
+	}
+
+	/*
+	 * Pick the largest process of the highest non-empty oom_adj bucket
+	 * at or above min_adj.
+	 */
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE) &&
+	     !selected; adj--) {
+		list_for_each_entry(t, lowmem_adj_bucket(adj), list) {
+			struct task_struct *p = t->task;
+			struct mm_struct *mm;
+
+			scanned++;
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, adj,
+				     tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+
+	trace_lowmem_select(min_adj, other_free, other_file, scanned,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)),
+			    selected ? selected->pid : 0, selected_oom_adj,
+			    selected_tasksize);
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
+		trace_lowmem_kill(selected, selected_oom_adj,
+				  selected_tasksize);
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
 	}
+	spin_unlock(&lowmem_lock);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	struct lowmem_task *t;
+	int i;
+
+	lowmem_task_cache = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cache)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_bucket[i]);
+	for (i = 0; i < (1 << LOWMEM_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&lowmem_hash[i]);
+
+	/*
+	 * Register first so that no process is missed, then index the
+	 * processes that already exist.  lowmem_add() skips those that
+	 * the notifier has added meanwhile.
+	 */
+	register_oom_adj_notifier(&lowmem_oom_adj_nb);
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		t = kmem_cache_alloc(lowmem_task_cache, GFP_ATOMIC);
+		if (!t)
+			break;
+		lowmem_add(p, t);
+	}
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
+
+	lowmem_vm_reclaim(&lowmem_reclaim_scanned, &lowmem_reclaim_stolen);
+	lowmem_reclaim_time = jiffies;
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "memory_pressure device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *t, *next;
+	int i;
+
+	misc_deregister(&lowmem_pressure_misc);
+	del_timer_sync(&lowmem_pressure_timer);
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&lowmem_oom_adj_nb);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(t, next, &lowmem_bucket[i], list)
+			kmem_cache_free(lowmem_task_cache, t);
+	kmem_cache_destroy(lowmem_task_cache);
 }
 
 module_init(lowmem_init);
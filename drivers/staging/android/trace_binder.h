@@ -0,0 +1,157 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoint for a transaction or reply being queued to its target.
+ */
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(	int,		debug_id	)
+		__field(	int,		target_node	)
+		__field(	int,		to_proc		)
+		__field(	int,		to_thread	)
+		__field(	int,		reply		)
+		__field(	unsigned int,	code		)
+		__field(	unsigned int,	flags		)
+		__field(	size_t,		data_size	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->target_node	= target_node ? target_node->debug_id : 0;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->to_thread	= t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply		= reply;
+		__entry->code		= t->code;
+		__entry->flags		= t->flags;
+		__entry->data_size	= t->buffer->data_size;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x size=%zd",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code, __entry->data_size)
+);
+
+/*
+ * Tracepoint for a target thread taking a transaction or reply.
+ * send_to_wake_ns is the time from queueing it to the thread waking up
+ * (or to it being queued, if the thread was already awake), and
+ * wake_to_read_ns the time from there until it was copied to userspace.
+ */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(struct binder_transaction *t, struct binder_thread *thread,
+		 s64 send_to_wake_ns, s64 wake_to_read_ns),
+
+	TP_ARGS(t, thread, send_to_wake_ns, wake_to_read_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	debug_id	)
+		__field(	int,	proc		)
+		__field(	int,	thread		)
+		__field(	s64,	send_to_wake_ns	)
+		__field(	s64,	wake_to_read_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->proc		= thread->proc->pid;
+		__entry->thread		= thread->pid;
+		__entry->send_to_wake_ns = send_to_wake_ns;
+		__entry->wake_to_read_ns = wake_to_read_ns;
+	),
+
+	TP_printk("transaction=%d proc=%d thread=%d send_to_wake=%lldns "
+		  "wake_to_read=%lldns",
+		  __entry->debug_id, __entry->proc, __entry->thread,
+		  (long long)__entry->send_to_wake_ns,
+		  (long long)__entry->wake_to_read_ns)
+);
+
+/*
+ * Tracepoint for a reply being sent.  round_trip_ns is the time since
+ * the transaction it answers was sent.
+ */
+TRACE_EVENT(binder_reply,
+
+	TP_PROTO(struct binder_transaction *t,
+		 struct binder_transaction *in_reply_to, s64 round_trip_ns),
+
+	TP_ARGS(t, in_reply_to, round_trip_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	debug_id	)
+		__field(	int,	in_reply_to	)
+		__field(	int,	to_proc		)
+		__field(	s64,	round_trip_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= t->debug_id;
+		__entry->in_reply_to	= in_reply_to->debug_id;
+		__entry->to_proc	= t->to_proc->pid;
+		__entry->round_trip_ns	= round_trip_ns;
+	),
+
+	TP_printk("transaction=%d in_reply_to=%d dest_proc=%d round_trip=%lldns",
+		  __entry->debug_id, __entry->in_reply_to, __entry->to_proc,
+		  (long long)__entry->round_trip_ns)
+);
+
+/*
+ * Tracepoint for a transaction buffer allocation, whether or not it
+ * succeeded.  latency_ns includes waiting for the allocator lock and
+ * mapping pages.
+ */
+TRACE_EVENT(binder_alloc_buf,
+
+	TP_PROTO(struct binder_proc *proc, size_t data_size,
+		 size_t offsets_size, int is_async,
+		 struct binder_buffer *buffer, s64 latency_ns),
+
+	TP_ARGS(proc, data_size, offsets_size, is_async, buffer, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	proc		)
+		__field(	size_t,	data_size	)
+		__field(	size_t,	offsets_size	)
+		__field(	int,	is_async	)
+		__field(	int,	failed		)
+		__field(	s64,	latency_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->proc		= proc->pid;
+		__entry->data_size	= data_size;
+		__entry->offsets_size	= offsets_size;
+		__entry->is_async	= is_async;
+		__entry->failed		= buffer == NULL;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("proc=%d size=%zd-%zd async=%d failed=%d latency=%lldns",
+		  __entry->proc, __entry->data_size, __entry->offsets_size,
+		  __entry->is_async, __entry->failed,
+		  (long long)__entry->latency_ns)
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE trace_binder
+#include <trace/define_trace.h>
@@ -0,0 +1,106 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoint for a victim selection, whether or not a task was selected.
+ * scanned is the number of indexed tasks looked at and latency_ns the
+ * time taken to select.
+ */
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_adj, int other_free, int other_file, int scanned,
+		 s64 latency_ns, pid_t pid, int adj, int tasksize),
+
+	TP_ARGS(min_adj, other_free, other_file, scanned, latency_ns, pid,
+		adj, tasksize),
+
+	TP_STRUCT__entry(
+		__field(	int,	min_adj		)
+		__field(	int,	other_free	)
+		__field(	int,	other_file	)
+		__field(	int,	scanned		)
+		__field(	s64,	latency_ns	)
+		__field(	pid_t,	pid		)
+		__field(	int,	adj		)
+		__field(	int,	tasksize	)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj	= min_adj;
+		__entry->other_free	= other_free;
+		__entry->other_file	= other_file;
+		__entry->scanned	= scanned;
+		__entry->latency_ns	= latency_ns;
+		__entry->pid		= pid;
+		__entry->adj		= adj;
+		__entry->tasksize	= tasksize;
+	),
+
+	TP_printk("min_adj=%d free=%d file=%d scanned=%d latency=%lldns "
+		  "pid=%d adj=%d size=%d",
+		  __entry->min_adj, __entry->other_free, __entry->other_file,
+		  __entry->scanned, (long long)__entry->latency_ns,
+		  __entry->pid, __entry->adj, __entry->tasksize)
+);
+
+/*
+ * Tracepoint for sending SIGKILL to the selected task:
+ */
+TRACE_EVENT(lowmem_kill,
+
+	TP_PROTO(struct task_struct *p, int adj, int tasksize),
+
+	TP_ARGS(p, adj, tasksize),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	adj			)
+		__field(	int,	tasksize		)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid		= p->pid;
+		__entry->adj		= adj;
+		__entry->tasksize	= tasksize;
+	),
+
+	TP_printk("task %s:%d adj=%d size=%d", __entry->comm, __entry->pid,
+		  __entry->adj, __entry->tasksize)
+);
+
+/*
+ * Tracepoint for a shrink skipped because an earlier victim is still
+ * exiting:
+ */
+TRACE_EVENT(lowmem_deathpending,
+
+	TP_PROTO(struct task_struct *p),
+
+	TP_ARGS(p),
+
+	TP_STRUCT__entry(
+		__field(	pid_t,	pid	)
+	),
+
+	TP_fast_assign(
+		__entry->pid	= p->pid;
+	),
+
+	TP_printk("pid=%d", __entry->pid)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE trace_lowmemorykiller
+#include <trace/define_trace.h>
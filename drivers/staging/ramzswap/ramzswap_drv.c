@@ -17,14 +17,17 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -37,6 +40,8 @@ static unsigned int num_devices;
 static unsigned long disksize_kb;
 static unsigned long memlimit_kb;
 static char backing_swap[MAX_SWAP_NAME_LEN];
+static char compressor[MAX_COMPRESSOR_NAME_LEN];
+static int dedup;
 
 /* Globals */
 static int ramzswap_major;
@@ -70,18 +75,40 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Table entries are shared by the I/O paths and the writeback
+ * thread. Each one is protected by a bit spinlock of its own,
+ * kept in a separate bitmap so the table layout is unchanged.
+ */
+static void rzs_lock_entry(struct ramzswap *rzs, u32 index)
+{
+	bit_spin_lock(index % BITS_PER_LONG,
+			&rzs->table_lock[BIT_WORD(index)]);
+}
+
+static void rzs_unlock_entry(struct ramzswap *rzs, u32 index)
+{
+	bit_spin_unlock(index % BITS_PER_LONG,
+			&rzs->table_lock[BIT_WORD(index)]);
+}
+
+/*
+ * Check if the page is filled with one repeated word, zero being
+ * the most common case. Such pages are stored as just that word.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -242,38 +269,76 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	struct ramzswap_stats *rs = &rzs->stats;
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
+	u32 pages_stored, pages_expand;
+
+	pages_stored = atomic_read(&rs->pages_stored);
+	pages_expand = atomic_read(&rs->pages_expand);
 
 	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
-			+ (rs->pages_expand << PAGE_SHIFT);
-	succ_writes = rzs_stat64_read(rzs, &rs->num_writes) -
-			rzs_stat64_read(rzs, &rs->failed_writes);
+			+ ((size_t)pages_expand << PAGE_SHIFT);
+	succ_writes = rzs_stat64_read(rzs, RZS_STAT_NUM_WRITES) -
+			rzs_stat64_read(rzs, RZS_STAT_FAILED_WRITES);
 
-	if (succ_writes && rs->pages_stored) {
-		good_compress_perc = rs->good_compress * 100
-					/ rs->pages_stored;
-		no_compress_perc = rs->pages_expand * 100
-					/ rs->pages_stored;
+	if (succ_writes && pages_stored) {
+		good_compress_perc = atomic_read(&rs->good_compress) * 100
+					/ pages_stored;
+		no_compress_perc = pages_expand * 100
+					/ pages_stored;
 	}
 
-	s->num_reads = rzs_stat64_read(rzs, &rs->num_reads);
-	s->num_writes = rzs_stat64_read(rzs, &rs->num_writes);
-	s->failed_reads = rzs_stat64_read(rzs, &rs->failed_reads);
-	s->failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
-	s->invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
-	s->notify_free = rzs_stat64_read(rzs, &rs->notify_free);
-	s->pages_zero = rs->pages_zero;
+	s->num_reads = rzs_stat64_read(rzs, RZS_STAT_NUM_READS);
+	s->num_writes = rzs_stat64_read(rzs, RZS_STAT_NUM_WRITES);
+	s->failed_reads = rzs_stat64_read(rzs, RZS_STAT_FAILED_READS);
+	s->failed_writes = rzs_stat64_read(rzs, RZS_STAT_FAILED_WRITES);
+	s->invalid_io = rzs_stat64_read(rzs, RZS_STAT_INVALID_IO);
+	s->notify_free = rzs_stat64_read(rzs, RZS_STAT_NOTIFY_FREE);
+	s->pages_zero = atomic_read(&rs->pages_zero);
 
 	s->good_compress_pct = good_compress_perc;
 	s->pages_expand_pct = no_compress_perc;
 
-	s->pages_stored = rs->pages_stored;
+	s->pages_stored = pages_stored;
 	s->pages_used = mem_used >> PAGE_SHIFT;
-	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
-	s->compr_data_size = rs->compr_size;
+	s->orig_data_size = (u64)pages_stored << PAGE_SHIFT;
+	s->compr_data_size = atomic_long_read(&rs->compr_size);
 	s->mem_used_total = mem_used;
 
-	s->bdev_num_reads = rzs_stat64_read(rzs, &rs->bdev_num_reads);
-	s->bdev_num_writes = rzs_stat64_read(rzs, &rs->bdev_num_writes);
+	s->bdev_num_reads = rzs_stat64_read(rzs, RZS_STAT_BDEV_NUM_READS);
+	s->bdev_num_writes = rzs_stat64_read(rzs, RZS_STAT_BDEV_NUM_WRITES);
+	}
+#endif /* CONFIG_RAMZSWAP_STATS */
+}
+
+static void ramzswap_ioctl_get_stats2(struct ramzswap *rzs,
+			struct ramzswap_ioctl_stats2 *s)
+{
+	memcpy(s->compressor, rzs->compressor, MAX_COMPRESSOR_NAME_LEN);
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	{
+	struct ramzswap_stats *rs = &rzs->stats;
+
+	s->alloc_slowpath = rzs_stat64_read(rzs, RZS_STAT_ALLOC_SLOWPATH);
+	s->xv_lock_contended = xv_get_lock_contended(rzs->mem_pool);
+
+	s->compr_calls = rzs_stat64_read(rzs, RZS_STAT_COMPR_CALLS);
+	s->compr_bytes_out = rzs_stat64_read(rzs, RZS_STAT_COMPR_BYTES_OUT);
+	s->compr_time_ns = rzs_stat64_read(rzs, RZS_STAT_COMPR_TIME_NS);
+	s->decompr_calls = rzs_stat64_read(rzs, RZS_STAT_DECOMPR_CALLS);
+	s->decompr_time_ns = rzs_stat64_read(rzs, RZS_STAT_DECOMPR_TIME_NS);
+
+	s->pages_same = atomic_read(&rs->pages_same);
+	s->pages_dedup = atomic_read(&rs->dedup_refs) -
+				atomic_read(&rs->dedup_objects);
+	s->dedup_hits = rzs_stat64_read(rzs, RZS_STAT_DEDUP_HITS);
+	s->dedup_collisions = rzs_stat64_read(rzs, RZS_STAT_DEDUP_COLLISIONS);
+
+	s->pages_written = atomic_read(&rs->pages_written);
+	s->idle_age_unit_secs = wb_age_interval_secs;
+	memcpy(s->idle_hist, rs->idle_hist, sizeof(s->idle_hist));
+	s->wb_pages = rzs_stat64_read(rzs, RZS_STAT_WB_PAGES);
+	s->wb_bios = rzs_stat64_read(rzs, RZS_STAT_WB_BIOS);
+	s->wb_cancelled = rzs_stat64_read(rzs, RZS_STAT_WB_CANCELLED);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
@@ -598,23 +663,226 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 	return se->phy_pagenum + se_offset;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+/*
+ * Allocate a page on backing swap, starting the search at 'hint'.
+ * Page 0 holds the swap header of the backing device and is never
+ * handed out, so 0 means the backing device is full.
+ */
+static unsigned long rzs_alloc_slot(struct ramzswap *rzs, unsigned long hint)
+{
+	unsigned long slot, nr_slots = rzs->disksize >> PAGE_SHIFT;
+
+	spin_lock(&rzs->wb_lock);
+	slot = find_next_zero_bit(rzs->wb_slots, nr_slots, hint);
+	if (slot >= nr_slots)
+		slot = find_next_zero_bit(rzs->wb_slots, nr_slots, 1);
+	if (slot < nr_slots)
+		__set_bit(slot, rzs->wb_slots);
+	else
+		slot = 0;
+	spin_unlock(&rzs->wb_lock);
+
+	return slot;
+}
+
+static void rzs_free_slot(struct ramzswap *rzs, unsigned long slot)
+{
+	spin_lock(&rzs->wb_lock);
+	__clear_bit(slot, rzs->wb_slots);
+	spin_unlock(&rzs->wb_lock);
+}
+
+/*
+ * Size of the compressed data in the object at <page, offset>
+ */
+static u32 ramzswap_object_size(struct page *page, u32 offset)
 {
 	u32 clen;
 	void *obj;
 
-	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	kunmap_atomic(obj, KM_USER0);
+
+	return clen;
+}
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
-			rzs_clear_flag(rzs, index, RZS_ZERO);
-			rzs_stat_dec(&rzs->stats.pages_zero);
+/*
+ * Drop a reference to a dedup object, freeing it with the last one.
+ */
+static void ramzswap_dedup_put(struct ramzswap *rzs,
+			struct rzs_dedup_entry *de)
+{
+	spin_lock(&rzs->dedup_lock);
+	if (--de->refcount) {
+		spin_unlock(&rzs->dedup_lock);
+		return;
+	}
+	hlist_del(&de->node);
+	spin_unlock(&rzs->dedup_lock);
+
+	atomic_long_sub(ramzswap_object_size(de->page, de->offset),
+			&rzs->stats.compr_size);
+	rzs_stat_dec(&rzs->stats.dedup_objects);
+	xv_free(rzs->mem_pool, de->page, de->offset);
+	kfree(de);
+}
+
+/*
+ * Look for an object holding the same data as 'page'. On success,
+ * a reference to it is returned along with its compressed size in
+ * 'clen'.
+ */
+static struct rzs_dedup_entry *ramzswap_dedup_find(struct ramzswap *rzs,
+			struct page *page, u32 checksum, size_t *clen)
+{
+	int ret, same = 0;
+	unsigned int dlen = PAGE_SIZE;
+	struct rzs_dedup_entry *de, *found = NULL;
+	struct ramzswap_stream *stream;
+	struct hlist_node *pos;
+	unsigned char *user_mem, *cmem;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(de, pos,
+		&rzs->dedup_table[hash_32(checksum, rzs->dedup_bits)], node) {
+		if (de->checksum == checksum) {
+			de->refcount++;
+			found = de;
+			break;
 		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	if (!found)
+		return NULL;
+
+	/*
+	 * The checksum only tells us where to look. Decompressing
+	 * the candidate is still much cheaper than compressing.
+	 */
+	stream = per_cpu_ptr(rzs->streams, get_cpu());
+	cmem = kmap_atomic(found->page, KM_USER1) + found->offset;
+	*clen = xv_get_object_size(cmem) - sizeof(struct zobj_header);
+	ret = crypto_comp_decompress(stream->tfm,
+		cmem + sizeof(struct zobj_header), *clen,
+		stream->buffer, &dlen);
+	kunmap_atomic(cmem, KM_USER1);
+
+	if (!ret && dlen == PAGE_SIZE) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		same = !memcmp(user_mem, stream->buffer, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+	put_cpu();
+
+	if (!same) {
+		rzs_stat64_inc(rzs, RZS_STAT_DEDUP_COLLISIONS);
+		ramzswap_dedup_put(rzs, found);
+		return NULL;
+	}
+
+	rzs_stat_inc(&rzs->stats.dedup_refs);
+	rzs_stat64_inc(rzs, RZS_STAT_DEDUP_HITS);
+
+	return found;
+}
+
+/*
+ * Make the object just stored at <page, offset> available for
+ * sharing. Failure to allocate the entry just leaves the object
+ * private, in which case NULL is returned.
+ */
+static struct rzs_dedup_entry *ramzswap_dedup_insert(struct ramzswap *rzs,
+			struct page *page, u32 offset, u32 checksum)
+{
+	struct rzs_dedup_entry *de;
+
+	de = kmalloc(sizeof(*de), GFP_NOIO);
+	if (!de)
+		return NULL;
+
+	de->page = page;
+	de->offset = offset;
+	de->checksum = checksum;
+	de->refcount = 1;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&de->node,
+		&rzs->dedup_table[hash_32(checksum, rzs->dedup_bits)]);
+	spin_unlock(&rzs->dedup_lock);
+
+	rzs_stat_inc(&rzs->stats.dedup_refs);
+	rzs_stat_inc(&rzs->stats.dedup_objects);
+
+	return de;
+}
+
+/*
+ * Get the <page, offset> of the object stored for 'index'
+ */
+static void ramzswap_get_object(struct ramzswap *rzs, u32 index,
+			struct page **page, u32 *offset)
+{
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		*page = rzs->table[index].dedup->page;
+		*offset = rzs->table[index].dedup->offset;
+	} else {
+		*page = rzs->table[index].page;
+		*offset = rzs->table[index].offset;
+	}
+}
+
+/*
+ * Called with the table entry locked. Also cancels writeback
+ * of the page, if in progress.
+ */
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	u32 clen;
+	struct page *page;
+	u32 offset;
+
+	rzs_clear_flag(rzs, index, RZS_WB_PENDING);
+
+	if (rzs_test_flag(rzs, index, RZS_WRITTEN)) {
+		rzs_free_slot(rzs, rzs->table[index].slot);
+		rzs_stat_dec(&rzs->stats.pages_written);
+		rzs_clear_flag(rzs, index, RZS_WRITTEN);
+		rzs->table[index].slot = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		if (rzs->table[index].element)
+			rzs_stat_dec(&rzs->stats.pages_same);
+		else
+			rzs_stat_dec(&rzs->stats.pages_zero);
+		rzs_clear_flag(rzs, index, RZS_SAME);
+		rzs->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!rzs->table[index].page))
+		return;
+
+	ramzswap_get_object(rzs, index, &page, &offset);
+
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		clen = ramzswap_object_size(page, offset);
+		if (clen <= PAGE_SIZE / 2)
+			rzs_stat_dec(&rzs->stats.good_compress);
+		rzs_stat_dec(&rzs->stats.pages_stored);
+		rzs_stat_dec(&rzs->stats.dedup_refs);
+
+		/* compr_size is dropped along with the last reference */
+		ramzswap_dedup_put(rzs, rzs->table[index].dedup);
+		rzs_clear_flag(rzs, index, RZS_DEDUP);
+		rzs->table[index].page = NULL;
 		return;
 	}
 
@@ -626,29 +894,33 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	clen = ramzswap_object_size(page, offset);
 
 	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_dec(&rzs->stats.good_compress);
 
 out:
-	rzs->stats.compr_size -= clen;
+	atomic_long_sub(clen, &rzs->stats.compr_size);
 	rzs_stat_dec(&rzs->stats.pages_stored);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
-static int handle_zero_page(struct bio *bio)
+static int handle_same_page(struct bio *bio, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 	struct page *page = bio->bi_io_vec[0].bv_page;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -658,64 +930,95 @@ static int handle_zero_page(struct bio *bio)
 	return 0;
 }
 
-static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
+/*
+ * Uncompress the page stored for 'index' into 'page'. Called with
+ * the table entry locked, so writeback cannot free it under us.
+ */
+static int ramzswap_load_page(struct ramzswap *rzs, u32 index,
+			struct page *page)
 {
-	u32 index;
-	struct page *page;
+	int ret;
+	u32 offset;
+	u64 start;
+	unsigned int clen;
+	struct page *obj_page;
+	struct zobj_header *zheader;
+	struct ramzswap_stream *stream;
 	unsigned char *user_mem, *cmem;
 
-	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
+				rzs->table[index].offset;
+
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+		kunmap_atomic(cmem, KM_USER1);
+		return 0;
+	}
+
+	stream = per_cpu_ptr(rzs->streams, get_cpu());
+
+	ramzswap_get_object(rzs, index, &obj_page, &offset);
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	clen = PAGE_SIZE;
+
+	cmem = kmap_atomic(obj_page, KM_USER1) + offset;
+
+	start = sched_clock();
+	ret = crypto_comp_decompress(stream->tfm,
+		cmem + sizeof(*zheader),
+		xv_get_object_size(cmem) - sizeof(*zheader),
+		user_mem, &clen);
+	rzs_stat64_add(rzs, RZS_STAT_DECOMPR_TIME_NS, sched_clock() - start);
+	rzs_stat64_inc(rzs, RZS_STAT_DECOMPR_CALLS);
 
-	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
 
-	flush_dcache_page(page);
+	put_cpu();
+
+	/* should NEVER happen */
+	if (unlikely(ret || clen != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret ? ret : -EIO;
+	}
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
 	return 0;
 }
 
+/*
+ * Page was moved to backing swap, either by writeback or because
+ * it could not be kept in memory. Let the backing device serve it.
+ */
+static int handle_written_page(struct ramzswap *rzs, struct bio *bio,
+			unsigned long slot)
+{
+	rzs_stat64_dec(rzs, RZS_STAT_NUM_READS);
+	rzs_stat64_inc(rzs, RZS_STAT_BDEV_NUM_READS);
+	bio->bi_bdev = rzs->backing_swap;
+
+	/*
+	 * In case backing swap is a file, find the right offset within
+	 * the file corresponding to 'slot'. For block device, this is
+	 * a nop.
+	 */
+	bio->bi_sector = map_backing_swap_page(rzs, slot)
+				<< SECTORS_PER_PAGE_SHIFT;
+	return 1;
+}
+
 /*
  * Called when request page is not present in ramzswap.
- * Its either in backing swap device (if present) or
- * this is an attempt to read before any previous write
+ * This is an attempt to read before any previous write
  * to this location - this happens due to readahead when
  * swap device is read from user-space (e.g. during swapon)
  */
 static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 {
-	/*
-	 * Always forward such requests to backing swap
-	 * device (if present)
-	 */
-	if (rzs->backing_swap) {
-		u32 pagenum;
-		rzs_stat64_dec(rzs, &rzs->stats.num_reads);
-		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_reads);
-		bio->bi_bdev = rzs->backing_swap;
-
-		/*
-		 * In case backing swap is a file, find the right offset within
-		 * the file corresponding to logical position 'index'. For block
-		 * device, this is a nop.
-		 */
-		pagenum = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-		bio->bi_sector = map_backing_swap_page(rzs, pagenum)
-					<< SECTORS_PER_PAGE_SHIFT;
-		return 1;
-	}
-
-	/*
-	 * Its unlikely event in case backing dev is
-	 * not present
-	 */
 	pr_debug("Read before write on swap device: "
 		"sector=%lu, size=%u, offset=%u\n",
 		(ulong)(bio->bi_sector), bio->bi_size,
@@ -731,47 +1034,45 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
+	unsigned long element, slot;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem;
 
-	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
+	rzs_stat64_inc(rzs, RZS_STAT_NUM_READS);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
-		return handle_zero_page(bio);
-
-	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
-		return handle_ramzswap_fault(rzs, bio);
+	rzs_lock_entry(rzs, index);
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	/* The page is in use again: keep it in memory */
+	rzs->table[index].age = 0;
+	rzs_clear_flag(rzs, index, RZS_WB_PENDING);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		element = rzs->table[index].element;
+		rzs_unlock_entry(rzs, index);
+		return handle_same_page(bio, element);
+	}
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	if (rzs_test_flag(rzs, index, RZS_WRITTEN)) {
+		slot = rzs->table[index].slot;
+		rzs_unlock_entry(rzs, index);
+		return handle_written_page(rzs, bio, slot);
+	}
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+	/* Requested page is not present in compressed area */
+	if (!rzs->table[index].page) {
+		rzs_unlock_entry(rzs, index);
+		return handle_ramzswap_fault(rzs, bio);
+	}
 
-	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+	ret = ramzswap_load_page(rzs, index, page);
+	rzs_unlock_entry(rzs, index);
 
-	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n",
-			ret, index);
-		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
-		goto out;
+	if (unlikely(ret)) {
+		rzs_stat64_inc(rzs, RZS_STAT_FAILED_READS);
+		bio_io_error(bio);
+		return 0;
 	}
 
 	flush_dcache_page(page);
@@ -779,79 +1080,151 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
+}
 
-out:
-	bio_io_error(bio);
-	return 0;
+/*
+ * Compress 'page' into the given per-CPU stream. Must be called
+ * with preemption disabled so that nobody else uses the stream.
+ */
+static int ramzswap_compress(struct ramzswap *rzs,
+			struct ramzswap_stream *stream,
+			struct page *page, size_t *clen)
+{
+	int ret;
+	u64 start;
+	unsigned int dlen = 2 * PAGE_SIZE;
+	unsigned char *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	start = sched_clock();
+	ret = crypto_comp_compress(stream->tfm, user_mem, PAGE_SIZE,
+				stream->buffer, &dlen);
+	rzs_stat64_add(rzs, RZS_STAT_COMPR_TIME_NS, sched_clock() - start);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	rzs_stat64_inc(rzs, RZS_STAT_COMPR_CALLS);
+	if (likely(!ret))
+		rzs_stat64_add(rzs, RZS_STAT_COMPR_BYTES_OUT, dlen);
+
+	*clen = dlen;
+	return ret;
+}
+
+/*
+ * Memory is getting tight: evict pages that are idle for less than
+ * the configured time as well.
+ */
+static int ramzswap_wb_pressure(struct ramzswap *rzs)
+{
+	return atomic_long_read(&rzs->stats.compr_size) >
+		rzs->memlimit / 100 * wb_pressure_perc;
 }
 
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
-	int ret, fwd_write_request = 0;
-	u32 offset, index;
-	size_t clen;
+	int ret, fwd_write_request = 0, uncompressed = 0;
+	u32 offset, index, checksum = 0;
+	unsigned long element, slot;
+	size_t clen, new_clen;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct rzs_dedup_entry *de = NULL;
+	struct ramzswap_stream *stream;
 	unsigned char *user_mem, *cmem, *src;
 
-	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
+	rzs_stat64_inc(rzs, RZS_STAT_NUM_WRITES);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
 	/*
 	 * System swaps to same sector again when the stored page
 	 * is no longer referenced by any process. So, its now safe
 	 * to free the memory that was allocated for this page.
+	 *
+	 * The entry stays empty until the new data is in place, so
+	 * writeback leaves it alone in the meantime.
 	 */
-	if (rzs->table[index].page || rzs_test_flag(rzs, index, RZS_ZERO))
+	rzs_lock_entry(rzs, index);
+	if (rzs->table[index].page || rzs_test_flag(rzs, index, RZS_SAME))
 		ramzswap_free_page(rzs, index);
-
-	mutex_lock(&rzs->lock);
+	rzs_unlock_entry(rzs, index);
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (page_zero_filled(user_mem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
-		rzs_set_flag(rzs, index, RZS_ZERO);
+		if (element)
+			rzs_stat_inc(&rzs->stats.pages_same);
+		else
+			rzs_stat_inc(&rzs->stats.pages_zero);
+
+		rzs_lock_entry(rzs, index);
+		rzs->table[index].element = element;
+		rzs->table[index].age = 0;
+		rzs_set_flag(rzs, index, RZS_SAME);
+		rzs_unlock_entry(rzs, index);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	if (rzs->dedup_table)
+		checksum = jhash2((u32 *)user_mem, PAGE_SIZE / sizeof(u32), 0);
+	kunmap_atomic(user_mem, KM_USER0);
 
-	if (rzs->backing_swap &&
-		(rzs->stats.compr_size > rzs->memlimit - PAGE_SIZE)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
+	/* A duplicate costs no memory, so check before the memlimit */
+	if (rzs->dedup_table)
+		de = ramzswap_dedup_find(rzs, page, checksum, &clen);
+	if (de) {
+		rzs_stat_inc(&rzs->stats.pages_stored);
+		if (clen <= PAGE_SIZE / 2)
+			rzs_stat_inc(&rzs->stats.good_compress);
+
+		rzs_lock_entry(rzs, index);
+		rzs->table[index].dedup = de;
+		rzs->table[index].age = 0;
+		rzs_set_flag(rzs, index, RZS_DEDUP);
+		rzs_unlock_entry(rzs, index);
+
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	if (rzs->backing_swap && (atomic_long_read(&rzs->stats.compr_size)
+					> rzs->memlimit - PAGE_SIZE)) {
 		fwd_write_request = 1;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
-
-	kunmap_atomic(user_mem, KM_USER0);
+	/*
+	 * Writes on different CPUs compress in parallel, each into
+	 * its own stream. The stream stays ours until put_cpu().
+	 */
+	stream = per_cpu_ptr(rzs->streams, get_cpu());
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	ret = ramzswap_compress(rzs, stream, page, &clen);
+	if (unlikely(ret)) {
+		put_cpu();
 		pr_err("Compression failed! err=%d\n", ret);
-		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
+		rzs_stat64_inc(rzs, RZS_STAT_FAILED_WRITES);
 		goto out;
 	}
 
+again:
 	/*
 	 * Page is incompressible. Forward it to backing swap
 	 * if present. Otherwise, store it as-is (uncompressed)
 	 * since we do not want to return too many swap write
 	 * errors which has side effect of hanging the system.
+	 *
+	 * With writeback enabled, such pages are kept in memory
+	 * for a while so that they reach the backing device in
+	 * large batches rather than one by one.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
-		if (rzs->backing_swap) {
-			mutex_unlock(&rzs->lock);
+		put_cpu();
+		if (rzs->backing_swap && !rzs->wb_task) {
 			fwd_write_request = 1;
 			goto out;
 		}
@@ -859,42 +1232,71 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
-			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
+			rzs_stat64_inc(rzs, RZS_STAT_FAILED_WRITES);
+			if (rzs->backing_swap)
+				fwd_write_request = 1;
 			goto out;
 		}
 
 		offset = 0;
-		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+		uncompressed = 1;
 		rzs_stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
+	/*
+	 * Growing the pool may sleep, which we cannot do while
+	 * holding the stream. If there is no free block, drop the
+	 * stream, allocate, and compress again on whichever CPU
+	 * we are running on now.
+	 */
 	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
-		if (rzs->backing_swap)
-			fwd_write_request = 1;
-		goto out;
+			&page_store, &offset, GFP_NOWAIT | __GFP_HIGHMEM)) {
+		put_cpu();
+		rzs_stat64_inc(rzs, RZS_STAT_ALLOC_SLOWPATH);
+
+		if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
+				&page_store, &offset, GFP_NOIO | __GFP_HIGHMEM)) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			rzs_stat64_inc(rzs, RZS_STAT_FAILED_WRITES);
+			if (rzs->backing_swap)
+				fwd_write_request = 1;
+			goto out;
+		}
+
+		stream = per_cpu_ptr(rzs->streams, get_cpu());
+		ret = ramzswap_compress(rzs, stream, page, &new_clen);
+		if (unlikely(ret)) {
+			put_cpu();
+			xv_free(rzs->mem_pool, page_store, offset);
+			pr_err("Compression failed! err=%d\n", ret);
+			rzs_stat64_inc(rzs, RZS_STAT_FAILED_WRITES);
+			goto out;
+		}
+
+		/*
+		 * The object size must match the data exactly, so if
+		 * the new stream compressed differently, start over
+		 * with the new length.
+		 */
+		if (unlikely(new_clen != clen)) {
+			xv_free(rzs->mem_pool, page_store, offset);
+			clen = new_clen;
+			goto again;
+		}
 	}
+	src = stream->buffer;
 
 memstore:
-	rzs->table[index].offset = offset;
-
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+	if (!uncompressed) {
 		zheader = (struct zobj_header *)cmem;
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
@@ -904,16 +1306,35 @@ memstore:
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+	if (unlikely(uncompressed))
 		kunmap_atomic(src, KM_USER0);
+	else
+		put_cpu();
+
+	if (rzs->dedup_table && !uncompressed)
+		de = ramzswap_dedup_insert(rzs, page_store, offset, checksum);
+
+	rzs_lock_entry(rzs, index);
+	if (de) {
+		rzs->table[index].dedup = de;
+		rzs_set_flag(rzs, index, RZS_DEDUP);
+	} else {
+		rzs->table[index].page = page_store;
+		rzs->table[index].offset = offset;
+		if (unlikely(uncompressed))
+			rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+	}
+	rzs->table[index].age = 0;
+	rzs_unlock_entry(rzs, index);
 
 	/* Update stats */
-	rzs->stats.compr_size += clen;
+	atomic_long_add(clen, &rzs->stats.compr_size);
 	rzs_stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
-	mutex_unlock(&rzs->lock);
+	if (rzs->wb_task && !rzs->wb_stalled && ramzswap_wb_pressure(rzs))
+		wake_up_process(rzs->wb_task);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -921,26 +1342,38 @@ memstore:
 
 out:
 	if (fwd_write_request) {
-		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_writes);
-		bio->bi_bdev = rzs->backing_swap;
-#if 0
 		/*
-		 * TODO: We currently have linear mapping of ramzswap and
-		 * backing swap sectors. This is not desired since we want
-		 * to optimize writes to backing swap to minimize disk seeks
-		 * or have effective wear leveling (for SSDs). Also, a
-		 * non-linear mapping is required to implement compressed
-		 * on-disk swapping.
+		 * Backing swap pages are allocated rather than mapped
+		 * one to one, which lets writeback place pages written
+		 * together next to each other. A page forwarded here
+		 * still goes to its own offset whenever that is free.
 		 */
-		 bio->bi_sector = get_backing_swap_page()
-					<< SECTORS_PER_PAGE_SHIFT;
-#endif
+		slot = rzs_alloc_slot(rzs, index);
+		if (unlikely(!slot)) {
+			pr_err("Backing swap is full, page=%u\n", index);
+			rzs_stat64_inc(rzs, RZS_STAT_FAILED_WRITES);
+			bio_io_error(bio);
+			return 0;
+		}
+
+		rzs_lock_entry(rzs, index);
+		rzs->table[index].slot = slot;
+		rzs_set_flag(rzs, index, RZS_WRITTEN);
+		rzs_unlock_entry(rzs, index);
+		rzs_stat_inc(&rzs->stats.pages_written);
+
+		if (rzs->wb_task && !rzs->wb_stalled)
+			wake_up_process(rzs->wb_task);
+
+		rzs_stat64_inc(rzs, RZS_STAT_BDEV_NUM_WRITES);
+		bio->bi_bdev = rzs->backing_swap;
+
 		/*
 		 * In case backing swap is a file, find the right offset within
-		 * the file corresponding to logical position 'index'. For block
-		 * device, this is a nop.
+		 * the file corresponding to 'slot'. For block device, this is
+		 * a nop.
 		 */
-		bio->bi_sector = map_backing_swap_page(rzs, index)
+		bio->bi_sector = map_backing_swap_page(rzs, slot)
 					<< SECTORS_PER_PAGE_SHIFT;
 		return 1;
 	}
@@ -982,7 +1415,7 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	}
 
 	if (!valid_swap_request(rzs, bio)) {
-		rzs_stat64_inc(rzs, &rzs->stats.invalid_io);
+		rzs_stat64_inc(rzs, RZS_STAT_INVALID_IO);
 		bio_io_error(bio);
 		return 0;
 	}
@@ -1000,8 +1433,418 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+/*
+ * Advance the idle age of every page held in memory and take
+ * a snapshot of the idle age histogram.
+ */
+static void ramzswap_age_pages(struct ramzswap *rzs)
+{
+	u8 age;
+	size_t index, num_pages;
+	u32 hist[RZS_IDLE_HIST_BUCKETS];
+
+	memset(hist, 0, sizeof(hist));
+	num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	for (index = 1; index < num_pages; index++) {
+		rzs_lock_entry(rzs, index);
+		if ((rzs->table[index].page ||
+				rzs_test_flag(rzs, index, RZS_SAME)) &&
+				!rzs_test_flag(rzs, index, RZS_WRITTEN)) {
+			age = rzs->table[index].age;
+			hist[age ? fls(age) : 0]++;
+			if (age < RZS_MAX_AGE)
+				rzs->table[index].age++;
+		}
+		rzs_unlock_entry(rzs, index);
+
+		if (!(index % 1024))
+			cond_resched();
+	}
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	memcpy(rzs->stats.idle_hist, hist, sizeof(hist));
+#endif
+}
+
+/*
+ * Copy page 'index' into the next free page of the batch if it
+ * is worth writing back: pages that were not accessed in the last
+ * 'min_age' aging periods, and incompressible pages right away.
+ * Shared (dedup) objects are left alone since writing back one of
+ * their users would not free any memory.
+ */
+static int ramzswap_wb_claim(struct ramzswap *rzs, u32 index,
+			u8 min_age, struct page *page)
+{
+	int ret = 0;
+
+	rzs_lock_entry(rzs, index);
+
+	if (!rzs->table[index].page ||
+			rzs_test_flag(rzs, index, RZS_SAME) ||
+			rzs_test_flag(rzs, index, RZS_DEDUP) ||
+			rzs_test_flag(rzs, index, RZS_WRITTEN))
+		goto out;
+
+	if (rzs->table[index].age < min_age &&
+			!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))
+		goto out;
+
+	if (ramzswap_load_page(rzs, index, page))
+		goto out;
+
+	rzs_set_flag(rzs, index, RZS_WB_PENDING);
+	ret = 1;
+
+out:
+	rzs_unlock_entry(rzs, index);
+	return ret;
+}
+
+static void ramzswap_wb_end_io(struct bio *bio, int err)
+{
+	struct rzs_wb_batch *wb = bio->bi_private;
+
+	if (err)
+		wb->error = err;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+static void ramzswap_wb_submit_bio(struct ramzswap *rzs,
+			struct rzs_wb_batch *wb, struct bio *bio)
+{
+	atomic_inc(&wb->pending);
+	rzs_stat64_inc(rzs, RZS_STAT_WB_BIOS);
+	submit_bio(WRITE, bio);
+}
+
+/*
+ * Write out the batch, merging pages that are adjacent on the
+ * backing device into one bio, and wait for it to complete.
+ */
+static void ramzswap_wb_write(struct ramzswap *rzs, struct rzs_wb_batch *wb)
+{
+	int i;
+	sector_t sector, next = 0;
+	struct bio *bio = NULL;
+
+	atomic_set(&wb->pending, 1);
+	init_completion(&wb->done);
+	wb->error = 0;
+
+	for (i = 0; i < wb->nr; i++) {
+		sector = (sector_t)map_backing_swap_page(rzs, wb->slot[i])
+				<< SECTORS_PER_PAGE_SHIFT;
+
+		if (bio && sector == next && bio_add_page(bio, wb->page[i],
+						PAGE_SIZE, 0) == PAGE_SIZE) {
+			next += SECTORS_PER_PAGE;
+			continue;
+		}
+
+		if (bio)
+			ramzswap_wb_submit_bio(rzs, wb, bio);
+
+		bio = bio_alloc(GFP_NOIO, wb->nr - i);
+		bio->bi_bdev = rzs->backing_swap;
+		bio->bi_sector = sector;
+		bio->bi_end_io = ramzswap_wb_end_io;
+		bio->bi_private = wb;
+		bio_add_page(bio, wb->page[i], PAGE_SIZE, 0);
+		next = sector + SECTORS_PER_PAGE;
+	}
+	if (bio)
+		ramzswap_wb_submit_bio(rzs, wb, bio);
+
+	blk_unplug(bdev_get_queue(rzs->backing_swap));
+
+	if (!atomic_dec_and_test(&wb->pending))
+		wait_for_completion(&wb->done);
+}
+
+/*
+ * Point each written table entry at its backing swap page and
+ * free its memory. Entries accessed since they were claimed keep
+ * their in-memory copy and the backing page is released.
+ */
+static void ramzswap_wb_commit(struct ramzswap *rzs, struct rzs_wb_batch *wb)
+{
+	int i;
+	u32 index;
+
+	for (i = 0; i < wb->nr; i++) {
+		index = wb->index[i];
+
+		rzs_lock_entry(rzs, index);
+		if (!rzs_test_flag(rzs, index, RZS_WB_PENDING)) {
+			rzs_stat64_inc(rzs, RZS_STAT_WB_CANCELLED);
+		} else if (wb->error) {
+			rzs_clear_flag(rzs, index, RZS_WB_PENDING);
+		} else {
+			ramzswap_free_page(rzs, index);
+			rzs->table[index].slot = wb->slot[i];
+			rzs_set_flag(rzs, index, RZS_WRITTEN);
+			rzs_stat_inc(&rzs->stats.pages_written);
+			rzs_stat64_inc(rzs, RZS_STAT_WB_PAGES);
+			wb->slot[i] = 0;
+		}
+		rzs_unlock_entry(rzs, index);
+
+		if (wb->slot[i])
+			rzs_free_slot(rzs, wb->slot[i]);
+	}
+
+	if (wb->error)
+		pr_err("Writeback to backing swap failed: err=%d\n",
+			wb->error);
+	wb->nr = 0;
+}
+
+/*
+ * One pass over the table, writing back every page that qualifies.
+ * Returns the number of pages written.
+ */
+static unsigned long ramzswap_writeback(struct ramzswap *rzs)
+{
+	u8 min_age;
+	int pressure;
+	size_t index, num_pages;
+	unsigned long slot, written = 0;
+	struct rzs_wb_batch *wb = rzs->wb_batch;
+
+	pressure = ramzswap_wb_pressure(rzs);
+	if (pressure)
+		min_age = 1;
+	else
+		min_age = min_t(unsigned, RZS_MAX_AGE, DIV_ROUND_UP(
+				rzs->wb_idle_secs, wb_age_interval_secs));
+
+	num_pages = rzs->disksize >> PAGE_SHIFT;
+	for (index = 1; index < num_pages; index++) {
+		if (kthread_should_stop())
+			break;
+
+		if (!ramzswap_wb_claim(rzs, index, min_age,
+					wb->page[wb->nr]))
+			continue;
+
+		slot = rzs_alloc_slot(rzs, wb->next_slot);
+		if (unlikely(!slot)) {
+			rzs_lock_entry(rzs, index);
+			rzs_clear_flag(rzs, index, RZS_WB_PENDING);
+			rzs_unlock_entry(rzs, index);
+			break;
+		}
+		wb->index[wb->nr] = index;
+		wb->slot[wb->nr++] = slot;
+		wb->next_slot = slot + 1;
+
+		if (wb->nr < WB_BATCH_PAGES)
+			continue;
+
+		ramzswap_wb_write(rzs, wb);
+		ramzswap_wb_commit(rzs, wb);
+		written += WB_BATCH_PAGES;
+
+		/* Relieving memory pressure is all that was asked for */
+		if (pressure && !ramzswap_wb_pressure(rzs))
+			break;
+		cond_resched();
+	}
+
+	if (wb->nr) {
+		written += wb->nr;
+		ramzswap_wb_write(rzs, wb);
+		ramzswap_wb_commit(rzs, wb);
+	}
+
+	return written;
+}
+
+/*
+ * Ages the pages once every aging period and writes back those
+ * that stayed idle for long enough. The write path wakes it up
+ * early when the memory limit is getting close.
+ */
+static int ramzswap_wb_thread(void *data)
+{
+	struct ramzswap *rzs = data;
+	unsigned long next_aging = jiffies + wb_age_interval_secs * HZ;
+
+	while (!kthread_should_stop()) {
+		if (time_after_eq(jiffies, next_aging)) {
+			ramzswap_age_pages(rzs);
+			next_aging = jiffies + wb_age_interval_secs * HZ;
+			rzs->wb_stalled = 0;
+		}
+
+		/*
+		 * Nothing to evict under pressure: further wake ups
+		 * would not change that until pages have aged again.
+		 */
+		if (!ramzswap_writeback(rzs) && ramzswap_wb_pressure(rzs))
+			rzs->wb_stalled = 1;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop() && time_before(jiffies, next_aging))
+			schedule_timeout(next_aging - jiffies);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static void free_writeback(struct ramzswap *rzs)
+{
+	int i;
+
+	if (rzs->wb_task) {
+		kthread_stop(rzs->wb_task);
+		rzs->wb_task = NULL;
+	}
+
+	if (rzs->wb_batch) {
+		for (i = 0; i < WB_BATCH_PAGES; i++)
+			if (rzs->wb_batch->page[i])
+				__free_page(rzs->wb_batch->page[i]);
+		kfree(rzs->wb_batch);
+		rzs->wb_batch = NULL;
+	}
+
+	vfree(rzs->wb_slots);
+	rzs->wb_slots = NULL;
+}
+
+/*
+ * Backing swap pages are tracked whenever a backing device is
+ * present. The writeback thread only runs if it is enabled.
+ */
+static int alloc_writeback(struct ramzswap *rzs, int dev_id)
+{
+	int i;
+	size_t size;
+
+	size = BITS_TO_LONGS(rzs->disksize >> PAGE_SHIFT) * sizeof(long);
+	rzs->wb_slots = vmalloc(size);
+	if (!rzs->wb_slots)
+		return -ENOMEM;
+	memset(rzs->wb_slots, 0, size);
+	__set_bit(0, rzs->wb_slots);
+
+	if (!rzs->wb_idle_secs)
+		return 0;
+
+	rzs->wb_batch = kzalloc(sizeof(*rzs->wb_batch), GFP_KERNEL);
+	if (!rzs->wb_batch)
+		return -ENOMEM;
+	rzs->wb_batch->next_slot = 1;
+
+	for (i = 0; i < WB_BATCH_PAGES; i++) {
+		rzs->wb_batch->page[i] = alloc_page(GFP_KERNEL);
+		if (!rzs->wb_batch->page[i])
+			return -ENOMEM;
+	}
+
+	rzs->wb_task = kthread_create(ramzswap_wb_thread, rzs,
+					"rzs_wb%d", dev_id);
+	if (IS_ERR(rzs->wb_task)) {
+		i = PTR_ERR(rzs->wb_task);
+		rzs->wb_task = NULL;
+		return i;
+	}
+
+	return 0;
+}
+
+static void free_streams(struct ramzswap *rzs)
+{
+	int cpu;
+	struct ramzswap_stream *stream;
+
+	if (!rzs->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		stream = per_cpu_ptr(rzs->streams, cpu);
+		if (stream->tfm)
+			crypto_free_comp(stream->tfm);
+		free_pages((unsigned long)stream->buffer, 1);
+	}
+	free_percpu(rzs->streams);
+	rzs->streams = NULL;
+}
+
+/*
+ * Streams are allocated for every possible CPU so that we do
+ * not have to deal with CPU hotplug in the write path.
+ */
+static int alloc_streams(struct ramzswap *rzs)
+{
+	int cpu;
+	struct ramzswap_stream *stream;
+
+	rzs->streams = alloc_percpu(struct ramzswap_stream);
+	if (!rzs->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		stream = per_cpu_ptr(rzs->streams, cpu);
+		stream->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(stream->tfm)) {
+			stream->tfm = NULL;
+			free_streams(rzs);
+			return -EINVAL;
+		}
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->buffer) {
+			free_streams(rzs);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * One bucket for every 4 swap slots keeps the chains short
+ * at a cost of 0.1% of the device size on 32-bit.
+ */
+static int alloc_dedup_table(struct ramzswap *rzs, size_t num_pages)
+{
+	unsigned long buckets;
+
+	buckets = roundup_pow_of_two(max_t(size_t, num_pages / 4, 64));
+	rzs->dedup_table = vmalloc(buckets * sizeof(*rzs->dedup_table));
+	if (!rzs->dedup_table)
+		return -ENOMEM;
+
+	memset(rzs->dedup_table, 0, buckets * sizeof(*rzs->dedup_table));
+	rzs->dedup_bits = ilog2(buckets);
+	return 0;
+}
+
+/*
+ * Per-device settings that may be changed before RZSIO_INIT
+ * start out as given by module parameters.
+ */
+static void ramzswap_set_defaults(struct ramzswap *rzs)
+{
+	if (compressor[0])
+		strlcpy(rzs->compressor, compressor, MAX_COMPRESSOR_NAME_LEN);
+	else
+		strlcpy(rzs->compressor, default_compressor,
+			MAX_COMPRESSOR_NAME_LEN);
+	rzs->dedup = dedup;
+	rzs->wb_idle_secs = default_wb_idle_secs;
+}
+
 static void reset_device(struct ramzswap *rzs)
 {
+	int cpu;
 	int is_backing_blkdev = 0;
 	size_t index, num_pages;
 	unsigned entries_per_page;
@@ -1015,12 +1858,11 @@ static void reset_device(struct ramzswap *rzs)
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
+	/* Stop writeback before the table goes away */
+	free_writeback(rzs);
 
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	free_streams(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
@@ -1030,15 +1872,21 @@ static void reset_device(struct ramzswap *rzs)
 		page = rzs->table[index].page;
 		offset = rzs->table[index].offset;
 
-		if (!page)
+		if (!page || rzs_test_flag(rzs, index, RZS_SAME) ||
+				rzs_test_flag(rzs, index, RZS_WRITTEN))
 			continue;
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+		if (rzs_test_flag(rzs, index, RZS_DEDUP))
+			ramzswap_dedup_put(rzs, rzs->table[index].dedup);
+		else if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 			__free_page(page);
 		else
 			xv_free(rzs->mem_pool, page, offset);
 	}
 
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+
 	entries_per_page = PAGE_SIZE / sizeof(*rzs->table);
 	num_table_pages = DIV_ROUND_UP(num_pages * sizeof(*rzs->table),
 					PAGE_SIZE);
@@ -1054,6 +1902,8 @@ static void reset_device(struct ramzswap *rzs)
 	}
 	vfree(rzs->table);
 	rzs->table = NULL;
+	vfree(rzs->table_lock);
+	rzs->table_lock = NULL;
 
 	xv_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
@@ -1081,9 +1931,13 @@ static void reset_device(struct ramzswap *rzs)
 
 	/* Reset stats */
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(rzs->stats_cpu, cpu)->count, 0,
+			sizeof(rzs->stats_cpu->count));
 
 	rzs->disksize = 0;
 	rzs->memlimit = 0;
+	ramzswap_set_defaults(rzs);
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
@@ -1109,17 +1963,10 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	else
 		ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = alloc_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			rzs->compressor);
 		goto fail;
 	}
 
@@ -1134,8 +1981,32 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	rzs->table_lock = vmalloc(BITS_TO_LONGS(num_pages) * sizeof(long));
+	if (!rzs->table_lock) {
+		pr_err("Error allocating ramzswap table locks\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->table_lock, 0, BITS_TO_LONGS(num_pages) * sizeof(long));
+
 	map_backing_swap_extents(rzs);
 
+	if (rzs->backing_swap) {
+		ret = alloc_writeback(rzs, dev_id);
+		if (ret) {
+			pr_err("Error setting up writeback\n");
+			goto fail;
+		}
+	}
+
+	if (rzs->dedup) {
+		ret = alloc_dedup_table(rzs, num_pages);
+		if (ret) {
+			pr_err("Error allocating dedup table\n");
+			goto fail;
+		}
+	}
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -1156,9 +2027,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	set_capacity(rzs->disk, rzs->disksize >> SECTOR_SHIFT);
 
 	/*
-	 * We have ident mapping of sectors for ramzswap and
-	 * and the backing swap device. So, this queue flag
-	 * should be according to backing dev.
+	 * Pages that are not kept in memory are read from the
+	 * backing swap device. So, this queue flag should be
+	 * according to backing dev.
 	 */
 	if (!rzs->backing_swap ||
 			blk_queue_nonrot(rzs->backing_swap->bd_disk->queue))
@@ -1184,13 +2055,19 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	rzs->init_done = 1;
 
+	if (rzs->wb_task)
+		wake_up_process(rzs->wb_task);
+
 	if (rzs->backing_swap) {
 		pr_info("/dev/ramzswap%d initialized: "
-			"backing_swap=%s, memlimit_kb=%zu\n",
-			dev_id, rzs->backing_swap_name, rzs->memlimit >> 10);
+			"backing_swap=%s, memlimit_kb=%zu, compressor=%s, "
+			"wb_idle_secs=%u\n",
+			dev_id, rzs->backing_swap_name, rzs->memlimit >> 10,
+			rzs->compressor, rzs->wb_task ? rzs->wb_idle_secs : 0);
 	} else {
 		pr_info("/dev/ramzswap%d initialized: "
-			"disksize_kb=%zu", dev_id, rzs->disksize >> 10);
+			"disksize_kb=%zu, compressor=%s\n", dev_id,
+			rzs->disksize >> 10, rzs->compressor);
 	}
 
 	pr_debug("Initialization done!\n");
@@ -1264,6 +2141,60 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_debug("Backing swap set to %s\n", rzs->backing_swap_name);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[MAX_COMPRESSOR_NAME_LEN];
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(name, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[MAX_COMPRESSOR_NAME_LEN - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Unknown compressor: %s\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		memcpy(rzs->compressor, name, MAX_COMPRESSOR_NAME_LEN);
+		pr_debug("Compressor set to %s\n", rzs->compressor);
+		break;
+	}
+
+	case RZSIO_SET_DEDUP:
+	{
+		int val;
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&val, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->dedup = !!val;
+		pr_debug("Dedup %s\n", rzs->dedup ? "enabled" : "disabled");
+		break;
+	}
+
+	case RZSIO_SET_WB_IDLE_SECS:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&rzs->wb_idle_secs, (void *)arg,
+						_IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		pr_debug("Writeback idle time set to %u secs\n",
+			rzs->wb_idle_secs);
+		break;
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -1285,6 +2216,27 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_GET_STATS2:
+	{
+		struct ramzswap_ioctl_stats2 *stats;
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ramzswap_ioctl_get_stats2(rzs, stats);
+		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+			kfree(stats);
+			ret = -EFAULT;
+			goto out;
+		}
+		kfree(stats);
+		break;
+	}
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
@@ -1319,16 +2271,27 @@ static struct block_device_operations ramzswap_devops = {
 
 static int create_device(struct ramzswap *rzs, int device_id)
 {
-	int ret = 0;
+	int ret = 0, cpu;
 
-	mutex_init(&rzs->lock);
-	spin_lock_init(&rzs->stat64_lock);
 	INIT_LIST_HEAD(&rzs->backing_swap_extent_list);
+	spin_lock_init(&rzs->dedup_lock);
+	spin_lock_init(&rzs->wb_lock);
+	ramzswap_set_defaults(rzs);
+
+	rzs->stats_cpu = alloc_percpu(struct ramzswap_stats_cpu);
+	if (!rzs->stats_cpu) {
+		pr_err("Error allocating stats for device %d\n", device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+	for_each_possible_cpu(cpu)
+		seqcount_init(&per_cpu_ptr(rzs->stats_cpu, cpu)->seq);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
 			device_id);
+		free_percpu(rzs->stats_cpu);
 		ret = -ENOMEM;
 		goto out;
 	}
@@ -1340,6 +2303,7 @@ static int create_device(struct ramzswap *rzs, int device_id)
 	rzs->disk = alloc_disk(1);
 	if (!rzs->disk) {
 		blk_cleanup_queue(rzs->queue);
+		free_percpu(rzs->stats_cpu);
 		pr_warning("Error allocating disk structure for device %d\n",
 			device_id);
 		ret = -ENOMEM;
@@ -1379,6 +2343,8 @@ static void destroy_device(struct ramzswap *rzs)
 
 	if (rzs->queue)
 		blk_cleanup_queue(rzs->queue);
+
+	free_percpu(rzs->stats_cpu);
 }
 
 static int __init ramzswap_init(void)
@@ -1386,6 +2352,12 @@ static int __init ramzswap_init(void)
 	int ret, dev_id;
 	struct ramzswap *rzs;
 
+	if (compressor[0] && !crypto_has_comp(compressor, 0, 0)) {
+		pr_warning("Unknown compressor: %s\n", compressor);
+		ret = -EINVAL;
+		goto out;
+	}
+
 	if (num_devices > max_num_devices) {
 		pr_warning("Invalid value for num_devices: %u\n",
 				num_devices);
@@ -1470,9 +2442,9 @@ static void __exit ramzswap_exit(void)
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
-		destroy_device(rzs);
 		if (rzs->init_done)
 			reset_device(rzs);
+		destroy_device(rzs);
 	}
 
 	unregister_blkdev(ramzswap_major, "ramzswap");
@@ -1514,6 +2486,14 @@ MODULE_PARM_DESC(memlimit_kb, "Memlimit in KB");
 module_param_string(backing_swap, backing_swap, sizeof(backing_swap), 0);
 MODULE_PARM_DESC(backing_swap, "Backing swap name");
 
+/* Optional: default = "lzo". Applies to all devices */
+module_param_string(compressor, compressor, sizeof(compressor), 0);
+MODULE_PARM_DESC(compressor, "Default compression algorithm");
+
+/* Optional: default = 0. Applies to all devices */
+module_param(dedup, bool, 0);
+MODULE_PARM_DESC(dedup, "Share identical pages between swap slots");
+
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
 
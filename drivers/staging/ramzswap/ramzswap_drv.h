@@ -15,8 +15,12 @@
 #ifndef _RAMZSWAP_DRV_H_
 #define _RAMZSWAP_DRV_H_
 
+#include <linux/completion.h>
+#include <linux/crypto.h>
+#include <linux/kthread.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock.h>
-#include <linux/mutex.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -42,6 +46,13 @@ struct zobj_header {
 
 /*-- Configurable parameters */
 
+/*
+ * Default compressor. Any compression algorithm registered with
+ * the crypto API (e.g. "lzo", "lz4", "deflate") can be selected
+ * per device using RZSIO_SET_COMPRESSOR before RZSIO_INIT.
+ */
+static const char default_compressor[] = "lzo";
+
 /* Default ramzswap disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 static const unsigned default_memlimit_perc_ram = 15;
@@ -60,6 +71,31 @@ static const unsigned max_zpage_size_bdev = PAGE_SIZE / 2;
  */
 static const unsigned max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
 
+/*
+ * Writeback: pages not accessed for this long are moved to the
+ * backing swap device by the writeback thread. Can be changed
+ * per device using RZSIO_SET_WB_IDLE_SECS (0 disables writeback).
+ */
+static const unsigned default_wb_idle_secs = 600;
+
+/*
+ * Idle age of every stored page is advanced once per this
+ * period. It is the unit of the idle age histogram.
+ */
+static const unsigned wb_age_interval_secs = 30;
+
+/*
+ * Above this percentage of memlimit the writeback thread also
+ * evicts pages that are idle for less than the threshold.
+ */
+static const unsigned wb_pressure_perc = 75;
+
+/* Max pages gathered for one round of writeback I/O */
+#define WB_BATCH_PAGES		32
+
+/* table[].age saturates at this many aging periods */
+#define RZS_MAX_AGE		255
+
 /*
  * NOTE: max_zpage_size_{bdev,nobdev} sizes must be
  * less than or equal to:
@@ -79,22 +115,49 @@ enum rzs_pageflags {
 	/* Page is stored uncompressed */
 	RZS_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	RZS_ZERO,
+	/* Page is filled with one repeated word (table[].element) */
+	RZS_SAME,
+
+	/* Object is shared through the dedup table (table[].dedup) */
+	RZS_DEDUP,
+
+	/* Page lives on backing swap at table[].slot */
+	RZS_WRITTEN,
+
+	/* Page is being copied to backing swap by the writeback thread */
+	RZS_WB_PENDING,
 
 	__NR_RZS_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * Compressed object shared by all swap slots that hold identical
+ * data. Hashed by a checksum of the uncompressed page so that
+ * duplicates are found before spending time compressing them.
+ */
+struct rzs_dedup_entry {
+	struct hlist_node node;
+	struct page *page;
+	u16 offset;
+	u32 checksum;
+	u32 refcount;	/* users of this object, under rzs->dedup_lock */
+};
+
 /*
  * Allocated for each swap slot, indexed by page no.
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		struct rzs_dedup_entry *dedup;	/* if RZS_DEDUP */
+		unsigned long element;		/* if RZS_SAME */
+		unsigned long slot;		/* if RZS_WRITTEN */
+	};
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u8 age;		/* aging periods since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -107,34 +170,96 @@ struct ramzswap_backing_extent {
 	pgoff_t num_pages;
 } __attribute__((aligned(4)));
 
+/*
+ * 64-bit event counters. These are kept per-CPU (see
+ * struct ramzswap_stats_cpu) so that the I/O paths never
+ * bounce a shared cacheline or take a lock to count events.
+ */
+enum rzs_stats_index {
+	RZS_STAT_NUM_READS,		/* failed + successful */
+	RZS_STAT_NUM_WRITES,		/* --do-- */
+	RZS_STAT_FAILED_READS,		/* should NEVER! happen */
+	RZS_STAT_FAILED_WRITES,		/* can happen when memory is too low */
+	RZS_STAT_INVALID_IO,		/* non-swap I/O requests */
+	RZS_STAT_NOTIFY_FREE,		/* no. of swap slot free notifications */
+	RZS_STAT_BDEV_NUM_READS,	/* no. of reads on backing dev */
+	RZS_STAT_BDEV_NUM_WRITES,	/* no. of writes on backing dev */
+	RZS_STAT_ALLOC_SLOWPATH,	/* writes that dropped their stream
+					 * to allocate memory */
+	RZS_STAT_COMPR_CALLS,		/* pages passed to the compressor */
+	RZS_STAT_COMPR_BYTES_OUT,	/* compressor output for those */
+	RZS_STAT_COMPR_TIME_NS,		/* time spent compressing */
+	RZS_STAT_DECOMPR_CALLS,		/* pages decompressed */
+	RZS_STAT_DECOMPR_TIME_NS,	/* time spent decompressing */
+	RZS_STAT_DEDUP_HITS,		/* writes satisfied by the dedup table */
+	RZS_STAT_DEDUP_COLLISIONS,	/* checksum matched, data did not */
+	RZS_STAT_WB_PAGES,		/* pages moved by writeback */
+	RZS_STAT_WB_BIOS,		/* bios used to write them */
+	RZS_STAT_WB_CANCELLED,		/* accessed while being written back */
+	NR_RZS_STATS,
+};
+
+struct ramzswap_stats_cpu {
+	u64 count[NR_RZS_STATS];
+	seqcount_t seq;		/* protect 64-bit counters on 32-bit */
+};
+
 struct ramzswap_stats {
 	/* basic stats */
-	size_t compr_size;	/* compressed size of pages stored -
-				 * needed to enforce memlimit */
+	atomic_long_t compr_size;	/* compressed size of pages stored -
+					 * needed to enforce memlimit */
 	/* more stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-swap I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
-	u64 bdev_num_reads;	/* no. of reads on backing dev */
-	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	atomic_t pages_zero;		/* no. of zero filled pages */
+	atomic_t pages_same;		/* no. of other same filled pages */
+	atomic_t dedup_refs;		/* table entries using dedup objects */
+	atomic_t dedup_objects;		/* objects in the dedup table */
+	atomic_t pages_stored;		/* no. of pages currently stored */
+	atomic_t good_compress;		/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;		/* % of incompressible pages */
+	atomic_t pages_written;		/* pages now on backing swap */
+	u32 idle_hist[RZS_IDLE_HIST_BUCKETS];	/* as of last aging */
 #endif
 };
 
+/*
+ * Pages being written back together. The writeback thread copies
+ * them out of the table into its own pages, writes those to the
+ * backing device with as few bios as possible and then commits
+ * each table entry that was not accessed in the meantime.
+ */
+struct rzs_wb_batch {
+	int nr;
+	int error;
+	atomic_t pending;		/* bios in flight + 1 */
+	struct completion done;
+	unsigned long next_slot;	/* keeps the next batch sequential */
+	u32 index[WB_BATCH_PAGES];
+	unsigned long slot[WB_BATCH_PAGES];
+	struct page *page[WB_BATCH_PAGES];
+};
+
+/*
+ * Per-CPU compression stream. Reads and writes use the stream
+ * of the CPU they run on with preemption disabled, so I/O on
+ * different CPUs never contends for a compressor or buffer.
+ */
+struct ramzswap_stream {
+	struct crypto_comp *tfm;
+	void *buffer;		/* compressed output: two pages */
+};
+
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct ramzswap_stream *streams;	/* per-CPU */
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	unsigned long *table_lock;	/* bit spinlock per table entry */
+	struct ramzswap_stats_cpu *stats_cpu;	/* per-CPU */
+	int dedup;			/* dedup requested for this device */
+	spinlock_t dedup_lock;		/* protects dedup table, refcounts */
+	struct hlist_head *dedup_table;
+	unsigned int dedup_bits;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -159,52 +284,77 @@ struct ramzswap {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
 	struct block_device *backing_swap;
 	struct file *swap_file;
+
+	/* writeback to backing swap */
+	unsigned int wb_idle_secs;	/* 0 if writeback is disabled */
+	struct task_struct *wb_task;
+	struct rzs_wb_batch *wb_batch;
+	int wb_stalled;			/* nothing to evict until next aging */
+	spinlock_t wb_lock;		/* protects wb_slots */
+	unsigned long *wb_slots;	/* backing swap pages in use */
 };
 
 /*-- */
 
 /* Debugging and Stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
-static void rzs_stat_inc(u32 *v)
+static void rzs_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void rzs_stat_dec(u32 *v)
+static void rzs_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
+}
+
+static void rzs_stat64_add(struct ramzswap *rzs,
+			enum rzs_stats_index idx, s64 val)
+{
+	struct ramzswap_stats_cpu *stats;
+
+	stats = per_cpu_ptr(rzs->stats_cpu, get_cpu());
+	write_seqcount_begin(&stats->seq);
+	stats->count[idx] += val;
+	write_seqcount_end(&stats->seq);
+	put_cpu();
 }
 
-static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
+static void rzs_stat64_inc(struct ramzswap *rzs, enum rzs_stats_index idx)
 {
-	spin_lock(&rzs->stat64_lock);
-	*v = *v + 1;
-	spin_unlock(&rzs->stat64_lock);
+	rzs_stat64_add(rzs, idx, 1);
 }
 
-static void rzs_stat64_dec(struct ramzswap *rzs, u64 *v)
+static void rzs_stat64_dec(struct ramzswap *rzs, enum rzs_stats_index idx)
 {
-	spin_lock(&rzs->stat64_lock);
-	*v = *v - 1;
-	spin_unlock(&rzs->stat64_lock);
+	rzs_stat64_add(rzs, idx, -1);
 }
 
-static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
+static u64 rzs_stat64_read(struct ramzswap *rzs, enum rzs_stats_index idx)
 {
-	u64 val;
+	int cpu;
+	u64 val, total = 0;
+	unsigned int start;
+	struct ramzswap_stats_cpu *stats;
 
-	spin_lock(&rzs->stat64_lock);
-	val = *v;
-	spin_unlock(&rzs->stat64_lock);
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(rzs->stats_cpu, cpu);
+		do {
+			start = read_seqcount_begin(&stats->seq);
+			val = stats->count[idx];
+		} while (read_seqcount_retry(&stats->seq, start));
+		total += val;
+	}
 
-	return val;
+	return total;
 }
 #else
 #define rzs_stat_inc(v)
 #define rzs_stat_dec(v)
-#define rzs_stat64_inc(r, v)
-#define rzs_stat64_dec(r, v)
-#define rzs_stat64_read(r, v)
+#define rzs_stat64_add(r, i, v)
+#define rzs_stat64_inc(r, i)
+#define rzs_stat64_dec(r, i)
+#define rzs_stat64_read(r, i)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
 #endif
@@ -16,6 +16,14 @@
 #define _RAMZSWAP_IOCTL_H_
 
 #define MAX_SWAP_NAME_LEN 128
+#define MAX_COMPRESSOR_NAME_LEN 32
+
+/*
+ * Idle age histogram: bucket 0 counts pages accessed during the
+ * last aging period, bucket n those idle for [2^(n-1), 2^n)
+ * periods of idle_age_unit_secs each.
+ */
+#define RZS_IDLE_HIST_BUCKETS 9
 
 struct ramzswap_ioctl_stats {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
@@ -40,11 +48,43 @@ struct ramzswap_ioctl_stats {
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * The size of the stats structure is part of the RZSIO_GET_STATS command
+ * number, so the structure above must not change.  Newer counters are
+ * returned by RZSIO_GET_STATS2 instead.
+ */
+struct ramzswap_ioctl_stats2 {
+	u64 alloc_slowpath;	/* writes that had to drop their per-CPU
+				 * stream to allocate memory */
+	u64 xv_lock_contended;	/* no. of waits for the allocator lock */
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
+	u64 compr_calls;	/* no. of pages passed to the compressor */
+	u64 compr_bytes_out;	/* total compressor output for those pages */
+	u64 compr_time_ns;	/* time spent compressing */
+	u64 decompr_calls;	/* no. of pages decompressed */
+	u64 decompr_time_ns;	/* time spent decompressing */
+	u32 pages_same;		/* no. of other same filled pages */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 dedup_hits;		/* writes satisfied by the dedup table */
+	u64 dedup_collisions;	/* checksum matched, data did not */
+	u32 pages_written;	/* pages moved to backing swap */
+	u32 idle_age_unit_secs;
+	u32 idle_hist[RZS_IDLE_HIST_BUCKETS];
+	u64 wb_pages;		/* no. of pages written back */
+	u64 wb_bios;		/* no. of bios issued for those */
+	u64 wb_cancelled;	/* pages accessed during writeback */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_SET_MEMLIMIT_KB	_IOW('z', 1, size_t)
 #define RZSIO_SET_BACKING_SWAP	_IOW('z', 2, unsigned char[MAX_SWAP_NAME_LEN])
 #define RZSIO_GET_STATS		_IOR('z', 3, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 4)
 #define RZSIO_RESET		_IO('z', 5)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 6, \
+				unsigned char[MAX_COMPRESSOR_NAME_LEN])
+#define RZSIO_SET_DEDUP		_IOW('z', 7, int)
+#define RZSIO_SET_WB_IDLE_SECS	_IOW('z', 8, unsigned int)
+#define RZSIO_GET_STATS2	_IOR('z', 9, struct ramzswap_ioctl_stats2)
 
 #endif
@@ -63,6 +63,24 @@ static void put_ptr_atomic(void *ptr, enum km_type type)
 	kunmap_atomic(ptr, type);
 }
 
+/*
+ * The pool lock is shared by all CPUs doing swap-out, so count
+ * how often we have to wait for it.
+ */
+static void pool_lock(struct xv_pool *pool)
+{
+	if (likely(spin_trylock(&pool->lock)))
+		return;
+
+	spin_lock(&pool->lock);
+	stat_inc(&pool->lock_contended);
+}
+
+static void pool_unlock(struct xv_pool *pool)
+{
+	spin_unlock(&pool->lock);
+}
+
 static u32 get_blockprev(struct block_header *block)
 {
 	return block->prev & PREV_MASK;
@@ -288,9 +306,7 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
-	stat_inc(&pool->total_pages);
-
-	spin_lock(&pool->lock);
+	/* The page is not visible to anyone else until it is inserted */
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -298,10 +314,12 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	clear_flag(block, PREV_FREE);
 	set_blockprev(block, 0);
 
+	pool_lock(pool);
 	insert_block(pool, page, 0, block);
+	stat_inc(&pool->total_pages);
+	pool_unlock(pool);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
 
 	return 0;
 }
@@ -342,6 +360,8 @@ void xv_destroy_pool(struct xv_pool *pool)
  * 0 and -ENOMEM is returned.
  *
  * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+ * If @flags does not allow sleeping, the pool is not grown and
+ * -ENOMEM is returned when no free block is available.
  */
 int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 		u32 *offset, gfp_t flags)
@@ -359,27 +379,26 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	size = ALIGN(size, XV_ALIGN);
 
-	spin_lock(&pool->lock);
+	pool_lock(pool);
 
 	index = find_block(pool, size, page, offset);
 
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
+	/*
+	 * Other CPUs may consume the page we add before we get
+	 * the lock back, so keep growing until we find a block.
+	 */
+	while (!*page) {
+		pool_unlock(pool);
+		if (!(flags & __GFP_WAIT))
 			return -ENOMEM;
 		error = grow_pool(pool, flags);
 		if (unlikely(error))
 			return error;
 
-		spin_lock(&pool->lock);
+		pool_lock(pool);
 		index = find_block(pool, size, page, offset);
 	}
 
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		return -ENOMEM;
-	}
-
 	block = get_ptr_atomic(*page, *offset, KM_USER0);
 
 	remove_block_head(pool, block, index);
@@ -411,7 +430,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	clear_flag(block, BLOCK_FREE);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
+	pool_unlock(pool);
 
 	*offset += XV_ALIGN;
 
@@ -428,7 +447,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	offset -= XV_ALIGN;
 
-	spin_lock(&pool->lock);
+	pool_lock(pool);
 
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
@@ -472,11 +491,11 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
+		stat_dec(&pool->total_pages);
 		put_ptr_atomic(page_start, KM_USER0);
-		spin_unlock(&pool->lock);
+		pool_unlock(pool);
 
 		__free_page(page);
-		stat_dec(&pool->total_pages);
 		return;
 	}
 
@@ -491,7 +510,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	put_ptr_atomic(page_start, KM_USER0);
-	spin_unlock(&pool->lock);
+	pool_unlock(pool);
 }
 
 u32 xv_get_object_size(void *obj)
@@ -509,3 +528,11 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns number of times a caller had to spin for the pool lock
+ */
+u64 xv_get_lock_contended(struct xv_pool *pool)
+{
+	return pool->lock_contended;
+}
@@ -79,8 +79,9 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
-	/* stats */
+	/* stats (protected by lock) */
 	u64 total_pages;
+	u64 lock_contended;
 };
 
 #endif
@@ -55,6 +55,7 @@
 #include <linux/kmod.h>
 #include <linux/fsnotify.h>
 #include <linux/fs_struct.h>
+#include <linux/oom.h>
 
 #include <trace/events/fs.h>
 
@@ -847,6 +848,7 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+		oom_adj_notify(tsk, OOM_ADJ_TASK_NEW);
 	}
 
 	sig->group_exit_task = NULL;
@@ -19,49 +19,126 @@
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 #include <linux/writeback.h>
 #include <linux/blkdev.h>
 #include <linux/backing-dev.h>
 #include <linux/buffer_head.h>
 #include "internal.h"
 
+/*
+ * The maximum number of pages to writeout in a single flusher pass.  We do
+ * this so we don't hold I_SYNC against an inode for enormous amounts of time,
+ * which would block a userspace task which has been forced to throttle
+ * against that inode.  Also, the code reevaluates the dirty each time it has
+ * written this many pages.
+ */
+#define MAX_WRITEBACK_PAGES	1024
+
+/*
+ * A writeback request queued on bdi->work_list for the bdi's flusher thread.
+ * Background and periodic writeback need no request: the thread checks for
+ * those itself every time it runs out of queued work.
+ */
+struct wb_writeback_work {
+	long nr_pages;
+	enum writeback_sync_modes sync_mode;
+	unsigned int for_kupdate:1;
+	unsigned int range_cyclic:1;
+	unsigned int for_background:1;
+
+	struct list_head list;		/* pending work list */
+};
+
+/*
+ * pdflush is gone, but /proc/sys/vm/nr_pdflush_threads is ABI.
+ */
+int nr_pdflush_threads;
 
 /**
- * writeback_acquire - attempt to get exclusive writeback access to a device
- * @bdi: the device's backing_dev_info structure
- *
- * It is a waste of resources to have more than one pdflush thread blocked on
- * a single request queue.  Exclusion at the request_queue level is obtained
- * via a flag in the request_queue's backing_dev_info.state.
+ * writeback_in_progress - determine whether there is writeback in progress
+ * @bdi: the device's backing_dev_info structure.
  *
- * Non-request_queue-backed address_spaces will share default_backing_dev_info,
- * unless they implement their own.  Which is somewhat inefficient, as this
- * may prevent concurrent writeback against multiple devices.
+ * Determine whether the flusher thread is currently writing back against
+ * a backing device.
+ */
+int writeback_in_progress(struct backing_dev_info *bdi)
+{
+	return test_bit(BDI_writeback_running, &bdi->state);
+}
+
+static inline struct backing_dev_info *inode_to_bdi(struct inode *inode)
+{
+	return inode->i_mapping->backing_dev_info;
+}
+
+/*
+ * Kick the flusher thread of @bdi, or the forker thread if @bdi currently
+ * has none: it will create one, or do the writeback itself.  Called with
+ * bdi->wb_lock held, which keeps ->task stable.
  */
-static int writeback_acquire(struct backing_dev_info *bdi)
+static void bdi_wakeup_flusher(struct backing_dev_info *bdi)
 {
-	return !test_and_set_bit(BDI_pdflush, &bdi->state);
+	if (bdi->wb.task)
+		wake_up_process(bdi->wb.task);
+	else if (default_backing_dev_info.wb.task)
+		wake_up_process(default_backing_dev_info.wb.task);
+}
+
+static void bdi_queue_work(struct backing_dev_info *bdi,
+			   struct wb_writeback_work *work)
+{
+	spin_lock_bh(&bdi->wb_lock);
+	list_add_tail(&work->list, &bdi->work_list);
+	bdi_wakeup_flusher(bdi);
+	spin_unlock_bh(&bdi->wb_lock);
 }
 
 /**
- * writeback_in_progress - determine whether there is writeback in progress
- * @bdi: the device's backing_dev_info structure.
+ * bdi_start_writeback - start writeback
+ * @bdi: the backing device to write from
+ * @nr_pages: the number of pages to write
  *
- * Determine whether there is writeback in progress against a backing device.
+ * Queue a WB_SYNC_NONE request for @nr_pages pages on @bdi and wake its
+ * flusher thread.  This function returns immediately; the writeback is
+ * done asynchronously by the flusher.
  */
-int writeback_in_progress(struct backing_dev_info *bdi)
+void bdi_start_writeback(struct backing_dev_info *bdi, long nr_pages)
 {
-	return test_bit(BDI_pdflush, &bdi->state);
+	struct wb_writeback_work *work;
+
+	/*
+	 * This is WB_SYNC_NONE writeback, so if allocation fails just
+	 * wake the thread for background and old data writeback.
+	 */
+	work = kzalloc(sizeof(*work), GFP_ATOMIC);
+	if (!work) {
+		bdi_start_background_writeback(bdi);
+		return;
+	}
+
+	work->sync_mode = WB_SYNC_NONE;
+	work->nr_pages = nr_pages;
+	work->range_cyclic = 1;
+
+	bdi_queue_work(bdi, work);
 }
 
 /**
- * writeback_release - relinquish exclusive writeback access against a device.
- * @bdi: the device's backing_dev_info structure
+ * bdi_start_background_writeback - start background writeback
+ * @bdi: the backing device to write from
+ *
+ * Wake the flusher thread of @bdi, which writes back until the system is
+ * below the background dirty threshold.  This needs no work item, so it
+ * cannot fail and may be called from atomic context.
  */
-static void writeback_release(struct backing_dev_info *bdi)
+void bdi_start_background_writeback(struct backing_dev_info *bdi)
 {
-	BUG_ON(!writeback_in_progress(bdi));
-	clear_bit(BDI_pdflush, &bdi->state);
+	spin_lock_bh(&bdi->wb_lock);
+	bdi_wakeup_flusher(bdi);
+	spin_unlock_bh(&bdi->wb_lock);
 }
 
 static noinline void block_dump___mark_inode_dirty(struct inode *inode)
@@ -93,7 +170,7 @@ static noinline void block_dump___mark_inode_dirty(struct inode *inode)
  *	Mark an inode as dirty. Callers should use mark_inode_dirty or
  *  	mark_inode_dirty_sync.
  *
- * Put the inode on the super block's dirty list.
+ * Put the inode on its backing device's dirty list.
  *
  * CAREFUL! We mark it dirty unconditionally, but move it onto the
  * dirty list only if it is hashed or if it refers to a blockdev.
@@ -116,6 +193,7 @@ static noinline void block_dump___mark_inode_dirty(struct inode *inode)
 void __mark_inode_dirty(struct inode *inode, int flags)
 {
 	struct super_block *sb = inode->i_sb;
+	struct backing_dev_info *bdi = NULL;
 
 	/*
 	 * Don't do this for I_DIRTY_PAGES - that doesn't actually
@@ -148,14 +226,14 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 		/*
 		 * If the inode is being synced, just update its dirty state.
 		 * The unlocker will place the inode on the appropriate
-		 * superblock list, based upon its state.
+		 * bdi list, based upon its state.
 		 */
 		if (inode->i_state & I_SYNC)
 			goto out;
 
 		/*
-		 * Only add valid (hashed) inodes to the superblock's
-		 * dirty list.  Add blockdev inodes as well.
+		 * Only add valid (hashed) inodes to the bdi's dirty
+		 * list.  Add blockdev inodes as well.
 		 */
 		if (!S_ISBLK(inode->i_mode)) {
 			if (hlist_unhashed(&inode->i_hash))
@@ -165,16 +243,30 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 			goto out;
 
 		/*
-		 * If the inode was already on s_dirty/s_io/s_more_io, don't
-		 * reposition it (that would break s_dirty time-ordering).
+		 * If the inode was already on b_dirty/b_io/b_more_io, don't
+		 * reposition it (that would break b_dirty time-ordering).
 		 */
 		if (!was_dirty) {
+			struct backing_dev_info *ibdi = inode_to_bdi(inode);
+
+			/*
+			 * The first dirty inode of a bdi wakes its flusher
+			 * (or gets one forked), so that periodic writeback
+			 * picks the inode up later.
+			 */
+			if (bdi_cap_writeback_dirty(ibdi) &&
+			    !wb_has_dirty_io(&ibdi->wb))
+				bdi = ibdi;
+
 			inode->dirtied_when = jiffies;
-			list_move(&inode->i_list, &sb->s_dirty);
+			list_move(&inode->i_list, &ibdi->wb.b_dirty);
 		}
 	}
 out:
 	spin_unlock(&inode_lock);
+
+	if (bdi)
+		bdi_start_background_writeback(bdi);
 }
 
 EXPORT_SYMBOL(__mark_inode_dirty);
@@ -188,34 +280,34 @@ static int write_inode(struct inode *inode, int sync)
 
 /*
  * Redirty an inode: set its when-it-was dirtied timestamp and move it to the
- * furthest end of its superblock's dirty-inode list.
+ * furthest end of its bdi's dirty-inode list.
  *
  * Before stamping the inode's ->dirtied_when, we check to see whether it is
- * already the most-recently-dirtied inode on the s_dirty list.  If that is
+ * already the most-recently-dirtied inode on the b_dirty list.  If that is
  * the case then the inode must have been redirtied while it was being written
  * out and we don't reset its dirtied_when.
  */
 static void redirty_tail(struct inode *inode)
 {
-	struct super_block *sb = inode->i_sb;
+	struct bdi_writeback *wb = &inode_to_bdi(inode)->wb;
 
-	if (!list_empty(&sb->s_dirty)) {
+	if (!list_empty(&wb->b_dirty)) {
 		struct inode *tail_inode;
 
-		tail_inode = list_entry(sb->s_dirty.next, struct inode, i_list);
+		tail_inode = list_entry(wb->b_dirty.next, struct inode, i_list);
 		if (time_before(inode->dirtied_when,
 				tail_inode->dirtied_when))
 			inode->dirtied_when = jiffies;
 	}
-	list_move(&inode->i_list, &sb->s_dirty);
+	list_move(&inode->i_list, &wb->b_dirty);
 }
 
 /*
- * requeue inode for re-scanning after sb->s_io list is exhausted.
+ * requeue inode for re-scanning after bdi->b_io list is exhausted.
  */
 static void requeue_io(struct inode *inode)
 {
-	list_move(&inode->i_list, &inode->i_sb->s_more_io);
+	list_move(&inode->i_list, &inode_to_bdi(inode)->wb.b_more_io);
 }
 
 static void inode_sync_complete(struct inode *inode)
@@ -235,7 +327,7 @@ static bool inode_dirtied_after(struct inode *inode, unsigned long t)
 	 * For inodes being constantly redirtied, dirtied_when can get stuck.
 	 * It _appears_ to be in the future, but is actually in distant past.
 	 * This test is necessary to prevent such wrapped-around relative times
-	 * from permanently stopping the whole pdflush writeback.
+	 * from permanently stopping the whole bdi writeback.
 	 */
 	ret = ret && time_before_eq(inode->dirtied_when, jiffies);
 #endif
@@ -262,20 +354,17 @@ static void move_expired_inodes(struct list_head *delaying_queue,
 /*
  * Queue all expired dirty inodes for io, eldest first.
  */
-static void queue_io(struct super_block *sb,
+static void queue_io(struct bdi_writeback *wb,
 				unsigned long *older_than_this)
 {
-	list_splice_init(&sb->s_more_io, sb->s_io.prev);
-	move_expired_inodes(&sb->s_dirty, &sb->s_io, older_than_this);
+	list_splice_init(&wb->b_more_io, wb->b_io.prev);
+	move_expired_inodes(&wb->b_dirty, &wb->b_io, older_than_this);
 }
 
-int sb_has_dirty_inodes(struct super_block *sb)
+int bdi_has_dirty_io(struct backing_dev_info *bdi)
 {
-	return !list_empty(&sb->s_dirty) ||
-	       !list_empty(&sb->s_io) ||
-	       !list_empty(&sb->s_more_io);
+	return wb_has_dirty_io(&bdi->wb);
 }
-EXPORT_SYMBOL(sb_has_dirty_inodes);
 
 /*
  * Wait for writeback on an inode to complete.
@@ -322,11 +411,11 @@ writeback_single_inode(struct inode *inode, struct writeback_control *wbc)
 	if (inode->i_state & I_SYNC) {
 		/*
 		 * If this inode is locked for writeback and we are not doing
-		 * writeback-for-data-integrity, move it to s_more_io so that
-		 * writeback can proceed with the other inodes on s_io.
+		 * writeback-for-data-integrity, move it to b_more_io so that
+		 * writeback can proceed with the other inodes on b_io.
 		 *
 		 * We'll have another go at writing back this inode when we
-		 * completed a full scan of s_io.
+		 * completed a full scan of b_io.
 		 */
 		if (!wait) {
 			requeue_io(inode);
@@ -371,11 +460,11 @@ writeback_single_inode(struct inode *inode, struct writeback_control *wbc)
 			/*
 			 * We didn't write back all the pages.  nfs_writepages()
 			 * sometimes bales out without doing anything. Redirty
-			 * the inode; Move it from s_io onto s_more_io/s_dirty.
+			 * the inode; Move it from b_io onto b_more_io/b_dirty.
 			 */
 			/*
 			 * akpm: if the caller was the kupdate function we put
-			 * this inode at the head of s_dirty so it gets first
+			 * this inode at the head of b_dirty so it gets first
 			 * consideration.  Otherwise, move it to the tail, for
 			 * the reasons described there.  I'm not really sure
 			 * how much sense this makes.  Presumably I had a good
@@ -385,7 +474,7 @@ writeback_single_inode(struct inode *inode, struct writeback_control *wbc)
 			if (wbc->for_kupdate) {
 				/*
 				 * For the kupdate function we move the inode
-				 * to s_more_io so it will get more writeout as
+				 * to b_more_io so it will get more writeout as
 				 * soon as the queue becomes uncongested.
 				 */
 				inode->i_state |= I_DIRTY_PAGES;
@@ -403,7 +492,7 @@ writeback_single_inode(struct inode *inode, struct writeback_control *wbc)
 			} else {
 				/*
 				 * Otherwise fully redirty the inode so that
-				 * other inodes on this superblock will get some
+				 * other inodes on this device will get some
 				 * writeout.  Otherwise heavy writing to one
 				 * file would indefinitely suspend writeout of
 				 * all the other files.
@@ -434,101 +523,436 @@ writeback_single_inode(struct inode *inode, struct writeback_control *wbc)
 }
 
 /*
- * Write out a superblock's list of dirty inodes.  A wait will be performed
- * upon no inodes, all inodes or the final one, depending upon sync_mode.
+ * Pin @sb for writeback of its inodes from a bdi list: the caller holds
+ * inode_lock and one of @sb's inodes is on the list, so @sb cannot go away
+ * under us.  Fails if the filesystem is being unmounted - there is no point
+ * in waiting for s_umount, most of the time the fs will be gone by the time
+ * it is released.
+ */
+static int pin_sb_for_writeback(struct super_block *sb)
+{
+	spin_lock(&sb_lock);
+	sb->s_count++;
+	if (down_read_trylock(&sb->s_umount)) {
+		if (sb->s_root) {
+			spin_unlock(&sb_lock);
+			return 1;
+		}
+		up_read(&sb->s_umount);
+	}
+	__put_super_and_need_restart(sb);
+	spin_unlock(&sb_lock);
+	return 0;
+}
+
+/*
+ * Write a run of inodes at the tail of @wb->b_io which all belong to @sb.
+ * Returns 1 if the caller should stop writing back, 0 if it should go on
+ * with the next superblock.
+ */
+static int writeback_sb_inodes(struct super_block *sb,
+			       struct bdi_writeback *wb,
+			       struct writeback_control *wbc,
+			       unsigned long start)
+{
+	while (!list_empty(&wb->b_io)) {
+		struct inode *inode = list_entry(wb->b_io.prev,
+						 struct inode, i_list);
+		long pages_skipped;
+
+		if (inode->i_sb != sb)
+			return 0;
+
+		if (inode->i_state & (I_NEW | I_WILL_FREE)) {
+			requeue_io(inode);
+			continue;
+		}
+
+		if (wbc->nonblocking && bdi_write_congested(wb->bdi)) {
+			wbc->encountered_congestion = 1;
+			return 1;
+		}
+
+		/*
+		 * Was this inode dirtied after writeback_inodes_wb was called?
+		 * This keeps sync from extra jobs and livelock.
+		 */
+		if (inode_dirtied_after(inode, start))
+			return 1;
+
+		BUG_ON(inode->i_state & (I_FREEING | I_CLEAR));
+		__iget(inode);
+		pages_skipped = wbc->pages_skipped;
+		writeback_single_inode(inode, wbc);
+		if (wbc->pages_skipped != pages_skipped) {
+			/*
+			 * writeback is not making progress due to locked
+			 * buffers.  Skip this inode for now.
+			 */
+			redirty_tail(inode);
+		}
+		spin_unlock(&inode_lock);
+		iput(inode);
+		cond_resched();
+		spin_lock(&inode_lock);
+		if (wbc->nr_to_write <= 0) {
+			wbc->more_io = 1;
+			return 1;
+		}
+		if (!list_empty(&wb->b_more_io))
+			wbc->more_io = 1;
+	}
+	/* b_io is empty */
+	return 1;
+}
+
+/*
+ * Write out a bdi's list of dirty inodes, eldest first, without waiting.
  *
  * If older_than_this is non-NULL, then only write out inodes which
  * had their first dirtying at a time earlier than *older_than_this.
  *
- * If we're a pdflush thread, then implement pdflush collision avoidance
- * against the entire list.
- *
- * If `bdi' is non-zero then we're being asked to writeback a specific queue.
- * This function assumes that the blockdev superblock's inodes are backed by
- * a variety of queues, so all inodes are searched.  For other superblocks,
- * assume that all inodes are backed by the same queue.
- *
- * FIXME: this linear search could get expensive with many fileystems.  But
- * how to fix?  We need to go from an address_space to all inodes which share
- * a queue with that address_space.  (Easy: have a global "dirty superblocks"
- * list).
- *
- * The inodes to be written are parked on sb->s_io.  They are moved back onto
- * sb->s_dirty as they are selected for writing.  This way, none can be missed
+ * The inodes to be written are parked on wb->b_io.  They are moved back onto
+ * wb->b_dirty as they are selected for writing.  This way, none can be missed
  * on the writer throttling path, and we get decent balancing between many
  * throttled threads: we don't want them all piling up on inode_sync_wait.
  */
-void generic_sync_sb_inodes(struct super_block *sb,
-				struct writeback_control *wbc)
+void writeback_inodes_wb(struct bdi_writeback *wb,
+			 struct writeback_control *wbc)
 {
 	const unsigned long start = jiffies;	/* livelock avoidance */
-	int sync = wbc->sync_mode == WB_SYNC_ALL;
 
 	spin_lock(&inode_lock);
-	if (!wbc->for_kupdate || list_empty(&sb->s_io))
-		queue_io(sb, wbc->older_than_this);
+	if (!wbc->for_kupdate || list_empty(&wb->b_io))
+		queue_io(wb, wbc->older_than_this);
 
-	while (!list_empty(&sb->s_io)) {
-		struct inode *inode = list_entry(sb->s_io.prev,
-						struct inode, i_list);
-		struct address_space *mapping = inode->i_mapping;
-		struct backing_dev_info *bdi = mapping->backing_dev_info;
-		long pages_skipped;
+	while (!list_empty(&wb->b_io)) {
+		struct inode *inode = list_entry(wb->b_io.prev,
+						 struct inode, i_list);
+		struct super_block *sb = inode->i_sb;
+		int done;
 
-		if (!bdi_cap_writeback_dirty(bdi)) {
-			redirty_tail(inode);
-			if (sb_is_blkdev_sb(sb)) {
-				/*
-				 * Dirty memory-backed blockdev: the ramdisk
-				 * driver does this.  Skip just this inode
-				 */
-				continue;
-			}
-			/*
-			 * Dirty memory-backed inode against a filesystem other
-			 * than the kernel-internal bdev filesystem.  Skip the
-			 * entire superblock.
-			 */
-			break;
-		}
-
-		if (inode->i_state & (I_NEW | I_WILL_FREE)) {
+		if (!pin_sb_for_writeback(sb)) {
 			requeue_io(inode);
 			continue;
 		}
+		done = writeback_sb_inodes(sb, wb, wbc, start);
+		spin_unlock(&inode_lock);
+		drop_super(sb);
+		spin_lock(&inode_lock);
+		if (done)
+			break;
+	}
+	spin_unlock(&inode_lock);
+	/* Leave any unwritten inodes on b_io */
+}
 
-		if (wbc->nonblocking && bdi_write_congested(bdi)) {
-			wbc->encountered_congestion = 1;
-			if (!sb_is_blkdev_sb(sb))
-				break;		/* Skip a congested fs */
-			requeue_io(inode);
-			continue;		/* Skip a congested blockdev */
-		}
+static int over_bground_thresh(void)
+{
+	unsigned long background_thresh, dirty_thresh;
 
-		if (wbc->bdi && bdi != wbc->bdi) {
-			if (!sb_is_blkdev_sb(sb))
-				break;		/* fs has the wrong queue */
-			requeue_io(inode);
-			continue;		/* blockdev has wrong queue */
-		}
+	get_dirty_limits(&background_thresh, &dirty_thresh, NULL, NULL);
 
+	return (global_page_state(NR_FILE_DIRTY) +
+		global_page_state(NR_UNSTABLE_NFS) >= background_thresh);
+}
+
+/*
+ * Explicit flushing or periodic writeback of "old" data.
+ *
+ * Define "old": the first time one of an inode's pages is dirtied, we mark the
+ * dirtying-time in the inode's address_space.  So this periodic writeback code
+ * just walks the bdi's inode list, writing back any inodes which are older
+ * than a specific point in time.
+ *
+ * older_than_this takes precedence over nr_to_write.  So we'll only write back
+ * all dirty pages if they are all attached to "old" mappings.
+ *
+ * Returns the number of pages written.
+ */
+static long wb_writeback(struct bdi_writeback *wb,
+			 struct wb_writeback_work *work)
+{
+	struct writeback_control wbc = {
+		.bdi			= wb->bdi,
+		.sync_mode		= work->sync_mode,
+		.older_than_this	= NULL,
+		.for_kupdate		= work->for_kupdate,
+		.range_cyclic		= work->range_cyclic,
+	};
+	unsigned long oldest_jif;
+	long wrote = 0;
+
+	if (wbc.for_kupdate) {
+		wbc.older_than_this = &oldest_jif;
+		oldest_jif = jiffies -
+				msecs_to_jiffies(dirty_expire_interval * 10);
+	}
+	if (!wbc.range_cyclic) {
+		wbc.range_start = 0;
+		wbc.range_end = LLONG_MAX;
+	}
+
+	for (;;) {
 		/*
-		 * Was this inode dirtied after sync_sb_inodes was called?
-		 * This keeps sync from extra jobs and livelock.
+		 * Stop writeback when nr_pages has been consumed
 		 */
-		if (inode_dirtied_after(inode, start))
+		if (work->nr_pages <= 0)
 			break;
 
-		/* Is another pdflush already flushing this queue? */
-		if (current_is_pdflush() && !writeback_acquire(bdi))
+		/*
+		 * For background writeout, stop when we are below the
+		 * background dirty threshold
+		 */
+		if (work->for_background && !over_bground_thresh())
 			break;
 
-		BUG_ON(inode->i_state & (I_FREEING | I_CLEAR));
+		wbc.more_io = 0;
+		wbc.encountered_congestion = 0;
+		wbc.nr_to_write = MAX_WRITEBACK_PAGES;
+		wbc.pages_skipped = 0;
+		writeback_inodes_wb(wb, &wbc);
+		work->nr_pages -= MAX_WRITEBACK_PAGES - wbc.nr_to_write;
+		wrote += MAX_WRITEBACK_PAGES - wbc.nr_to_write;
+
+		/*
+		 * If we consumed everything, see if we have more
+		 */
+		if (wbc.nr_to_write <= 0)
+			continue;
+		/*
+		 * Didn't write everything and we don't have more IO, bail
+		 */
+		if (!wbc.more_io)
+			break;
+		/*
+		 * Did we write something? Try for more
+		 */
+		if (wbc.nr_to_write < MAX_WRITEBACK_PAGES)
+			continue;
+		/*
+		 * Nothing written, but inodes are parked on b_more_io:
+		 * give the queue some time instead of busylooping.
+		 */
+		congestion_wait(BLK_RW_ASYNC, HZ/10);
+	}
+
+	return wrote;
+}
+
+/*
+ * Return the next queued work item for @bdi, if any
+ */
+static struct wb_writeback_work *
+get_next_work_item(struct backing_dev_info *bdi)
+{
+	struct wb_writeback_work *work = NULL;
+
+	spin_lock_bh(&bdi->wb_lock);
+	if (!list_empty(&bdi->work_list)) {
+		work = list_entry(bdi->work_list.next,
+				  struct wb_writeback_work, list);
+		list_del_init(&work->list);
+	}
+	spin_unlock_bh(&bdi->wb_lock);
+	return work;
+}
+
+/*
+ * kupdate-style writeback, run once every dirty_writeback_interval.
+ */
+static long wb_check_old_data_flush(struct bdi_writeback *wb)
+{
+	unsigned long expired;
+	long nr_pages;
+
+	/*
+	 * When set to zero, disable periodic writeback
+	 */
+	if (!dirty_writeback_interval)
+		return 0;
+
+	expired = wb->last_old_flush +
+			msecs_to_jiffies(dirty_writeback_interval * 10);
+	if (time_before(jiffies, expired))
+		return 0;
+
+	wb->last_old_flush = jiffies;
+	nr_pages = global_page_state(NR_FILE_DIRTY) +
+			global_page_state(NR_UNSTABLE_NFS) +
+			(inodes_stat.nr_inodes - inodes_stat.nr_unused);
+
+	if (nr_pages) {
+		struct wb_writeback_work work = {
+			.nr_pages	= nr_pages,
+			.sync_mode	= WB_SYNC_NONE,
+			.for_kupdate	= 1,
+			.range_cyclic	= 1,
+		};
+
+		return wb_writeback(wb, &work);
+	}
+
+	return 0;
+}
+
+static long wb_check_background_flush(struct bdi_writeback *wb)
+{
+	if (over_bground_thresh()) {
+		struct wb_writeback_work work = {
+			.nr_pages	= LONG_MAX,
+			.sync_mode	= WB_SYNC_NONE,
+			.for_background	= 1,
+			.range_cyclic	= 1,
+		};
+
+		return wb_writeback(wb, &work);
+	}
+
+	return 0;
+}
+
+/*
+ * Retrieve work items and do the writeback they describe, then any
+ * periodic and background writeback that is due.  Returns the number of
+ * pages written.
+ */
+long wb_do_writeback(struct bdi_writeback *wb)
+{
+	struct backing_dev_info *bdi = wb->bdi;
+	struct wb_writeback_work *work;
+	long wrote = 0;
+
+	set_bit(BDI_writeback_running, &bdi->state);
+	while ((work = get_next_work_item(bdi)) != NULL) {
+		wrote += wb_writeback(wb, work);
+		kfree(work);
+	}
+
+	wrote += wb_check_old_data_flush(wb);
+	wrote += wb_check_background_flush(wb);
+	clear_bit(BDI_writeback_running, &bdi->state);
+
+	return wrote;
+}
+
+/*
+ * Handle writeback of dirty data for the device backed by this bdi.  Also
+ * wakes up periodically and does kupdated style flushing.  The thread is
+ * forked on demand by the bdi forker thread in mm/backing-dev.c, which also
+ * stops it again once it has been idle for a while.
+ */
+int bdi_writeback_thread(void *data)
+{
+	struct bdi_writeback *wb = data;
+	struct backing_dev_info *bdi = wb->bdi;
+	unsigned long wait_jiffies;
+	long pages_written;
+
+	current->flags |= PF_SWAPWRITE;
+	set_freezable();
+	wb->last_active = jiffies;
+
+	/*
+	 * Our parent may run at a different priority, just set us to normal
+	 */
+	set_user_nice(current, 0);
+
+	while (!kthread_should_stop()) {
+		pages_written = wb_do_writeback(wb);
+
+		if (pages_written)
+			wb->last_active = jiffies;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!list_empty(&bdi->work_list) || kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+
+		if (wb_has_dirty_io(wb) && dirty_writeback_interval) {
+			wait_jiffies =
+				msecs_to_jiffies(dirty_writeback_interval * 10);
+			schedule_timeout(wait_jiffies);
+		} else {
+			/*
+			 * Nothing dirty: sleep without a timeout to save
+			 * power.  Queued work or a newly dirtied inode will
+			 * wake us up.
+			 */
+			schedule();
+		}
+
+		try_to_freeze();
+	}
+
+	/* Flush any work that raced with us exiting */
+	if (!list_empty(&bdi->work_list))
+		wb_do_writeback(wb);
+
+	return 0;
+}
+
+/*
+ * Start writeback of `nr_pages' pages on every bdi with dirty inodes.  If
+ * `nr_pages' is zero, write back the whole world.
+ */
+void wakeup_flusher_threads(long nr_pages)
+{
+	struct backing_dev_info *bdi;
+
+	if (!nr_pages)
+		nr_pages = global_page_state(NR_FILE_DIRTY) +
+				global_page_state(NR_UNSTABLE_NFS);
+
+	spin_lock_bh(&bdi_lock);
+	list_for_each_entry(bdi, &bdi_list, bdi_list) {
+		if (!bdi_cap_writeback_dirty(bdi) || !bdi_has_dirty_io(bdi))
+			continue;
+		bdi_start_writeback(bdi, nr_pages);
+	}
+	spin_unlock_bh(&bdi_lock);
+}
+
+/*
+ * Write out a superblock's dirty inodes in the caller's context.  A wait
+ * will be performed upon no inodes, all inodes or the final one, depending
+ * upon sync_mode.
+ *
+ * The dirty inode lists hang off the backing devices, so walk the
+ * superblock's own inode list and write whatever is dirty on it.  Inodes
+ * dirtied after the walk started are left alone to avoid livelocking
+ * against a busy writer, as are inodes of devices which do no writeback.
+ */
+void generic_sync_sb_inodes(struct super_block *sb,
+				struct writeback_control *wbc)
+{
+	const unsigned long start = jiffies;	/* livelock avoidance */
+	int sync = wbc->sync_mode == WB_SYNC_ALL;
+	struct inode *inode, *old_inode = NULL;
+
+	spin_lock(&inode_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		long pages_skipped;
+
+		if (!(inode->i_state & I_DIRTY))
+			continue;
+		if (inode->i_state & (I_NEW|I_FREEING|I_CLEAR|I_WILL_FREE))
+			continue;
+		/*
+		 * Mirror __mark_inode_dirty(): unhashed inodes never make it
+		 * onto a dirty list, so they are not ours to write either.
+		 */
+		if (!S_ISBLK(inode->i_mode) && hlist_unhashed(&inode->i_hash))
+			continue;
+		if (!mapping_cap_writeback_dirty(inode->i_mapping))
+			continue;
+		if (inode_dirtied_after(inode, start))
+			continue;
+
 		__iget(inode);
 		pages_skipped = wbc->pages_skipped;
 		writeback_single_inode(inode, wbc);
-		if (current_is_pdflush())
-			writeback_release(bdi);
 		if (wbc->pages_skipped != pages_skipped) {
 			/*
 			 * writeback is not making progress due to locked
@@ -537,19 +961,25 @@ void generic_sync_sb_inodes(struct super_block *sb,
 			redirty_tail(inode);
 		}
 		spin_unlock(&inode_lock);
-		iput(inode);
+		/*
+		 * We hold a reference to 'inode' so it couldn't have been
+		 * removed from s_inodes list while we dropped the inode_lock.
+		 * See the wait loop below for why old_inode is put late.
+		 */
+		iput(old_inode);
+		old_inode = inode;
 		cond_resched();
 		spin_lock(&inode_lock);
 		if (wbc->nr_to_write <= 0) {
 			wbc->more_io = 1;
 			break;
 		}
-		if (!list_empty(&sb->s_more_io))
-			wbc->more_io = 1;
 	}
+	spin_unlock(&inode_lock);
+	iput(old_inode);
 
 	if (sync) {
-		struct inode *inode, *old_inode = NULL;
+		old_inode = NULL;
 
 		/*
 		 * Data integrity sync. Must wait for all pages under writeback,
@@ -558,6 +988,7 @@ void generic_sync_sb_inodes(struct super_block *sb,
 		 * In which case, the inode may not be on the dirty list, but
 		 * we still have to wait for that writeout.
 		 */
+		spin_lock(&inode_lock);
 		list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
 			struct address_space *mapping;
 
@@ -588,70 +1019,9 @@ void generic_sync_sb_inodes(struct super_block *sb,
 		}
 		spin_unlock(&inode_lock);
 		iput(old_inode);
-	} else
-		spin_unlock(&inode_lock);
-
-	return;		/* Leave any unwritten inodes on s_io */
-}
-EXPORT_SYMBOL_GPL(generic_sync_sb_inodes);
-
-static void sync_sb_inodes(struct super_block *sb,
-				struct writeback_control *wbc)
-{
-	generic_sync_sb_inodes(sb, wbc);
-}
-
-/*
- * Start writeback of dirty pagecache data against all unlocked inodes.
- *
- * Note:
- * We don't need to grab a reference to superblock here. If it has non-empty
- * ->s_dirty it's hadn't been killed yet and kill_super() won't proceed
- * past sync_inodes_sb() until the ->s_dirty/s_io/s_more_io lists are all
- * empty. Since __sync_single_inode() regains inode_lock before it finally moves
- * inode from superblock lists we are OK.
- *
- * If `older_than_this' is non-zero then only flush inodes which have a
- * flushtime older than *older_than_this.
- *
- * If `bdi' is non-zero then we will scan the first inode against each
- * superblock until we find the matching ones.  One group will be the dirty
- * inodes against a filesystem.  Then when we hit the dummy blockdev superblock,
- * sync_sb_inodes will seekout the blockdev which matches `bdi'.  Maybe not
- * super-efficient but we're about to do a ton of I/O...
- */
-void
-writeback_inodes(struct writeback_control *wbc)
-{
-	struct super_block *sb;
-
-	might_sleep();
-	spin_lock(&sb_lock);
-restart:
-	list_for_each_entry_reverse(sb, &super_blocks, s_list) {
-		if (sb_has_dirty_inodes(sb)) {
-			/* we're making our own get_super here */
-			sb->s_count++;
-			spin_unlock(&sb_lock);
-			/*
-			 * If we can't get the readlock, there's no sense in
-			 * waiting around, most of the time the FS is going to
-			 * be unmounted by the time it is released.
-			 */
-			if (down_read_trylock(&sb->s_umount)) {
-				if (sb->s_root)
-					sync_sb_inodes(sb, wbc);
-				up_read(&sb->s_umount);
-			}
-			spin_lock(&sb_lock);
-			if (__put_super_and_need_restart(sb))
-				goto restart;
-		}
-		if (wbc->nr_to_write <= 0)
-			break;
 	}
-	spin_unlock(&sb_lock);
 }
+EXPORT_SYMBOL_GPL(generic_sync_sb_inodes);
 
 /*
  * writeback and wait upon the filesystem's dirty inodes.  The caller will
@@ -680,7 +1050,7 @@ void sync_inodes_sb(struct super_block *sb, int wait)
 	} else
 		wbc.nr_to_write = LONG_MAX; /* doesn't actually matter */
 
-	sync_sb_inodes(sb, &wbc);
+	generic_sync_sb_inodes(sb, &wbc);
 }
 
 /**
@@ -722,7 +1092,7 @@ EXPORT_SYMBOL(write_inode_now);
  * @wbc: controls the writeback mode
  *
  * sync_inode() will write an inode and its pages to disk.  It will also
- * correctly update the inode on its superblock's dirty inode lists and will
+ * correctly update the inode on its bdi's dirty inode lists and will
  * update inode->i_state.
  *
  * The caller must have a ref on the inode.
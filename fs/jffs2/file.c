@@ -26,6 +26,8 @@ static int jffs2_write_begin(struct file *filp, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned flags,
 			struct page **pagep, void **fsdata);
 static int jffs2_readpage (struct file *filp, struct page *pg);
+static int jffs2_readpages(struct file *filp, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages);
 
 int jffs2_fsync(struct file *filp, struct dentry *dentry, int datasync)
 {
@@ -67,6 +69,7 @@ const struct inode_operations jffs2_file_inode_operations =
 const struct address_space_operations jffs2_file_address_operations =
 {
 	.readpage =	jffs2_readpage,
+	.readpages =	jffs2_readpages,
 	.write_begin =	jffs2_write_begin,
 	.write_end =	jffs2_write_end,
 };
@@ -121,6 +124,66 @@ static int jffs2_readpage (struct file *filp, struct page *pg)
 	return ret;
 }
 
+/* Largest run of consecutive pages handed to jffs2_read_inode_pages() */
+#define JFFS2_READPAGES_BATCH	32
+
+static void jffs2_readpage_batch(struct inode *inode, struct page **pages, int nr)
+{
+	struct jffs2_inode_info *f = JFFS2_INODE_INFO(inode);
+	struct jffs2_sb_info *c = JFFS2_SB_INFO(inode->i_sb);
+	int i, ret;
+
+	ret = jffs2_read_inode_pages(c, f, pages, nr);
+
+	for (i = 0; i < nr; i++) {
+		/* On failure, fall back to reading page by page so that
+		   only the pages which really can't be read get an error */
+		if (ret) {
+			jffs2_do_readpage_nolock(inode, pages[i]);
+		} else {
+			flush_dcache_page(pages[i]);
+			SetPageUptodate(pages[i]);
+			ClearPageError(pages[i]);
+		}
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+}
+
+static int jffs2_readpages(struct file *filp, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct jffs2_inode_info *f = JFFS2_INODE_INFO(inode);
+	struct page *batch[JFFS2_READPAGES_BATCH];
+	struct page *pg;
+	int nr = 0;
+
+	D1(printk(KERN_DEBUG "jffs2_readpages(): ino #%lu, %u pages\n", inode->i_ino, nr_pages));
+
+	mutex_lock(&f->sem);
+	while (!list_empty(pages)) {
+		pg = list_entry(pages->prev, struct page, lru);
+		list_del(&pg->lru);
+		if (add_to_page_cache_lru(pg, mapping, pg->index, GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (nr == JFFS2_READPAGES_BATCH ||
+		    (nr && pg->index != batch[nr - 1]->index + 1)) {
+			jffs2_readpage_batch(inode, batch, nr);
+			nr = 0;
+		}
+		batch[nr++] = pg;
+	}
+	if (nr)
+		jffs2_readpage_batch(inode, batch, nr);
+	mutex_unlock(&f->sem);
+
+	return 0;
+}
+
 static int jffs2_write_begin(struct file *filp, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned flags,
 			struct page **pagep, void **fsdata)
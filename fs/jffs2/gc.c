@@ -112,6 +112,30 @@ again:
 	return ret;
 }
 
+/* Find an inode which has live nodes in the given block but has not been
+ * CRC-checked yet, and so would stop us garbage collecting the block.
+ * Called with erase_completion_lock held.
+ */
+static struct jffs2_inode_cache *jffs2_gc_unchecked_ino(struct jffs2_eraseblock *jeb)
+{
+	struct jffs2_raw_node_ref *raw;
+	struct jffs2_inode_cache *ic;
+
+	for (raw = jeb->first_node; raw; raw = ref_next(raw)) {
+		if (ref_obsolete(raw) || !raw->next_in_ino)
+			continue;
+
+		ic = jffs2_raw_ref_to_ic(raw);
+		if (ic->class != RAWNODE_CLASS_INODE_CACHE)
+			continue;
+
+		if (ic->state != INO_STATE_CHECKEDABSENT &&
+		    ic->state != INO_STATE_PRESENT)
+			return ic;
+	}
+	return NULL;
+}
+
 /* jffs2_garbage_collect_pass
  * Make a single attempt to progress GC. Move one node, and possibly
  * start erasing one eraseblock.
@@ -124,7 +148,7 @@ int jffs2_garbage_collect_pass(struct jffs2_sb_info *c)
 	struct jffs2_raw_node_ref *raw;
 	uint32_t gcblock_dirty;
 	int ret = 0, inum, nlink;
-	int xattr = 0;
+	int xattr = 0, targeted;
 
 	if (mutex_lock_interruptible(&c->alloc_sem))
 		return -EINTR;
@@ -152,13 +176,42 @@ int jffs2_garbage_collect_pass(struct jffs2_sb_info *c)
 		if (!xattr)
 			xattr = jffs2_verify_xattr(c);
 
+		/* The GC thread checks every inode in turn. Anyone else is
+		   here because they need space now, and shouldn't have to
+		   wait for the whole medium to be checked: just check the
+		   inodes with nodes in the block we are going to collect,
+		   and collect it as soon as they are done. */
+		ic = NULL;
+		if (current != c->gc_task) {
+			spin_lock(&c->erase_completion_lock);
+			jeb = c->gcblock;
+			if (!jeb)
+				jeb = jffs2_find_gc_block(c);
+			if (jeb) {
+				ic = jffs2_gc_unchecked_ino(jeb);
+				if (!ic) {
+					D1(printk(KERN_DEBUG "All inodes in block at 0x%08x checked. Collecting it\n",
+						  jeb->offset));
+					break;
+				}
+				/* Unlinked inodes are never checked. Leave
+				   them to be obsoleted in the usual way. */
+				if (!ic->pino_nlink)
+					ic = NULL;
+			}
+			spin_unlock(&c->erase_completion_lock);
+		}
+		targeted = (ic != NULL);
+
 		spin_lock(&c->inocache_lock);
 
-		ic = jffs2_get_ino_cache(c, c->checked_ino++);
+		if (!targeted) {
+			ic = jffs2_get_ino_cache(c, c->checked_ino++);
 
-		if (!ic) {
-			spin_unlock(&c->inocache_lock);
-			continue;
+			if (!ic) {
+				spin_unlock(&c->inocache_lock);
+				continue;
+			}
 		}
 
 		if (!ic->pino_nlink) {
@@ -188,7 +241,8 @@ int jffs2_garbage_collect_pass(struct jffs2_sb_info *c)
 			D1(printk(KERN_DEBUG "Waiting for ino #%u to finish reading\n", ic->ino));
 			/* We need to come back again for the _same_ inode. We've
 			 made no progress in this case, but that should be OK */
-			c->checked_ino--;
+			if (!targeted)
+				c->checked_ino--;
 
 			mutex_unlock(&c->alloc_sem);
 			sleep_on_spinunlock(&c->inocache_wq, &c->inocache_lock);
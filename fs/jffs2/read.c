@@ -13,6 +13,7 @@
 #include <linux/slab.h>
 #include <linux/crc32.h>
 #include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/mtd/mtd.h>
 #include <linux/compiler.h>
 #include "nodelist.h"
@@ -214,3 +215,225 @@ int jffs2_read_inode_range(struct jffs2_sb_info *c, struct jffs2_inode_info *f,
 	return 0;
 }
 
+
+/* Nodes which follow each other on the flash are fetched with a single
+   read of up to this many bytes by jffs2_read_inode_pages() */
+#define JFFS2_BULK_READ_MAX	(32 * 1024)
+
+struct jffs2_bulk_read {
+	unsigned char *buf;	/* Raw nodes read from the flash */
+	uint32_t ofs;		/* Flash offset of buf */
+	uint32_t len;
+	struct jffs2_full_dnode *fn;	/* Node whose data is at 'data' */
+	unsigned char *data;	/* NULL for a hole node */
+	uint32_t dsize;
+	unsigned char *dbuf;	/* Decompression buffer */
+	uint32_t dbuf_size;
+};
+
+/* Copy len bytes at file offset 'offset' into the pages, which start at
+   file offset 'base'. A NULL src fills with zeroes. */
+static void jffs2_fill_pages(struct page **pages, uint32_t base, uint32_t offset,
+			     const unsigned char *src, uint32_t len)
+{
+	while (len) {
+		uint32_t pgofs = (offset - base) & (PAGE_CACHE_SIZE - 1);
+		uint32_t n = min_t(uint32_t, len, PAGE_CACHE_SIZE - pgofs);
+		unsigned char *pg_buf;
+
+		pg_buf = kmap_atomic(pages[(offset - base) >> PAGE_CACHE_SHIFT], KM_USER0);
+		if (src) {
+			memcpy(pg_buf + pgofs, src, n);
+			src += n;
+		} else
+			memset(pg_buf + pgofs, 0, n);
+		kunmap_atomic(pg_buf, KM_USER0);
+
+		offset += n;
+		len -= n;
+	}
+}
+
+/* Read the node of 'frag', and as many of the nodes of the following frags
+   (up to 'end') as lie right behind it in the same eraseblock, in one go */
+static int jffs2_bulk_fetch(struct jffs2_sb_info *c, struct jffs2_bulk_read *br,
+			    struct jffs2_node_frag *frag, uint32_t end)
+{
+	struct jffs2_full_dnode *last = NULL;
+	uint32_t start = ref_offset(frag->node->raw);
+	uint32_t len = 0, totlen;
+	size_t retlen;
+	int ret;
+
+	spin_lock(&c->erase_completion_lock);
+	for (; frag && frag->ofs < end; frag = frag_next(frag)) {
+		if (!frag->node || frag->node == last)
+			continue;
+		if (ref_offset(frag->node->raw) != start + len ||
+		    (start + len) / c->sector_size != start / c->sector_size)
+			break;
+		totlen = ref_totlen(c, NULL, frag->node->raw);
+		if (len + totlen > JFFS2_BULK_READ_MAX)
+			break;
+		len += totlen;
+		last = frag->node;
+	}
+	spin_unlock(&c->erase_completion_lock);
+
+	br->fn = NULL;
+	br->len = 0;
+	if (!len)
+		return -E2BIG;
+
+	D1(printk(KERN_DEBUG "jffs2_bulk_fetch: reading 0x%x bytes at 0x%08x\n", len, start));
+	ret = jffs2_flash_read(c, start, len, &retlen, br->buf);
+	if (!ret && retlen != len)
+		ret = -EIO;
+	if (ret) {
+		printk(KERN_WARNING "Error reading nodes from 0x%08x: %d\n", start, ret);
+		return ret;
+	}
+
+	br->ofs = start;
+	br->len = len;
+	return 0;
+}
+
+/* Check and decompress a node which jffs2_bulk_fetch() has read */
+static int jffs2_bulk_decode(struct jffs2_sb_info *c, struct jffs2_inode_info *f,
+			     struct jffs2_bulk_read *br, struct jffs2_full_dnode *fn)
+{
+	uint32_t nodeofs = ref_offset(fn->raw) - br->ofs;
+	struct jffs2_raw_inode *ri = (struct jffs2_raw_inode *)(br->buf + nodeofs);
+	unsigned char *data = (unsigned char *)(ri + 1);
+	uint32_t crc, csize, dsize;
+	int ret;
+
+	br->fn = NULL;
+	if (nodeofs + sizeof(*ri) > br->len)
+		return -EIO;
+
+	crc = crc32(0, ri, sizeof(*ri)-8);
+	if (crc != je32_to_cpu(ri->node_crc)) {
+		printk(KERN_WARNING "Node CRC %08x != calculated CRC %08x for node at %08x\n",
+		       je32_to_cpu(ri->node_crc), crc, ref_offset(fn->raw));
+		return -EIO;
+	}
+	/* Hole nodes with csize/dsize swapped; see jffs2_read_dnode() */
+	if (ri->compr == JFFS2_COMPR_ZERO && !je32_to_cpu(ri->dsize) &&
+	    je32_to_cpu(ri->csize)) {
+		ri->dsize = ri->csize;
+		ri->csize = cpu_to_je32(0);
+	}
+	csize = je32_to_cpu(ri->csize);
+	dsize = je32_to_cpu(ri->dsize);
+
+	if (ri->compr == JFFS2_COMPR_ZERO) {
+		data = NULL;
+		goto out;
+	}
+
+	if (nodeofs + sizeof(*ri) + csize > br->len)
+		return -EIO;
+
+	crc = crc32(0, data, csize);
+	if (crc != je32_to_cpu(ri->data_crc)) {
+		printk(KERN_WARNING "Data CRC %08x != calculated CRC %08x for node at %08x\n",
+		       je32_to_cpu(ri->data_crc), crc, ref_offset(fn->raw));
+		return -EIO;
+	}
+
+	if (ri->compr != JFFS2_COMPR_NONE) {
+		if (dsize > br->dbuf_size) {
+			kfree(br->dbuf);
+			br->dbuf_size = 0;
+			br->dbuf = kmalloc(dsize, GFP_KERNEL);
+			if (!br->dbuf)
+				return -ENOMEM;
+			br->dbuf_size = dsize;
+		}
+		ret = jffs2_decompress(c, f, ri->compr | (ri->usercompr << 8), data, br->dbuf, csize, dsize);
+		if (ret) {
+			printk(KERN_WARNING "Error: jffs2_decompress returned %d\n", ret);
+			return ret;
+		}
+		data = br->dbuf;
+	} else if (csize < dsize)
+		return -EIO;
+
+ out:
+	br->fn = fn;
+	br->data = data;
+	br->dsize = dsize;
+	return 0;
+}
+
+/* Read a run of consecutive pages for readpages. Unlike calling
+   jffs2_read_inode_range() for each page, which does two flash reads
+   per node, nodes lying next to each other on the flash are read with a
+   single flash read, and each node is checked and decompressed only
+   once even when its data is needed by more than one of the pages. */
+int jffs2_read_inode_pages(struct jffs2_sb_info *c, struct jffs2_inode_info *f,
+			   struct page **pages, int nr_pages)
+{
+	uint32_t base = pages[0]->index << PAGE_CACHE_SHIFT;
+	uint32_t offset = base, end = base + (nr_pages << PAGE_CACHE_SHIFT);
+	struct jffs2_bulk_read br;
+	struct jffs2_node_frag *frag;
+	struct jffs2_full_dnode *fn;
+	uint32_t readlen, nodeofs;
+	int ret = 0;
+
+	D1(printk(KERN_DEBUG "jffs2_read_inode_pages: ino #%u, range 0x%08x-0x%08x\n",
+		  f->inocache->ino, offset, end));
+
+	memset(&br, 0, sizeof(br));
+	br.buf = kmalloc(JFFS2_BULK_READ_MAX, GFP_KERNEL);
+	if (!br.buf)
+		return -ENOMEM;
+
+	frag = jffs2_lookup_node_frag(&f->fragtree, offset);
+
+	while (offset < end) {
+		if (unlikely(!frag || frag->ofs > offset ||
+			     frag->ofs + frag->size <= offset)) {
+			uint32_t holesize = end - offset;
+			if (frag && frag->ofs > offset)
+				holesize = min(holesize, frag->ofs - offset);
+			jffs2_fill_pages(pages, base, offset, NULL, holesize);
+			offset += holesize;
+			continue;
+		}
+
+		readlen = min(end, frag->ofs + frag->size) - offset;
+		fn = frag->node;
+		if (!fn) {
+			jffs2_fill_pages(pages, base, offset, NULL, readlen);
+		} else {
+			if (fn != br.fn) {
+				if (ref_offset(fn->raw) < br.ofs ||
+				    ref_offset(fn->raw) >= br.ofs + br.len) {
+					ret = jffs2_bulk_fetch(c, &br, frag, end);
+					if (ret)
+						break;
+				}
+				ret = jffs2_bulk_decode(c, f, &br, fn);
+				if (ret)
+					break;
+			}
+			nodeofs = offset - fn->ofs;
+			if (nodeofs + readlen > br.dsize) {
+				ret = -EIO;
+				break;
+			}
+			jffs2_fill_pages(pages, base, offset,
+					 br.data ? br.data + nodeofs : NULL, readlen);
+		}
+		offset += readlen;
+		frag = frag_next(frag);
+	}
+
+	kfree(br.dbuf);
+	kfree(br.buf);
+	return ret;
+}
@@ -47,7 +47,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
-#include <linux/zlib.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -372,12 +373,222 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/* The lowest index page of a readahead list, see mm/readahead.c */
+#define list_to_page(head) (list_entry((head)->prev, struct page, lru))
+
+/*
+ * Number of page cache pages in datablock 'index' of the file.  This is
+ * less than the block size for the last block.
+ */
+static int squashfs_block_pages(struct inode *inode, int index)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	pgoff_t start_index = (pgoff_t) index << shift;
+	pgoff_t file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+					PAGE_CACHE_SHIFT;
+
+	return min_t(pgoff_t, 1 << shift, file_pages - start_index);
+}
+
+
+/*
+ * Map the pages of a datablock for squashfs_read_data(), which takes
+ * an array of page sized buffers.
+ */
+static void **squashfs_map_pages(struct page **page, int pages)
+{
+	void **data = kmalloc(pages * sizeof(*data), GFP_KERNEL);
+	int i;
+
+	if (data == NULL)
+		return NULL;
+
+#ifdef CONFIG_HIGHMEM
+	{
+		/*
+		 * A block can be up to 256 pages, too many to hold kmapped
+		 * at once by every reader, so map the block contiguously.
+		 */
+		void *addr = vmap(page, pages, VM_MAP, PAGE_KERNEL);
+
+		if (addr == NULL) {
+			kfree(data);
+			return NULL;
+		}
+		for (i = 0; i < pages; i++)
+			data[i] = addr + (i << PAGE_CACHE_SHIFT);
+	}
+#else
+	for (i = 0; i < pages; i++)
+		data[i] = page_address(page[i]);
+#endif
+
+	return data;
+}
+
+
+static void squashfs_unmap_pages(void **data)
+{
+#ifdef CONFIG_HIGHMEM
+	vunmap(data[0]);
+#endif
+	kfree(data);
+}
+
+
+/*
+ * Read datablock 'index' into its page cache pages.  page[] holds the
+ * locked pages of the block, with NULL for those that could not be
+ * grabbed or are already uptodate.  If all pages are present the block
+ * is decompressed straight into them, otherwise it is decompressed into
+ * the read_page cache and copied to the pages that are present.  All
+ * pages are unlocked and released.
+ */
+static void squashfs_read_block(struct inode *inode, int index,
+	struct page **page, int pages, int missing)
+{
+	struct super_block *sb = inode->i_sb;
+	struct squashfs_cache_entry *buffer;
+	void *pageaddr, **data;
+	u64 block = 0;
+	int i, avail, bsize, bytes, err = 0;
+
+	bsize = read_blocklist(inode, index, &block);
+	if (bsize < 0) {
+		err = bsize;
+		goto finish;
+	}
+
+	if (bsize == 0) { /* hole */
+		for (i = 0; i < pages; i++)
+			if (page[i])
+				zero_user(page[i], 0, PAGE_CACHE_SIZE);
+		goto finish;
+	}
+
+	data = missing ? NULL : squashfs_map_pages(page, pages);
+	if (data) {
+		bytes = squashfs_read_data(sb, data, block, bsize, NULL,
+			pages << PAGE_CACHE_SHIFT, pages);
+		if (bytes < 0)
+			err = bytes;
+		else
+			for (i = 0; i < pages; i++) {
+				avail = clamp_t(int, bytes -
+					(i << PAGE_CACHE_SHIFT), 0,
+					PAGE_CACHE_SIZE);
+				memset(data[i] + avail, 0,
+					PAGE_CACHE_SIZE - avail);
+			}
+		squashfs_unmap_pages(data);
+		goto finish;
+	}
+
+	buffer = squashfs_get_datablock(sb, block, bsize);
+	if (buffer->error)
+		err = -EIO;
+	else
+		for (i = 0; i < pages; i++) {
+			if (page[i] == NULL)
+				continue;
+			avail = clamp_t(int, buffer->length -
+				(i << PAGE_CACHE_SHIFT), 0, PAGE_CACHE_SIZE);
+			pageaddr = kmap_atomic(page[i], KM_USER0);
+			squashfs_copy_data(pageaddr, buffer,
+				i << PAGE_CACHE_SHIFT, avail);
+			memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
+			kunmap_atomic(pageaddr, KM_USER0);
+		}
+	squashfs_cache_put(buffer);
+
+finish:
+	if (err)
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL)
+			continue;
+		if (err)
+			SetPageError(page[i]);
+		else {
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		}
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+}
+
+
+/*
+ * Read the datablock containing the locked page 'target'.  As the
+ * datablock likely covers many PAGE_CACHE_SIZE pages (default block size
+ * is 128 KiB) the other pages of the block are filled too: they are
+ * taken from the readahead list if given, otherwise grabbed from the page
+ * cache if that can be done without blocking.  The target page is
+ * unlocked on return, the caller keeps its reference.
+ */
+static void squashfs_readpage_block(struct inode *inode, struct page *target,
+	struct list_head *readahead)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	struct address_space *mapping = inode->i_mapping;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int index = target->index >> shift;
+	pgoff_t n = (pgoff_t) index << shift;
+	int i, pages = squashfs_block_pages(inode, index), missing = 0;
+	struct page *push_page, **page;
+
+	page = kcalloc(pages, sizeof(*page), GFP_KERNEL);
+	if (page == NULL) {
+		SetPageError(target);
+		unlock_page(target);
+		return;
+	}
+
+	for (i = 0; i < pages; i++, n++) {
+		if (n == target->index) {
+			page_cache_get(target);
+			page[i] = target;
+			continue;
+		}
+
+		if (readahead && !list_empty(readahead) &&
+				list_to_page(readahead)->index == n) {
+			push_page = list_to_page(readahead);
+			list_del(&push_page->lru);
+			if (add_to_page_cache_lru(push_page, mapping, n,
+							GFP_KERNEL)) {
+				page_cache_release(push_page);
+				push_page = NULL;
+			}
+		} else
+			push_page = grab_cache_page_nowait(mapping, n);
+
+		if (push_page && PageUptodate(push_page)) {
+			unlock_page(push_page);
+			page_cache_release(push_page);
+			push_page = NULL;
+		}
+
+		page[i] = push_page;
+		if (push_page == NULL)
+			missing++;
+	}
+
+	squashfs_read_block(inode, index, page, pages, missing);
+	kfree(page);
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
-	struct squashfs_cache_entry *buffer = NULL;
+	int bytes, i, offset;
+	struct squashfs_cache_entry *buffer;
 	void *pageaddr;
 
 	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
@@ -396,63 +607,39 @@ static int squashfs_readpage(struct file *file, struct page *page)
 	if (index < file_end || squashfs_i(inode)->fragment_block ==
 					SQUASHFS_INVALID_BLK) {
 		/*
-		 * Reading a datablock from disk.  Need to read block list
-		 * to get location and block size.
-		 */
-		u64 block = 0;
-		int bsize = read_blocklist(inode, index, &block);
-		if (bsize < 0)
-			goto error_out;
-
-		if (bsize == 0) { /* hole */
-			bytes = index == file_end ?
-				(i_size_read(inode) & (msblk->block_size - 1)) :
-				 msblk->block_size;
-			sparse = 1;
-		} else {
-			/*
-			 * Read and decompress datablock.
-			 */
-			buffer = squashfs_get_datablock(inode->i_sb,
-								block, bsize);
-			if (buffer->error) {
-				ERROR("Unable to read page, block %llx, size %x"
-					"\n", block, bsize);
-				squashfs_cache_put(buffer);
-				goto error_out;
-			}
-			bytes = buffer->length;
-		}
-	} else {
-		/*
-		 * Datablock is stored inside a fragment (tail-end packed
-		 * block).
+		 * Reading a datablock from disk, straight into the page
+		 * cache.
 		 */
-		buffer = squashfs_get_fragment(inode->i_sb,
-				squashfs_i(inode)->fragment_block,
-				squashfs_i(inode)->fragment_size);
-
-		if (buffer->error) {
-			ERROR("Unable to read page, block %llx, size %x\n",
-				squashfs_i(inode)->fragment_block,
-				squashfs_i(inode)->fragment_size);
-			squashfs_cache_put(buffer);
-			goto error_out;
-		}
-		bytes = i_size_read(inode) & (msblk->block_size - 1);
-		offset = squashfs_i(inode)->fragment_offset;
+		squashfs_readpage_block(inode, page, NULL);
+		return 0;
+	}
+
+	/*
+	 * Datablock is stored inside a fragment (tail-end packed block).
+	 */
+	buffer = squashfs_get_fragment(inode->i_sb,
+			squashfs_i(inode)->fragment_block,
+			squashfs_i(inode)->fragment_size);
+
+	if (buffer->error) {
+		ERROR("Unable to read page, block %llx, size %x\n",
+			squashfs_i(inode)->fragment_block,
+			squashfs_i(inode)->fragment_size);
+		squashfs_cache_put(buffer);
+		goto error_out;
 	}
+	bytes = i_size_read(inode) & (msblk->block_size - 1);
+	offset = squashfs_i(inode)->fragment_offset;
 
 	/*
-	 * Loop copying datablock into pages.  As the datablock likely covers
-	 * many PAGE_CACHE_SIZE pages (default block size is 128 KiB) explicitly
-	 * grab the pages from the page cache, except for the page that we've
-	 * been called to fill.
+	 * Loop copying the fragment into pages.  Explicitly grab the pages
+	 * from the page cache, except for the page that we've been called to
+	 * fill.
 	 */
 	for (i = start_index; i <= end_index && bytes > 0; i++,
 			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
 		struct page *push_page;
-		int avail = sparse ? 0 : min_t(int, bytes, PAGE_CACHE_SIZE);
+		int avail = min_t(int, bytes, PAGE_CACHE_SIZE);
 
 		TRACE("bytes %d, i %d, available_bytes %d\n", bytes, i, avail);
 
@@ -477,8 +664,7 @@ skip_page:
 			page_cache_release(push_page);
 	}
 
-	if (!sparse)
-		squashfs_cache_put(buffer);
+	squashfs_cache_put(buffer);
 
 	return 0;
 
@@ -497,6 +683,42 @@ out:
 }
 
 
+/*
+ * Readahead.  Pages are taken off the list in index order, and each
+ * datablock is decompressed straight into the pages of the list that it
+ * covers, so sequential reads do not go through the read_page cache.
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	struct page *page;
+
+	while (!list_empty(pages)) {
+		page = list_to_page(pages);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+						GFP_KERNEL)) {
+			page_cache_release(page);
+			continue;
+		}
+
+		if ((page->index >> (msblk->block_log - PAGE_CACHE_SHIFT)) <
+				file_end || squashfs_i(inode)->fragment_block ==
+				SQUASHFS_INVALID_BLK)
+			squashfs_readpage_block(inode, page, pages);
+		else
+			squashfs_readpage(file, page);
+		page_cache_release(page);
+	}
+
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
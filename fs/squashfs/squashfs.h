@@ -51,6 +51,9 @@ extern struct squashfs_cache_entry *squashfs_get_datablock(struct super_block *,
 				u64, int);
 extern int squashfs_read_table(struct super_block *, void *, u64, int);
 
+/* decompressor.c */
+extern const struct squashfs_decompressor *squashfs_lookup_decompressor(int);
+
 /* export.c */
 extern __le64 *squashfs_read_inode_lookup_table(struct super_block *, u64,
 				unsigned int);
@@ -70,6 +73,13 @@ extern struct inode *squashfs_iget(struct super_block *, long long,
 				unsigned int);
 extern int squashfs_read_inode(struct inode *, long long);
 
+/* stream.c */
+extern int squashfs_streams_init(struct squashfs_sb_info *, int);
+extern void squashfs_streams_destroy(struct squashfs_sb_info *);
+extern struct squashfs_stream *squashfs_stream_get(struct squashfs_sb_info *);
+extern void squashfs_stream_put(struct squashfs_sb_info *,
+				struct squashfs_stream *);
+
 /*
  * Inodes and files operations
  */
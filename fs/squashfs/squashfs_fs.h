@@ -178,6 +178,9 @@
 /* cached data constants for filesystem */
 #define SQUASHFS_CACHED_BLKS		8
 
+/* max number of blocks decompressed in parallel (threads= mount option) */
+#define SQUASHFS_MAX_THREADS		64
+
 #define SQUASHFS_MAX_FILE_SIZE_LOG	64
 
 #define SQUASHFS_MAX_FILE_SIZE		(1LL << \
@@ -212,6 +215,8 @@ struct meta_index {
  * definitions for structures on disk
  */
 #define ZLIB_COMPRESSION	 1
+#define LZMA_COMPRESSION	 2
+#define LZO_COMPRESSION		 3
 
 struct squashfs_super_block {
 	__le32			s_magic;
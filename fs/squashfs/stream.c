@@ -0,0 +1,154 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * stream.c
+ */
+
+/*
+ * This file implements the pool of decompression streams.
+ *
+ * A stream is the private state of the filesystem's decompressor (see
+ * decompressor.h).  Each mounted filesystem owns a fixed number of streams
+ * (the threads= mount option, by default one per online CPU), allocated at
+ * mount time.
+ * A reader takes a free stream for the duration of one block read and
+ * decompression, and sleeps if all are in use.  Blocks read by different
+ * processes are therefore decompressed in parallel, up to the number of
+ * streams.
+ *
+ * A stream is held while waiting for the block's buffers to be read, so
+ * a pool (rather than per-CPU streams used with preemption disabled) is
+ * needed.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+#include "decompressor.h"
+
+static void squashfs_stream_free(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	squashfs_decompressor_free(msblk, stream->stream);
+	kfree(stream);
+}
+
+
+static struct squashfs_stream *squashfs_stream_alloc(
+	struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+
+	if (stream == NULL)
+		return NULL;
+
+	stream->stream = squashfs_decompressor_init(msblk);
+	if (stream->stream == NULL) {
+		kfree(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+
+/*
+ * Allocate 'threads' decompression streams.
+ */
+int squashfs_streams_init(struct squashfs_sb_info *msblk, int threads)
+{
+	struct squashfs_stream *stream;
+	int i;
+
+	spin_lock_init(&msblk->stream_lock);
+	INIT_LIST_HEAD(&msblk->stream_list);
+	init_waitqueue_head(&msblk->stream_wait);
+
+	for (i = 0; i < threads; i++) {
+		stream = squashfs_stream_alloc(msblk);
+		if (stream == NULL) {
+			squashfs_streams_destroy(msblk);
+			return -ENOMEM;
+		}
+		list_add(&stream->list, &msblk->stream_list);
+	}
+
+	msblk->threads = threads;
+	return 0;
+}
+
+
+/*
+ * Free all the streams.  They must all have been put back.
+ */
+void squashfs_streams_destroy(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+
+	while (!list_empty(&msblk->stream_list)) {
+		stream = list_entry(msblk->stream_list.next,
+			struct squashfs_stream, list);
+		list_del(&stream->list);
+		squashfs_stream_free(msblk, stream);
+	}
+}
+
+
+/*
+ * Get a free stream, sleeping until one is put back if all are in use.
+ */
+struct squashfs_stream *squashfs_stream_get(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+
+	spin_lock(&msblk->stream_lock);
+	while (list_empty(&msblk->stream_list)) {
+		spin_unlock(&msblk->stream_lock);
+		wait_event(msblk->stream_wait,
+			!list_empty(&msblk->stream_list));
+		spin_lock(&msblk->stream_lock);
+	}
+
+	stream = list_entry(msblk->stream_list.next, struct squashfs_stream,
+		list);
+	list_del(&stream->list);
+	spin_unlock(&msblk->stream_lock);
+
+	return stream;
+}
+
+
+void squashfs_stream_put(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	spin_lock(&msblk->stream_lock);
+	list_add(&stream->list, &msblk->stream_list);
+	spin_unlock(&msblk->stream_lock);
+
+	wake_up(&msblk->stream_wait);
+}
@@ -35,34 +35,96 @@
 #include <linux/pagemap.h>
 #include <linux/init.h>
 #include <linux/module.h>
-#include <linux/zlib.h>
 #include <linux/magic.h>
+#include <linux/mount.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
+#include "decompressor.h"
 
 static struct file_system_type squashfs_fs_type;
 static struct super_operations squashfs_super_ops;
 
-static int supported_squashfs_filesystem(short major, short minor, short comp)
+enum {
+	Opt_threads, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_threads, "threads=%u"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse the mount options.  threads=N sets the number of blocks that can
+ * be decompressed in parallel; each costs a decompression stream and a
+ * block sized data cache entry.  Unknown options are ignored, as they
+ * were before squashfs took any options.
+ */
+static int squashfs_parse_options(char *options, int *threads)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+
+		if (!*p)
+			continue;
+
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_threads:
+			if (match_int(&args[0], &option) || option < 1 ||
+					option > SQUASHFS_MAX_THREADS) {
+				ERROR("threads= must be between 1 and %d\n",
+					SQUASHFS_MAX_THREADS);
+				return -EINVAL;
+			}
+			*threads = option;
+			break;
+		default:
+			WARNING("Ignoring unrecognized mount option \"%s\"\n",
+				p);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
+static const struct squashfs_decompressor *supported_squashfs_filesystem(
+	short major, short minor, short id)
 {
+	const struct squashfs_decompressor *decompressor;
+
 	if (major < SQUASHFS_MAJOR) {
 		ERROR("Major/Minor mismatch, older Squashfs %d.%d "
 			"filesystems are unsupported\n", major, minor);
-		return -EINVAL;
+		return NULL;
 	} else if (major > SQUASHFS_MAJOR || minor > SQUASHFS_MINOR) {
 		ERROR("Major/Minor mismatch, trying to mount newer "
 			"%d.%d filesystem\n", major, minor);
 		ERROR("Please update your kernel\n");
-		return -EINVAL;
+		return NULL;
 	}
 
-	if (comp != ZLIB_COMPRESSION)
-		return -EINVAL;
+	decompressor = squashfs_lookup_decompressor(id);
+	if (!decompressor->supported) {
+		ERROR("Filesystem uses \"%s\" compression. This is not "
+			"supported\n", decompressor->name);
+		return NULL;
+	}
 
-	return 0;
+	return decompressor;
 }
 
 
@@ -76,10 +138,15 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	unsigned short flags;
 	unsigned int fragments;
 	u64 lookup_table_start;
+	int threads = min_t(int, num_online_cpus(), SQUASHFS_MAX_THREADS);
 	int err;
 
 	TRACE("Entered squashfs_fill_superblock\n");
 
+	err = squashfs_parse_options(data, &threads);
+	if (err)
+		return err;
+
 	sb->s_fs_info = kzalloc(sizeof(*msblk), GFP_KERNEL);
 	if (sb->s_fs_info == NULL) {
 		ERROR("Failed to allocate squashfs_sb_info\n");
@@ -87,13 +154,6 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	msblk = sb->s_fs_info;
 
-	msblk->stream.workspace = kmalloc(zlib_inflate_workspacesize(),
-		GFP_KERNEL);
-	if (msblk->stream.workspace == NULL) {
-		ERROR("Failed to allocate zlib workspace\n");
-		goto failure;
-	}
-
 	sblk = kzalloc(sizeof(*sblk), GFP_KERNEL);
 	if (sblk == NULL) {
 		ERROR("Failed to allocate squashfs_super_block\n");
@@ -103,7 +163,6 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	msblk->devblksize = sb_min_blocksize(sb, BLOCK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
 
 	/*
@@ -130,15 +189,16 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_mount;
 	}
 
-	/* Check the MAJOR & MINOR versions and compression type */
-	err = supported_squashfs_filesystem(le16_to_cpu(sblk->s_major),
+	err = -EINVAL;
+
+	/* Check the MAJOR & MINOR versions and lookup compression type */
+	msblk->decompressor = supported_squashfs_filesystem(
+			le16_to_cpu(sblk->s_major),
 			le16_to_cpu(sblk->s_minor),
 			le16_to_cpu(sblk->compression));
-	if (err < 0)
+	if (msblk->decompressor == NULL)
 		goto failed_mount;
 
-	err = -EINVAL;
-
 	/*
 	 * Check if there's xattrs in the filesystem.  These are not
 	 * supported in this version, so warn that they will be ignored.
@@ -205,13 +265,24 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	err = -ENOMEM;
 
+	/* The decompressor sizes its buffers from the block size */
+	if (squashfs_streams_init(msblk, threads)) {
+		ERROR("Failed to allocate %s decompressor\n",
+			msblk->decompressor->name);
+		goto failed_mount;
+	}
+
 	msblk->block_cache = squashfs_cache_init("metadata",
 			SQUASHFS_CACHED_BLKS, SQUASHFS_METADATA_SIZE);
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
-	/* Allocate read_page block */
-	msblk->read_page = squashfs_cache_init("data", 1, msblk->block_size);
+	/*
+	 * Allocate read_page blocks, one for each stream so that readers
+	 * of different blocks do not wait for each other's cache entry
+	 */
+	msblk->read_page = squashfs_cache_init("data", msblk->threads,
+		msblk->block_size);
 	if (msblk->read_page == NULL) {
 		ERROR("Failed to allocate read_page block\n");
 		goto failed_mount;
@@ -295,14 +366,14 @@ failed_mount:
 	kfree(msblk->inode_lookup_table);
 	kfree(msblk->fragment_index);
 	kfree(msblk->id_table);
-	kfree(msblk->stream.workspace);
+	if (msblk->threads)
+		squashfs_streams_destroy(msblk);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	kfree(sblk);
 	return err;
 
 failure:
-	kfree(msblk->stream.workspace);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 	return -ENOMEM;
@@ -330,13 +401,40 @@ static int squashfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 }
 
 
+/*
+ * The stream pool and data cache are sized at mount time, so threads=
+ * cannot change on remount.  It is still accepted with the current value,
+ * which is what mount(8) passes back from /proc/mounts.
+ */
 static int squashfs_remount(struct super_block *sb, int *flags, char *data)
 {
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	int threads = msblk->threads;
+	int err;
+
+	err = squashfs_parse_options(data, &threads);
+	if (err)
+		return err;
+
+	if (threads != msblk->threads) {
+		ERROR("threads= cannot be changed on remount\n");
+		return -EINVAL;
+	}
+
 	*flags |= MS_RDONLY;
 	return 0;
 }
 
 
+static int squashfs_show_options(struct seq_file *seq, struct vfsmount *mnt)
+{
+	struct squashfs_sb_info *msblk = mnt->mnt_sb->s_fs_info;
+
+	seq_printf(seq, ",threads=%d", msblk->threads);
+	return 0;
+}
+
+
 static void squashfs_put_super(struct super_block *sb)
 {
 	lock_kernel();
@@ -349,7 +447,7 @@ static void squashfs_put_super(struct super_block *sb)
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
 		kfree(sbi->meta_index);
-		kfree(sbi->stream.workspace);
+		squashfs_streams_destroy(sbi);
 		kfree(sb->s_fs_info);
 		sb->s_fs_info = NULL;
 	}
@@ -449,7 +547,8 @@ static struct super_operations squashfs_super_ops = {
 	.destroy_inode = squashfs_destroy_inode,
 	.statfs = squashfs_statfs,
 	.put_super = squashfs_put_super,
-	.remount_fs = squashfs_remount
+	.remount_fs = squashfs_remount,
+	.show_options = squashfs_show_options
 };
 
 module_init(init_squashfs_fs);
@@ -25,9 +25,15 @@
 /*
  * This file provides a single place to access to compression and
  * decompression.
+ *
+ * Data written back is compressed in batches (see 'ubifs_compress_reqs()'),
+ * which are split between per-CPU workers of the @compr_wq workqueue, so that
+ * write-back is not limited by the speed of one CPU.
  */
 
 #include <linux/crypto.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
 #include "ubifs.h"
 
 /* Fake description object for the "none" compressor */
@@ -38,11 +44,8 @@ static struct ubifs_compressor none_compr = {
 };
 
 #ifdef CONFIG_UBIFS_FS_LZO
-static DEFINE_MUTEX(lzo_mutex);
-
 static struct ubifs_compressor lzo_compr = {
 	.compr_type = UBIFS_COMPR_LZO,
-	.comp_mutex = &lzo_mutex,
 	.name = "lzo",
 	.capi_name = "lzo",
 };
@@ -54,12 +57,10 @@ static struct ubifs_compressor lzo_compr = {
 #endif
 
 #ifdef CONFIG_UBIFS_FS_ZLIB
-static DEFINE_MUTEX(deflate_mutex);
 static DEFINE_MUTEX(inflate_mutex);
 
 static struct ubifs_compressor zlib_compr = {
 	.compr_type = UBIFS_COMPR_ZLIB,
-	.comp_mutex = &deflate_mutex,
 	.decomp_mutex = &inflate_mutex,
 	.name = "zlib",
 	.capi_name = "deflate",
@@ -71,9 +72,67 @@ static struct ubifs_compressor zlib_compr = {
 };
 #endif
 
+#ifdef CONFIG_UBIFS_FS_LZ4
+static struct ubifs_compressor lz4_compr = {
+	.compr_type = UBIFS_COMPR_LZ4,
+	.name = "lz4",
+	.capi_name = "lz4",
+};
+#else
+static struct ubifs_compressor lz4_compr = {
+	.compr_type = UBIFS_COMPR_LZ4,
+	.name = "lz4",
+};
+#endif
+
 /* All UBIFS compressors */
 struct ubifs_compressor *ubifs_compressors[UBIFS_COMPR_TYPES_CNT];
 
+/* Workqueue of the compression workers */
+static struct workqueue_struct *compr_wq;
+
+/**
+ * struct compr_work - part of a batch of compression requests.
+ * @work: the work item
+ * @reqs: the compression requests
+ * @cnt: count of elements in @reqs
+ */
+struct compr_work {
+	struct work_struct work;
+	struct ubifs_compr_req *reqs;
+	int cnt;
+};
+
+/**
+ * get_comp_cc - get a free compression handle.
+ * @compr: compressor description object
+ *
+ * Returns %NULL if all handles are in use.
+ */
+static struct crypto_comp *get_comp_cc(struct ubifs_compressor *compr)
+{
+	struct crypto_comp *cc = NULL;
+
+	spin_lock(&compr->comp_lock);
+	if (compr->comp_free)
+		cc = compr->comp_ccs[--compr->comp_free];
+	spin_unlock(&compr->comp_lock);
+	return cc;
+}
+
+/**
+ * put_comp_cc - return a compression handle.
+ * @compr: compressor description object
+ * @cc: the handle to return
+ */
+static void put_comp_cc(struct ubifs_compressor *compr, struct crypto_comp *cc)
+{
+	spin_lock(&compr->comp_lock);
+	compr->comp_ccs[compr->comp_free++] = cc;
+	spin_unlock(&compr->comp_lock);
+	wake_up(&compr->comp_wait);
+}
+
 /**
  * ubifs_compress - compress data.
  * @in_buf: data to compress
@@ -97,6 +156,7 @@ void ubifs_compress(const void *in_buf, int in_len, void *out_buf, int *out_len,
 {
 	int err;
 	struct ubifs_compressor *compr = ubifs_compressors[*compr_type];
+	struct crypto_comp *cc;
 
 	if (*compr_type == UBIFS_COMPR_NONE)
 		goto no_compr;
@@ -105,12 +165,10 @@ void ubifs_compress(const void *in_buf, int in_len, void *out_buf, int *out_len,
 	if (in_len < UBIFS_MIN_COMPR_LEN)
 		goto no_compr;
 
-	if (compr->comp_mutex)
-		mutex_lock(compr->comp_mutex);
-	err = crypto_comp_compress(compr->cc, in_buf, in_len, out_buf,
+	wait_event(compr->comp_wait, (cc = get_comp_cc(compr)));
+	err = crypto_comp_compress(cc, in_buf, in_len, out_buf,
 				   (unsigned int *)out_len);
-	if (compr->comp_mutex)
-		mutex_unlock(compr->comp_mutex);
+	put_comp_cc(compr, cc);
 	if (unlikely(err)) {
 		ubifs_warn("cannot compress %d bytes, compressor %s, "
 			   "error %d, leave data uncompressed",
@@ -133,6 +191,74 @@ no_compr:
 	*compr_type = UBIFS_COMPR_NONE;
 }
 
+/**
+ * compr_worker - compression worker.
+ * @work: the &struct compr_work to do
+ */
+static void compr_worker(struct work_struct *work)
+{
+	struct compr_work *cw = container_of(work, struct compr_work, work);
+	struct ubifs_compr_req *req;
+
+	for (req = cw->reqs; req < cw->reqs + cw->cnt; req++)
+		ubifs_compress(req->in_buf, req->in_len, req->out_buf,
+			       &req->out_len, &req->compr_type);
+}
+
+/**
+ * ubifs_compress_reqs - compress a batch of data.
+ * @reqs: compression requests
+ * @cnt: count of elements in @reqs
+ *
+ * This function does the same as calling 'ubifs_compress()' for each element
+ * of @reqs, but splits the work between the current CPU and the compression
+ * workers of other online CPUs. It returns when all the requests are done.
+ */
+void ubifs_compress_reqs(struct ubifs_compr_req *reqs, int cnt)
+{
+	int i, n, per, cpu, this_cpu, queued;
+	struct compr_work *cw;
+
+	n = min_t(int, num_online_cpus(), UBIFS_MAX_COMPR_WORKERS);
+	n = min(n, cnt);
+	cw = n > 1 ? kmalloc(n * sizeof(struct compr_work), GFP_NOFS) : NULL;
+	if (!cw) {
+		for (i = 0; i < cnt; i++)
+			ubifs_compress(reqs[i].in_buf, reqs[i].in_len,
+				       reqs[i].out_buf, &reqs[i].out_len,
+				       &reqs[i].compr_type);
+		return;
+	}
+
+	per = DIV_ROUND_UP(cnt, n);
+	n = DIV_ROUND_UP(cnt, per);
+	for (i = 0; i < n; i++) {
+		INIT_WORK(&cw[i].work, compr_worker);
+		cw[i].reqs = reqs + i * per;
+		cw[i].cnt = min(per, cnt - i * per);
+	}
+
+	/* The first part is done by the caller, the others by other CPUs */
+	get_online_cpus();
+	this_cpu = raw_smp_processor_id();
+	queued = 1;
+	for_each_online_cpu(cpu) {
+		if (queued == n)
+			break;
+		if (cpu != this_cpu)
+			queue_work_on(cpu, compr_wq, &cw[queued++].work);
+	}
+
+	/* If a CPU has gone off-line meanwhile, its part is done here too */
+	compr_worker(&cw[0].work);
+	for (i = queued; i < n; i++)
+		compr_worker(&cw[i].work);
+	for (i = 1; i < queued; i++)
+		flush_work(&cw[i].work);
+	put_online_cpus();
+	kfree(cw);
+}
+
 /**
  * ubifs_decompress - decompress data.
  * @in_buf: data to decompress
@@ -191,6 +317,12 @@ int ubifs_decompress(const void *in_buf, int in_len, void *out_buf,
  */
 static int __init compr_init(struct ubifs_compressor *compr)
 {
+	int n = min_t(int, num_online_cpus(), UBIFS_MAX_COMPR_WORKERS);
+	struct crypto_comp *cc;
+
+	spin_lock_init(&compr->comp_lock);
+	init_waitqueue_head(&compr->comp_wait);
+
 	if (compr->capi_name) {
 		compr->cc = crypto_alloc_comp(compr->capi_name, 0, 0);
 		if (IS_ERR(compr->cc)) {
@@ -198,6 +330,24 @@ static int __init compr_init(struct ubifs_compressor *compr)
 				  compr->name, PTR_ERR(compr->cc));
 			return PTR_ERR(compr->cc);
 		}
+
+		compr->comp_ccs = kmalloc(n * sizeof(struct crypto_comp *),
+					  GFP_KERNEL);
+		if (!compr->comp_ccs) {
+			crypto_free_comp(compr->cc);
+			return -ENOMEM;
+		}
+
+		/* Extra handles only add parallelism, so failures are fine */
+		compr->comp_ccs[0] = compr->cc;
+		compr->comp_cnt = 1;
+		while (compr->comp_cnt < n) {
+			cc = crypto_alloc_comp(compr->capi_name, 0, 0);
+			if (IS_ERR(cc))
+				break;
+			compr->comp_ccs[compr->comp_cnt++] = cc;
+		}
+		compr->comp_free = compr->comp_cnt;
 	}
 
 	ubifs_compressors[compr->compr_type] = compr;
@@ -210,8 +360,14 @@ static int __init compr_init(struct ubifs_compressor *compr)
  */
 static void compr_exit(struct ubifs_compressor *compr)
 {
-	if (compr->capi_name)
-		crypto_free_comp(compr->cc);
+	int i;
+
+	if (compr->capi_name) {
+		ubifs_assert(compr->comp_free == compr->comp_cnt);
+		for (i = 0; i < compr->comp_cnt; i++)
+			crypto_free_comp(compr->comp_ccs[i]);
+		kfree(compr->comp_ccs);
+	}
 	return;
 }
 
@@ -225,19 +381,31 @@ int __init ubifs_compressors_init(void)
 {
 	int err;
 
+	compr_wq = create_workqueue("ubifs_compr");
+	if (!compr_wq)
+		return -ENOMEM;
+
 	err = compr_init(&lzo_compr);
 	if (err)
-		return err;
+		goto out_wq;
 
 	err = compr_init(&zlib_compr);
 	if (err)
 		goto out_lzo;
 
+	err = compr_init(&lz4_compr);
+	if (err)
+		goto out_zlib;
+
 	ubifs_compressors[UBIFS_COMPR_NONE] = &none_compr;
 	return 0;
 
+out_zlib:
+	compr_exit(&zlib_compr);
 out_lzo:
 	compr_exit(&lzo_compr);
+out_wq:
+	destroy_workqueue(compr_wq);
 	return err;
 }
 
@@ -248,4 +416,6 @@ void ubifs_compressors_exit(void)
 {
 	compr_exit(&lzo_compr);
 	compr_exit(&zlib_compr);
+	compr_exit(&lz4_compr);
+	destroy_workqueue(compr_wq);
 }
@@ -258,6 +258,8 @@ void dbg_dump_inode(const struct ubifs_info *c, const struct inode *inode)
 	printk(KERN_DEBUG "\tcompr_type     %d\n", ui->compr_type);
 	printk(KERN_DEBUG "\tlast_page_read %lu\n", ui->last_page_read);
 	printk(KERN_DEBUG "\tread_in_a_row  %lu\n", ui->read_in_a_row);
+	printk(KERN_DEBUG "\tcompr_fails    %d\n", ui->compr_fails);
+	printk(KERN_DEBUG "\tcompr_skip     %d\n", ui->compr_skip);
 	printk(KERN_DEBUG "\tdata_len       %d\n", ui->data_len);
 }
 
@@ -2533,6 +2535,67 @@ static const struct file_operations dfs_fops = {
 	.owner = THIS_MODULE,
 };
 
+/**
+ * dbg_compr_done - account a data node UBIFS tried to compress.
+ * @c: UBIFS file-system description object
+ * @in_len: length of the data
+ * @out_len: length of the data written
+ * @compr_type: compression type used (%UBIFS_COMPR_NONE if the data did not
+ *              compress)
+ */
+void dbg_compr_done(struct ubifs_info *c, int in_len, int out_len,
+		    int compr_type)
+{
+	struct ubifs_debug_info *d = c->dbg;
+
+	atomic_long_inc(&d->compr_cnt);
+	if (compr_type == UBIFS_COMPR_NONE)
+		atomic_long_inc(&d->compr_fail_cnt);
+	atomic_long_add(in_len, &d->compr_in_bytes);
+	atomic_long_add(out_len, &d->compr_out_bytes);
+}
+
+/**
+ * dbg_compr_skipped - account a data node written without trying to compress.
+ * @c: UBIFS file-system description object
+ */
+void dbg_compr_skipped(struct ubifs_info *c)
+{
+	atomic_long_inc(&c->dbg->compr_skip_cnt);
+}
+
+static ssize_t read_compr_stats(struct file *file, char __user *u,
+				size_t count, loff_t *ppos)
+{
+	struct ubifs_info *c = file->private_data;
+	struct ubifs_debug_info *d = c->dbg;
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf),
+		       "compressor:      %s\n"
+		       "adaptive:        %d\n"
+		       "compressed:      %ld\n"
+		       "not compressed:  %ld\n"
+		       "skipped:         %ld\n"
+		       "bytes in:        %ld\n"
+		       "bytes out:       %ld\n",
+		       ubifs_compr_name(c->default_compr), c->adaptive_compr,
+		       atomic_long_read(&d->compr_cnt) -
+		       atomic_long_read(&d->compr_fail_cnt),
+		       atomic_long_read(&d->compr_fail_cnt),
+		       atomic_long_read(&d->compr_skip_cnt),
+		       atomic_long_read(&d->compr_in_bytes),
+		       atomic_long_read(&d->compr_out_bytes));
+	return simple_read_from_buffer(u, count, ppos, buf, len);
+}
+
+static const struct file_operations dfs_compr_fops = {
+	.open = open_debugfs_file,
+	.read = read_compr_stats,
+	.owner = THIS_MODULE,
+};
+
 /**
  * dbg_debugfs_init_fs - initialize debugfs for UBIFS instance.
  * @c: UBIFS file-system description object
@@ -2579,6 +2642,13 @@ int dbg_debugfs_init_fs(struct ubifs_info *c)
 		goto out_remove;
 	d->dfs_dump_tnc = dent;
 
+	fname = "compr_stats";
+	dent = debugfs_create_file(fname, S_IRUSR, d->dfs_dir, c,
+				   &dfs_compr_fops);
+	if (IS_ERR(dent))
+		goto out_remove;
+	d->dfs_compr_stats = dent;
+
 	return 0;
 
 out_remove:
@@ -52,6 +52,15 @@
  * dfs_dump_lprops: "dump lprops" debugfs knob
  * dfs_dump_budg: "dump budgeting information" debugfs knob
  * dfs_dump_tnc: "dump TNC" debugfs knob
+ * dfs_compr_stats: "compression statistics" debugfs file
+ *
+ * @compr_cnt: count of data nodes UBIFS tried to compress
+ * @compr_fail_cnt: count of data nodes which did not compress and were
+ *                  written uncompressed
+ * @compr_skip_cnt: count of data nodes written uncompressed without trying to
+ *                  compress them (see 'data_compr_type()')
+ * @compr_in_bytes: amount of data UBIFS tried to compress
+ * @compr_out_bytes: amount of data written for @compr_in_bytes
  */
 struct ubifs_debug_info {
 	void *buf;
@@ -79,6 +88,13 @@ struct ubifs_debug_info {
 	struct dentry *dfs_dump_lprops;
 	struct dentry *dfs_dump_budg;
 	struct dentry *dfs_dump_tnc;
+	struct dentry *dfs_compr_stats;
+
+	atomic_long_t compr_cnt;
+	atomic_long_t compr_fail_cnt;
+	atomic_long_t compr_skip_cnt;
+	atomic_long_t compr_in_bytes;
+	atomic_long_t compr_out_bytes;
 };
 
 #define ubifs_assert(expr) do {                                                \
@@ -380,6 +396,11 @@ void dbg_debugfs_exit(void);
 int dbg_debugfs_init_fs(struct ubifs_info *c);
 void dbg_debugfs_exit_fs(struct ubifs_info *c);
 
+/* Compression statistics */
+void dbg_compr_done(struct ubifs_info *c, int in_len, int out_len,
+		    int compr_type);
+void dbg_compr_skipped(struct ubifs_info *c);
+
 #else /* !CONFIG_UBIFS_FS_DEBUG */
 
 /* Use "if (0)" to make compiler check arguments even if debugging is off */
@@ -464,6 +485,9 @@ void dbg_debugfs_exit_fs(struct ubifs_info *c);
 #define dbg_force_in_the_gaps()                    0
 #define dbg_failure_mode                           0
 
+#define dbg_compr_done(c, in_len, out_len, type)   ({})
+#define dbg_compr_skipped(c)                       ({})
+
 #define dbg_debugfs_init()                         0
 #define dbg_debugfs_exit()
 #define dbg_debugfs_init_fs(c)                     0
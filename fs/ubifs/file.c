@@ -54,6 +54,7 @@
 #include "ubifs.h"
 #include <linux/mount.h>
 #include <linux/namei.h>
+#include <linux/writeback.h>
 
 static int read_block(struct inode *inode, void *addr, unsigned int block,
 		      struct ubifs_data_node *dn)
@@ -889,6 +890,39 @@ static int ubifs_readpage(struct file *file, struct page *page)
 	return 0;
 }
 
+/**
+ * finish_writepage - finish write-back of a page.
+ * @c: UBIFS file-system description object
+ * @page: the page
+ * @err: result of writing the page
+ *
+ * This function releases the page budget, unlocks the page and ends its
+ * write-back.
+ */
+static void finish_writepage(struct ubifs_info *c, struct page *page, int err)
+{
+	if (err) {
+		SetPageError(page);
+		ubifs_err("cannot write page %lu of inode %lu, error %d",
+			  page->index, page->mapping->host->i_ino, err);
+		ubifs_ro_mode(c, err);
+	}
+
+	ubifs_assert(PagePrivate(page));
+	if (PageChecked(page))
+		release_new_page_budget(c);
+	else
+		release_existing_page_budget(c);
+
+	atomic_long_dec(&c->dirty_pg_cnt);
+	ClearPagePrivate(page);
+	ClearPageChecked(page);
+
+	kunmap(page);
+	unlock_page(page);
+	end_page_writeback(page);
+}
+
 static int do_writepage(struct page *page, int len)
 {
 	int err = 0, i, blen;
@@ -922,29 +956,94 @@ static int do_writepage(struct page *page, int len)
 		addr += blen;
 		len -= blen;
 	}
-	if (err) {
-		SetPageError(page);
-		ubifs_err("cannot write page %lu of inode %lu, error %d",
-			  page->index, inode->i_ino, err);
-		ubifs_ro_mode(c, err);
+	finish_writepage(c, page, err);
+	return err;
+}
+
+/**
+ * struct wp_batch - batch of pages to write-back.
+ * @pages: the pages, locked and in index order
+ * @lens: how many bytes of each page to write
+ * @cnt: count of pages in the batch
+ * @done_index: index following the last page queued
+ * @blks: data blocks of the pages
+ */
+struct wp_batch {
+	struct page *pages[UBIFS_WRITEPAGES_BATCH];
+	int lens[UBIFS_WRITEPAGES_BATCH];
+	int cnt;
+	pgoff_t done_index;
+	struct ubifs_data_blk blks[UBIFS_WRITEPAGES_BATCH *
+				   UBIFS_BLOCKS_PER_PAGE];
+};
+
+/**
+ * write_batch - write-back a batch of pages.
+ * @inode: inode the pages belong to
+ * @b: the batch
+ *
+ * This function is the same as calling 'do_writepage()' for each page of the
+ * batch, but the data of all the pages is compressed in parallel. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+static int write_batch(struct inode *inode, struct wp_batch *b)
+{
+	int err, i, n = 0, blen, len, written;
+	unsigned int block;
+	void *addr;
+	struct ubifs_info *c = inode->i_sb->s_fs_info;
+
+	for (i = 0; i < b->cnt; i++) {
+		struct page *page = b->pages[i];
+
+		set_page_writeback(page);
+		addr = kmap(page);
+		block = page->index << UBIFS_BLOCKS_PER_PAGE_SHIFT;
+		len = b->lens[i];
+		while (len) {
+			blen = min_t(int, len, UBIFS_BLOCK_SIZE);
+			data_key_init(c, &b->blks[n].key, inode->i_ino, block);
+			b->blks[n].buf = addr;
+			b->blks[n].len = blen;
+			n += 1;
+			block += 1;
+			addr += blen;
+			len -= blen;
+		}
 	}
 
-	ubifs_assert(PagePrivate(page));
-	if (PageChecked(page))
-		release_new_page_budget(c);
-	else
-		release_existing_page_budget(c);
+	err = ubifs_jnl_write_data_blks(c, inode, b->blks, n, &written);
 
-	atomic_long_dec(&c->dirty_pg_cnt);
-	ClearPagePrivate(page);
-	ClearPageChecked(page);
+	/* A page is written only if all its blocks have been written */
+	for (i = 0; i < b->cnt; i++) {
+		n = DIV_ROUND_UP(b->lens[i], UBIFS_BLOCK_SIZE);
+		finish_writepage(c, b->pages[i], written >= n ? 0 : err);
+		written -= n;
+	}
 
-	kunmap(page);
-	unlock_page(page);
-	end_page_writeback(page);
+	b->cnt = 0;
 	return err;
 }
 
+/**
+ * queue_writepage - write-back a page or add it to a batch.
+ * @page: the page to write
+ * @len: how many bytes of the page to write
+ * @b: batch to add the page to, or %NULL to write it right away
+ */
+static int queue_writepage(struct page *page, int len, struct wp_batch *b)
+{
+	if (!b)
+		return do_writepage(page, len);
+
+	b->pages[b->cnt] = page;
+	b->lens[b->cnt++] = len;
+	b->done_index = page->index + 1;
+	if (b->cnt == UBIFS_WRITEPAGES_BATCH)
+		return write_batch(page->mapping->host, b);
+	return 0;
+}
+
 /*
  * When writing-back dirty inodes, VFS first writes-back pages belonging to the
  * inode, then the inode itself. For UBIFS this may cause a problem. Consider a
@@ -987,7 +1086,8 @@ static int do_writepage(struct page *page, int len)
  * on the page lock and it would not write the truncated inode node to the
  * journal before we have finished.
  */
-static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
+static int writepage(struct page *page, struct writeback_control *wbc,
+		     void *batch)
 {
 	struct inode *inode = page->mapping->host;
 	struct ubifs_inode *ui = ubifs_inode(inode);
@@ -1025,7 +1125,7 @@ static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
 			 * with this.
 			 */
 		}
-		return do_writepage(page, PAGE_CACHE_SIZE);
+		return queue_writepage(page, PAGE_CACHE_SIZE, batch);
 	}
 
 	/*
@@ -1046,13 +1146,91 @@ static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
 			goto out_unlock;
 	}
 
-	return do_writepage(page, len);
+	return queue_writepage(page, len, batch);
 
 out_unlock:
 	unlock_page(page);
 	return err;
 }
 
+static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	return writepage(page, wbc, NULL);
+}
+
+/**
+ * write_pages - write-back the dirty pages of a range of a mapping.
+ * @mapping: the mapping
+ * @wbc: write-back control, with the range to write
+ * @b: batch to collect the pages in
+ *
+ * The batch is written out before returning, so no page is left locked.
+ */
+static int write_pages(struct address_space *mapping,
+		       struct writeback_control *wbc, struct wp_batch *b)
+{
+	int err, err1;
+
+	err = write_cache_pages(mapping, wbc, writepage, b);
+	if (b->cnt) {
+		err1 = write_batch(mapping->host, b);
+		if (!err)
+			err = err1;
+	}
+	return err;
+}
+
+/*
+ * Write-back of many pages is done in batches of %UBIFS_WRITEPAGES_BATCH
+ * pages, which are kept locked until the whole batch is written. This lets
+ * UBIFS compress the data of a batch on several CPUs, and then write the data
+ * nodes in page order.
+ *
+ * Pages of a batch must be locked in index order, otherwise we could deadlock
+ * with another write-back of the same file. 'write_cache_pages()' wraps back
+ * to the start of the file for @range_cyclic write-back, so we do the two
+ * passes ourselves and write the batch out in between.
+ */
+static int ubifs_writepages(struct address_space *mapping,
+			    struct writeback_control *wbc)
+{
+	int err;
+	struct wp_batch *b;
+	pgoff_t start;
+	loff_t range_start = wbc->range_start, range_end = wbc->range_end;
+
+	b = kmalloc(sizeof(struct wp_batch), GFP_NOFS);
+	if (!b)
+		return generic_writepages(mapping, wbc);
+
+	b->cnt = 0;
+	if (!wbc->range_cyclic) {
+		err = write_pages(mapping, wbc, b);
+		goto out;
+	}
+
+	start = mapping->writeback_index;
+	b->done_index = start;
+	wbc->range_cyclic = 0;
+	wbc->range_start = (loff_t)start << PAGE_CACHE_SHIFT;
+	wbc->range_end = LLONG_MAX;
+	err = write_pages(mapping, wbc, b);
+	if (!err && start && wbc->nr_to_write > 0) {
+		wbc->range_start = 0;
+		wbc->range_end = ((loff_t)start << PAGE_CACHE_SHIFT) - 1;
+		err = write_pages(mapping, wbc, b);
+	}
+
+	wbc->range_cyclic = 1;
+	wbc->range_start = range_start;
+	wbc->range_end = range_end;
+	if (!wbc->no_nrwrite_index_update)
+		mapping->writeback_index = b->done_index;
+out:
+	kfree(b);
+	return err;
+}
+
 /**
  * do_attr_changes - change inode attributes.
  * @inode: inode to change attributes for
@@ -1556,6 +1734,7 @@ static int ubifs_file_mmap(struct file *file, struct vm_area_struct *vma)
 const struct address_space_operations ubifs_file_address_operations = {
 	.readpage       = ubifs_readpage,
 	.writepage      = ubifs_writepage,
+	.writepages     = ubifs_writepages,
 	.write_begin    = ubifs_write_begin,
 	.write_end      = ubifs_write_end,
 	.invalidatepage = ubifs_invalidatepage,
@@ -670,6 +670,109 @@ out_ro:
 	return err;
 }
 
+/**
+ * data_compr_type - get compression type to use for a data block.
+ * @c: UBIFS file-system description object
+ * @ui: inode the data block belongs to
+ *
+ * With adaptive compression, once %UBIFS_COMPR_FAILS_MAX data blocks of an
+ * inode in a row did not compress, the next %UBIFS_COMPR_SKIP blocks are
+ * written without trying to compress them. The block after those is a sample:
+ * if it does not compress either, the following blocks are skipped again.
+ */
+static int data_compr_type(struct ubifs_info *c, struct ubifs_inode *ui)
+{
+	int compr_type = ui->compr_type;
+
+	if (!(ui->flags & UBIFS_COMPR_FL))
+		/* Compression is disabled for this inode */
+		return UBIFS_COMPR_NONE;
+
+	if (!c->adaptive_compr || compr_type == UBIFS_COMPR_NONE)
+		return compr_type;
+
+	spin_lock(&ui->ui_lock);
+	if (ui->compr_skip) {
+		ui->compr_skip -= 1;
+		compr_type = UBIFS_COMPR_NONE;
+	}
+	spin_unlock(&ui->ui_lock);
+
+	if (compr_type == UBIFS_COMPR_NONE)
+		dbg_compr_skipped(c);
+	return compr_type;
+}
+
+/**
+ * data_compr_done - account the result of compressing a data block.
+ * @c: UBIFS file-system description object
+ * @ui: inode the data block belongs to
+ * @compr_type: compression type returned by 'data_compr_type()'
+ * @in_len: data block length
+ * @out_len: length of the data written
+ * @used_compr_type: compression type actually used
+ */
+static void data_compr_done(struct ubifs_info *c, struct ubifs_inode *ui,
+			    int compr_type, int in_len, int out_len,
+			    int used_compr_type)
+{
+	/* Too short data is not even tried, so it tells nothing */
+	if (compr_type == UBIFS_COMPR_NONE || in_len < UBIFS_MIN_COMPR_LEN)
+		return;
+
+	dbg_compr_done(c, in_len, out_len, used_compr_type);
+	if (!c->adaptive_compr)
+		return;
+
+	spin_lock(&ui->ui_lock);
+	if (used_compr_type != UBIFS_COMPR_NONE)
+		ui->compr_fails = 0;
+	else if (++ui->compr_fails >= UBIFS_COMPR_FAILS_MAX)
+		ui->compr_skip = UBIFS_COMPR_SKIP;
+	spin_unlock(&ui->ui_lock);
+}
+
+/**
+ * write_data_node - write a prepared data node to the journal.
+ * @c: UBIFS file-system description object
+ * @key: data node key
+ * @data: the data node
+ * @dlen: data node length
+ *
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+static int write_data_node(struct ubifs_info *c, const union ubifs_key *key,
+			   struct ubifs_data_node *data, int dlen)
+{
+	int err, lnum, offs;
+
+	/* Make reservation before allocating sequence numbers */
+	err = make_reservation(c, DATAHD, dlen);
+	if (err)
+		return err;
+
+	err = write_node(c, DATAHD, data, dlen, &lnum, &offs);
+	if (err)
+		goto out_release;
+	ubifs_wbuf_add_ino_nolock(&c->jheads[DATAHD].wbuf, key_inum(c, key));
+	release_head(c, DATAHD);
+
+	err = ubifs_tnc_add(c, key, lnum, offs, dlen);
+	if (err)
+		goto out_ro;
+
+	finish_reservation(c);
+	return 0;
+
+out_release:
+	release_head(c, DATAHD);
+out_ro:
+	ubifs_ro_mode(c, err);
+	finish_reservation(c);
+	return err;
+}
+
 /**
  * ubifs_jnl_write_data - write a data node to the journal.
  * @c: UBIFS file-system description object
@@ -685,7 +788,7 @@ int ubifs_jnl_write_data(struct ubifs_info *c, const struct inode *inode,
 			 const union ubifs_key *key, const void *buf, int len)
 {
 	struct ubifs_data_node *data;
-	int err, lnum, offs, compr_type, out_len;
+	int err, compr_type, used_compr_type, out_len;
 	int dlen = UBIFS_DATA_NODE_SZ + UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR;
 	struct ubifs_inode *ui = ubifs_inode(inode);
 
@@ -703,45 +806,114 @@ int ubifs_jnl_write_data(struct ubifs_info *c, const struct inode *inode,
 	data->size = cpu_to_le32(len);
 	zero_data_node_unused(data);
 
-	if (!(ui->flags & UBIFS_COMPR_FL))
-		/* Compression is disabled for this inode */
-		compr_type = UBIFS_COMPR_NONE;
-	else
-		compr_type = ui->compr_type;
-
+	compr_type = data_compr_type(c, ui);
+	used_compr_type = compr_type;
 	out_len = dlen - UBIFS_DATA_NODE_SZ;
-	ubifs_compress(buf, len, &data->data, &out_len, &compr_type);
+	ubifs_compress(buf, len, &data->data, &out_len, &used_compr_type);
 	ubifs_assert(out_len <= UBIFS_BLOCK_SIZE);
+	data_compr_done(c, ui, compr_type, len, out_len, used_compr_type);
 
 	dlen = UBIFS_DATA_NODE_SZ + out_len;
-	data->compr_type = cpu_to_le16(compr_type);
+	data->compr_type = cpu_to_le16(used_compr_type);
 
-	/* Make reservation before allocating sequence numbers */
-	err = make_reservation(c, DATAHD, dlen);
-	if (err)
+	err = write_data_node(c, key, data, dlen);
+	kfree(data);
+	return err;
+}
+
+/**
+ * ubifs_jnl_write_data_blks - write several data nodes to the journal.
+ * @c: UBIFS file-system description object
+ * @inode: inode the data nodes belong to
+ * @blks: data blocks to write
+ * @cnt: count of elements in @blks
+ * @written: count of data nodes written is returned here
+ *
+ * This function is equivalent to calling 'ubifs_jnl_write_data()' for each
+ * element of @blks, except that the blocks are compressed in parallel (see
+ * 'ubifs_compress_reqs()'). The data nodes are then written to the journal
+ * one by one, in the @blks order. Returns zero in case of success and a
+ * negative error code in case of failure.
+ */
+int ubifs_jnl_write_data_blks(struct ubifs_info *c, const struct inode *inode,
+			      const struct ubifs_data_blk *blks, int cnt,
+			      int *written)
+{
+	struct ubifs_data_node **data;
+	struct ubifs_compr_req *reqs;
+	int err = 0, i, j, n = 0, round, compr_type;
+	int dlen = UBIFS_DATA_NODE_SZ + UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR;
+	struct ubifs_inode *ui = ubifs_inode(inode);
+
+	dbg_jnl("ino %lu, %d blocks, first key %s",
+		(unsigned long)key_inum(c, &blks[0].key), cnt,
+		DBGKEY(&blks[0].key));
+
+	*written = 0;
+	reqs = kmalloc(cnt * sizeof(struct ubifs_compr_req), GFP_NOFS);
+	data = kmalloc(cnt * sizeof(struct ubifs_data_node *), GFP_NOFS);
+	if (!reqs || !data) {
+		err = -ENOMEM;
 		goto out_free;
+	}
 
-	err = write_node(c, DATAHD, data, dlen, &lnum, &offs);
-	if (err)
-		goto out_release;
-	ubifs_wbuf_add_ino_nolock(&c->jheads[DATAHD].wbuf, key_inum(c, key));
-	release_head(c, DATAHD);
+	/*
+	 * Allocate as many data node buffers as possible, but do not insist,
+	 * because the blocks may as well be written in several rounds.
+	 */
+	for (n = 0; n < cnt; n++) {
+		data[n] = kmalloc(dlen, n ? GFP_NOFS | __GFP_NOWARN : GFP_NOFS);
+		if (!data[n])
+			break;
+	}
+	if (!n) {
+		err = -ENOMEM;
+		goto out_free;
+	}
 
-	err = ubifs_tnc_add(c, key, lnum, offs, dlen);
-	if (err)
-		goto out_ro;
+	for (i = 0; i < cnt; i += n) {
+		round = min(n, cnt - i);
+		for (j = 0; j < round; j++) {
+			const struct ubifs_data_blk *blk = &blks[i + j];
+
+			ubifs_assert(blk->len <= UBIFS_BLOCK_SIZE);
+			data[j]->ch.node_type = UBIFS_DATA_NODE;
+			key_write(c, &blk->key, &data[j]->key);
+			data[j]->size = cpu_to_le32(blk->len);
+			zero_data_node_unused(data[j]);
+
+			reqs[j].in_buf = blk->buf;
+			reqs[j].in_len = blk->len;
+			reqs[j].out_buf = &data[j]->data;
+			reqs[j].out_len = dlen - UBIFS_DATA_NODE_SZ;
+			/* Requested type is kept in the node until compressed */
+			compr_type = data_compr_type(c, ui);
+			data[j]->compr_type = cpu_to_le16(compr_type);
+			reqs[j].compr_type = compr_type;
+		}
 
-	finish_reservation(c);
-	kfree(data);
-	return 0;
+		ubifs_compress_reqs(reqs, round);
+
+		for (j = 0; j < round; j++) {
+			ubifs_assert(reqs[j].out_len <= UBIFS_BLOCK_SIZE);
+			compr_type = le16_to_cpu(data[j]->compr_type);
+			data_compr_done(c, ui, compr_type, reqs[j].in_len,
+					reqs[j].out_len, reqs[j].compr_type);
+			data[j]->compr_type = cpu_to_le16(reqs[j].compr_type);
+			err = write_data_node(c, &blks[i + j].key, data[j],
+					      UBIFS_DATA_NODE_SZ +
+					      reqs[j].out_len);
+			if (err)
+				goto out_free;
+			*written += 1;
+		}
+	}
 
-out_release:
-	release_head(c, DATAHD);
-out_ro:
-	ubifs_ro_mode(c, err);
-	finish_reservation(c);
 out_free:
+	for (j = 0; j < n; j++)
+		kfree(data[j]);
 	kfree(data);
+	kfree(reqs);
 	return err;
 }
 
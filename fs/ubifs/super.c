@@ -431,6 +431,11 @@ static int ubifs_show_options(struct seq_file *s, struct vfsmount *mnt)
 			   ubifs_compr_name(c->mount_opts.compr_type));
 	}
 
+	if (c->mount_opts.adaptive_compr == 2)
+		seq_printf(s, ",adaptive_compr");
+	else if (c->mount_opts.adaptive_compr == 1)
+		seq_printf(s, ",no_adaptive_compr");
+
 	return 0;
 }
 
@@ -913,6 +918,8 @@ static int check_volume_empty(struct ubifs_info *c)
  * Opt_chk_data_crc: check CRCs when reading data nodes
  * Opt_no_chk_data_crc: do not check CRCs when reading data nodes
  * Opt_override_compr: override default compressor
+ * Opt_adaptive_compr: skip compression of data which does not compress
+ * Opt_no_adaptive_compr: always try to compress data
  * Opt_err: just end of array marker
  */
 enum {
@@ -923,6 +930,8 @@ enum {
 	Opt_chk_data_crc,
 	Opt_no_chk_data_crc,
 	Opt_override_compr,
+	Opt_adaptive_compr,
+	Opt_no_adaptive_compr,
 	Opt_err,
 };
 
@@ -934,6 +943,8 @@ static const match_table_t tokens = {
 	{Opt_chk_data_crc, "chk_data_crc"},
 	{Opt_no_chk_data_crc, "no_chk_data_crc"},
 	{Opt_override_compr, "compr=%s"},
+	{Opt_adaptive_compr, "adaptive_compr"},
+	{Opt_no_adaptive_compr, "no_adaptive_compr"},
 	{Opt_err, NULL},
 };
 
@@ -1023,6 +1034,8 @@ static int ubifs_parse_options(struct ubifs_info *c, char *options,
 				c->mount_opts.compr_type = UBIFS_COMPR_LZO;
 			else if (!strcmp(name, "zlib"))
 				c->mount_opts.compr_type = UBIFS_COMPR_ZLIB;
+			else if (!strcmp(name, "lz4"))
+				c->mount_opts.compr_type = UBIFS_COMPR_LZ4;
 			else {
 				ubifs_err("unknown compressor \"%s\"", name);
 				kfree(name);
@@ -1033,6 +1046,14 @@ static int ubifs_parse_options(struct ubifs_info *c, char *options,
 			c->default_compr = c->mount_opts.compr_type;
 			break;
 		}
+		case Opt_adaptive_compr:
+			c->mount_opts.adaptive_compr = 2;
+			c->adaptive_compr = 1;
+			break;
+		case Opt_no_adaptive_compr:
+			c->mount_opts.adaptive_compr = 1;
+			c->adaptive_compr = 0;
+			break;
 		default:
 		{
 			unsigned long flag;
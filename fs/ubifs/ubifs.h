@@ -154,6 +154,19 @@
 /* Maximum number of data nodes to bulk-read */
 #define UBIFS_MAX_BULK_READ 32
 
+/* Maximum number of dirty pages to write-back in one go */
+#define UBIFS_WRITEPAGES_BATCH 32
+
+/* Maximum number of workers compressing one batch of data blocks */
+#define UBIFS_MAX_COMPR_WORKERS 8
+
+/*
+ * Adaptive compression: after this many data blocks of an inode in a row did
+ * not compress, the next %UBIFS_COMPR_SKIP blocks are written uncompressed.
+ */
+#define UBIFS_COMPR_FAILS_MAX 8
+#define UBIFS_COMPR_SKIP 64
+
 /*
  * Lockdep classes for UBIFS inode @ui_mutex.
  */
@@ -344,7 +357,7 @@ struct ubifs_gced_idx_leb {
  * @ui_mutex: serializes inode write-back with the rest of VFS operations,
  *            serializes "clean <-> dirty" state changes, serializes bulk-read,
  *            protects @dirty, @bulk_read, @ui_size, and @xattr_size
- * @ui_lock: protects @synced_i_size
+ * @ui_lock: protects @synced_i_size, @compr_fails and @compr_skip
  * @synced_i_size: synchronized size of inode, i.e. the value of inode size
  *                 currently stored on the flash; used only for regular file
  *                 inodes
@@ -353,6 +366,10 @@ struct ubifs_gced_idx_leb {
  * @compr_type: default compression type used for this inode
  * @last_page_read: page number of last page read (for bulk read)
  * @read_in_a_row: number of consecutive pages read in a row (for bulk read)
+ * @compr_fails: number of consecutive data blocks which did not compress (for
+ *               adaptive compression)
+ * @compr_skip: number of data blocks to write without trying to compress them
+ *              (for adaptive compression)
  * @data_len: length of the data attached to the inode
  * @data: inode's data
  *
@@ -403,6 +420,8 @@ struct ubifs_inode {
 	int flags;
 	pgoff_t last_page_read;
 	pgoff_t read_in_a_row;
+	int compr_fails;
+	int compr_skip;
 	int data_len;
 	void *data;
 };
@@ -809,19 +828,61 @@ struct ubifs_node_range {
 /**
  * struct ubifs_compressor - UBIFS compressor description structure.
  * @compr_type: compressor type (%UBIFS_COMPR_LZO, etc)
- * @cc: cryptoapi compressor handle
- * @comp_mutex: mutex used during compression
+ * @cc: cryptoapi compressor handle used for decompression
  * @decomp_mutex: mutex used during decompression
  * @name: compressor name
  * @capi_name: cryptoapi compressor name
+ * @comp_ccs: cryptoapi compressor handles used for compression
+ * @comp_cnt: count of elements in @comp_ccs
+ * @comp_free: count of free handles, which are at the start of @comp_ccs
+ * @comp_lock: protects @comp_ccs and @comp_free
+ * @comp_wait: wait queue for a free compression handle
+ *
+ * A cryptoapi compressor handle may only be used for one compression at a
+ * time, so there is one handle per online CPU (at most
+ * %UBIFS_MAX_COMPR_WORKERS), in order to compress data in parallel. The first
+ * one is also @cc.
  */
 struct ubifs_compressor {
 	int compr_type;
 	struct crypto_comp *cc;
-	struct mutex *comp_mutex;
 	struct mutex *decomp_mutex;
 	const char *name;
 	const char *capi_name;
+	struct crypto_comp **comp_ccs;
+	int comp_cnt;
+	int comp_free;
+	spinlock_t comp_lock;
+	wait_queue_head_t comp_wait;
+};
+
+/**
+ * struct ubifs_compr_req - data compression request.
+ * @in_buf: data to compress
+ * @in_len: length of the data to compress
+ * @out_buf: output buffer
+ * @out_len: output buffer length on entry, compressed data length on exit
+ * @compr_type: compression type to use on entry, actually used compression
+ *              type on exit
+ */
+struct ubifs_compr_req {
+	const void *in_buf;
+	int in_len;
+	void *out_buf;
+	int out_len;
+	int compr_type;
+};
+
+/**
+ * struct ubifs_data_blk - data block to write to the journal.
+ * @key: data node key
+ * @buf: data
+ * @len: data length (at most %UBIFS_BLOCK_SIZE)
+ */
+struct ubifs_data_blk {
+	union ubifs_key key;
+	const void *buf;
+	int len;
 };
 
 /**
@@ -917,6 +978,8 @@ struct ubifs_orphan {
  *                  specified in @compr_type)
  * @compr_type: compressor type to override the superblock compressor with
  *              (%UBIFS_COMPR_NONE, etc)
+ * @adaptive_compr: enable/disable adaptive compression (%0 default,
+ *                  %1 disable, %2 enable)
  */
 struct ubifs_mount_opts {
 	unsigned int unmount_mode:2;
@@ -924,6 +987,7 @@ struct ubifs_mount_opts {
 	unsigned int chk_data_crc:2;
 	unsigned int override_compr:1;
 	unsigned int compr_type:2;
+	unsigned int adaptive_compr:2;
 };
 
 struct ubifs_debug_info;
@@ -973,6 +1037,8 @@ struct ubifs_debug_info;
  *                   recovery)
  * @bulk_read: enable bulk-reads
  * @default_compr: default compression algorithm (%UBIFS_COMPR_LZO, etc)
+ * @adaptive_compr: stop compressing data of an inode for a while when it does
+ *                  not compress (see 'data_compr_type()')
  * @rw_incompat: the media is not R/W compatible
  *
  * @tnc_mutex: protects the Tree Node Cache (TNC), @zroot, @cnext, @enext, and
@@ -1216,6 +1282,7 @@ struct ubifs_info {
 	unsigned int no_chk_data_crc:1;
 	unsigned int bulk_read:1;
 	unsigned int default_compr:2;
+	unsigned int adaptive_compr:1;
 	unsigned int rw_incompat:1;
 
 	struct mutex tnc_mutex;
@@ -1481,6 +1548,9 @@ int ubifs_jnl_update(struct ubifs_info *c, const struct inode *dir,
 		     int deletion, int xent);
 int ubifs_jnl_write_data(struct ubifs_info *c, const struct inode *inode,
 			 const union ubifs_key *key, const void *buf, int len);
+int ubifs_jnl_write_data_blks(struct ubifs_info *c, const struct inode *inode,
+			      const struct ubifs_data_blk *blks, int cnt,
+			      int *written);
 int ubifs_jnl_write_inode(struct ubifs_info *c, const struct inode *inode);
 int ubifs_jnl_delete_inode(struct ubifs_info *c, const struct inode *inode);
 int ubifs_jnl_rename(struct ubifs_info *c, const struct inode *old_dir,
@@ -1725,6 +1795,7 @@ int __init ubifs_compressors_init(void);
 void ubifs_compressors_exit(void);
 void ubifs_compress(const void *in_buf, int in_len, void *out_buf, int *out_len,
 		    int *compr_type);
+void ubifs_compress_reqs(struct ubifs_compr_req *reqs, int cnt);
 int ubifs_decompress(const void *buf, int len, void *out, int *out_len,
 		     int compr_type);
 
@@ -204,6 +204,47 @@ static inline int pmd_none_or_clear_bad(pmd_t *pmd)
 	return 0;
 }
 
+#ifndef CONFIG_TRANSPARENT_HUGEPAGE
+static inline int pmd_trans_huge(pmd_t pmd)
+{
+	return 0;
+}
+
+static inline int pmd_trans_splitting(pmd_t pmd)
+{
+	return 0;
+}
+
+static inline int pmd_write(pmd_t pmd)
+{
+	BUG();
+	return 0;
+}
+
+#define pmdp_clear_flush_young(vma, address, pmdp)	({ BUG(); 0; })
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
+/*
+ * Walkers holding mmap_sem only for reading can race with a page fault
+ * establishing a transparent huge pmd.  Read the pmd once, and never
+ * clear a huge pmd as if it were a corrupted page table.  Returns 1 if
+ * there is no page table to walk below this pmd.
+ */
+static inline int pmd_none_or_trans_huge_or_clear_bad(pmd_t *pmd)
+{
+	pmd_t pmdval = *pmd;
+
+	barrier();
+	if (pmd_none(pmdval))
+		return 1;
+	if (unlikely(pmd_bad(pmdval))) {
+		if (!pmd_trans_huge(pmdval))
+			pmd_clear_bad(pmd);
+		return 1;
+	}
+	return 0;
+}
+
 static inline pte_t __ptep_modify_prot_start(struct mm_struct *mm,
 					     unsigned long addr,
 					     pte_t *ptep)
@@ -0,0 +1,40 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  A byte-oriented LZ77 compressor producing LZ4 block format.
+ *  It trades some compression ratio against LZO for considerably
+ *  faster compression and decompression.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_MEM_COMPRESS	(4096 * sizeof(unsigned int))
+
+#define lz4_worst_compress(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS. On entry *dst_len
+ * is the size of 'dst'; on success it is set to the compressed size.
+ * 'src_len' must be less than 4GB.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK			0
+#define LZ4_E_ERROR			(-1)
+#define LZ4_E_INPUT_OVERRUN		(-4)
+#define LZ4_E_OUTPUT_OVERRUN		(-5)
+#define LZ4_E_LOOKBEHIND_OVERRUN	(-6)
+
+#endif
@@ -236,6 +236,45 @@ static inline void mmu_notifier_mm_destroy(struct mm_struct *mm)
 	__young;							\
 })
 
+#define pmdp_clear_flush_young_notify(__vma, __address, __pmdp)		\
+({									\
+	int __young;							\
+	struct vm_area_struct *___vma = __vma;				\
+	unsigned long ___address = __address;				\
+	__young = pmdp_clear_flush_young(___vma, ___address, __pmdp);	\
+	__young |= mmu_notifier_clear_flush_young(___vma->vm_mm,	\
+						  ___address);		\
+	__young;							\
+})
+
+/*
+ * A huge pmd covers a whole range, so secondary MMUs are told about it
+ * with a range invalidate around the flush.
+ */
+#define pmdp_clear_flush_notify(__vma, __haddr, __pmd)			\
+({									\
+	pmd_t __pmdval;							\
+	struct vm_area_struct *___vma = __vma;				\
+	unsigned long ___haddr = __haddr;				\
+	mmu_notifier_invalidate_range_start(___vma->vm_mm, ___haddr,	\
+					    ___haddr + HPAGE_PMD_SIZE);	\
+	__pmdval = pmdp_clear_flush(___vma, ___haddr, __pmd);		\
+	mmu_notifier_invalidate_range_end(___vma->vm_mm, ___haddr,	\
+					  ___haddr + HPAGE_PMD_SIZE);	\
+	__pmdval;							\
+})
+
+#define pmdp_splitting_flush_notify(__vma, __haddr, __pmd)		\
+({									\
+	struct vm_area_struct *___vma = __vma;				\
+	unsigned long ___haddr = __haddr;				\
+	mmu_notifier_invalidate_range_start(___vma->vm_mm, ___haddr,	\
+					    ___haddr + HPAGE_PMD_SIZE);	\
+	pmdp_splitting_flush(___vma, ___haddr, __pmd);			\
+	mmu_notifier_invalidate_range_end(___vma->vm_mm, ___haddr,	\
+					  ___haddr + HPAGE_PMD_SIZE);	\
+})
+
 #else /* CONFIG_MMU_NOTIFIER */
 
 static inline void mmu_notifier_release(struct mm_struct *mm)
@@ -273,6 +312,9 @@ static inline void mmu_notifier_mm_destroy(struct mm_struct *mm)
 
 #define ptep_clear_flush_young_notify ptep_clear_flush_young
 #define ptep_clear_flush_notify ptep_clear_flush
+#define pmdp_clear_flush_young_notify pmdp_clear_flush_young
+#define pmdp_clear_flush_notify pmdp_clear_flush
+#define pmdp_splitting_flush_notify pmdp_splitting_flush
 
 #endif /* CONFIG_MMU_NOTIFIER */
 
@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -30,5 +31,19 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events of the oom_adj notifier.  The data is the thread group leader
+ * concerned.
+ */
+enum oom_adj_event {
+	OOM_ADJ_TASK_NEW,	/* new process, or new leader after exec */
+	OOM_ADJ_TASK_EXIT,	/* process is exiting, before its mm goes */
+	OOM_ADJ_TASK_CHANGE,	/* oomkilladj was written */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(struct task_struct *p, enum oom_adj_event event);
+
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
@@ -87,6 +87,13 @@ int page_referenced(struct page *, int is_locked,
 			struct mem_cgroup *cnt, unsigned long *vm_flags);
 int try_to_unmap(struct page *, int ignore_refs);
 
+/*
+ * Used by mm/huge_memory.c to walk the mappings of a huge page.
+ */
+struct anon_vma *page_lock_anon_vma(struct page *page);
+void page_unlock_anon_vma(struct anon_vma *anon_vma);
+unsigned long vma_address(struct page *page, struct vm_area_struct *vma);
+
 /*
  * Called from mm/filemap_xip.c to unmap empty zero page
  */
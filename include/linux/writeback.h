@@ -8,22 +8,12 @@
 #include <linux/fs.h>
 
 struct backing_dev_info;
+struct bdi_writeback;
 
 extern spinlock_t inode_lock;
 extern struct list_head inode_in_use;
 extern struct list_head inode_unused;
 
-/*
- * Yes, writeback.h requires sched.h
- * No, sched.h is not included from here.
- */
-static inline int task_is_pdflush(struct task_struct *task)
-{
-	return task->flags & PF_FLUSHER;
-}
-
-#define current_is_pdflush()	task_is_pdflush(current)
-
 /*
  * fs/fs-writeback.c
  */
@@ -76,7 +66,10 @@ struct writeback_control {
 /*
  * fs/fs-writeback.c
  */	
-void writeback_inodes(struct writeback_control *wbc);
+void writeback_inodes_wb(struct bdi_writeback *wb,
+			 struct writeback_control *wbc);
+long wb_do_writeback(struct bdi_writeback *wb);
+void wakeup_flusher_threads(long nr_pages);
 int inode_wait(void *);
 void sync_inodes_sb(struct super_block *, int wait);
 
@@ -98,7 +91,6 @@ static inline void inode_sync_wait(struct inode *inode)
 /*
  * mm/page-writeback.c
  */
-int wakeup_pdflush(long nr_pages);
 void laptop_io_completion(void);
 void laptop_sync_completion(void);
 void throttle_vm_writeout(gfp_t gfp_mask);
@@ -150,7 +142,6 @@ balance_dirty_pages_ratelimited(struct address_space *mapping)
 typedef int (*writepage_t)(struct page *page, struct writeback_control *wbc,
 				void *data);
 
-int pdflush_operation(void (*fn)(unsigned long), unsigned long arg0);
 int generic_writepages(struct address_space *mapping,
 		       struct writeback_control *wbc);
 int write_cache_pages(struct address_space *mapping,
@@ -164,9 +155,9 @@ int sync_page_range_nolock(struct inode *inode, struct address_space *mapping,
 void set_page_dirty_balance(struct page *page, int page_mkwrite);
 void writeback_set_ratelimit(void);
 
-/* pdflush.c */
-extern int nr_pdflush_threads;	/* Global so it can be exported to sysctl
-				   read-only. */
+/* fs-writeback.c */
+extern int nr_pdflush_threads;	/* Always zero, kept so the read-only sysctl
+				   does not disappear. */
 
 
 #endif		/* WRITEBACK_H */
@@ -38,6 +38,13 @@
 
 #include <linux/decompress/mm.h>
 
+#ifndef STATIC
+/* unlzma() is also used at runtime by squashfs, so keep it after boot */
+#undef INIT
+#define INIT
+#include <linux/module.h>
+#endif
+
 #define	MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 static long long INIT read_int(unsigned char *ptr, int size)
@@ -82,6 +89,12 @@ struct rc {
 #define RC_MODEL_TOTAL_BITS 11
 
 
+/* Fill function used when the whole input is passed in the buffer */
+static int nofill(void *buffer, unsigned int len)
+{
+	return -1;
+}
+
 /* Called twice: once at startup and once in rc_normalize() */
 static void INIT rc_read(struct rc *rc)
 {
@@ -97,7 +110,10 @@ static inline void INIT rc_init(struct rc *rc,
 				       int (*fill)(void*, unsigned int),
 				       char *buffer, int buffer_size)
 {
-	rc->fill = fill;
+	if (fill)
+		rc->fill = fill;
+	else
+		rc->fill = nofill;
 	rc->buffer = (uint8_t *)buffer;
 	rc->buffer_size = buffer_size;
 	rc->buffer_end = rc->buffer + rc->buffer_size;
@@ -644,6 +660,9 @@ exit_1:
 exit_0:
 	return ret;
 }
+#ifndef STATIC
+EXPORT_SYMBOL(unlzma);
+#endif
 
 #ifdef PREBOOT
 STATIC int INIT decompress(unsigned char *buf, int in_len,
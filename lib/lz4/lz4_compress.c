@@ -0,0 +1,139 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Single pass greedy LZ77 parser emitting the LZ4 block format.
+ *  Candidate matches come from a 4096 entry hash table of the
+ *  positions at which 4-byte sequences were last seen.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/*
+ * Hash the little endian value so that the compressed output does
+ * not depend on host byte order.
+ */
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned_le32(p) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* Worst case size of a sequence with 'lit' literals and a match */
+static inline size_t lz4_seq_bound(size_t lit, size_t mlen)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char * const oend = dst + *dst_len;
+	unsigned char *op = dst, *token;
+	unsigned int *table = wrkmem;
+	size_t lit, mlen;
+	u32 h;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	while (ip < mflimit) {
+		h = lz4_hash(ip);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+			continue;
+		}
+
+		/* Extend the match backwards into pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* and forwards, leaving LASTLITERALS bytes at the end */
+		mlen = MIN_MATCH;
+		while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+			mlen++;
+
+		lit = ip - anchor;
+		if (unlikely(op + lz4_seq_bound(lit, mlen) > oend))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		token = op++;
+		if (lit >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, lit - RUN_MASK);
+		} else {
+			*token = lit << ML_BITS;
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		mlen -= MIN_MATCH;
+		if (mlen >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, mlen - ML_MASK);
+		} else {
+			*token |= mlen;
+		}
+
+		ip += mlen + MIN_MATCH;
+		anchor = ip;
+
+		/* Remember a position inside the match for the next one */
+		if (ip < mflimit)
+			table[lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	lit = iend - anchor;
+	if (unlikely(op + 1 + lit / 255 + 1 + lit > oend))
+		return LZ4_E_OUTPUT_OVERRUN;
+
+	if (lit >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit - RUN_MASK);
+	} else {
+		*op++ = lit << ML_BITS;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
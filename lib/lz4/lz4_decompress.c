@@ -0,0 +1,101 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char * const iend = src + src_len;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst, *ref;
+	unsigned int token, s;
+	size_t len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		if (unlikely(len > (size_t)(iend - ip)))
+			goto input_overrun;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* Match */
+		if (unlikely(iend - ip < 2))
+			goto input_overrun;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > (size_t)(op - dst)))
+			goto lookbehind_overrun;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += MIN_MATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+
+		ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* Overlapping copy repeats the last 'offset' bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+
+input_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_INPUT_OVERRUN;
+
+output_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_LOOKBEHIND_OVERRUN;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
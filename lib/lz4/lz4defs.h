@@ -0,0 +1,36 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+/*
+ * A block is a series of sequences. Each sequence is a token byte
+ * (literal run length in the high nibble, match length - MIN_MATCH
+ * in the low nibble), optional literal length bytes, the literals,
+ * a 16-bit little endian match offset and optional match length
+ * bytes. A nibble of 15 means "add the following bytes until one is
+ * not 255". The last sequence has literals only.
+ */
+
+#define MIN_MATCH	4
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define MAX_DISTANCE	0xffff
+
+/* The last match must start at least MFLIMIT bytes before the end */
+#define MFLIMIT		12
+/* and the last LASTLITERALS bytes are always literals */
+#define LASTLITERALS	5
+
+#define HASH_LOG	12
+#define HASH_SIZE	(1U << HASH_LOG)
+
+/* Step further ahead the longer we go without finding a match */
+#define SKIP_TRIGGER	6
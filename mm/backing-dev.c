@@ -7,6 +7,9 @@
 #include <linux/module.h>
 #include <linux/writeback.h>
 #include <linux/device.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/timer.h>
 
 void default_unplug_io_fn(struct backing_dev_info *bdi, struct page *page)
 {
@@ -23,6 +26,19 @@ EXPORT_SYMBOL_GPL(default_backing_dev_info);
 
 static struct class *bdi_class;
 
+/*
+ * bdi_lock protects updates to bdi_list: every initialised bdi is on it,
+ * registered or not, so that its dirty inodes can be found for writeback.
+ */
+DEFINE_SPINLOCK(bdi_lock);
+LIST_HEAD(bdi_list);
+
+static struct task_struct *sync_supers_tsk;
+static struct timer_list sync_supers_timer;
+
+static int bdi_sync_supers(void *);
+static void sync_supers_timer_fn(unsigned long);
+
 #ifdef CONFIG_DEBUG_FS
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
@@ -185,6 +201,12 @@ static int __init default_bdi_init(void)
 {
 	int err;
 
+	sync_supers_tsk = kthread_run(bdi_sync_supers, NULL, "sync_supers");
+	BUG_ON(IS_ERR(sync_supers_tsk));
+
+	setup_timer(&sync_supers_timer, sync_supers_timer_fn, 0);
+	bdi_arm_supers_timer();
+
 	err = bdi_init(&default_backing_dev_info);
 	if (!err)
 		bdi_register(&default_backing_dev_info, NULL, "default");
@@ -193,6 +215,281 @@ static int __init default_bdi_init(void)
 }
 subsys_initcall(default_bdi_init);
 
+/*
+ * kupdated() used to do this.  It cannot be done from the forker thread, or
+ * a filesystem stuck in ->write_super() would stop flusher threads from
+ * being created; nor from a flusher, as superblocks have no bdi to go with.
+ */
+static int bdi_sync_supers(void *unused)
+{
+	set_user_nice(current, 0);
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
+
+		/*
+		 * Do this periodically, like kupdated() did before.
+		 */
+		sync_supers();
+	}
+
+	return 0;
+}
+
+void bdi_arm_supers_timer(void)
+{
+	unsigned long next;
+
+	if (!dirty_writeback_interval)
+		return;
+
+	next = msecs_to_jiffies(dirty_writeback_interval * 10) + jiffies;
+	mod_timer(&sync_supers_timer, round_jiffies_up(next));
+}
+
+static void sync_supers_timer_fn(unsigned long unused)
+{
+	wake_up_process(sync_supers_tsk);
+	bdi_arm_supers_timer();
+}
+
+/*
+ * A flusher thread idle for this long is stopped; it is forked again the
+ * next time its bdi has dirty inodes.
+ */
+static unsigned long bdi_longest_inactive(void)
+{
+	unsigned long interval;
+
+	interval = msecs_to_jiffies(dirty_writeback_interval * 10);
+	return max(5UL * 60 * HZ, interval);
+}
+
+/*
+ * Write back a chunk of a bdi's dirty data from the forker thread, for bdis
+ * which cannot have a flusher of their own: unregistered ones, or ones whose
+ * thread could not be created.  Queued work is dropped, it was WB_SYNC_NONE
+ * and kupdate-style flushing from here writes the data out eventually.
+ */
+static void bdi_flush_io(struct backing_dev_info *bdi)
+{
+	struct writeback_control wbc = {
+		.bdi			= bdi,
+		.sync_mode		= WB_SYNC_NONE,
+		.older_than_this	= NULL,
+		.range_cyclic		= 1,
+		.nr_to_write		= 1024,
+	};
+	LIST_HEAD(work_list);
+
+	spin_lock_bh(&bdi->wb_lock);
+	list_splice_init(&bdi->work_list, &work_list);
+	spin_unlock_bh(&bdi->wb_lock);
+	while (!list_empty(&work_list)) {
+		struct list_head *work = work_list.next;
+
+		list_del(work);
+		kfree(work);
+	}
+
+	bdi->wb.last_old_flush = jiffies;
+	writeback_inodes_wb(&bdi->wb, &wbc);
+}
+
+/*
+ * The forker thread runs on behalf of default_backing_dev_info.  It forks a
+ * flusher thread for every registered bdi that has dirty inodes or queued
+ * work, stops flushers which have been idle for bdi_longest_inactive(), and
+ * writes back the default bdi and the bdis which have no flusher itself.
+ */
+static int bdi_forker_thread(void *ptr)
+{
+	struct bdi_writeback *me = ptr;
+
+	current->flags |= PF_SWAPWRITE;
+	set_freezable();
+
+	/*
+	 * Our parent may run at a different priority, just set us to normal
+	 */
+	set_user_nice(current, 0);
+
+	for (;;) {
+		struct task_struct *task = NULL;
+		struct backing_dev_info *bdi;
+		unsigned long interval;
+		bool flush_later = false;
+		enum {
+			NO_ACTION,	/* Nothing to do */
+			FORK_THREAD,	/* Fork bdi thread */
+			KILL_THREAD,	/* Kill inactive bdi thread */
+			FLUSH_IO,	/* Write back on behalf of the bdi */
+		} action = NO_ACTION;
+
+		if (wb_has_dirty_io(me) || !list_empty(&me->bdi->work_list))
+			wb_do_writeback(me);
+
+		interval = msecs_to_jiffies(dirty_writeback_interval * 10);
+
+		spin_lock_bh(&bdi_lock);
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		list_for_each_entry(bdi, &bdi_list, bdi_list) {
+			bool have_dirty_io;
+
+			if (bdi == me->bdi || !bdi_cap_writeback_dirty(bdi) ||
+			    test_bit(BDI_pending, &bdi->state))
+				continue;
+
+			have_dirty_io = !list_empty(&bdi->work_list) ||
+					wb_has_dirty_io(&bdi->wb);
+
+			/*
+			 * If the bdi has work to do, but the thread does not
+			 * exist - create it, or do the work ourselves if it
+			 * cannot have one.  The pending bit makes anybody
+			 * unregistering this bdi wait for us.
+			 */
+			if (!bdi->wb.task && have_dirty_io) {
+				if (test_bit(BDI_registered, &bdi->state)) {
+					action = FORK_THREAD;
+				} else if (time_after(jiffies,
+					   bdi->wb.last_old_flush + interval)) {
+					action = FLUSH_IO;
+				} else {
+					flush_later = true;
+					continue;
+				}
+				set_bit(BDI_pending, &bdi->state);
+				break;
+			}
+
+			spin_lock(&bdi->wb_lock);
+			/*
+			 * If there is no work to do and the bdi thread was
+			 * inactive long enough - kill it.  The wb_lock is taken
+			 * to make sure no-one adds more work to this bdi and
+			 * wakes the bdi thread up.
+			 */
+			if (bdi->wb.task && !have_dirty_io &&
+			    time_after(jiffies, bdi->wb.last_active +
+						bdi_longest_inactive())) {
+				task = bdi->wb.task;
+				bdi->wb.task = NULL;
+				spin_unlock(&bdi->wb_lock);
+				set_bit(BDI_pending, &bdi->state);
+				action = KILL_THREAD;
+				break;
+			}
+			spin_unlock(&bdi->wb_lock);
+		}
+		spin_unlock_bh(&bdi_lock);
+
+		/* Keep working if the default bdi still has things to do */
+		if (!list_empty(&me->bdi->work_list))
+			__set_current_state(TASK_RUNNING);
+
+		switch (action) {
+		case FORK_THREAD:
+			__set_current_state(TASK_RUNNING);
+			task = kthread_create(bdi_writeback_thread, &bdi->wb,
+					      "flush-%s", dev_name(bdi->dev));
+			if (IS_ERR(task)) {
+				/*
+				 * If thread creation fails, force writeout of
+				 * the bdi from the thread.
+				 */
+				bdi_flush_io(bdi);
+			} else {
+				/*
+				 * The spinlock makes sure we do not lose
+				 * wake-ups when racing with bdi_queue_work().
+				 * As soon as the thread is visible, start it.
+				 */
+				spin_lock_bh(&bdi->wb_lock);
+				bdi->wb.task = task;
+				spin_unlock_bh(&bdi->wb_lock);
+				wake_up_process(task);
+			}
+			break;
+
+		case KILL_THREAD:
+			__set_current_state(TASK_RUNNING);
+			kthread_stop(task);
+			break;
+
+		case FLUSH_IO:
+			__set_current_state(TASK_RUNNING);
+			bdi_flush_io(bdi);
+			break;
+
+		case NO_ACTION:
+			if (!(wb_has_dirty_io(me) || flush_later) ||
+			    !dirty_writeback_interval)
+				/*
+				 * No dirty data to write ourselves: the only
+				 * thing left to care about is stopping idle
+				 * threads, so sleep longer and save power.
+				 */
+				schedule_timeout(bdi_longest_inactive());
+			else
+				schedule_timeout(interval);
+			try_to_freeze();
+			/* Back to the main loop */
+			continue;
+		}
+
+		/*
+		 * Clear pending bit and wakeup anybody waiting to tear us down.
+		 */
+		clear_bit(BDI_pending, &bdi->state);
+		smp_mb__after_clear_bit();
+		wake_up_bit(&bdi->state, BDI_pending);
+	}
+
+	return 0;
+}
+
+static int bdi_sched_wait(void *word)
+{
+	schedule();
+	return 0;
+}
+
+/*
+ * Stop the flusher thread of a bdi which is being unregistered.  Its
+ * remaining dirty inodes are left to the forker thread.
+ */
+static void bdi_wb_shutdown(struct backing_dev_info *bdi)
+{
+	struct task_struct *task;
+
+	if (!bdi_cap_writeback_dirty(bdi))
+		return;
+
+	/*
+	 * Make sure the forker does not create a new thread from now on.
+	 */
+	spin_lock_bh(&bdi_lock);
+	clear_bit(BDI_registered, &bdi->state);
+	spin_unlock_bh(&bdi_lock);
+
+	/*
+	 * If a thread is being forked or stopped, wait for that to finish.
+	 */
+	wait_on_bit(&bdi->state, BDI_pending, bdi_sched_wait,
+			TASK_UNINTERRUPTIBLE);
+
+	spin_lock_bh(&bdi->wb_lock);
+	task = bdi->wb.task;
+	bdi->wb.task = NULL;
+	spin_unlock_bh(&bdi->wb_lock);
+
+	if (task)
+		kthread_stop(task);
+}
+
 int bdi_register(struct backing_dev_info *bdi, struct device *parent,
 		const char *fmt, ...)
 {
@@ -212,6 +509,31 @@ int bdi_register(struct backing_dev_info *bdi, struct device *parent,
 	}
 
 	bdi->dev = dev;
+
+	/*
+	 * The default bdi has no flusher of its own, its thread is the one
+	 * forking flushers for everybody else.
+	 */
+	if (bdi == &default_backing_dev_info) {
+		struct task_struct *task;
+
+		task = kthread_run(bdi_forker_thread, &bdi->wb, "bdi-%s",
+				   dev_name(dev));
+		if (IS_ERR(task)) {
+			device_unregister(dev);
+			bdi->dev = NULL;
+			ret = PTR_ERR(task);
+			goto exit;
+		}
+		spin_lock_bh(&bdi->wb_lock);
+		bdi->wb.task = task;
+		spin_unlock_bh(&bdi->wb_lock);
+	}
+
+	spin_lock_bh(&bdi_lock);
+	set_bit(BDI_registered, &bdi->state);
+	spin_unlock_bh(&bdi_lock);
+
 	bdi_debug_register(bdi, dev_name(dev));
 
 exit:
@@ -228,6 +550,7 @@ EXPORT_SYMBOL(bdi_register_dev);
 void bdi_unregister(struct backing_dev_info *bdi)
 {
 	if (bdi->dev) {
+		bdi_wb_shutdown(bdi);
 		bdi_debug_unregister(bdi);
 		device_unregister(bdi->dev);
 		bdi->dev = NULL;
@@ -241,10 +564,20 @@ int bdi_init(struct backing_dev_info *bdi)
 	int err;
 
 	bdi->dev = NULL;
+	INIT_LIST_HEAD(&bdi->bdi_list);
 
 	bdi->min_ratio = 0;
 	bdi->max_ratio = 100;
 	bdi->max_prop_frac = PROP_FRAC_BASE;
+	spin_lock_init(&bdi->wb_lock);
+	INIT_LIST_HEAD(&bdi->work_list);
+
+	memset(&bdi->wb, 0, sizeof(bdi->wb));
+	bdi->wb.bdi = bdi;
+	bdi->wb.last_old_flush = jiffies;
+	INIT_LIST_HEAD(&bdi->wb.b_dirty);
+	INIT_LIST_HEAD(&bdi->wb.b_io);
+	INIT_LIST_HEAD(&bdi->wb.b_more_io);
 
 	for (i = 0; i < NR_BDI_STAT_ITEMS; i++) {
 		err = percpu_counter_init(&bdi->bdi_stat[i], 0);
@@ -259,9 +592,14 @@ int bdi_init(struct backing_dev_info *bdi)
 err:
 		while (i--)
 			percpu_counter_destroy(&bdi->bdi_stat[i]);
+		return err;
 	}
 
-	return err;
+	spin_lock_bh(&bdi_lock);
+	list_add_tail(&bdi->bdi_list, &bdi_list);
+	spin_unlock_bh(&bdi_lock);
+
+	return 0;
 }
 EXPORT_SYMBOL(bdi_init);
 
@@ -271,6 +609,39 @@ void bdi_destroy(struct backing_dev_info *bdi)
 
 	bdi_unregister(bdi);
 
+	/*
+	 * Callers destroy bdis that bdi_init() failed on, or that were
+	 * only zeroed because setup failed before bdi_init() was reached.
+	 * Such a bdi is not on bdi_list and has no inodes to hand over.
+	 */
+	if (!bdi->bdi_list.next || list_empty(&bdi->bdi_list))
+		goto out;
+
+	spin_lock_bh(&bdi_lock);
+	list_del_init(&bdi->bdi_list);
+	spin_unlock_bh(&bdi_lock);
+
+	/*
+	 * The forker may still be writing back on our behalf.
+	 */
+	wait_on_bit(&bdi->state, BDI_pending, bdi_sched_wait,
+			TASK_UNINTERRUPTIBLE);
+
+	/*
+	 * Splice our entries to the default_backing_dev_info, if this
+	 * bdi disappears
+	 */
+	if (bdi_has_dirty_io(bdi)) {
+		struct bdi_writeback *dst = &default_backing_dev_info.wb;
+
+		spin_lock(&inode_lock);
+		list_splice(&bdi->wb.b_dirty, &dst->b_dirty);
+		list_splice(&bdi->wb.b_io, &dst->b_io);
+		list_splice(&bdi->wb.b_more_io, &dst->b_more_io);
+		spin_unlock(&inode_lock);
+	}
+
+out:
 	for (i = 0; i < NR_BDI_STAT_ITEMS; i++)
 		percpu_counter_destroy(&bdi->bdi_stat[i]);
 
@@ -610,6 +610,14 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	/* prepare cgroup just returns 0 or -ENOMEM */
 	rc = -EAGAIN;
 
+	/*
+	 * Transparent huge pages are split: the first subpage is
+	 * migrated and the rest go back to the LRU.
+	 */
+	if (unlikely(PageTransHuge(page)))
+		if (unlikely(split_huge_page(page)))
+			goto move_newpage;
+
 	if (!trylock_page(page)) {
 		if (!force)
 			goto move_newpage;
@@ -166,9 +166,10 @@ static long __mlock_vma_pages_range(struct vm_area_struct *vma,
 	VM_BUG_ON(end   > vma->vm_end);
 	VM_BUG_ON(!rwsem_is_locked(&mm->mmap_sem));
 
-	gup_flags = 0;
+	/* mlocked ranges are kept on small pages */
+	gup_flags = GUP_FLAGS_SPLIT_HUGE_PMD;
 	if (vma->vm_flags & VM_WRITE)
-		gup_flags = GUP_FLAGS_WRITE;
+		gup_flags |= GUP_FLAGS_WRITE;
 
 	while (nr_pages > 0) {
 		int i;
@@ -309,7 +310,8 @@ void munlock_vma_pages_range(struct vm_area_struct *vma,
 	vma->vm_flags &= ~VM_LOCKED;
 
 	for (addr = start; addr < end; addr += PAGE_SIZE) {
-		struct page *page = follow_page(vma, addr, FOLL_GET);
+		struct page *page = follow_page(vma, addr,
+					       FOLL_GET | FOLL_SPLIT);
 		if (page) {
 			lock_page(page);
 			if (page->mapping)
@@ -41,7 +41,8 @@ static pmd_t *get_old_pmd(struct mm_struct *mm, unsigned long addr)
 		return NULL;
 
 	pmd = pmd_offset(pud, addr);
-	if (pmd_none_or_clear_bad(pmd))
+	split_huge_page_pmd(mm, pmd);
+	if (pmd_none_or_trans_huge_or_clear_bad(pmd))
 		return NULL;
 
 	return pmd;
@@ -62,6 +63,7 @@ static pmd_t *alloc_new_pmd(struct mm_struct *mm, unsigned long addr)
 	if (!pmd)
 		return NULL;
 
+	VM_BUG_ON(pmd_trans_huge(*pmd));
 	if (!pmd_present(*pmd) && __pte_alloc(mm, pmd, addr))
 		return NULL;
 
@@ -465,6 +465,32 @@ int unregister_oom_notifier(struct notifier_block *nb)
 }
 EXPORT_SYMBOL_GPL(unregister_oom_notifier);
 
+/*
+ * The oom_adj notifier lets a killer keep its own index of candidate
+ * processes by oomkilladj instead of walking the task list to select a
+ * victim.  It is called for thread group leaders only, from process
+ * context.
+ */
+static BLOCKING_NOTIFIER_HEAD(oom_adj_notify_list);
+
+int register_oom_adj_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(register_oom_adj_notifier);
+
+int unregister_oom_adj_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_oom_adj_notifier);
+
+void oom_adj_notify(struct task_struct *p, enum oom_adj_event event)
+{
+	if (thread_group_leader(p))
+		blocking_notifier_call_chain(&oom_adj_notify_list, event, p);
+}
+
 /*
  * Try to acquire the OOM killer lock for the zones in zonelist.  Returns zero
  * if a parallel OOM killing is already taking place that includes a zone in
@@ -34,17 +34,25 @@ static int walk_pmd_range(pud_t *pud, unsigned long addr, unsigned long end,
 	pmd = pmd_offset(pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
-		if (pmd_none_or_clear_bad(pmd)) {
+		if (pmd_none(*pmd)) {
 			if (walk->pte_hole)
 				err = walk->pte_hole(addr, next, walk);
 			if (err)
 				break;
 			continue;
 		}
+		/*
+		 * ->pmd_entry() handlers must cope with transparent huge
+		 * pmds themselves; huge pmds are only split when the
+		 * walk has to look at individual ptes.
+		 */
 		if (walk->pmd_entry)
 			err = walk->pmd_entry(pmd, addr, next, walk);
-		if (!err && walk->pte_entry)
-			err = walk_pte_range(pmd, addr, next, walk);
+		if (!err && walk->pte_entry) {
+			split_huge_page_pmd(walk->mm, pmd);
+			if (!pmd_none_or_trans_huge_or_clear_bad(pmd))
+				err = walk_pte_range(pmd, addr, next, walk);
+		}
 		if (err)
 			break;
 	} while (pmd++, addr = next, addr != end);
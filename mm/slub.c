@@ -53,6 +53,15 @@
  *   allocating a long series of objects that fill up slabs does not require
  *   the list lock.
  *
+ *   Each processor also keeps a short list of frozen partial slabs of its
+ *   own (kmem_cache_cpu->partial). That list is only touched by its owner
+ *   with interrupts disabled so it needs no lock at all. Slabs move between
+ *   it and the node lists in batches, which takes the list_lock once per
+ *   batch instead of once per slab. When the list is drained the list_lock
+ *   is held while taking the slab_lock of each slab. This cannot deadlock
+ *   since the only other user of the slab_lock of a frozen slab is
+ *   slab_free, which never takes the list_lock for a frozen slab.
+ *
  *   The lock order is sometimes inverted when we are trying to get a slab
  *   off a list. We take the list_lock and then look for a page on the list
  *   to use. While we do that objects in the slabs may be freed. We can
@@ -1303,11 +1312,15 @@ static inline int lock_and_freeze_slab(struct kmem_cache_node *n,
 }
 
 /*
- * Try to allocate a partial slab from a specific node.
+ * Try to allocate a partial slab from a specific node. While the list_lock
+ * is held a few more slabs are moved to the cpu partial list so that the
+ * next refills do not have to come back here.
  */
-static struct page *get_partial_node(struct kmem_cache_node *n)
+static struct page *get_partial_node(struct kmem_cache *s,
+		struct kmem_cache_node *n, struct kmem_cache_cpu *c)
 {
-	struct page *page;
+	struct page *page, *t;
+	struct page *first = NULL;
 
 	/*
 	 * Racy check. If we mistakenly see no partial slabs then we
@@ -1319,19 +1332,34 @@ static struct page *get_partial_node(struct kmem_cache_node *n)
 		return NULL;
 
 	spin_lock(&n->list_lock);
-	list_for_each_entry(page, &n->partial, lru)
-		if (lock_and_freeze_slab(n, page))
-			goto out;
-	page = NULL;
-out:
+	stat(c, NODE_LIST_LOCK);
+	list_for_each_entry_safe(page, t, &n->partial, lru) {
+		if (first && c->nr_partial >= s->cpu_partial / 2)
+			break;
+		/* Debug slabs never go onto the cpu partial list */
+		if (first && SLABDEBUG && PageSlubDebug(page))
+			continue;
+		if (!lock_and_freeze_slab(n, page))
+			continue;
+		if (!first) {
+			first = page;
+			continue;
+		}
+		/* Extra slabs stay frozen but unlocked on the cpu list */
+		slab_unlock(page);
+		list_add_tail(&page->lru, &c->partial);
+		c->nr_partial++;
+		stat(c, CPU_PARTIAL_NODE);
+	}
 	spin_unlock(&n->list_lock);
-	return page;
+	return first;
 }
 
 /*
  * Get a page from somewhere. Search in increasing NUMA distances.
  */
-static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
+static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags,
+					struct kmem_cache_cpu *c)
 {
 #ifdef CONFIG_NUMA
 	struct zonelist *zonelist;
@@ -1370,7 +1398,7 @@ static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
 
 		if (n && cpuset_zone_allowed_hardwall(zone, flags) &&
 				n->nr_partial > s->min_partial) {
-			page = get_partial_node(n);
+			page = get_partial_node(s, n, c);
 			if (page)
 				return page;
 		}
@@ -1382,16 +1410,40 @@ static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
 /*
  * Get a partial page, lock it and return it.
  */
-static struct page *get_partial(struct kmem_cache *s, gfp_t flags, int node)
+static struct page *get_partial(struct kmem_cache *s, gfp_t flags, int node,
+				struct kmem_cache_cpu *c)
 {
 	struct page *page;
 	int searchnode = (node == -1) ? numa_node_id() : node;
 
-	page = get_partial_node(get_node(s, searchnode));
+	page = get_partial_node(s, get_node(s, searchnode), c);
 	if (page || (flags & __GFP_THISNODE))
 		return page;
 
-	return get_any_partial(s, flags);
+	return get_any_partial(s, flags, c);
+}
+
+/*
+ * Take a slab off the cpu partial list, lock it and return it. The slab is
+ * still frozen from the time it was put on the list.
+ *
+ * Interrupts must be disabled.
+ */
+static struct page *get_cpu_partial(struct kmem_cache_cpu *c, int node)
+{
+	struct page *page;
+
+	if (!c->nr_partial)
+		return NULL;
+
+	page = list_first_entry(&c->partial, struct page, lru);
+	if (node != -1 && page_to_nid(page) != node)
+		return NULL;
+
+	list_del(&page->lru);
+	c->nr_partial--;
+	slab_lock(page);
+	return page;
 }
 
 /*
@@ -1411,6 +1463,7 @@ static void unfreeze_slab(struct kmem_cache *s, struct page *page, int tail)
 
 		if (page->freelist) {
 			add_partial(n, page, tail);
+			stat(c, NODE_LIST_LOCK);
 			stat(c, tail ? DEACTIVATE_TO_TAIL : DEACTIVATE_TO_HEAD);
 		} else {
 			stat(c, DEACTIVATE_FULL);
@@ -1433,6 +1486,7 @@ static void unfreeze_slab(struct kmem_cache *s, struct page *page, int tail)
 			 * the partial list.
 			 */
 			add_partial(n, page, 1);
+			stat(c, NODE_LIST_LOCK);
 			slab_unlock(page);
 		} else {
 			slab_unlock(page);
@@ -1475,6 +1529,57 @@ static void deactivate_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
 	unfreeze_slab(s, page, tail);
 }
 
+/*
+ * Move all slabs on the cpu partial list back to the node partial lists.
+ * Consecutive slabs from the same node are handled under a single
+ * list_lock hold. Empty slabs beyond min_partial are freed.
+ *
+ * Interrupts must be disabled.
+ */
+static void unfreeze_partials(struct kmem_cache *s, struct kmem_cache_cpu *c)
+{
+	struct kmem_cache_node *n = NULL;
+	struct page *page, *t;
+	LIST_HEAD(discard);
+
+	if (!c->nr_partial)
+		return;
+
+	stat(c, CPU_PARTIAL_DRAIN);
+	list_for_each_entry_safe(page, t, &c->partial, lru) {
+		struct kmem_cache_node *n2 = get_node(s, page_to_nid(page));
+
+		if (n != n2) {
+			if (n)
+				spin_unlock(&n->list_lock);
+			n = n2;
+			spin_lock(&n->list_lock);
+			stat(c, NODE_LIST_LOCK);
+		}
+
+		list_del(&page->lru);
+		slab_lock(page);
+		__ClearPageSlubFrozen(page);
+		if (!page->inuse && n->nr_partial >= s->min_partial)
+			list_add(&page->lru, &discard);
+		else if (page->freelist) {
+			list_add_tail(&page->lru, &n->partial);
+			n->nr_partial++;
+		}
+		slab_unlock(page);
+	}
+	if (n)
+		spin_unlock(&n->list_lock);
+	c->nr_partial = 0;
+
+	list_for_each_entry_safe(page, t, &discard, lru) {
+		list_del(&page->lru);
+		stat(c, DEACTIVATE_EMPTY);
+		stat(c, FREE_SLAB);
+		discard_slab(s, page);
+	}
+}
+
 static inline void flush_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
 {
 	stat(c, CPUSLAB_FLUSH);
@@ -1491,8 +1596,11 @@ static inline void __flush_cpu_slab(struct kmem_cache *s, int cpu)
 {
 	struct kmem_cache_cpu *c = get_cpu_slab(s, cpu);
 
-	if (likely(c && c->page))
-		flush_slab(s, c);
+	if (likely(c)) {
+		if (c->page)
+			flush_slab(s, c);
+		unfreeze_partials(s, c);
+	}
 }
 
 static void flush_cpu_slab(void *d)
@@ -1589,9 +1697,10 @@ slab_out_of_memory(struct kmem_cache *s, gfp_t gfpflags, int nid)
  * regular freelist. In that case we simply take over the regular freelist
  * as the lockless freelist and zap the regular freelist.
  *
- * If that is not working then we fall back to the partial lists. We take the
- * first element of the freelist as the object to allocate now and move the
- * rest of the freelist to the lockless freelist.
+ * If that is not working then we fall back to the partial lists, first the
+ * one of this cpu and then the node partial lists. We take the first
+ * element of the freelist as the object to allocate now and move the rest
+ * of the freelist to the lockless freelist.
  *
  * And if we were unable to get a new slab from the partial slab lists then
  * we need to allocate a new slab. This is the slowest path since it involves
@@ -1635,7 +1744,14 @@ another_slab:
 	deactivate_slab(s, c);
 
 new_slab:
-	new = get_partial(s, gfpflags, node);
+	new = get_cpu_partial(c, node);
+	if (new) {
+		c->page = new;
+		stat(c, CPU_PARTIAL_ALLOC);
+		goto load_freelist;
+	}
+
+	new = get_partial(s, gfpflags, node, c);
 	if (new) {
 		c->page = new;
 		stat(c, ALLOC_FROM_PARTIAL);
@@ -1800,10 +1916,22 @@ checks_ok:
 
 	/*
 	 * Objects left in the slab. If it was not on the partial list before
-	 * then add it.
+	 * then add it. Prefer the partial list of this cpu since that does not
+	 * need the list_lock. Debug slabs have to stay on the node lists.
 	 */
 	if (unlikely(!prior)) {
+		if (s->cpu_partial && !(SLABDEBUG && PageSlubDebug(page))) {
+			__SetPageSlubFrozen(page);
+			list_add(&page->lru, &c->partial);
+			c->nr_partial++;
+			stat(c, CPU_PARTIAL_FREE);
+			slab_unlock(page);
+			if (c->nr_partial > s->cpu_partial)
+				unfreeze_partials(s, c);
+			return;
+		}
 		add_partial(get_node(s, page_to_nid(page)), page, 1);
+		stat(c, NODE_LIST_LOCK);
 		stat(c, FREE_ADD_PARTIAL);
 	}
 
@@ -1817,6 +1945,7 @@ slab_empty:
 		 * Slab still on the partial list.
 		 */
 		remove_partial(s, page);
+		stat(c, NODE_LIST_LOCK);
 		stat(c, FREE_REMOVE_PARTIAL);
 	}
 	slab_unlock(page);
@@ -2055,6 +2184,8 @@ static void init_kmem_cache_cpu(struct kmem_cache *s,
 	c->node = 0;
 	c->offset = s->offset / sizeof(void *);
 	c->objsize = s->objsize;
+	c->nr_partial = 0;
+	INIT_LIST_HEAD(&c->partial);
 #ifdef CONFIG_SLUB_STATS
 	memset(c->stat, 0, NR_SLUB_STAT_ITEMS * sizeof(unsigned));
 #endif
@@ -2315,6 +2446,27 @@ static void set_min_partial(struct kmem_cache *s, unsigned long min)
 	s->min_partial = min;
 }
 
+static void set_cpu_partial(struct kmem_cache *s)
+{
+	/*
+	 * Every slab kept on a cpu partial list saves a trip to the node
+	 * list_lock, but also pins its free objects to that cpu. Keep fewer
+	 * slabs around for large objects. Debug caches track their slabs on
+	 * the node lists and do not use cpu partial lists at all.
+	 */
+	if (s->flags & (SLAB_DEBUG_FREE | SLAB_RED_ZONE | SLAB_POISON |
+			SLAB_STORE_USER | SLAB_TRACE))
+		s->cpu_partial = 0;
+	else if (s->size >= PAGE_SIZE)
+		s->cpu_partial = 2;
+	else if (s->size >= 1024)
+		s->cpu_partial = 4;
+	else if (s->size >= 256)
+		s->cpu_partial = 8;
+	else
+		s->cpu_partial = 16;
+}
+
 /*
  * calculate_sizes() determines the order and the distribution of data within
  * a slab object.
@@ -2458,6 +2610,7 @@ static int kmem_cache_open(struct kmem_cache *s, gfp_t gfpflags,
 	 * list to avoid pounding the page allocator excessively.
 	 */
 	set_min_partial(s, ilog2(s->size));
+	set_cpu_partial(s);
 	s->refcount = 1;
 #ifdef CONFIG_NUMA
 	s->remote_node_defrag_ratio = 1000;
@@ -4032,6 +4185,29 @@ static ssize_t min_partial_store(struct kmem_cache *s, const char *buf,
 }
 SLAB_ATTR(min_partial);
 
+static ssize_t cpu_partial_show(struct kmem_cache *s, char *buf)
+{
+	return sprintf(buf, "%d\n", s->cpu_partial);
+}
+
+static ssize_t cpu_partial_store(struct kmem_cache *s, const char *buf,
+				 size_t length)
+{
+	unsigned long slabs;
+	int err;
+
+	err = strict_strtoul(buf, 10, &slabs);
+	if (err)
+		return err;
+	if (slabs > INT_MAX)
+		return -EINVAL;
+
+	s->cpu_partial = slabs;
+	flush_all(s);
+	return length;
+}
+SLAB_ATTR(cpu_partial);
+
 static ssize_t ctor_show(struct kmem_cache *s, char *buf)
 {
 	if (s->ctor) {
@@ -4067,6 +4243,29 @@ static ssize_t cpu_slabs_show(struct kmem_cache *s, char *buf)
 }
 SLAB_ATTR_RO(cpu_slabs);
 
+static ssize_t slabs_cpu_partial_show(struct kmem_cache *s, char *buf)
+{
+	int slabs = 0;
+	int cpu;
+	int len;
+
+	for_each_online_cpu(cpu)
+		slabs += get_cpu_slab(s, cpu)->nr_partial;
+
+	len = sprintf(buf, "%d", slabs);
+
+#ifdef CONFIG_SMP
+	for_each_online_cpu(cpu) {
+		int x = get_cpu_slab(s, cpu)->nr_partial;
+
+		if (x && len < PAGE_SIZE - 20)
+			len += sprintf(buf + len, " C%d=%d", cpu, x);
+	}
+#endif
+	return len + sprintf(buf + len, "\n");
+}
+SLAB_ATTR_RO(slabs_cpu_partial);
+
 static ssize_t objects_show(struct kmem_cache *s, char *buf)
 {
 	return show_slab_objects(s, buf, SO_ALL|SO_OBJECTS);
@@ -4340,6 +4539,11 @@ STAT_ATTR(DEACTIVATE_TO_HEAD, deactivate_to_head);
 STAT_ATTR(DEACTIVATE_TO_TAIL, deactivate_to_tail);
 STAT_ATTR(DEACTIVATE_REMOTE_FREES, deactivate_remote_frees);
 STAT_ATTR(ORDER_FALLBACK, order_fallback);
+STAT_ATTR(CPU_PARTIAL_ALLOC, cpu_partial_alloc);
+STAT_ATTR(CPU_PARTIAL_FREE, cpu_partial_free);
+STAT_ATTR(CPU_PARTIAL_NODE, cpu_partial_node);
+STAT_ATTR(CPU_PARTIAL_DRAIN, cpu_partial_drain);
+STAT_ATTR(NODE_LIST_LOCK, node_list_lock);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -4348,12 +4552,14 @@ static struct attribute *slab_attrs[] = {
 	&objs_per_slab_attr.attr,
 	&order_attr.attr,
 	&min_partial_attr.attr,
+	&cpu_partial_attr.attr,
 	&objects_attr.attr,
 	&objects_partial_attr.attr,
 	&total_objects_attr.attr,
 	&slabs_attr.attr,
 	&partial_attr.attr,
 	&cpu_slabs_attr.attr,
+	&slabs_cpu_partial_attr.attr,
 	&ctor_attr.attr,
 	&aliases_attr.attr,
 	&align_attr.attr,
@@ -4394,6 +4600,11 @@ static struct attribute *slab_attrs[] = {
 	&deactivate_to_tail_attr.attr,
 	&deactivate_remote_frees_attr.attr,
 	&order_fallback_attr.attr,
+	&cpu_partial_alloc_attr.attr,
+	&cpu_partial_free_attr.attr,
+	&cpu_partial_node_attr.attr,
+	&cpu_partial_drain_attr.attr,
+	&node_list_lock_attr.attr,
 #endif
 	NULL
 };
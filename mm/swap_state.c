@@ -150,6 +150,17 @@ int add_to_swap(struct page *page)
 		if (!entry.val)
 			return 0;
 
+		/*
+		 * Swap works on small pages: a transparent huge page is
+		 * split here, and its tail pages go back on the LRU to be
+		 * reclaimed individually.
+		 */
+		if (unlikely(PageTransHuge(page)))
+			if (unlikely(split_huge_page(page))) {
+				swapcache_free(entry, NULL);
+				return 0;
+			}
+
 		/*
 		 * Radix-tree node allocations from PF_MEMALLOC contexts could
 		 * completely exhaust the page allocator. __GFP_NOMEMALLOC
@@ -0,0 +1,358 @@
+/* binder_stress.c
+ *
+ * Measure binder transaction throughput against the number of concurrent
+ * client/server pairs.
+ *
+ * A server process becomes the context manager (handle 0) and runs one
+ * looper thread per client.  For each step from 1 up to the number of
+ * online CPUs, that many client processes issue back-to-back synchronous
+ * transactions to handle 0 and the aggregate transactions/sec is printed.
+ * The context manager slot must be free, so run this on a system where
+ * servicemanager is not running.
+ *
+ * Compile with
+ *	gcc -O2 -Wall -I../../drivers/staging/android binder_stress.c \
+ *		-o binder_stress -lpthread
+ *
+ * Usage: binder_stress [-d seconds] [-n max_pairs] [-s payload_bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(128 * 1024)
+#define CMD_BUF_SIZE	256
+#define MAX_PAYLOAD	4096
+
+static int duration = 5;
+static int payload = 16;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static int binder_open_map(void)
+{
+	int fd;
+
+	fd = open(BINDER_DEV, O_RDWR);
+	if (fd < 0)
+		die("open " BINDER_DEV);
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return ret;
+}
+
+/* Append a command and its argument to a write buffer. */
+static size_t put_cmd(uint8_t *buf, size_t pos, uint32_t cmd,
+		      const void *arg, size_t size)
+{
+	memcpy(buf + pos, &cmd, sizeof(cmd));
+	pos += sizeof(cmd);
+	if (size) {
+		memcpy(buf + pos, arg, size);
+		pos += size;
+	}
+	return pos;
+}
+
+struct server {
+	int fd;
+	pthread_t thread;
+};
+
+static void *server_loop(void *arg)
+{
+	struct server *s = arg;
+	uint8_t wbuf[CMD_BUF_SIZE], rbuf[CMD_BUF_SIZE];
+	uint8_t reply[MAX_PAYLOAD];
+	struct binder_transaction_data txn;
+	struct binder_ptr_cookie pc;
+	size_t wpos, rpos, rsize;
+	uint32_t cmd;
+
+	memset(reply, 0, sizeof(reply));
+	wpos = put_cmd(wbuf, 0, BC_ENTER_LOOPER, NULL, 0);
+
+	for (;;) {
+		if (binder_write_read(s->fd, wbuf, wpos, rbuf, sizeof(rbuf),
+				      &rsize) < 0)
+			die("server BINDER_WRITE_READ");
+		wpos = 0;
+
+		for (rpos = 0; rpos < rsize; ) {
+			memcpy(&cmd, rbuf + rpos, sizeof(cmd));
+			rpos += sizeof(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, rbuf + rpos, sizeof(pc));
+				rpos += sizeof(pc);
+				wpos = put_cmd(wbuf, wpos, cmd == BR_INCREFS ?
+					       BC_INCREFS_DONE : BC_ACQUIRE_DONE,
+					       &pc, sizeof(pc));
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				rpos += sizeof(pc);
+				break;
+			case BR_TRANSACTION:
+				memcpy(&txn, rbuf + rpos, sizeof(txn));
+				rpos += sizeof(txn);
+				wpos = put_cmd(wbuf, wpos, BC_FREE_BUFFER,
+					       &txn.data.ptr.buffer,
+					       sizeof(void *));
+				memset(&txn, 0, sizeof(txn));
+				txn.data_size = payload;
+				txn.data.ptr.buffer = reply;
+				wpos = put_cmd(wbuf, wpos, BC_REPLY,
+					       &txn, sizeof(txn));
+				break;
+			default:
+				fprintf(stderr, "server: unexpected 0x%x\n",
+					cmd);
+				exit(1);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start a context manager with nr_threads loopers.  Returns the server
+ * pid once it is ready to accept transactions.
+ */
+static pid_t start_server(int nr_threads)
+{
+	struct server *servers;
+	int pfd[2], i, fd, tries;
+	char c = 0;
+	pid_t pid;
+
+	if (pipe(pfd) < 0)
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid) {
+		close(pfd[1]);
+		if (read(pfd[0], &c, 1) != 1 || c != 1) {
+			fprintf(stderr, "server failed to start\n");
+			exit(1);
+		}
+		close(pfd[0]);
+		return pid;
+	}
+
+	close(pfd[0]);
+	fd = binder_open_map();
+	/* The previous manager is torn down asynchronously. */
+	for (tries = 0; ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0; tries++) {
+		if (errno != EBUSY || tries == 100)
+			die("BINDER_SET_CONTEXT_MGR");
+		usleep(10000);
+	}
+	i = nr_threads;
+	if (ioctl(fd, BINDER_SET_MAX_THREADS, &i) < 0)
+		die("BINDER_SET_MAX_THREADS");
+
+	servers = calloc(nr_threads, sizeof(*servers));
+	if (!servers)
+		die("calloc");
+	for (i = 0; i < nr_threads; i++)
+		servers[i].fd = fd;
+	for (i = 1; i < nr_threads; i++)
+		if (pthread_create(&servers[i].thread, NULL, server_loop,
+				   &servers[i]))
+			die("pthread_create");
+
+	c = 1;
+	if (write(pfd[1], &c, 1) != 1)
+		die("write");
+	close(pfd[1]);
+	server_loop(&servers[0]);
+	exit(0);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Issue synchronous transactions to handle 0 until the deadline. */
+static unsigned long run_client(double start, double end)
+{
+	uint8_t wbuf[CMD_BUF_SIZE], rbuf[CMD_BUF_SIZE];
+	uint8_t data[MAX_PAYLOAD];
+	struct binder_transaction_data txn;
+	void *reply_buf = NULL;
+	unsigned long count = 0;
+	size_t wpos, rpos, rsize;
+	uint32_t cmd;
+	int fd, done;
+
+	fd = binder_open_map();
+	memset(data, 0, sizeof(data));
+
+	while (now() < start)
+		;
+
+	while (now() < end) {
+		wpos = 0;
+		if (reply_buf)
+			wpos = put_cmd(wbuf, wpos, BC_FREE_BUFFER,
+				       &reply_buf, sizeof(void *));
+		memset(&txn, 0, sizeof(txn));
+		txn.target.handle = 0;
+		txn.code = 1;
+		txn.data_size = payload;
+		txn.data.ptr.buffer = data;
+		wpos = put_cmd(wbuf, wpos, BC_TRANSACTION, &txn, sizeof(txn));
+
+		for (done = 0; !done; wpos = 0) {
+			if (binder_write_read(fd, wbuf, wpos, rbuf,
+					      sizeof(rbuf), &rsize) < 0)
+				die("client BINDER_WRITE_READ");
+			for (rpos = 0; rpos < rsize; ) {
+				memcpy(&cmd, rbuf + rpos, sizeof(cmd));
+				rpos += sizeof(cmd);
+				switch (cmd) {
+				case BR_NOOP:
+				case BR_TRANSACTION_COMPLETE:
+					break;
+				case BR_REPLY:
+					memcpy(&txn, rbuf + rpos, sizeof(txn));
+					rpos += sizeof(txn);
+					reply_buf = (void *)txn.data.ptr.buffer;
+					done = 1;
+					break;
+				default:
+					fprintf(stderr,
+						"client: unexpected 0x%x\n",
+						cmd);
+					exit(1);
+				}
+			}
+		}
+		count++;
+	}
+	return count;
+}
+
+static double run_step(int pairs)
+{
+	unsigned long *counts;
+	double start, total = 0;
+	pid_t server, pid;
+	int i;
+
+	counts = mmap(NULL, pairs * sizeof(*counts), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counts == MAP_FAILED)
+		die("mmap counts");
+
+	server = start_server(pairs);
+	start = now() + 0.2;
+	for (i = 0; i < pairs; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			counts[i] = run_client(start, start + duration);
+			exit(0);
+		}
+	}
+	for (i = 0; i < pairs; i++)
+		wait(NULL);
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+
+	for (i = 0; i < pairs; i++)
+		total += counts[i];
+	munmap(counts, pairs * sizeof(*counts));
+	return total / duration;
+}
+
+int main(int argc, char **argv)
+{
+	int max_pairs, pairs, opt;
+	double rate, base = 0;
+
+	max_pairs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "d:n:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			max_pairs = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d seconds] [-n max_pairs]"
+				" [-s payload_bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || max_pairs < 1 || payload < 0 ||
+	    payload > MAX_PAYLOAD) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	printf("%6s %12s %8s\n", "pairs", "txn/s", "scaling");
+	for (pairs = 1; pairs <= max_pairs; pairs++) {
+		rate = run_step(pairs);
+		if (pairs == 1)
+			base = rate;
+		printf("%6d %12.0f %8.2f\n", pairs, rate,
+		       base ? rate / base : 0.0);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+/* squashfs_randread.c
+ *
+ * Measure random read throughput of a squashfs filesystem against the
+ * number of concurrent readers.
+ *
+ * All regular files below the given directory are collected, then for
+ * each step from 1 up to the number of online CPUs that many threads
+ * read randomly chosen blocks of randomly chosen files for a fixed time
+ * and the aggregate MB/s is printed.  The page cache is dropped before
+ * each step so that every read goes to the decompressor, which requires
+ * root.  For example, over a loopback image:
+ *
+ *	mksquashfs /usr/lib /tmp/lib.sqsh
+ *	mount -t squashfs -o loop,threads=4 /tmp/lib.sqsh /mnt
+ *	squashfs_randread /mnt
+ *
+ * Repeat with different threads= mount options to compare.
+ *
+ * Compile with
+ *	gcc -O2 -Wall squashfs_randread.c -o squashfs_randread -lpthread
+ *
+ * Usage: squashfs_randread [-d seconds] [-n max_threads] [-b block_bytes] dir
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+struct file {
+	char *path;
+	off_t size;
+};
+
+static struct file *files;
+static int nr_files, max_files;
+static int duration = 5;
+static size_t block = 4096;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode) || !st->st_size)
+		return 0;
+
+	if (nr_files == max_files) {
+		max_files = max_files ? max_files * 2 : 1024;
+		files = realloc(files, max_files * sizeof(*files));
+		if (!files)
+			die("realloc");
+	}
+	files[nr_files].path = strdup(path);
+	if (!files[nr_files].path)
+		die("strdup");
+	files[nr_files++].size = st->st_size;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		die("open /proc/sys/vm/drop_caches");
+	if (write(fd, "3", 1) != 1)
+		die("drop_caches");
+	close(fd);
+}
+
+struct reader {
+	pthread_t thread;
+	unsigned int seed;
+	double end;
+	uint64_t bytes;
+};
+
+static void *reader_loop(void *arg)
+{
+	struct reader *r = arg;
+	struct file *f;
+	char *buf;
+	off_t off;
+	ssize_t ret;
+	int fd;
+
+	buf = malloc(block);
+	if (!buf)
+		die("malloc");
+
+	while (now() < r->end) {
+		f = &files[rand_r(&r->seed) % nr_files];
+		fd = open(f->path, O_RDONLY);
+		if (fd < 0)
+			die(f->path);
+		off = 0;
+		if (f->size > (off_t)block)
+			off = (off_t)(rand_r(&r->seed) %
+				      (f->size / block)) * block;
+		ret = pread(fd, buf, block, off);
+		if (ret < 0)
+			die("pread");
+		r->bytes += ret;
+		close(fd);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static double run_step(int threads)
+{
+	struct reader *readers;
+	double start, end, total = 0;
+	int i;
+
+	readers = calloc(threads, sizeof(*readers));
+	if (!readers)
+		die("calloc");
+
+	drop_caches();
+	start = now();
+	end = start + duration;
+	for (i = 0; i < threads; i++) {
+		readers[i].seed = i + 1;
+		readers[i].end = end;
+		if (pthread_create(&readers[i].thread, NULL, reader_loop,
+				   &readers[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		total += readers[i].bytes;
+	}
+
+	free(readers);
+	return total / (now() - start) / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads, threads, opt;
+	double rate, base = 0;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "d:n:b:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			max_threads = atoi(optarg);
+			break;
+		case 'b':
+			block = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	if (duration < 1 || max_threads < 1 || block < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	if (nftw(argv[optind], add_file, 64, FTW_PHYS) < 0)
+		die(argv[optind]);
+	if (!nr_files) {
+		fprintf(stderr, "no regular files under %s\n", argv[optind]);
+		return 1;
+	}
+
+	printf("%d files\n", nr_files);
+	printf("%8s %10s %8s\n", "threads", "MB/s", "scaling");
+	for (threads = 1; threads <= max_threads; threads++) {
+		rate = run_step(threads);
+		if (threads == 1)
+			base = rate;
+		printf("%8d %10.1f %8.2f\n", threads, rate,
+		       base ? rate / base : 0.0);
+		fflush(stdout);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-d seconds] [-n max_threads]"
+		" [-b block_bytes] dir\n", argv[0]);
+	return 1;
+}
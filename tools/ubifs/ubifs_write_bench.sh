@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# ubifs_write_bench.sh
+#
+# Measure UBIFS write-back throughput against the number of online CPUs.
+#
+# A UBIFS file-system is created on a nandsim simulated NAND flash, then for
+# each step from 1 up to the number of CPUs, all other CPUs are taken
+# off-line and a compressible file is written and synced.  The time of
+# the sync is dominated by write-back, i.e. by compressing and writing
+# the data nodes, so the MB/s shows how well compression scales.  All
+# CPUs are brought back on-line at the end.  Requires root, the nandsim
+# and ubi modules (or built-in drivers) and mtd-utils.
+#
+# Usage: ubifs_write_bench.sh [-s size_mib] [-c compressor] [source_file]
+#
+# The data written is made by repeating source_file (by default a
+# concatenation of the files in /usr/lib) up to size_mib (default 64).
+# The compressor is passed to mkfs.ubifs -x (default lzo).
+
+size=64
+compr=lzo
+mnt=/tmp/ubifs_bench
+
+while getopts "s:c:" opt; do
+	case $opt in
+	s) size=$OPTARG ;;
+	c) compr=$OPTARG ;;
+	*) echo "usage: $0 [-s size_mib] [-c compressor] [source_file]"
+	   exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+die()
+{
+	echo "$@" >&2
+	exit 1
+}
+
+set_cpus()
+{
+	for cpu in /sys/devices/system/cpu/cpu[0-9]*; do
+		n=${cpu##*/cpu}
+		[ -f $cpu/online ] || continue
+		if [ $n -lt $1 ]; then
+			echo 1 > $cpu/online
+		else
+			echo 0 > $cpu/online
+		fi
+	done
+}
+
+cleanup()
+{
+	umount $mnt 2>/dev/null
+	ubidetach -p /dev/mtd0 2>/dev/null
+	rmmod nandsim 2>/dev/null
+	set_cpus $ncpus
+	rm -f $data
+}
+
+ncpus=$(ls -d /sys/devices/system/cpu/cpu[0-9]* | wc -l)
+data=$(mktemp /tmp/ubifs_bench.XXXXXX) || die "cannot create temp file"
+trap cleanup EXIT
+
+# Build the data in memory, so that reading it is not measured
+if [ -n "$1" ]; then
+	src=$1
+else
+	src=$(mktemp /tmp/ubifs_bench_src.XXXXXX)
+	find /usr/lib -maxdepth 1 -type f -size -1M -exec cat {} + \
+		2>/dev/null | head -c $((size * 1024 * 1024)) > $src
+fi
+while [ $(stat -c %s $data) -lt $((size * 1024 * 1024)) ]; do
+	cat $src >> $data
+done
+truncate -s ${size}M $data
+[ -z "$1" ] && rm -f $src
+
+# 512MiB NAND flash with 2KiB pages and 128KiB eraseblocks
+modprobe nandsim first_id_byte=0x20 second_id_byte=0xdc \
+	third_id_byte=0x00 fourth_id_byte=0x15 || die "cannot load nandsim"
+modprobe ubi 2>/dev/null
+ubiformat -y /dev/mtd0 > /dev/null || die "cannot format mtd0"
+ubiattach -p /dev/mtd0 > /dev/null || die "cannot attach mtd0"
+ubimkvol /dev/ubi0 -N bench -m > /dev/null || die "cannot create volume"
+mkdir -p $mnt
+mount -t ubifs -o compr=$compr ubi0:bench $mnt || die "cannot mount"
+
+printf "%8s %10s %8s\n" cpus MB/s scaling
+base=
+cpus=1
+while [ $cpus -le $ncpus ]; do
+	set_cpus $cpus
+	rm -f $mnt/data
+	sync
+	cp $data $mnt/data
+	start=$(date +%s.%N)
+	sync
+	end=$(date +%s.%N)
+	rate=$(echo "$size / ($end - $start)" | bc -l)
+	[ -z "$base" ] && base=$rate
+	printf "%8d %10.1f %8.2f\n" $cpus $rate $(echo "$rate / $base" | bc -l)
+	cpus=$((cpus + 1))
+done